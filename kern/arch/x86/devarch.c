@@ -12,6 +12,7 @@
 #include <kmalloc.h>
 #include <kref.h>
 #include <kthread.h>
+#include <process.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -371,7 +372,7 @@ static const uint8_t *arch_read_core_set(struct core_set *cset,
 static long arch_perf_write(struct perf_context *pc, const void *udata,
                             long usize)
 {
-	ERRSTACK(1);
+	ERRSTACK(2);
 	void *kdata;
 	const uint8_t *kptr, *ktop;
 
@@ -413,6 +414,37 @@ static long arch_perf_write(struct perf_context *pc, const void *udata,
 			put_le_u32(pc->resp, (uint32_t) ped);
 			break;
 		}
+		case PERFMON_CMD_PROC_COUNTER_OPEN: {
+			int ped;
+			uint32_t pid;
+			struct perfmon_event pev;
+			struct proc *p;
+
+			error_assert(EBADMSG, (kptr + 4 * sizeof(uint64_t) +
+			                       sizeof(uint32_t)) <= ktop);
+			perfmon_init_event(&pev);
+			kptr = get_le_u64(kptr, &pev.event);
+			kptr = get_le_u64(kptr, &pev.flags);
+			kptr = get_le_u64(kptr, &pev.trigger_count);
+			kptr = get_le_u64(kptr, &pev.user_data);
+			kptr = get_le_u32(kptr, &pid);
+
+			p = pid2proc(pid);
+			if (!p)
+				error(ESRCH, "No such process %d", pid);
+			if (waserror()) {
+				proc_decref(p);
+				nexterror();
+			}
+			ped = perfmon_open_proc_event(pc->ps, p, &pev);
+			poperror();
+			proc_decref(p);
+
+			pc->resp_size = sizeof(uint32_t);
+			pc->resp = kmalloc(pc->resp_size, MEM_WAIT);
+			put_le_u32(pc->resp, (uint32_t) ped);
+			break;
+		}
 		case PERFMON_CMD_COUNTER_STATUS: {
 			uint32_t ped;
 			uint8_t *rptr;
@@ -423,10 +455,11 @@ static long arch_perf_write(struct perf_context *pc, const void *udata,
 
 			pef = perfmon_get_event_status(pc->ps, (int) ped);
 
-			pc->resp_size = sizeof(uint32_t) + num_cores * sizeof(uint64_t);
+			pc->resp_size = sizeof(uint32_t) +
+			                pef->nr_values * sizeof(uint64_t);
 			pc->resp = kmalloc(pc->resp_size, MEM_WAIT);
-			rptr = put_le_u32(pc->resp, num_cores);
-			for (int i = 0; i < num_cores; i++)
+			rptr = put_le_u32(pc->resp, pef->nr_values);
+			for (int i = 0; i < pef->nr_values; i++)
 				rptr = put_le_u64(rptr, pef->cores_values[i]);
 
 			perfmon_free_event_status(pef);
@@ -28,7 +28,17 @@
  *
  * You can have multiple sessions, but if you try to install the same counter in
  * multiple, concurrent sessions, the hardware might complain (it definitely
- * will if it is a fixed event). */
+ * will if it is a fixed event).
+ *
+ * Per-process events (perfmon_open_proc_event()) reserve a counter on every
+ * core, but only run it while their process is loaded on that core.  Cores run
+ * MCP vcores and time-sliced SCPs, so a per-core count mixes processes.
+ * Instead, perfmon_switch_proc() is called on the way out to userspace and
+ * perfmon_leave_proc() when the core abandons the process.  On a switch, the
+ * running counters are added to the old process's per-vcore totals in its
+ * perfmon_alloc, and the new process's counters start again from zero.  SCPs
+ * and kernel work done without an owning vcore count towards vcore 0.  These
+ * events only count; they don't sample. */
 
 #include <sys/types.h>
 #include <arch/ros/msr-index.h>
@@ -47,6 +57,8 @@
 #include <err.h>
 #include <string.h>
 #include <profiler.h>
+#include <process.h>
+#include <env.h>
 #include <arch/perfmon.h>
 
 #define FIXCNTR_NBITS 4
@@ -56,6 +68,12 @@ struct perfmon_cpu_context {
 	spinlock_t lock;
 	struct perfmon_event counters[MAX_VAR_COUNTERS];
 	struct perfmon_event fixed_counters[MAX_FIX_COUNTERS];
+	/* Per-process events, which only run while their proc is loaded */
+	struct perfmon_alloc *proc_counters[MAX_VAR_COUNTERS];
+	struct perfmon_alloc *proc_fixed_counters[MAX_FIX_COUNTERS];
+	int nr_proc_counters;
+	struct proc *loaded_proc;
+	uint32_t loaded_vcoreid;
 };
 
 struct perfmon_status_env {
@@ -206,6 +224,116 @@ static void perfmon_set_unfixed_trigger(unsigned int idx, uint64_t count)
 	write_msr(MSR_IA32_PERFCTR0 + idx, write_val);
 }
 
+/* Helper: Reads a fixed counter's value.  Returns the max amount possible if
+ * the counter overflowed. */
+static uint64_t perfmon_read_fixed_counter(int ccno)
+{
+	uint64_t overflow_status = read_msr(MSR_CORE_PERF_GLOBAL_STATUS);
+
+	if (overflow_status & (1ULL << (32 + ccno)))
+		return (1ULL << cpu_caps.bits_x_fix_counter) - 1;
+	else
+		return read_msr(MSR_CORE_PERF_FIXED_CTR0 + ccno);
+}
+
+/* Helper: Reads an unfixed counter's value.  Returns the max amount possible if
+ * the counter overflowed. */
+static uint64_t perfmon_read_unfixed_counter(int ccno)
+{
+	uint64_t overflow_status = read_msr(MSR_CORE_PERF_GLOBAL_STATUS);
+
+	if (overflow_status & (1ULL << ccno))
+		return (1ULL << cpu_caps.bits_x_counter) - 1;
+	else
+		return read_msr(MSR_IA32_PERFCTR0 + ccno);
+}
+
+/* Helper: starts a per-process counter from zero. */
+static void perfmon_start_proc_counter(int idx, bool fixed, uint64_t event)
+{
+	if (fixed) {
+		write_msr(MSR_CORE_PERF_FIXED_CTR0 + idx, 0);
+		write_msr(MSR_CORE_PERF_GLOBAL_OVF_CTRL, 1ULL << (32 + idx));
+		perfmon_enable_fix_event(idx, event,
+		                         read_msr(MSR_CORE_PERF_FIXED_CTR_CTRL));
+	} else {
+		write_msr(MSR_IA32_PERFCTR0 + idx, 0);
+		write_msr(MSR_CORE_PERF_GLOBAL_OVF_CTRL, 1ULL << idx);
+		perfmon_enable_event(idx, event);
+	}
+}
+
+/* Helper: stops a per-process counter, returning what it counted. */
+static uint64_t perfmon_stop_proc_counter(int idx, bool fixed)
+{
+	uint64_t val;
+
+	if (fixed) {
+		val = perfmon_read_fixed_counter(idx);
+		perfmon_disable_fix_event(idx, read_msr(MSR_CORE_PERF_FIXED_CTR_CTRL));
+		write_msr(MSR_CORE_PERF_FIXED_CTR0 + idx, 0);
+	} else {
+		val = perfmon_read_unfixed_counter(idx);
+		perfmon_disable_event(idx);
+		write_msr(MSR_IA32_PERFCTR0 + idx, 0);
+	}
+	return val;
+}
+
+static void perfmon_account_proc(struct perfmon_alloc *pa, uint32_t vcoreid,
+                                 uint64_t val)
+{
+	if (vcoreid >= pa->nr_vcores)
+		vcoreid = 0;
+	/* A vcore's slot can be hit from two cores, e.g. an SCP's kthreads */
+	__sync_fetch_and_add(&pa->vcore_values[vcoreid], val);
+}
+
+/* Stops the loaded proc's counters and adds them to its totals.  Hold the cctx
+ * lock. */
+static void __perfmon_unload_proc(struct perfmon_cpu_context *cctx)
+{
+	struct perfmon_alloc *pa;
+	int i;
+
+	if (!cctx->loaded_proc)
+		return;
+	for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
+		pa = cctx->proc_counters[i];
+		if (pa && (pa->proc == cctx->loaded_proc))
+			perfmon_account_proc(pa, cctx->loaded_vcoreid,
+			                     perfmon_stop_proc_counter(i, FALSE));
+	}
+	for (i = 0; i < (int) cpu_caps.fix_counters_x_proc; i++) {
+		pa = cctx->proc_fixed_counters[i];
+		if (pa && (pa->proc == cctx->loaded_proc))
+			perfmon_account_proc(pa, cctx->loaded_vcoreid,
+			                     perfmon_stop_proc_counter(i, TRUE));
+	}
+	cctx->loaded_proc = NULL;
+}
+
+/* Starts p's counters, if it has any on this core.  Hold the cctx lock. */
+static void __perfmon_load_proc(struct perfmon_cpu_context *cctx,
+                                struct proc *p, uint32_t vcoreid)
+{
+	struct perfmon_alloc *pa;
+	int i;
+
+	for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
+		pa = cctx->proc_counters[i];
+		if (pa && (pa->proc == p))
+			perfmon_start_proc_counter(i, FALSE, pa->ev.event);
+	}
+	for (i = 0; i < (int) cpu_caps.fix_counters_x_proc; i++) {
+		pa = cctx->proc_fixed_counters[i];
+		if (pa && (pa->proc == p))
+			perfmon_start_proc_counter(i, TRUE, pa->ev.event);
+	}
+	cctx->loaded_proc = p;
+	cctx->loaded_vcoreid = vcoreid;
+}
+
 /* Helper: sets errno/errstr based on the error code returned from the core.  We
  * don't have a great way to get errors back from smp_do_in_cores() commands.
  * We use negative counter values (e.g. i = -EBUSY) to signal an error of a
@@ -243,8 +371,15 @@ static void perfmon_do_cores_alloc(void *opaque)
 		i = PMEV_GET_EVENT(pa->ev.event);
 		if (i >= (int) cpu_caps.fix_counters_x_proc) {
 			i = -ENOSPC;
-		} else if (!perfmon_fix_event_available(i, fxctrl_value)) {
+		} else if (!perfmon_fix_event_available(i, fxctrl_value) ||
+		           cctx->proc_fixed_counters[i]) {
 			i = -EBUSY;
+		} else if (pa->proc) {
+			cctx->fixed_counters[i] = pa->ev;
+			cctx->proc_fixed_counters[i] = pa;
+			cctx->nr_proc_counters++;
+			if (cctx->loaded_proc == pa->proc)
+				perfmon_start_proc_counter(i, TRUE, pa->ev.event);
 		} else {
 			/* Keep a copy of pa->ev for later.  pa is read-only and shared. */
 			cctx->fixed_counters[i] = pa->ev;
@@ -264,7 +399,13 @@ static void perfmon_do_cores_alloc(void *opaque)
 				break;
 			}
 		}
-		if (i < (int) cpu_caps.counters_x_proc) {
+		if ((i < (int) cpu_caps.counters_x_proc) && pa->proc) {
+			cctx->counters[i] = pa->ev;
+			cctx->proc_counters[i] = pa;
+			cctx->nr_proc_counters++;
+			if (cctx->loaded_proc == pa->proc)
+				perfmon_start_proc_counter(i, FALSE, pa->ev.event);
+		} else if (i < (int) cpu_caps.counters_x_proc) {
 			cctx->counters[i] = pa->ev;
 			pev = &cctx->counters[i];
 			if (PMEV_GET_INTEN(pev->event))
@@ -282,6 +423,32 @@ static void perfmon_do_cores_alloc(void *opaque)
 	pa->cores_counters[core_id()] = (counter_t) i;
 }
 
+/* Releases a per-process event's counter.  Hold the cctx lock. */
+static int __perfmon_free_proc_counter(struct perfmon_cpu_context *cctx,
+                                       struct perfmon_alloc *pa, counter_t ccno)
+{
+	bool fixed = perfmon_is_fixed_event(&pa->ev);
+	struct perfmon_alloc **slots = fixed ? cctx->proc_fixed_counters
+	                                     : cctx->proc_counters;
+	counter_t max = fixed ? cpu_caps.fix_counters_x_proc
+	                      : cpu_caps.counters_x_proc;
+
+	if ((ccno < 0) || (ccno >= max) || (slots[ccno] != pa))
+		return -ENOENT;
+	/* Whatever it counted since the last switch is lost with the event */
+	if (cctx->loaded_proc == pa->proc)
+		perfmon_stop_proc_counter(ccno, fixed);
+	slots[ccno] = NULL;
+	if (fixed)
+		perfmon_init_event(&cctx->fixed_counters[ccno]);
+	else
+		perfmon_init_event(&cctx->counters[ccno]);
+	/* loaded_proc is only tracked while there are proc counters */
+	if (!--cctx->nr_proc_counters)
+		cctx->loaded_proc = NULL;
+	return 0;
+}
+
 static void perfmon_do_cores_free(void *opaque)
 {
 	struct perfmon_alloc *pa = (struct perfmon_alloc *) opaque;
@@ -290,7 +457,9 @@ static void perfmon_do_cores_free(void *opaque)
 	counter_t ccno = pa->cores_counters[coreno];
 
 	spin_lock_irqsave(&cctx->lock);
-	if (perfmon_is_fixed_event(&pa->ev)) {
+	if (pa->proc) {
+		err = __perfmon_free_proc_counter(cctx, pa, ccno);
+	} else if (perfmon_is_fixed_event(&pa->ev)) {
 		uint64_t fxctrl_value = read_msr(MSR_CORE_PERF_FIXED_CTR_CTRL);
 
 		if ((ccno >= cpu_caps.fix_counters_x_proc) ||
@@ -315,30 +484,6 @@ static void perfmon_do_cores_free(void *opaque)
 	pa->cores_counters[coreno] = (counter_t) err;
 }
 
-/* Helper: Reads a fixed counter's value.  Returns the max amount possible if
- * the counter overflowed. */
-static uint64_t perfmon_read_fixed_counter(int ccno)
-{
-	uint64_t overflow_status = read_msr(MSR_CORE_PERF_GLOBAL_STATUS);
-
-	if (overflow_status & (1ULL << (32 + ccno)))
-		return (1ULL << cpu_caps.bits_x_fix_counter) - 1;
-	else
-		return read_msr(MSR_CORE_PERF_FIXED_CTR0 + ccno);
-}
-
-/* Helper: Reads an unfixed counter's value.  Returns the max amount possible if
- * the counter overflowed. */
-static uint64_t perfmon_read_unfixed_counter(int ccno)
-{
-	uint64_t overflow_status = read_msr(MSR_CORE_PERF_GLOBAL_STATUS);
-
-	if (overflow_status & (1ULL << ccno))
-		return (1ULL << cpu_caps.bits_x_counter) - 1;
-	else
-		return read_msr(MSR_IA32_PERFCTR0 + ccno);
-}
-
 static void perfmon_do_cores_status(void *opaque)
 {
 	struct perfmon_status_env *env = (struct perfmon_status_env *) opaque;
@@ -354,6 +499,23 @@ static void perfmon_do_cores_status(void *opaque)
 	spin_unlock_irqsave(&cctx->lock);
 }
 
+/* Folds the running count of pa's proc, if it is loaded here, into its totals,
+ * restarting the counters from zero. */
+static void perfmon_do_cores_proc_sync(void *opaque)
+{
+	struct perfmon_alloc *pa = (struct perfmon_alloc *) opaque;
+	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+	uint32_t vcoreid;
+
+	spin_lock_irqsave(&cctx->lock);
+	if (cctx->loaded_proc == pa->proc) {
+		vcoreid = cctx->loaded_vcoreid;
+		__perfmon_unload_proc(cctx);
+		__perfmon_load_proc(cctx, pa->proc, vcoreid);
+	}
+	spin_unlock_irqsave(&cctx->lock);
+}
+
 static void perfmon_setup_alloc_core_set(const struct perfmon_alloc *pa,
                                          struct core_set *cset)
 {
@@ -376,6 +538,10 @@ static void perfmon_cleanup_cores_alloc(struct perfmon_alloc *pa)
 
 static void perfmon_free_alloc(struct perfmon_alloc *pa)
 {
+	if (pa->proc) {
+		kfree(pa->vcore_values);
+		proc_decref(pa->proc);
+	}
 	kfree(pa);
 }
 
@@ -385,7 +551,9 @@ static void perfmon_destroy_alloc(struct perfmon_alloc *pa)
 	perfmon_free_alloc(pa);
 }
 
-static struct perfmon_alloc *perfmon_create_alloc(const struct perfmon_event *pev)
+/* p is optional; if set, the alloc takes a ref on it. */
+static struct perfmon_alloc *perfmon_create_alloc(const struct perfmon_event *pev,
+                                                  struct proc *p)
 {
 	int i;
 	struct perfmon_alloc *pa = kzmalloc(sizeof(struct perfmon_alloc) +
@@ -395,16 +563,24 @@ static struct perfmon_alloc *perfmon_create_alloc(const struct perfmon_event *pe
 	pa->ev = *pev;
 	for (i = 0; i < num_cores; i++)
 		pa->cores_counters[i] = INVALID_COUNTER;
+	if (p) {
+		proc_incref(p, 1);
+		pa->proc = p;
+		pa->nr_vcores = p->procinfo->max_vcores;
+		pa->vcore_values = kzmalloc(pa->nr_vcores * sizeof(uint64_t),
+		                            MEM_WAIT);
+	}
 
 	return pa;
 }
 
-static struct perfmon_status *perfmon_status_alloc(void)
+static struct perfmon_status *perfmon_status_alloc(uint32_t nr_values)
 {
 	struct perfmon_status *pef = kzmalloc(sizeof(struct perfmon_status) +
-	                                          num_cores * sizeof(uint64_t),
+	                                          nr_values * sizeof(uint64_t),
 	                                      MEM_WAIT);
 
+	pef->nr_values = nr_values;
 	return pef;
 }
 
@@ -529,7 +705,7 @@ void perfmon_interrupt(struct hw_trapframe *hw_tf, void *data)
 	write_msr(MSR_CORE_PERF_GLOBAL_CTRL, 0);
 	for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
 		if (status & ((uint64_t) 1 << i)) {
-			if (cctx->counters[i].event) {
+			if (cctx->counters[i].event && !cctx->proc_counters[i]) {
 				profiler_add_sample(
 				    perfmon_make_sample_event(cctx->counters + i));
 				perfmon_set_unfixed_trigger(i, cctx->counters[i].trigger_count);
@@ -538,7 +714,8 @@ void perfmon_interrupt(struct hw_trapframe *hw_tf, void *data)
 	}
 	for (i = 0; i < (int) cpu_caps.fix_counters_x_proc; i++) {
 		if (status & ((uint64_t) 1 << (32 + i))) {
-			if (cctx->fixed_counters[i].event) {
+			if (cctx->fixed_counters[i].event &&
+			    !cctx->proc_fixed_counters[i]) {
 				profiler_add_sample(
 				    perfmon_make_sample_event(cctx->fixed_counters + i));
 				perfmon_set_fixed_trigger(i,
@@ -577,12 +754,14 @@ static int perfmon_install_session_alloc(struct perfmon_session *ps,
 	error(ENFILE, "Too many perf allocs in the session");
 }
 
-int perfmon_open_event(const struct core_set *cset, struct perfmon_session *ps,
-                       const struct perfmon_event *pev)
+static int __perfmon_open_event(const struct core_set *cset,
+                                struct perfmon_session *ps,
+                                const struct perfmon_event *pev,
+                                struct proc *p)
 {
 	ERRSTACK(1);
 	int i;
-	struct perfmon_alloc *pa = perfmon_create_alloc(pev);
+	struct perfmon_alloc *pa = perfmon_create_alloc(pev, p);
 
 	if (waserror()) {
 		perfmon_destroy_alloc(pa);
@@ -617,6 +796,26 @@ int perfmon_open_event(const struct core_set *cset, struct perfmon_session *ps,
 	return i;
 }
 
+int perfmon_open_event(const struct core_set *cset, struct perfmon_session *ps,
+                       const struct perfmon_event *pev)
+{
+	return __perfmon_open_event(cset, ps, pev, NULL);
+}
+
+/* Opens an event that only counts while p runs, on any core.  The event holds a
+ * ref on p until it is closed. */
+int perfmon_open_proc_event(struct perfmon_session *ps, struct proc *p,
+                            const struct perfmon_event *pev)
+{
+	struct core_set cset;
+
+	if (PMEV_GET_INTEN(pev->event))
+		error(EINVAL, "Per-process perf events can count, but not sample");
+	core_set_init(&cset);
+	core_set_fill_available(&cset);
+	return __perfmon_open_event(&cset, ps, pev, p);
+}
+
 /* Helper, looks up a pa, given ped.  Hold the qlock. */
 static struct perfmon_alloc *__lookup_pa(struct perfmon_session *ps, int ped)
 {
@@ -649,7 +848,8 @@ void perfmon_close_event(struct perfmon_session *ps, int ped)
 }
 
 /* Fetches the status (i.e. PMU counters) of event ped from all applicable
- * cores.  Returns a perfmon_status, which the caller should free. */
+ * cores.  Per-process events report their totals per vcore instead.  Returns a
+ * perfmon_status, which the caller should free. */
 struct perfmon_status *perfmon_get_event_status(struct perfmon_session *ps,
                                                 int ped)
 {
@@ -665,10 +865,16 @@ struct perfmon_status *perfmon_get_event_status(struct perfmon_session *ps,
 		nexterror();
 	};
 	env.pa = __lookup_pa(ps, ped);
-	env.pef = perfmon_status_alloc();
-
 	perfmon_setup_alloc_core_set(env.pa, &cset);
-	smp_do_in_cores(&cset, perfmon_do_cores_status, &env);
+	if (env.pa->proc) {
+		env.pef = perfmon_status_alloc(env.pa->nr_vcores);
+		smp_do_in_cores(&cset, perfmon_do_cores_proc_sync, env.pa);
+		for (int i = 0; i < env.pa->nr_vcores; i++)
+			env.pef->cores_values[i] = ACCESS_ONCE(env.pa->vcore_values[i]);
+	} else {
+		env.pef = perfmon_status_alloc(num_cores);
+		smp_do_in_cores(&cset, perfmon_do_cores_status, &env);
+	}
 
 	poperror();
 	qunlock(&ps->qlock);
@@ -701,3 +907,31 @@ void perfmon_close_session(struct perfmon_session *ps)
 	}
 	kfree(ps);
 }
+
+/* Called with IRQs off on the way out to p's vcoreid.  This is on every kernel
+ * exit, so it does nothing unless someone has per-process events open. */
+void perfmon_switch_proc(struct proc *p, uint32_t vcoreid)
+{
+	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+
+	if (likely(!cctx->nr_proc_counters))
+		return;
+	if ((cctx->loaded_proc == p) && (cctx->loaded_vcoreid == vcoreid))
+		return;
+	spin_lock_irqsave(&cctx->lock);
+	__perfmon_unload_proc(cctx);
+	__perfmon_load_proc(cctx, p, vcoreid);
+	spin_unlock_irqsave(&cctx->lock);
+}
+
+/* Called when the core stops running the current process. */
+void perfmon_leave_proc(void)
+{
+	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+
+	if (likely(!cctx->nr_proc_counters))
+		return;
+	spin_lock_irqsave(&cctx->lock);
+	__perfmon_unload_proc(cctx);
+	spin_unlock_irqsave(&cctx->lock);
+}
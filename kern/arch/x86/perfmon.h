@@ -20,6 +20,7 @@
 #define INVALID_COUNTER INT32_MIN
 
 struct hw_trapframe;
+struct proc;
 
 typedef int32_t counter_t;
 
@@ -34,6 +35,11 @@ struct perfmon_cpu_caps {
 
 struct perfmon_alloc {
 	struct perfmon_event ev;
+	/* For per-process events, the (counted) target and its totals so far, one
+	 * per vcore.  NULL proc for events that count everything on their cores. */
+	struct proc *proc;
+	uint32_t nr_vcores;
+	uint64_t *vcore_values;
 	counter_t cores_counters[0];
 };
 
@@ -44,6 +50,8 @@ struct perfmon_session {
 
 struct perfmon_status {
 	struct perfmon_event ev;
+	/* num_cores values, or one per vcore for per-process events */
+	uint32_t nr_values;
 	uint64_t cores_values[0];
 };
 
@@ -56,12 +64,16 @@ void perfmon_interrupt(struct hw_trapframe *hw_tf, void *data);
 void perfmon_get_cpu_caps(struct perfmon_cpu_caps *pcc);
 int perfmon_open_event(const struct core_set *cset, struct perfmon_session *ps,
 					   const struct perfmon_event *pev);
+int perfmon_open_proc_event(struct perfmon_session *ps, struct proc *p,
+                            const struct perfmon_event *pev);
 void perfmon_close_event(struct perfmon_session *ps, int ped);
 struct perfmon_status *perfmon_get_event_status(struct perfmon_session *ps,
 												int ped);
 void perfmon_free_event_status(struct perfmon_status *pef);
 struct perfmon_session *perfmon_create_session(void);
 void perfmon_close_session(struct perfmon_session *ps);
+void perfmon_switch_proc(struct proc *p, uint32_t vcoreid);
+void perfmon_leave_proc(void);
 
 static inline uint64_t read_pmc(uint32_t index)
 {
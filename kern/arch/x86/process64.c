@@ -4,6 +4,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <arch/fsgsbase.h>
+#include <arch/perfmon.h>
 
 #include <string.h>
 #include <assert.h>
@@ -203,7 +204,14 @@ static void __attribute__((noreturn)) proc_pop_vmtf(struct vm_trapframe *tf)
 
 void proc_pop_ctx(struct user_context *ctx)
 {
+	struct per_cpu_info *pcpui;
+
 	disable_irq();
+	pcpui = &per_cpu_info[core_id()];
+	/* Kernel work for an SCP or a kthread isn't on an owned vcore: vcore 0 */
+	perfmon_switch_proc(pcpui->cur_proc,
+	                    pcpui->owning_proc == pcpui->cur_proc ?
+	                    pcpui->owning_vcoreid : 0);
 	switch (ctx->type) {
 	case ROS_HW_CTX:
 		proc_pop_hwtf(&ctx->tf.hw_tf);
@@ -328,6 +336,7 @@ void proc_secure_ctx(struct user_context *ctx)
 void __abandon_core(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	perfmon_leave_proc();
 	lcr3(boot_cr3);
 	proc_decref(pcpui->cur_proc);
 	pcpui->cur_proc = 0;
@@ -30,13 +30,24 @@
  * PERFMON_CMD_COUNTER_OPEN response
  *   U32 EVENT_DESCRIPTOR;
  *
+ * PERFMON_CMD_PROC_COUNTER_OPEN request
+ *   U8 CMD; (= PERFMON_CMD_PROC_COUNTER_OPEN)
+ *   U64 EVENT_DESCRIPTOR;
+ *   U64 EVENT_FLAGS;
+ *   U64 EVENT_TRIGGER_COUNT; (ignored, these events can't sample)
+ *   U64 EVENT_USER_DATA;
+ *   U32 PID;
+ * PERFMON_CMD_PROC_COUNTER_OPEN response
+ *   U32 EVENT_DESCRIPTOR;
+ *
  * PERFMON_CMD_COUNTER_STATUS request
  *   U8 CMD; (= PERFMON_CMD_COUNTER_STATUS)
  *   U32 EVENT_DESCRIPTOR;
  * PERFMON_CMD_COUNTER_STATUS response
- *   U32 NUM_VALUES; (always num_cores)
+ *   U32 NUM_VALUES; (num_cores, or max_vcores for PROC_COUNTER_OPEN events)
  *   U64 VALUES[NUM_VALUES]; (one value per core - zero if the counter was not
- *                            active in that core)
+ *                            active in that core - or one per vcore of the
+ *                            process)
  *
  * PERFMON_CMD_COUNTER_CLOSE request
  *   U8 CMD; (= PERFMON_CMD_COUNTER_CLOSE)
@@ -59,6 +70,7 @@
 #define PERFMON_CMD_COUNTER_STATUS 2
 #define PERFMON_CMD_COUNTER_CLOSE 3
 #define PERFMON_CMD_CPU_CAPS 4
+#define PERFMON_CMD_PROC_COUNTER_OPEN 5
 
 #define PERFMON_FIXED_EVENT (1 << 0)
 
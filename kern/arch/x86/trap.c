@@ -20,6 +20,7 @@
 #include <ex_table.h>
 #include <arch/mptables.h>
 #include <ros/procinfo.h>
+#include <tracepoint.h>
 
 enum {
 	NMI_NORMAL_OPN = 0,
@@ -698,6 +699,7 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 	if (!in_irq_ctx(pcpui))
 		__set_cpu_state(pcpui, CPU_STATE_IRQ);
 	inc_irq_depth(pcpui);
+	tracepoint(irq_enter, hw_tf->tf_trapno);
 	//if (core_id())
 	if (hw_tf->tf_trapno != IdtLAPIC_TIMER)	/* timer irq */
 	if (hw_tf->tf_trapno != I_KERNEL_MSG)
@@ -734,6 +736,7 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 	irq_handlers[hw_tf->tf_trapno]->eoi(hw_tf->tf_trapno);
 	/* Fall-through */
 out_no_eoi:
+	tracepoint(irq_exit, hw_tf->tf_trapno);
 	dec_irq_depth(pcpui);
 	if (!in_irq_ctx(pcpui))
 		__set_cpu_state(pcpui, CPU_STATE_KERNEL);
@@ -39,6 +39,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <tracepoint.h>
 
 struct dev etherdevtab;
 
@@ -312,6 +313,7 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	struct ether *vlan;
 
 	ether->inpackets++;
+	tracepoint(net_rx, ether->ctlrno, BLEN(bp));
 
 	pkt = (struct etherpkt *)bp->rp;
 	/* TODO: we might need to assert more for higher layers, or otherwise deal
@@ -405,6 +407,7 @@ static int etheroq(struct ether *ether, struct block *bp)
 	int8_t irq_state = 0;
 
 	ether->outpackets++;
+	tracepoint(net_tx, ether->ctlrno, BLEN(bp));
 
 	if (!(ether->feat & NETF_SG))
 		bp = linearizeblock(bp);
@@ -519,6 +522,7 @@ static long etherbwrite(struct chan *chan, struct block *bp, uint32_t unused)
 
 	n = BLEN(bp);
 	if (NETTYPE(chan->qid.path) != Ndataqid) {
+		bp = linearizeblock(bp);
 		if (waserror()) {
 			freeb(bp);
 			nexterror();
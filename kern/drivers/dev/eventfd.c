@@ -300,6 +300,11 @@ static int efd_tapfd(struct chan *c, struct fd_tap *tap, int cmd)
 					SLIST_REMOVE(&efd->fd_taps, tap, fd_tap, link);
 					ret = 0;
 					break;
+				case (FDTAP_CMD_POLL):
+					fire_tap(tap, (has_counts(efd) ? FDTAP_FILT_READABLE : 0) |
+					              (has_room(efd) ? FDTAP_FILT_WRITABLE : 0));
+					ret = 0;
+					break;
 				default:
 					set_error(ENOSYS, "Unsupported #%s tap command %p",
 							  devname(), cmd);
@@ -26,6 +26,9 @@
 #include <umem.h>
 #include <profiler.h>
 #include <kprof.h>
+#include <lockstat.h>
+#include <lathist.h>
+#include <kmemtrack.h>
 #include <ros/procinfo.h>
 
 #define KTRACE_BUFFER_SIZE (128 * 1024)
@@ -39,6 +42,13 @@ enum {
 	Kprintxqid,
 	Kmpstatqid,
 	Kmpstatrawqid,
+	Klathistqid,
+#ifdef CONFIG_LOCKSTAT
+	Klockstatqid,
+#endif
+#ifdef CONFIG_KMEM_TRACK
+	Kkmemtrackqid,
+#endif
 };
 
 struct trace_printk_buffer {
@@ -49,6 +59,8 @@ struct trace_printk_buffer {
 struct kprof {
 	qlock_t lock;
 	bool mpstat_ipi;
+	int lockstat_sort;
+	int kmemtrack_top;
 	bool profiling;
 	bool opened;
 };
@@ -62,6 +74,13 @@ struct dirtab kproftab[] = {
 	{"kprintx",		{Kprintxqid},		0,	0600},
 	{"mpstat",		{Kmpstatqid},		0,	0600},
 	{"mpstat-raw",	{Kmpstatrawqid},	0,	0600},
+	{"lathist",		{Klathistqid},		0,	0600},
+#ifdef CONFIG_LOCKSTAT
+	{"lockstat",	{Klockstatqid},		0,	0600},
+#endif
+#ifdef CONFIG_KMEM_TRACK
+	{"kmemtrack",	{Kkmemtrackqid},	0,	0600},
+#endif
 };
 
 static struct kprof kprof;
@@ -168,6 +187,8 @@ static void kprof_init(void)
 		kproftab[i].length = 0;
 
 	kprof.mpstat_ipi = TRUE;
+	kprof.lockstat_sort = LOCKSTAT_SORT_WAIT;
+	kprof.kmemtrack_top = 50;
 	kproftab[Kmpstatqid].length = mpstat_len();
 	kproftab[Kmpstatrawqid].length = mpstatraw_len();
 
@@ -317,6 +338,102 @@ static long mpstatraw_read(void *va, long n, int64_t off)
 	return n;
 }
 
+static long lathist_read(void *va, long n, int64_t off)
+{
+	size_t len;
+	char *buf = lathist_report(&len);
+
+	if (!buf)
+		return 0;
+	n = readmem(off, va, n, buf, len);
+	kfree(buf);
+	return n;
+}
+
+static const char lathist_usage[] = "lathist: reset|on|off";
+
+static void lathist_write(struct cmdbuf *cb)
+{
+	if (cb->nf < 1)
+		error(EFAIL, lathist_usage);
+	if (!strcmp(cb->f[0], "reset"))
+		lathist_reset();
+	else if (!strcmp(cb->f[0], "on"))
+		lathist_set_enabled(TRUE);
+	else if (!strcmp(cb->f[0], "off"))
+		lathist_set_enabled(FALSE);
+	else
+		error(EFAIL, lathist_usage);
+}
+
+#ifdef CONFIG_LOCKSTAT
+static long lockstat_read(void *va, long n, int64_t off)
+{
+	size_t len;
+	char *buf = lockstat_report(kprof.lockstat_sort, &len);
+
+	if (!buf)
+		return 0;
+	n = readmem(off, va, n, buf, len);
+	kfree(buf);
+	return n;
+}
+
+static const char lockstat_usage[] =
+	"lockstat: reset|on|off|sort (acquired|contended|wait|hold)";
+
+static void lockstat_write(struct cmdbuf *cb)
+{
+	if (cb->nf < 1)
+		error(EFAIL, lockstat_usage);
+	if (!strcmp(cb->f[0], "reset")) {
+		lockstat_reset();
+	} else if (!strcmp(cb->f[0], "on")) {
+		lockstat_set_enabled(TRUE);
+	} else if (!strcmp(cb->f[0], "off")) {
+		lockstat_set_enabled(FALSE);
+	} else if (!strcmp(cb->f[0], "sort")) {
+		if (cb->nf < 2)
+			error(EFAIL, lockstat_usage);
+		if (!strcmp(cb->f[1], "acquired"))
+			kprof.lockstat_sort = LOCKSTAT_SORT_ACQUIRED;
+		else if (!strcmp(cb->f[1], "contended"))
+			kprof.lockstat_sort = LOCKSTAT_SORT_CONTENDED;
+		else if (!strcmp(cb->f[1], "wait"))
+			kprof.lockstat_sort = LOCKSTAT_SORT_WAIT;
+		else if (!strcmp(cb->f[1], "hold"))
+			kprof.lockstat_sort = LOCKSTAT_SORT_HOLD;
+		else
+			error(EFAIL, lockstat_usage);
+	} else {
+		error(EFAIL, lockstat_usage);
+	}
+}
+#endif /* CONFIG_LOCKSTAT */
+
+#ifdef CONFIG_KMEM_TRACK
+static long kmemtrack_read(void *va, long n, int64_t off)
+{
+	size_t len;
+	char *buf = kmemtrack_report(kprof.kmemtrack_top, &len);
+
+	if (!buf)
+		return 0;
+	n = readmem(off, va, n, buf, len);
+	kfree(buf);
+	return n;
+}
+
+static const char kmemtrack_usage[] = "kmemtrack: top N (0 for all sites)";
+
+static void kmemtrack_write(struct cmdbuf *cb)
+{
+	if (cb->nf != 2 || strcmp(cb->f[0], "top"))
+		error(EFAIL, kmemtrack_usage);
+	kprof.kmemtrack_top = strtol(cb->f[1], 0, 0);
+}
+#endif /* CONFIG_KMEM_TRACK */
+
 static long kprof_read(struct chan *c, void *va, long n, int64_t off)
 {
 	uint64_t w, *bp;
@@ -342,6 +459,19 @@ static long kprof_read(struct chan *c, void *va, long n, int64_t off)
 	case Kmpstatrawqid:
 		n = mpstatraw_read(va, n, offset);
 		break;
+	case Klathistqid:
+		n = lathist_read(va, n, offset);
+		break;
+#ifdef CONFIG_LOCKSTAT
+	case Klockstatqid:
+		n = lockstat_read(va, n, offset);
+		break;
+#endif
+#ifdef CONFIG_KMEM_TRACK
+	case Kkmemtrackqid:
+		n = kmemtrack_read(va, n, offset);
+		break;
+#endif
 	default:
 		n = 0;
 		break;
@@ -420,6 +550,19 @@ static long kprof_write(struct chan *c, void *a, long n, int64_t unused)
 			error(EFAIL, "Bad mpstat option (reset|ipi|on|off)");
 		}
 		break;
+	case Klathistqid:
+		lathist_write(cb);
+		break;
+#ifdef CONFIG_LOCKSTAT
+	case Klockstatqid:
+		lockstat_write(cb);
+		break;
+#endif
+#ifdef CONFIG_KMEM_TRACK
+	case Kkmemtrackqid:
+		kmemtrack_write(cb);
+		break;
+#endif
 	default:
 		error(EBADFD, ERROR_FIXME);
 	}
@@ -539,6 +539,13 @@ static int pipetapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 				qio_set_wake_cb(p->q[which], 0, (void *)kludge);
 			ret = 0;
 			break;
+		case (FDTAP_CMD_POLL):
+			/* Same readiness as the DMREADABLE/DMWRITABLE bits in stat */
+			fire_tap(tap, (qreadable(p->q[which]) ? FDTAP_FILT_READABLE : 0) |
+			              (qwritable(p->q[which]) ? FDTAP_FILT_WRITABLE : 0) |
+			              (qisclosed(p->q[which]) ? FDTAP_FILT_HANGUP : 0));
+			ret = 0;
+			break;
 		default:
 			set_errno(ENOSYS);
 			set_errstr("Unsupported #%s data tap command %p", devname(), cmd);
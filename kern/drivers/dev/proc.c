@@ -29,6 +29,7 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <ros/bcq.h>
 #include <arch/vmm/vmm.h>
 #include <ros/vmm.h>
 
@@ -92,6 +93,8 @@ enum {
 	CMstraceme,
 	CMstraceall,
 	CMstraceoff,
+	CMstracesysc,
+	CMstracepid,
 };
 
 enum {
@@ -158,6 +161,8 @@ struct cmdtab proccmd[] = {
 	{CMstraceme, "straceme", 0},
 	{CMstraceall, "straceall", 0},
 	{CMstraceoff, "straceoff", 0},
+	{CMstracesysc, "stracesysc", 0},
+	{CMstracepid, "stracepid", 0},
 };
 
 /*
@@ -935,7 +940,7 @@ static long procread(struct chan *c, void *va, long n, int64_t off)
 	switch (QID(c->qid)) {
 		case Qstrace:
 			s = c->aux;
-			n = qread(s->q, va, n);
+			n = systrace_read(s, va, n);
 			return n;
 	}
 
@@ -1149,10 +1154,9 @@ static long procwrite(struct chan *c, void *va, long n, int64_t off)
 		 * which is a very powerful tool. */
 		case Qstrace:
 			assert(c->aux);
-			/* it is possible that the q hungup and is closed.  that would be
-			 * the case if all of the procs closed and decref'd.  if the q is
-			 * closed, qwrite() will throw an error. */
-			n = qwrite(((struct strace*)c->aux)->q, va, n);
+			/* it is possible that the strace hungup.  that would be the case
+			 * if all of the procs closed and decref'd, and then this throws. */
+			systrace_write_marker(c->aux, va, n);
 			break;
 		default:
 			error(EFAIL, "unknown qid %#llux in procwrite\n", c->qid.path);
@@ -1299,25 +1303,72 @@ void procctlclosefiles(struct proc *p, int all, int fd)
 static void strace_shutdown(struct kref *a)
 {
 	struct strace *strace = container_of(a, struct strace, procs);
-	static const char base_msg[] = "Traced ~%lu syscs, Dropped %lu";
-	size_t msg_len = NUMSIZE64 * 2 + sizeof(base_msg);
-	char *msg = kmalloc(msg_len, 0);
-
-	if (msg)
-		snprintf(msg, msg_len, base_msg, strace->appx_nr_sysc,
-		         atomic_read(&strace->nr_drops));
-	qhangup(strace->q, msg);
-	kfree(msg);
+
+	systrace_hangup(strace);
 }
 
 static void strace_release(struct kref *a)
 {
 	struct strace *strace = container_of(a, struct strace, users);
 
-	qfree(strace->q);
+	kfree(strace->rings);
 	kfree(strace);
 }
 
+static struct strace *strace_alloc(void)
+{
+	struct strace *strace;
+
+	strace = kzmalloc(sizeof(struct strace), MEM_WAIT);
+	strace->rings = kzmalloc(sizeof(struct systrace_bcq) * num_cores,
+	                         MEM_WAIT);
+	for (int i = 0; i < num_cores; i++)
+		bcq_init(&strace->rings[i], struct systrace_record, SYSTR_RING_SZ);
+	rendez_init(&strace->rv);
+	return strace;
+}
+
+/* Sets the syscall filter from "stracesysc all" or "stracesysc N...". */
+static void strace_filter_sysc(struct strace *strace, struct cmdbuf *cb)
+{
+	long num;
+
+	if (cb->nf < 2)
+		error(EINVAL, "usage: stracesysc all|SYSC_NUM...");
+	if (!strcmp(cb->f[1], "all")) {
+		strace->sysc_filtered = FALSE;
+		return;
+	}
+	CLR_BITMASK(strace->sysc_filter, SYSTR_MAX_SYSC);
+	for (int i = 1; i < cb->nf; i++) {
+		num = strtol(cb->f[i], 0, 0);
+		if (num < 0 || num >= SYSTR_MAX_SYSC)
+			error(EINVAL, "bad syscall number %s", cb->f[i]);
+		SET_BITMASK_BIT(strace->sysc_filter, num);
+	}
+	strace->sysc_filtered = TRUE;
+}
+
+/* Sets the pid filter from "stracepid all" or "stracepid PID...". */
+static void strace_filter_pid(struct strace *strace, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		error(EINVAL, "usage: stracepid all|PID...");
+	if (!strcmp(cb->f[1], "all")) {
+		strace->nr_pids = 0;
+		return;
+	}
+	if (cb->nf - 1 > SYSTR_MAX_PIDS)
+		error(EINVAL, "can filter at most %d pids", SYSTR_MAX_PIDS);
+	/* Tracers might briefly see no filter, and trace a little extra */
+	strace->nr_pids = 0;
+	wmb();
+	for (int i = 1; i < cb->nf; i++)
+		strace->pids[i - 1] = strtol(cb->f[i], 0, 0);
+	wmb();
+	strace->nr_pids = cb->nf - 1;
+}
+
 static void procctlreq(struct proc *p, char *va, int n)
 {
 	ERRSTACK(1);
@@ -1342,8 +1393,7 @@ static void procctlreq(struct proc *p, char *va, int n)
 	case CMstraceme:
 		/* common allocation.  if we inherited, we might have one already */
 		if (!p->strace) {
-			strace = kzmalloc(sizeof(*p->strace), MEM_WAIT);
-			strace->q = qopen(65536, Qdropoverflow|Qcoalesce, NULL, NULL);
+			strace = strace_alloc();
 			/* both of these refs are put when the proc is freed.  procs is for
 			 * every process that has this p->strace.  users is procs + every
 			 * user (e.g. from open()).
@@ -1357,7 +1407,7 @@ static void procctlreq(struct proc *p, char *va, int n)
 			kref_init(&strace->users, strace_release, 1);
 			if (!atomic_cas_ptr((void**)&p->strace, 0, strace)) {
 				/* someone else won the race and installed strace. */
-				qfree(strace->q);
+				kfree(strace->rings);
 				kfree(strace);
 				error(EAGAIN, "Concurrent strace init, try again");
 			}
@@ -1410,6 +1460,16 @@ static void procctlreq(struct proc *p, char *va, int n)
 		p->strace_on = FALSE;
 		p->strace_inherit = FALSE;
 		break;
+	case CMstracesysc:
+		if (!p->strace)
+			error(ENOENT, "Process %d is not being traced", p->pid);
+		strace_filter_sysc(p->strace, cb);
+		break;
+	case CMstracepid:
+		if (!p->strace)
+			error(ENOENT, "Process %d is not being traced", p->pid);
+		strace_filter_pid(p->strace, cb);
+		break;
 	}
 	poperror();
 	kfree(cb);
@@ -54,7 +54,7 @@ struct dirtab regresstab[]={
 	{"monctl",	{Monitorctlqid},		0,	0600},
 };
 
-static char *ctlcommands = "ktest";
+static char *ctlcommands = "ktest kbench";
 
 static struct chan*
 regressattach(char *spec)
@@ -160,6 +160,12 @@ regresswrite(struct chan *c, void *a, long n, int64_t unused)
 	case Monitorctlqid:
 		if(strncmp(a, "ktest", 5) == 0){
 			run_registered_ktest_suites();
+		} else if (cb->nf && !strcmp(cb->f[0], "kbench")) {
+			/* kbench [name|all [nr_cores [nr_iters]]] */
+			run_registered_kbench_suites(
+				cb->nf > 1 && strcmp(cb->f[1], "all") ? cb->f[1] : NULL,
+				cb->nf > 2 ? strtoul(cb->f[2], 0, 0) : 0,
+				cb->nf > 3 ? strtoul(cb->f[3], 0, 0) : 0);
 		} else {
 			error(EFAIL, "regresswrite: only commands are %s", ctlcommands);
 		}
@@ -10,19 +10,36 @@
 /*
  * Storage Device.
  */
-#include "../port/error.h"
-#include "../port/lib.h"
-#include "dat.h"
-#include "fns.h"
-#include "io.h"
-#include "mem.h"
-#include "u.h"
-#include "ureg.h"
+#include <vfs.h>
+#include <kfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <kthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <pmap.h>
+#include <smp.h>
+#include <ns.h>
+#include <blockdev.h>
+#include <sd.h>
+
+struct dev sddevtab;
+
+static char *devname(void)
+{
+	return sddevtab.name;
+}
 
-#include "../port/sd.h"
+/* Controller types, probed in order at reset. */
+extern struct sdifc sdiahciifc;
 
-extern struct dev sddevtab;
-extern struct sdifc *sdifc[];
+struct sdifc *sdifc[] = {
+	&sdiahciifc,
+	NULL,
+};
 
 static char Echange[] = "media or partition has changed";
 
@@ -31,7 +48,7 @@ static char devletters[] = "0123456789"
                            "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
 static struct sdev *devs[sizeof devletters - 1];
-static qlock_t devslock;
+static qlock_t devslock = QLOCK_INITIALIZER(devslock);
 
 enum {
 	Rawcmd,
@@ -90,7 +107,7 @@ void sdaddpart(struct sdunit *unit, char *name, uint64_t start, uint64_t end)
 	 * Check name not already used
 	 * and look for a free slot.
 	 */
-	if (unit->part != nil) {
+	if (unit->part != NULL) {
 		partno = -1;
 		for (i = 0; i < unit->npart; i++) {
 			pp = &unit->part[i];
@@ -99,31 +116,29 @@ void sdaddpart(struct sdunit *unit, char *name, uint64_t start, uint64_t end)
 					partno = i;
 				break;
 			}
-			if (strcmp(name, pp->SDperm.name) == 0) {
+			if (strcmp(name, pp->sdperm.name) == 0) {
 				if (pp->start == start && pp->end == end)
 					return;
-				error(Ebadctl);
+				error(EINVAL, "partition %s already exists", name);
 			}
 		}
 	} else {
-		if ((unit->part = malloc(sizeof(struct sdpart) * SDnpart)) == nil)
-			error(Enomem);
+		unit->part = kzmalloc(sizeof(struct sdpart) * SDnpart, MEM_WAIT);
 		unit->npart = SDnpart;
 		partno = 0;
 	}
 
 	/*
 	 * If no free slot found then increase the
-	 * array size (can't get here with unit->part == nil).
+	 * array size (can't get here with unit->part == NULL).
 	 */
 	if (partno == -1) {
 		if (unit->npart >= NPart)
-			error(Enomem);
-		if ((pp = malloc(sizeof(struct sdpart) * (unit->npart + SDnpart))) ==
-		    nil)
-			error(Enomem);
+			error(ENOMEM, "too many partitions");
+		pp = kzmalloc(sizeof(struct sdpart) * (unit->npart + SDnpart),
+		              MEM_WAIT);
 		memmove(pp, unit->part, sizeof(struct sdpart) * unit->npart);
-		free(unit->part);
+		kfree(unit->part);
 		unit->part = pp;
 		partno = unit->npart;
 		unit->npart += SDnpart;
@@ -133,19 +148,18 @@ void sdaddpart(struct sdunit *unit, char *name, uint64_t start, uint64_t end)
 	 * Check size and extent are valid.
 	 */
 	if (start > end || end > unit->sectors)
-		error(Eio);
+		error(EIO, "bad partition extent %llu to %llu", start, end);
 	pp = &unit->part[partno];
 	pp->start = start;
 	pp->end = end;
-	kstrdup(&pp->SDperm.name, name);
-	kstrdup(&pp->SDperm.user, eve);
-	pp->SDperm.perm = 0640;
+	kstrdup(&pp->sdperm.name, name);
+	kstrdup(&pp->sdperm.user, eve);
+	pp->sdperm.perm = 0640;
 	pp->valid = 1;
 }
 
 static void sddelpart(struct sdunit *unit, char *name)
 {
-	struct proc *up = externup();
 	int i;
 	struct sdpart *pp;
 	/*
@@ -154,14 +168,14 @@ static void sddelpart(struct sdunit *unit, char *name)
 	 */
 	pp = unit->part;
 	for (i = 0; i < unit->npart; i++) {
-		if (strcmp(name, pp->SDperm.name) == 0)
+		if (strcmp(name, pp->sdperm.name) == 0)
 			break;
 		pp++;
 	}
 	if (i >= unit->npart)
-		error(Ebadctl);
-	if (strcmp(up->user, pp->SDperm.user) && !iseve())
-		error(Eperm);
+		error(EINVAL, "no partition %s", name);
+	if (strcmp(current->user, pp->sdperm.user) && !iseve())
+		error(EPERM, ERROR_FIXME);
 	pp->valid = 0;
 	pp->vers++;
 }
@@ -179,16 +193,158 @@ static void sdincvers(struct sdunit *unit)
 	}
 }
 
+/*
+ * Block layer glue.  Each unit with media gets a block device covering the
+ * whole unit, /dev/<unit name>, for the page cache and file systems.
+ * Controllers that can run IOs asynchronously provide ifc->aio, which starts
+ * the IO and calls bdev_io_done() from the interrupt handler, and set
+ * unit->qdepth to how many they can run at once.  aio can turn down an IO
+ * (e.g. the drive can't queue), and those, like all IOs for controllers
+ * without aio, go to a ktask per unit that runs them one at a time through
+ * ifc->bio.
+ */
+struct sdbdev {
+	struct block_device bdev;
+	struct sdunit *unit;
+	spinlock_t lock;
+	struct bdev_io_tailq ios; /* for the ktask */
+	struct semaphore nios;
+};
+
+/* Runs io through ifc->bio, bouncing it if it has more than one segment. */
+static int sdbdevbio(struct sdunit *unit, struct bdev_io *io)
+{
+	ERRSTACK(1);
+	int write = io->flags & BREQ_WRITE;
+	long len = io->nr_sector * unit->secsize;
+	uint8_t *b, *p;
+	int i, ret;
+
+	if (io->nr_segs == 0)
+		return EINVAL;
+	b = io->segs[0].buf;
+	if (io->nr_segs > 1) {
+		b = kmalloc(len, MEM_WAIT);
+		if (write) {
+			for (i = 0, p = b; i < io->nr_segs; i++) {
+				memmove(p, io->segs[i].buf, io->segs[i].nr_sector * unit->secsize);
+				p += io->segs[i].nr_sector * unit->secsize;
+			}
+		}
+	}
+	ret = 0;
+	if (waserror()) {
+		ret = EIO;
+	} else {
+		if (unit->dev->ifc->bio(unit, 0, write, b, io->nr_sector, io->sector) !=
+		    len)
+			ret = EIO;
+	}
+	poperror();
+	if (io->nr_segs > 1) {
+		if (!write && !ret) {
+			for (i = 0, p = b; i < io->nr_segs; i++) {
+				memmove(io->segs[i].buf, p, io->segs[i].nr_sector * unit->secsize);
+				p += io->segs[i].nr_sector * unit->secsize;
+			}
+		}
+		kfree(b);
+	}
+	return ret;
+}
+
+static void sdbdevproc(void *arg)
+{
+	struct sdbdev *sb = arg;
+	struct bdev_io *io;
+	int8_t irq_state = 0;
+
+	for (;;) {
+		sem_down_irqsave(&sb->nios, &irq_state);
+		spin_lock_irqsave(&sb->lock);
+		io = TAILQ_FIRST(&sb->ios);
+		TAILQ_REMOVE(&sb->ios, io, link);
+		spin_unlock_irqsave(&sb->lock);
+		bdev_io_done(io, sdbdevbio(sb->unit, io));
+	}
+}
+
+static void sdbdevstart(struct block_device *bdev, struct bdev_io *io)
+{
+	struct sdbdev *sb = container_of(bdev, struct sdbdev, bdev);
+	struct sdunit *unit = sb->unit;
+	int8_t irq_state = 0;
+
+	if (unit->dev->ifc->aio && unit->dev->ifc->aio(unit, io) == 0)
+		return;
+	spin_lock_irqsave(&sb->lock);
+	TAILQ_INSERT_TAIL(&sb->ios, io, link);
+	spin_unlock_irqsave(&sb->lock);
+	sem_up_irqsave(&sb->nios, &irq_state);
+}
+
+static struct bdev_ops sdbdevops = {
+	.start = sdbdevstart,
+};
+
+static void sdbdevinit(struct sdunit *unit)
+{
+	struct sdbdev *sb;
+	char path[32];
+
+	sb = kzmalloc(sizeof(struct sdbdev), MEM_WAIT);
+	sb->unit = unit;
+	spinlock_init_irqsave(&sb->lock);
+	TAILQ_INIT(&sb->ios);
+	sem_init_irqsave(&sb->nios, 0);
+	bdev_init(&sb->bdev, unit->sdperm.name, unit->secsize, unit->sectors,
+	          &sdbdevops, unit);
+	sb->bdev.b_max_sectors = SDmaxio / unit->secsize;
+	/* Without a queueing aio, the ktask runs one at a time anyway.  Keeping
+	 * the rest in the block layer's queue lets them merge. */
+	sb->bdev.b_max_inflight = MAX(unit->qdepth, 1);
+	unit->bdev = sb;
+	ktask("sdbdev", sdbdevproc, sb);
+	snprintf(path, sizeof(path), "/dev/%s", unit->sdperm.name);
+	bdev_make_device(&sb->bdev, path);
+}
+
+/* Reads or writes nb sectors at bno for sdbio.  Once a unit has a block
+ * device, we go through it, so that concurrent readers and writers of the
+ * unit are in flight at once on controllers that queue. */
+static long sdunitio(struct sdunit *unit, int write, void *b, long nb,
+                     uint64_t bno)
+{
+	struct block_request *breq;
+	struct buffer_head bh;
+	long ret;
+
+	if (!unit->bdev)
+		return unit->dev->ifc->bio(unit, 0, write, b, nb, bno);
+	memset(&bh, 0, sizeof(struct buffer_head));
+	bh.bh_buffer = b;
+	bh.bh_sector = bno;
+	bh.bh_nr_sector = nb;
+	breq = kmem_cache_alloc(breq_kcache, MEM_WAIT);
+	breq->flags = write ? BREQ_WRITE : BREQ_READ;
+	breq->callback = generic_breq_done;
+	breq->data = NULL;
+	sem_init_irqsave(&breq->sem, 0);
+	breq->bhs = breq->local_bhs;
+	breq->bhs[0] = &bh;
+	breq->nr_bhs = 1;
+	if (bdev_submit_request(&unit->bdev->bdev, breq)) {
+		kmem_cache_free(breq_kcache, breq);
+		return -1;
+	}
+	sleep_on_breq(breq);
+	ret = breq->error ? -1 : nb * unit->secsize;
+	kmem_cache_free(breq_kcache, breq);
+	return ret;
+}
+
 static int sdinitpart(struct sdunit *unit)
 {
-#if 0
-	Mach *m;
-	int nf;
-	uint64_t start, end;
-	char *f[4], *p, *q, buf[10];
-
-	m = machp();
-#endif
 	if (unit->sectors > 0) {
 		unit->sectors = unit->secsize = 0;
 		sdincvers(unit);
@@ -212,32 +368,9 @@ static int sdinitpart(struct sdunit *unit)
 	if (unit->sectors) {
 		sdincvers(unit);
 		sdaddpart(unit, "data", 0, unit->sectors);
-
-/*
- * Use partitions passed from boot program,
- * e.g.
- *	sdC0part=dos 63 123123/plan9 123123 456456
- * This happens before /boot sets hostname so the
- * partitions will have the null-string for user.
- * The gen functions patch it up.
- */
-#if 0
-		snprint(buf, sizeof buf, "%spart", unit->SDperm.name);
-		for(p = getconf(buf); p != nil; p = q){
-			if(q = strchr(p, '/'))
-				*q++ = '\0';
-			nf = tokenize(p, f, nelem(f));
-			if(nf < 3)
-				continue;
-
-			start = strtoull(f[1], 0, 0);
-			end = strtoull(f[2], 0, 0);
-			if(!waserror()){
-				sdaddpart(unit, f[0], start, end);
-				poperror();
-			}
-		}
-#endif
+		/* Media changes don't resize the block device yet */
+		if (unit->bdev == NULL)
+			sdbdevinit(unit);
 	}
 
 	return 1;
@@ -248,7 +381,7 @@ static int sdindex(int idno)
 	char *p;
 
 	p = strchr(devletters, idno);
-	if (p == nil)
+	if (p == NULL)
 		return -1;
 	return p - devletters;
 }
@@ -259,11 +392,11 @@ static struct sdev *sdgetdev(int idno)
 	int i;
 
 	if ((i = sdindex(idno)) < 0)
-		return nil;
+		return NULL;
 
 	qlock(&devslock);
-	if (sdev = devs[i])
-		incref(&sdev->r);
+	if ((sdev = devs[i]))
+		kref_get(&sdev->r, 1);
 	qunlock(&devslock);
 	return sdev;
 }
@@ -280,31 +413,30 @@ static struct sdunit *sdgetunit(struct sdev *sdev, int subno)
 	 * successfully accessed.
 	 */
 	qlock(&sdev->unitlock);
-	if (subno > sdev->nunit) {
+	if (subno >= sdev->nunit) {
 		qunlock(&sdev->unitlock);
-		return nil;
+		return NULL;
 	}
 
 	unit = sdev->unit[subno];
-	if (unit == nil) {
+	if (unit == NULL) {
 		/*
 		 * Probe the unit only once. This decision
 		 * may be a little severe and reviewed later.
 		 */
 		if (sdev->unitflg[subno]) {
 			qunlock(&sdev->unitlock);
-			return nil;
-		}
-		if ((unit = malloc(sizeof(struct sdunit))) == nil) {
-			qunlock(&sdev->unitlock);
-			return nil;
+			return NULL;
 		}
+		unit = kzmalloc(sizeof(struct sdunit), MEM_WAIT);
+		qlock_init(&unit->ctl);
+		qlock_init(&unit->raw);
 		sdev->unitflg[subno] = 1;
 
-		snprint(buf, sizeof(buf), "%s%d", sdev->name, subno);
-		kstrdup(&unit->SDperm.name, buf);
-		kstrdup(&unit->SDperm.user, eve);
-		unit->SDperm.perm = 0555;
+		snprintf(buf, sizeof(buf), "%s%d", sdev->name, subno);
+		kstrdup(&unit->sdperm.name, buf);
+		kstrdup(&unit->sdperm.user, eve);
+		unit->sdperm.perm = 0555;
 		unit->subno = subno;
 		unit->dev = sdev;
 
@@ -319,8 +451,8 @@ static struct sdunit *sdgetunit(struct sdev *sdev, int subno)
 		 */
 		if (unit->dev->ifc->verify(unit) == 0) {
 			qunlock(&sdev->unitlock);
-			free(unit);
-			return nil;
+			kfree(unit);
+			return NULL;
 		}
 		sdev->unit[subno] = unit;
 	}
@@ -328,6 +460,29 @@ static struct sdunit *sdgetunit(struct sdev *sdev, int subno)
 	return unit;
 }
 
+/* Returns the block device for unit subno of controller idno (e.g. 'E', 0 for
+ * sdE0), bringing the unit online if it isn't yet.  Returns NULL if there's no
+ * such unit or it has no media. */
+struct block_device *sdgetbdev(int idno, int subno)
+{
+	struct sdev *sdev;
+	struct sdunit *unit;
+	struct block_device *bdev = NULL;
+
+	if ((sdev = sdgetdev(idno)) == NULL)
+		return NULL;
+	if ((unit = sdgetunit(sdev, subno)) != NULL) {
+		qlock(&unit->ctl);
+		if (unit->sectors == 0)
+			sdinitpart(unit);
+		if (unit->bdev)
+			bdev = &unit->bdev->bdev;
+		qunlock(&unit->ctl);
+	}
+	kref_put(&sdev->r);
+	return bdev;
+}
+
 static void sdreset(void)
 {
 	int i;
@@ -336,8 +491,8 @@ static void sdreset(void)
 	/*
 	 * Probe all known controller types and register any devices found.
 	 */
-	for (i = 0; sdifc[i] != nil; i++) {
-		if (sdifc[i]->pnp == nil || (sdev = sdifc[i]->pnp()) == nil)
+	for (i = 0; sdifc[i] != NULL; i++) {
+		if (sdifc[i]->pnp == NULL || (sdev = sdifc[i]->pnp()) == NULL)
 			continue;
 		sdadddevs(sdev);
 	}
@@ -351,56 +506,46 @@ void sdadddevs(struct sdev *sdev)
 	for (; sdev; sdev = next) {
 		next = sdev->next;
 
-		sdev->unit =
-		    (struct sdunit **)malloc(sdev->nunit * sizeof(struct sdunit *));
-		sdev->unitflg = (int *)malloc(sdev->nunit * sizeof(int));
-		if (sdev->unit == nil || sdev->unitflg == nil) {
-			print("sdadddevs: out of memory\n");
-		giveup:
-			free(sdev->unit);
-			free(sdev->unitflg);
-			if (sdev->ifc->clear)
-				sdev->ifc->clear(sdev);
-			free(sdev);
-			continue;
-		}
+		kref_init(&sdev->r, fake_release, 1);
+		qlock_init(&sdev->ql);
+		qlock_init(&sdev->unitlock);
+		sdev->unit = kzmalloc(sdev->nunit * sizeof(struct sdunit *), MEM_WAIT);
+		sdev->unitflg = kzmalloc(sdev->nunit * sizeof(int), MEM_WAIT);
 		id = sdindex(sdev->idno);
 		if (id == -1) {
-			print("sdadddevs: bad id number %d (%C)\n", id, id);
+			printk("sdadddevs: bad id number %d (%c)\n", id, id);
 			goto giveup;
 		}
 		qlock(&devslock);
-		for (i = 0; i < nelem(devs); i++) {
-			if (devs[j = (id + i) % nelem(devs)] == nil) {
+		for (i = 0; i < ARRAY_SIZE(devs); i++) {
+			if (devs[j = (id + i) % ARRAY_SIZE(devs)] == NULL) {
 				sdev->idno = devletters[j];
 				devs[j] = sdev;
-				snprint(sdev->name, sizeof sdev->name, "sd%c", devletters[j]);
+				snprintf(sdev->name, sizeof sdev->name, "sd%c", devletters[j]);
 				break;
 			}
 		}
 		qunlock(&devslock);
-		if (i == nelem(devs)) {
-			print("sdadddevs: out of device letters\n");
+		if (i == ARRAY_SIZE(devs)) {
+			printk("sdadddevs: out of device letters\n");
 			goto giveup;
 		}
+		continue;
+	giveup:
+		kfree(sdev->unit);
+		kfree(sdev->unitflg);
+		if (sdev->ifc->clear)
+			sdev->ifc->clear(sdev);
+		kfree(sdev);
 	}
 }
 
-// void
-// sdrmdevs(SDev *sdev)
-// {
-// 	char buf[2];
-//
-// 	snprint(buf, sizeof buf, "%c", sdev->idno);
-// 	unconfigure(buf);
-// }
-
 void sdaddallconfs(void (*addconf)(struct sdunit *))
 {
 	int i, u;
 	struct sdev *sdev;
 
-	for (i = 0; i < nelem(devs); i++) /* each controller */
+	for (i = 0; i < ARRAY_SIZE(devs); i++) /* each controller */
 		for (sdev = devs[i]; sdev; sdev = sdev->next)
 			for (u = 0; u < sdev->nunit; u++) /* each drive */
 				(*addconf)(sdev->unit[u]);
@@ -451,14 +596,14 @@ static int sd2gen(struct chan *c, int i, struct dir *dp)
 		l = (pp->end - pp->start) * unit->secsize;
 		mkqid(&q, QID(DEV(c->qid), UNIT(c->qid), PART(c->qid), Qpart),
 		      unit->vers + pp->vers, QTFILE);
-		if (emptystr(pp->SDperm.user))
-			kstrdup(&pp->SDperm.user, eve);
-		devdir(c, q, pp->SDperm.name, l, pp->SDperm.user, pp->SDperm.perm, dp);
+		if (emptystr(pp->sdperm.user))
+			kstrdup(&pp->sdperm.user, eve);
+		devdir(c, q, pp->sdperm.name, l, pp->sdperm.user, pp->sdperm.perm, dp);
 		rv = 1;
 		break;
 	}
 
-	decref(&sdev->r);
+	kref_put(&sdev->r);
 	return rv;
 }
 
@@ -478,7 +623,6 @@ static int sd1gen(struct chan *c, int i, struct dir *dp)
 static int sdgen(struct chan *c, char *d, struct dirtab *dir, int j, int s,
                  struct dir *dp)
 {
-	struct proc *up = externup();
 	struct qid q = {};
 	int64_t l;
 	int i, r;
@@ -490,8 +634,8 @@ static int sdgen(struct chan *c, char *d, struct dirtab *dir, int j, int s,
 	case Qtopdir:
 		if (s == DEVDOTDOT) {
 			mkqid(&q, QID(0, 0, 0, Qtopdir), 0, QTDIR);
-			sprint(up->genbuf, "#%C", sddevtab.dc);
-			devdir(c, q, up->genbuf, 0, eve, 0555, dp);
+			snprintf(get_cur_genbuf(), GENBUF_SZ, "#%s", devname());
+			devdir(c, q, get_cur_genbuf(), 0, eve, 0555, dp);
 			return 1;
 		}
 
@@ -500,7 +644,7 @@ static int sdgen(struct chan *c, char *d, struct dirtab *dir, int j, int s,
 		s -= (Qunitdir - Qtopbase);
 
 		qlock(&devslock);
-		for (i = 0; i < nelem(devs); i++) {
+		for (i = 0; i < ARRAY_SIZE(devs); i++) {
 			if (devs[i]) {
 				if (s < devs[i]->nunit)
 					break;
@@ -508,43 +652,43 @@ static int sdgen(struct chan *c, char *d, struct dirtab *dir, int j, int s,
 			}
 		}
 
-		if (i == nelem(devs)) {
+		if (i == ARRAY_SIZE(devs)) {
 			/* Run off the end of the list */
 			qunlock(&devslock);
 			return -1;
 		}
 
-		if ((sdev = devs[i]) == nil) {
+		if ((sdev = devs[i]) == NULL) {
 			qunlock(&devslock);
 			return 0;
 		}
 
-		incref(&sdev->r);
+		kref_get(&sdev->r, 1);
 		qunlock(&devslock);
 
-		if ((unit = sdev->unit[s]) == nil)
-			if ((unit = sdgetunit(sdev, s)) == nil) {
-				decref(&sdev->r);
+		if ((unit = sdev->unit[s]) == NULL)
+			if ((unit = sdgetunit(sdev, s)) == NULL) {
+				kref_put(&sdev->r);
 				return 0;
 			}
 
 		mkqid(&q, QID(sdev->idno, s, 0, Qunitdir), 0, QTDIR);
-		if (emptystr(unit->SDperm.user))
-			kstrdup(&unit->SDperm.user, eve);
-		devdir(c, q, unit->SDperm.name, 0, unit->SDperm.user, unit->SDperm.perm,
+		if (emptystr(unit->sdperm.user))
+			kstrdup(&unit->sdperm.user, eve);
+		devdir(c, q, unit->sdperm.name, 0, unit->sdperm.user, unit->sdperm.perm,
 		       dp);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		return 1;
 
 	case Qunitdir:
 		if (s == DEVDOTDOT) {
 			mkqid(&q, QID(0, 0, 0, Qtopdir), 0, QTDIR);
-			sprint(up->genbuf, "#%C", sddevtab.dc);
-			devdir(c, q, up->genbuf, 0, eve, 0555, dp);
+			snprintf(get_cur_genbuf(), GENBUF_SZ, "#%s", devname());
+			devdir(c, q, get_cur_genbuf(), 0, eve, 0555, dp);
 			return 1;
 		}
 
-		if ((sdev = sdgetdev(DEV(c->qid))) == nil) {
+		if ((sdev = sdgetdev(DEV(c->qid))) == NULL) {
 			devdir(c, c->qid, "unavailable", 0, eve, 0, dp);
 			return 1;
 		}
@@ -567,34 +711,34 @@ static int sdgen(struct chan *c, char *d, struct dirtab *dir, int j, int s,
 		if (i < Qpart) {
 			r = sd2gen(c, i, dp);
 			qunlock(&unit->ctl);
-			decref(&sdev->r);
+			kref_put(&sdev->r);
 			return r;
 		}
 		i -= Qpart;
-		if (unit->part == nil || i >= unit->npart) {
+		if (unit->part == NULL || i >= unit->npart) {
 			qunlock(&unit->ctl);
-			decref(&sdev->r);
+			kref_put(&sdev->r);
 			break;
 		}
 		pp = &unit->part[i];
 		if (!pp->valid) {
 			qunlock(&unit->ctl);
-			decref(&sdev->r);
+			kref_put(&sdev->r);
 			return 0;
 		}
 		l = (pp->end - pp->start) * (int64_t)unit->secsize;
 		mkqid(&q, QID(DEV(c->qid), UNIT(c->qid), i, Qpart),
 		      unit->vers + pp->vers, QTFILE);
-		if (emptystr(pp->SDperm.user))
-			kstrdup(&pp->SDperm.user, eve);
-		devdir(c, q, pp->SDperm.name, l, pp->SDperm.user, pp->SDperm.perm, dp);
+		if (emptystr(pp->sdperm.user))
+			kstrdup(&pp->sdperm.user, eve);
+		devdir(c, q, pp->sdperm.name, l, pp->sdperm.user, pp->sdperm.perm, dp);
 		qunlock(&unit->ctl);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		return 1;
 	case Qraw:
 	case Qctl:
 	case Qpart:
-		if ((sdev = sdgetdev(DEV(c->qid))) == nil) {
+		if ((sdev = sdgetdev(DEV(c->qid))) == NULL) {
 			devdir(c, q, "unavailable", 0, eve, 0, dp);
 			return 1;
 		}
@@ -602,7 +746,7 @@ static int sdgen(struct chan *c, char *d, struct dirtab *dir, int j, int s,
 		qlock(&unit->ctl);
 		r = sd2gen(c, TYPE(c->qid), dp);
 		qunlock(&unit->ctl);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		return r;
 	case Qtopctl:
 		return sd1gen(c, TYPE(c->qid), dp);
@@ -621,46 +765,46 @@ static struct chan *sdattach(char *spec)
 	int idno, subno;
 
 	if (*spec == '\0') {
-		c = devattach(sddevtab.dc, spec);
+		c = devattach(devname(), spec);
 		mkqid(&c->qid, QID(0, 0, 0, Qtopdir), 0, QTDIR);
 		return c;
 	}
 
 	if (spec[0] != 's' || spec[1] != 'd')
-		error(Ebadspec);
+		error(EINVAL, "bad attach spec %s", spec);
 	idno = spec[2];
 	subno = strtol(&spec[3], &p, 0);
 	if (p == &spec[3])
-		error(Ebadspec);
+		error(EINVAL, "bad attach spec %s", spec);
 
-	if ((sdev = sdgetdev(idno)) == nil)
-		error(Enonexist);
-	if (sdgetunit(sdev, subno) == nil) {
-		decref(&sdev->r);
-		error(Enonexist);
+	if ((sdev = sdgetdev(idno)) == NULL)
+		error(ENODEV, "no controller %c", idno);
+	if (sdgetunit(sdev, subno) == NULL) {
+		kref_put(&sdev->r);
+		error(ENODEV, "no unit %d on %s", subno, sdev->name);
 	}
 
-	c = devattach(sddevtab.dc, spec);
+	c = devattach(devname(), spec);
 	mkqid(&c->qid, QID(sdev->idno, subno, 0, Qunitdir), 0, QTDIR);
-	c->devno = (sdev->idno << UnitLOG) + subno;
-	decref(&sdev->r);
+	c->dev = (sdev->idno << UnitLOG) + subno;
+	kref_put(&sdev->r);
 	return c;
 }
 
 static struct walkqid *sdwalk(struct chan *c, struct chan *nc, char **name,
                               int nname)
 {
-	return devwalk(c, nc, name, nname, nil, 0, sdgen);
+	return devwalk(c, nc, name, nname, NULL, 0, sdgen);
 }
 
-static int32_t sdstat(struct chan *c, uint8_t *db, int32_t n)
+static int sdstat(struct chan *c, uint8_t *db, int n)
 {
-	return devstat(c, db, n, nil, 0, sdgen);
+	return devstat(c, db, n, NULL, 0, sdgen);
 }
 
 static struct chan *sdopen(struct chan *c, int omode)
 {
-	struct proc *up = externup();
+	ERRSTACK(1);
 	struct sdpart *pp;
 	struct sdunit *unit;
 	struct sdev *sdev;
@@ -671,8 +815,8 @@ static struct chan *sdopen(struct chan *c, int omode)
 		return c;
 
 	sdev = sdgetdev(DEV(c->qid));
-	if (sdev == nil)
-		error(Enonexist);
+	if (sdev == NULL)
+		error(ENODEV, ERROR_FIXME);
 
 	unit = sdev->unit[UNIT(c->qid)];
 
@@ -682,10 +826,10 @@ static struct chan *sdopen(struct chan *c, int omode)
 		break;
 	case Qraw:
 		c->qid.vers = unit->vers;
-		if (TAS(&unit->rawinuse) != 0) {
+		if (atomic_swap(&unit->rawinuse, 1) != 0) {
 			c->flag &= ~COPEN;
-			decref(&sdev->r);
-			error(Einuse);
+			kref_put(&sdev->r);
+			error(EBUSY, "%s raw is in use", unit->sdperm.name);
 		}
 		unit->state = Rawcmd;
 		break;
@@ -694,7 +838,7 @@ static struct chan *sdopen(struct chan *c, int omode)
 		if (waserror()) {
 			qunlock(&unit->ctl);
 			c->flag &= ~COPEN;
-			decref(&sdev->r);
+			kref_put(&sdev->r);
 			nexterror();
 		}
 		pp = &unit->part[PART(c->qid)];
@@ -703,7 +847,7 @@ static struct chan *sdopen(struct chan *c, int omode)
 		poperror();
 		break;
 	}
-	decref(&sdev->r);
+	kref_put(&sdev->r);
 	return c;
 }
 
@@ -724,52 +868,51 @@ static void sdclose(struct chan *c)
 		sdev = sdgetdev(DEV(c->qid));
 		if (sdev) {
 			unit = sdev->unit[UNIT(c->qid)];
-			unit->rawinuse = 0;
-			decref(&sdev->r);
+			atomic_set(&unit->rawinuse, 0);
+			kref_put(&sdev->r);
 		}
 		break;
 	}
 }
 
-static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
-                     int64_t off)
+static long sdbio(struct chan *c, int write, char *a, long len, int64_t off)
 {
-	struct proc *up = externup();
+	ERRSTACK(2);
 	int nchange;
 	uint8_t *b;
 	struct sdpart *pp;
 	struct sdunit *unit;
 	struct sdev *sdev;
 	int64_t bno;
-	int32_t l, max, nb, offset;
+	long l, max, nb, offset;
 
 	sdev = sdgetdev(DEV(c->qid));
-	if (sdev == nil) {
-		decref(&sdev->r);
-		error(Enonexist);
-	}
+	if (sdev == NULL)
+		error(ENODEV, ERROR_FIXME);
 	unit = sdev->unit[UNIT(c->qid)];
-	if (unit == nil)
-		error(Enonexist);
+	if (unit == NULL) {
+		kref_put(&sdev->r);
+		error(ENODEV, ERROR_FIXME);
+	}
 
 	nchange = 0;
 	qlock(&unit->ctl);
 	while (waserror()) {
 		/* notification of media change; go around again */
-		if (strcmp(up->errstr, Eio) == 0 && unit->sectors == 0 &&
-		    nchange++ == 0) {
+		if (get_errno() == EIO && unit->sectors == 0 && nchange++ == 0) {
 			sdinitpart(unit);
+			poperror();
 			continue;
 		}
 
 		/* other errors; give up */
 		qunlock(&unit->ctl);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		nexterror();
 	}
 	pp = &unit->part[PART(c->qid)];
 	if (unit->vers + pp->vers != c->qid.vers)
-		error(Echange);
+		error(ESTALE, Echange);
 
 	/*
 	 * Check the request is within bounds.
@@ -791,9 +934,9 @@ static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
 		nb = pp->end - bno;
 	if (bno >= pp->end || nb == 0) {
 		if (write)
-			error(Eio);
+			error(EIO, "write past the end of %s", pp->sdperm.name);
 		qunlock(&unit->ctl);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		poperror();
 		return 0;
 	}
@@ -803,12 +946,10 @@ static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
 	}
 
 	b = sdmalloc(nb * unit->secsize);
-	if (b == nil)
-		error(Enomem);
 	if (waserror()) {
 		sdfree(b);
 		if (!(unit->inquiry[1] & SDinq1removable))
-			decref(&sdev->r); /* gadverdamme! */
+			kref_put(&sdev->r); /* gadverdamme! */
 		nexterror();
 	}
 
@@ -817,9 +958,9 @@ static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
 		len = nb * unit->secsize - offset;
 	if (write) {
 		if (offset || (len % unit->secsize)) {
-			l = unit->dev->ifc->bio(unit, 0, 0, b, nb, bno);
+			l = sdunitio(unit, 0, b, nb, bno);
 			if (l < 0)
-				error(Eio);
+				error(EIO, ERROR_FIXME);
 			if (l < (nb * unit->secsize)) {
 				nb = l / unit->secsize;
 				l = nb * unit->secsize - offset;
@@ -828,17 +969,17 @@ static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
 			}
 		}
 		memmove(b + offset, a, len);
-		l = unit->dev->ifc->bio(unit, 0, 1, b, nb, bno);
+		l = sdunitio(unit, 1, b, nb, bno);
 		if (l < 0)
-			error(Eio);
+			error(EIO, ERROR_FIXME);
 		if (l < offset)
 			len = 0;
 		else if (len > l - offset)
 			len = l - offset;
 	} else {
-		l = unit->dev->ifc->bio(unit, 0, 0, b, nb, bno);
+		l = sdunitio(unit, 0, b, nb, bno);
 		if (l < 0)
-			error(Eio);
+			error(EIO, ERROR_FIXME);
 		if (l < offset)
 			len = 0;
 		else if (len > l - offset)
@@ -853,22 +994,21 @@ static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
 		poperror();
 	}
 
-	decref(&sdev->r);
+	kref_put(&sdev->r);
 	return len;
 }
 
-static int32_t sdrio(struct sdreq *r, void *a, int32_t n)
+static long sdrio(struct sdreq *r, void *a, long n)
 {
-	struct proc *up = externup();
+	ERRSTACK(1);
 	void *data;
 
 	if (n >= SDmaxio || n < 0)
-		error(Etoobig);
+		error(E2BIG, "raw IO of %d bytes", n);
 
-	data = nil;
+	data = NULL;
 	if (n) {
-		if ((data = sdmalloc(n)) == nil)
-			error(Enomem);
+		data = sdmalloc(n);
 		if (r->write)
 			memmove(data, a, n);
 	}
@@ -877,17 +1017,17 @@ static int32_t sdrio(struct sdreq *r, void *a, int32_t n)
 
 	if (waserror()) {
 		sdfree(data);
-		r->data = nil;
+		r->data = NULL;
 		nexterror();
 	}
 
 	if (r->unit->dev->ifc->rio(r) != SDok)
-		error(Eio);
+		error(EIO, ERROR_FIXME);
 
 	if (!r->write && r->rlen > 0)
 		memmove(a, data, r->rlen);
 	sdfree(data);
-	r->data = nil;
+	r->data = NULL;
 	poperror();
 
 	return r->rlen;
@@ -938,7 +1078,7 @@ int sdmodesense(struct sdreq *r, uint8_t *cmd, void *info, int ilen)
 		return SDok;
 	if (len < 8 + ilen)
 		return sdsetsense(r, SDcheck, 0x05, 0x1A, 0);
-	if (r->data == nil || r->dlen < len)
+	if (r->data == NULL || r->dlen < len)
 		return sdsetsense(r, SDcheck, 0x05, 0x20, 1);
 	data = r->data;
 	memset(data, 0, 8);
@@ -1018,14 +1158,14 @@ int sdfakescsi(struct sdreq *r, void *info, int ilen)
 
 	case 0x1B: /* start/stop unit */
 		/*
-		* nop for now, can use power management later.
-		                   */
+		 * nop for now, can use power management later.
+		 */
 		return sdsetsense(r, SDok, 0, 0, 0);
 
 	case 0x25: /* read capacity */
 		if ((cmd[1] & 0x01) || cmd[2] || cmd[3])
 			return sdsetsense(r, SDcheck, 0x05, 0x24, 0);
-		if (r->data == nil || r->dlen < 8)
+		if (r->data == NULL || r->dlen < 8)
 			return sdsetsense(r, SDcheck, 0x05, 0x20, 1);
 
 		/*
@@ -1048,7 +1188,7 @@ int sdfakescsi(struct sdreq *r, void *info, int ilen)
 	case 0x9E: /* long read capacity */
 		if ((cmd[1] & 0x01) || cmd[2] || cmd[3])
 			return sdsetsense(r, SDcheck, 0x05, 0x24, 0);
-		if (r->data == nil || r->dlen < 8)
+		if (r->data == NULL || r->dlen < 8)
 			return sdsetsense(r, SDcheck, 0x05, 0x20, 1);
 		/*
 		 * Read capcity returns the LBA of the last sector.
@@ -1082,35 +1222,33 @@ int sdfakescsi(struct sdreq *r, void *info, int ilen)
 	}
 }
 
-static int32_t sdread(struct chan *c, void *a, int32_t n, int64_t off)
+static long sdread(struct chan *c, void *a, long n, int64_t off)
 {
-	struct proc *up = externup();
+	ERRSTACK(1);
 	char *p, *e, *buf;
 	struct sdpart *pp;
 	struct sdunit *unit;
 	struct sdev *sdev;
-	int32_t offset;
+	long offset;
 	int i, l, mm, status;
 
 	offset = off;
 	switch (TYPE(c->qid)) {
 	default:
-		error(Eperm);
+		error(EPERM, ERROR_FIXME);
 	case Qtopctl:
 		mm = 64 * 1024; /* room for register dumps */
-		p = buf = malloc(mm);
-		if (p == nil)
-			error(Enomem);
+		p = buf = kzmalloc(mm, MEM_WAIT);
 		e = p + mm;
 		qlock(&devslock);
-		for (i = 0; i < nelem(devs); i++) {
+		for (i = 0; i < ARRAY_SIZE(devs); i++) {
 			sdev = devs[i];
 			if (sdev && sdev->ifc->rtopctl)
 				p = sdev->ifc->rtopctl(sdev, p, e);
 		}
 		qunlock(&devslock);
 		n = readstr(offset, a, n, buf);
-		free(buf);
+		kfree(buf);
 		return n;
 
 	case Qtopdir:
@@ -1119,15 +1257,13 @@ static int32_t sdread(struct chan *c, void *a, int32_t n, int64_t off)
 
 	case Qctl:
 		sdev = sdgetdev(DEV(c->qid));
-		if (sdev == nil)
-			error(Enonexist);
+		if (sdev == NULL)
+			error(ENODEV, ERROR_FIXME);
 
 		unit = sdev->unit[UNIT(c->qid)];
 		mm = 16 * 1024; /* room for register dumps */
-		p = malloc(mm);
-		if (p == nil)
-			error(Enomem);
-		l = snprint(p, mm, "inquiry %.48s\n", (char *)unit->inquiry + 8);
+		p = kzmalloc(mm, MEM_WAIT);
+		l = snprintf(p, mm, "inquiry %.48s\n", (char *)unit->inquiry + 8);
 		qlock(&unit->ctl);
 		/*
 		 * If there's a device specific routine it must
@@ -1139,33 +1275,33 @@ static int32_t sdread(struct chan *c, void *a, int32_t n, int64_t off)
 		if (unit->sectors == 0)
 			sdinitpart(unit);
 		if (unit->sectors) {
-			if (unit->dev->ifc->rctl == nil)
-				l += snprint(p + l, mm - l, "geometry %llu %lu\n",
-				             unit->sectors, unit->secsize);
+			if (unit->dev->ifc->rctl == NULL)
+				l += snprintf(p + l, mm - l, "geometry %llu %lu\n",
+				              unit->sectors, unit->secsize);
 			pp = unit->part;
 			for (i = 0; i < unit->npart; i++) {
 				if (pp->valid)
-					l += snprint(p + l, mm - l, "part %s %llu %llu\n",
-					             pp->SDperm.name, pp->start, pp->end);
+					l += snprintf(p + l, mm - l, "part %s %llu %llu\n",
+					              pp->sdperm.name, pp->start, pp->end);
 				pp++;
 			}
 		}
 		qunlock(&unit->ctl);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		l = readstr(offset, a, n, p);
-		free(p);
+		kfree(p);
 		return l;
 
 	case Qraw:
 		sdev = sdgetdev(DEV(c->qid));
-		if (sdev == nil)
-			error(Enonexist);
+		if (sdev == NULL)
+			error(ENODEV, ERROR_FIXME);
 
 		unit = sdev->unit[UNIT(c->qid)];
 		qlock(&unit->raw);
 		if (waserror()) {
 			qunlock(&unit->raw);
-			decref(&sdev->r);
+			kref_put(&sdev->r);
 			nexterror();
 		}
 		if (unit->state == Rawdata) {
@@ -1174,13 +1310,13 @@ static int32_t sdread(struct chan *c, void *a, int32_t n, int64_t off)
 		} else if (unit->state == Rawstatus) {
 			status = unit->req->status;
 			unit->state = Rawcmd;
-			free(unit->req);
-			unit->req = nil;
+			kfree(unit->req);
+			unit->req = NULL;
 			i = readnum(0, a, n, status, NUMSIZE);
 		} else
 			i = 0;
 		qunlock(&unit->raw);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		poperror();
 		return i;
 
@@ -1189,11 +1325,9 @@ static int32_t sdread(struct chan *c, void *a, int32_t n, int64_t off)
 	}
 }
 
-static void legacytopctl(struct cmdbuf *);
-
-static int32_t sdwrite(struct chan *c, void *a, int32_t n, int64_t off)
+static long sdwrite(struct chan *c, void *a, long n, int64_t off)
 {
-	struct proc *up = externup();
+	ERRSTACK(2);
 	char *f0;
 	int i;
 	uint64_t end, start;
@@ -1205,35 +1339,28 @@ static int32_t sdwrite(struct chan *c, void *a, int32_t n, int64_t off)
 
 	switch (TYPE(c->qid)) {
 	default:
-		error(Eperm);
+		error(EPERM, ERROR_FIXME);
 	case Qtopctl:
 		cb = parsecmd(a, n);
 		if (waserror()) {
-			free(cb);
+			kfree(cb);
 			nexterror();
 		}
 		if (cb->nf == 0)
-			error("empty control message");
+			error(EINVAL, "empty control message");
 		f0 = cb->f[0];
 		cb->f++;
 		cb->nf--;
-		if (strcmp(f0, "config") == 0) {
-			/* wormhole into ugly legacy interface */
-			legacytopctl(cb);
-			poperror();
-			free(cb);
-			break;
-		}
 		/*
-		 * "ata arg..." invokes sdifc[i]->wtopctl(nil, cb),
-		 * where sdifc[i]->SDperm.name=="ata" and cb contains the args.
+		 * "ata arg..." invokes sdifc[i]->wtopctl(NULL, cb),
+		 * where sdifc[i]->name=="ata" and cb contains the args.
 		 */
-		ifc = nil;
-		sdev = nil;
+		ifc = NULL;
+		sdev = NULL;
 		for (i = 0; sdifc[i]; i++) {
 			if (strcmp(sdifc[i]->name, f0) == 0) {
 				ifc = sdifc[i];
-				sdev = nil;
+				sdev = NULL;
 				goto subtopctl;
 			}
 		}
@@ -1243,88 +1370,89 @@ static int32_t sdwrite(struct chan *c, void *a, int32_t n, int64_t off)
 		 * and cb contains the args.
 		 */
 		if (f0[0] == 's' && f0[1] == 'd' && f0[2] && f0[3] == 0) {
-			if ((sdev = sdgetdev(f0[2])) != nil) {
+			if ((sdev = sdgetdev(f0[2])) != NULL) {
 				ifc = sdev->ifc;
 				goto subtopctl;
 			}
 		}
-		error("unknown interface");
+		error(EINVAL, "unknown interface %s", f0);
 
 	subtopctl:
 		if (waserror()) {
 			if (sdev)
-				decref(&sdev->r);
+				kref_put(&sdev->r);
 			nexterror();
 		}
 		if (ifc->wtopctl)
 			ifc->wtopctl(sdev, cb);
 		else
-			error(Ebadctl);
+			error(EINVAL, "%s has no top level controls", f0);
 		poperror();
 		poperror();
 		if (sdev)
-			decref(&sdev->r);
-		free(cb);
+			kref_put(&sdev->r);
+		kfree(cb);
 		break;
 
 	case Qctl:
 		cb = parsecmd(a, n);
 		sdev = sdgetdev(DEV(c->qid));
-		if (sdev == nil)
-			error(Enonexist);
+		if (sdev == NULL) {
+			kfree(cb);
+			error(ENODEV, ERROR_FIXME);
+		}
 		unit = sdev->unit[UNIT(c->qid)];
 
 		qlock(&unit->ctl);
 		if (waserror()) {
 			qunlock(&unit->ctl);
-			decref(&sdev->r);
-			free(cb);
+			kref_put(&sdev->r);
+			kfree(cb);
 			nexterror();
 		}
 		if (unit->vers != c->qid.vers)
-			error(Echange);
+			error(ESTALE, Echange);
 
 		if (cb->nf < 1)
-			error(Ebadctl);
+			error(EINVAL, "empty control message");
 		if (strcmp(cb->f[0], "part") == 0) {
 			if (cb->nf != 4)
-				error(Ebadctl);
+				error(EINVAL, "usage: part name start end");
 			if (unit->sectors == 0 && !sdinitpart(unit))
-				error(Eio);
-			start = strtoull(cb->f[2], 0, 0);
-			end = strtoull(cb->f[3], 0, 0);
+				error(EIO, "%s has no media", unit->sdperm.name);
+			start = strtoul(cb->f[2], 0, 0);
+			end = strtoul(cb->f[3], 0, 0);
 			sdaddpart(unit, cb->f[1], start, end);
 		} else if (strcmp(cb->f[0], "delpart") == 0) {
-			if (cb->nf != 2 || unit->part == nil)
-				error(Ebadctl);
+			if (cb->nf != 2 || unit->part == NULL)
+				error(EINVAL, "usage: delpart name");
 			sddelpart(unit, cb->f[1]);
 		} else if (unit->dev->ifc->wctl)
 			unit->dev->ifc->wctl(unit, cb);
 		else
-			error(Ebadctl);
+			error(EINVAL, "unknown control %s", cb->f[0]);
 		qunlock(&unit->ctl);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		poperror();
-		free(cb);
+		kfree(cb);
 		break;
 
 	case Qraw:
 		sdev = sdgetdev(DEV(c->qid));
-		if (sdev == nil)
-			error(Enonexist);
+		if (sdev == NULL)
+			error(ENODEV, ERROR_FIXME);
 		unit = sdev->unit[UNIT(c->qid)];
 		qlock(&unit->raw);
 		if (waserror()) {
 			qunlock(&unit->raw);
-			decref(&sdev->r);
+			kref_put(&sdev->r);
 			nexterror();
 		}
 		switch (unit->state) {
 		case Rawcmd:
 			if (n < 6 || n > sizeof(req->cmd))
-				error(Ebadarg);
-			if ((req = malloc(sizeof(struct sdreq))) == nil)
-				error(Enomem);
+				error(EINVAL, "bad raw command length %d", n);
+			req = kzmalloc(sizeof(struct sdreq), MEM_WAIT);
 			req->unit = unit;
 			memmove(req->cmd, a, n);
 			req->clen = n;
@@ -1337,9 +1465,9 @@ static int32_t sdwrite(struct chan *c, void *a, int32_t n, int64_t off)
 
 		case Rawstatus:
 			unit->state = Rawcmd;
-			free(unit->req);
-			unit->req = nil;
-			error(Ebadusefd);
+			kfree(unit->req);
+			unit->req = NULL;
+			error(EBADFD, "raw status wasn't read");
 
 		case Rawdata:
 			unit->state = Rawstatus;
@@ -1347,7 +1475,7 @@ static int32_t sdwrite(struct chan *c, void *a, int32_t n, int64_t off)
 			n = sdrio(unit->req, a, n);
 		}
 		qunlock(&unit->raw);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		poperror();
 		break;
 	case Qpart:
@@ -1357,9 +1485,9 @@ static int32_t sdwrite(struct chan *c, void *a, int32_t n, int64_t off)
 	return n;
 }
 
-static int32_t sdwstat(struct chan *c, uint8_t *dp, int32_t n)
+static int sdwstat(struct chan *c, uint8_t *dp, int n)
 {
-	struct proc *up = externup();
+	ERRSTACK(1);
 	struct dir *d;
 	struct sdpart *pp;
 	struct sdperm *perm;
@@ -1367,24 +1495,24 @@ static int32_t sdwstat(struct chan *c, uint8_t *dp, int32_t n)
 	struct sdev *sdev;
 
 	if (c->qid.type & QTDIR)
-		error(Eperm);
+		error(EPERM, ERROR_FIXME);
 
 	sdev = sdgetdev(DEV(c->qid));
-	if (sdev == nil)
-		error(Enonexist);
+	if (sdev == NULL)
+		error(ENODEV, ERROR_FIXME);
 	unit = sdev->unit[UNIT(c->qid)];
 	qlock(&unit->ctl);
-	d = nil;
+	d = NULL;
 	if (waserror()) {
-		free(d);
+		kfree(d);
 		qunlock(&unit->ctl);
-		decref(&sdev->r);
+		kref_put(&sdev->r);
 		nexterror();
 	}
 
 	switch (TYPE(c->qid)) {
 	default:
-		error(Eperm);
+		error(EPERM, ERROR_FIXME);
 	case Qctl:
 		perm = &unit->ctlperm;
 		break;
@@ -1394,246 +1522,48 @@ static int32_t sdwstat(struct chan *c, uint8_t *dp, int32_t n)
 	case Qpart:
 		pp = &unit->part[PART(c->qid)];
 		if (unit->vers + pp->vers != c->qid.vers)
-			error(Enonexist);
-		perm = &pp->SDperm;
+			error(ENODEV, ERROR_FIXME);
+		perm = &pp->sdperm;
 		break;
 	}
 
-	if (strcmp(up->user, perm->user) && !iseve())
-		error(Eperm);
+	if (strcmp(current->user, perm->user) && !iseve())
+		error(EPERM, ERROR_FIXME);
 
-	d = smalloc(sizeof(struct dir) + n);
+	d = kzmalloc(sizeof(struct dir) + n, MEM_WAIT);
 	n = convM2D(dp, n, &d[0], (char *)&d[1]);
 	if (n == 0)
-		error(Eshortstat);
+		error(ENODATA, ERROR_FIXME);
 	if (!emptystr(d[0].uid))
 		kstrdup(&perm->user, d[0].uid);
 	if (d[0].mode != (uint32_t)~0UL)
 		perm->perm = (perm->perm & ~0777) | (d[0].mode & 0777);
 
-	free(d);
+	kfree(d);
 	qunlock(&unit->ctl);
-	decref(&sdev->r);
+	kref_put(&sdev->r);
 	poperror();
 	return n;
 }
 
-static int configure(char *spec, DevConf *cf)
-{
-	struct sdev *s, *sdev;
-	char *p;
-	int i;
-
-	if (sdindex(*spec) < 0)
-		error("bad sd spec");
-
-	if ((p = strchr(cf->type, '/')) != nil)
-		*p++ = '\0';
-
-	for (i = 0; sdifc[i] != nil; i++)
-		if (strcmp(sdifc[i]->name, cf->type) == 0)
-			break;
-	if (sdifc[i] == nil)
-		error("sd type not found");
-	if (p)
-		*(p - 1) = '/';
-
-	if (sdifc[i]->probe == nil)
-		error("sd type cannot probe");
-
-	sdev = sdifc[i]->probe(cf);
-	for (s = sdev; s; s = s->next)
-		s->idno = *spec;
-	sdadddevs(sdev);
-	return 0;
-}
-
-static int unconfigure(char *spec)
-{
-	int i;
-	struct sdev *sdev;
-	struct sdunit *unit;
-
-	if ((i = sdindex(*spec)) < 0)
-		error(Enonexist);
-
-	qlock(&devslock);
-	if ((sdev = devs[i]) == nil) {
-		qunlock(&devslock);
-		error(Enonexist);
-	}
-	if (sdev->r.ref) {
-		qunlock(&devslock);
-		error(Einuse);
-	}
-	devs[i] = nil;
-	qunlock(&devslock);
-
-	/* make sure no interrupts arrive anymore before removing resources */
-	if (sdev->enabled && sdev->ifc->disable)
-		sdev->ifc->disable(sdev);
-
-	for (i = 0; i != sdev->nunit; i++) {
-		if (unit = sdev->unit[i]) {
-			free(unit->SDperm.name);
-			free(unit->SDperm.user);
-			free(unit);
-		}
-	}
-
-	if (sdev->ifc->clear)
-		sdev->ifc->clear(sdev);
-	free(sdev);
-	return 0;
-}
-
-static int sdconfig(int on, char *spec, DevConf *cf)
-{
-	if (on)
-		return configure(spec, cf);
-	return unconfigure(spec);
-}
-
-struct dev sddevtab = {
-    .dc = 'S',
-    .name = "sd",
-
-    .reset = sdreset,
-    .init = devinit,
-    .shutdown = devshutdown,
-    .attach = sdattach,
-    .walk = sdwalk,
-    .stat = sdstat,
-    .open = sdopen,
-    .create = devcreate,
-    .close = sdclose,
-    .read = sdread,
-    .bread = devbread,
-    .write = sdwrite,
-    .bwrite = devbwrite,
-    .remove = devremove,
-    .wstat = sdwstat,
-    .power = devpower,
-    .config = sdconfig, /* probe; only called for pcmcia-like devices */
+struct dev sddevtab __devtab = {
+	.name = "sd",
+
+	.reset = sdreset,
+	.init = devinit,
+	.shutdown = devshutdown,
+	.attach = sdattach,
+	.walk = sdwalk,
+	.stat = sdstat,
+	.open = sdopen,
+	.create = devcreate,
+	.close = sdclose,
+	.read = sdread,
+	.bread = devbread,
+	.write = sdwrite,
+	.bwrite = devbwrite,
+	.remove = devremove,
+	.wstat = sdwstat,
+	.power = devpower,
+	.chaninfo = devchaninfo,
 };
-
-/*
- * This is wrong for so many reasons.  This code must go.
- */
-typedef struct Confdata Confdata;
-struct Confdata {
-	int on;
-	char *spec;
-	DevConf cf;
-};
-
-static void parseswitch(Confdata *cd, char *option)
-{
-	if (!strcmp("on", option))
-		cd->on = 1;
-	else if (!strcmp("off", option))
-		cd->on = 0;
-	else
-		error(Ebadarg);
-}
-
-static void parsespec(Confdata *cd, char *option)
-{
-	if (strlen(option) > 1)
-		error(Ebadarg);
-	cd->spec = option;
-}
-
-static struct devport *getnewport(DevConf *dc)
-{
-	struct devport *p;
-
-	p = (struct devport *)malloc((dc->nports + 1) * sizeof(struct devport));
-	if (p == nil)
-		error(Enomem);
-	if (dc->nports > 0) {
-		memmove(p, dc->ports, dc->nports * sizeof(struct devport));
-		free(dc->ports);
-	}
-	dc->ports = p;
-	p = &dc->ports[dc->nports++];
-	p->size = -1;
-	p->port = (uint32_t)-1;
-	return p;
-}
-
-static void parseport(Confdata *cd, char *option)
-{
-	char *e;
-	struct devport *p;
-
-	if (cd->cf.nports == 0 ||
-	    cd->cf.ports[cd->cf.nports - 1].port != (uint32_t)-1)
-		p = getnewport(&cd->cf);
-	else
-		p = &cd->cf.ports[cd->cf.nports - 1];
-	p->port = strtol(option, &e, 0);
-	if (e == nil || *e != '\0')
-		error(Ebadarg);
-}
-
-static void parsesize(Confdata *cd, char *option)
-{
-	char *e;
-	struct devport *p;
-
-	if (cd->cf.nports == 0 || cd->cf.ports[cd->cf.nports - 1].size != -1)
-		p = getnewport(&cd->cf);
-	else
-		p = &cd->cf.ports[cd->cf.nports - 1];
-	p->size = (int)strtol(option, &e, 0);
-	if (e == nil || *e != '\0')
-		error(Ebadarg);
-}
-
-static void parseirq(Confdata *cd, char *option)
-{
-	char *e;
-
-	cd->cf.intnum = strtoul(option, &e, 0);
-	if (e == nil || *e != '\0')
-		error(Ebadarg);
-}
-
-static void parsetype(Confdata *cd, char *option) { cd->cf.type = option; }
-
-static struct {
-	char *name;
-	void (*parse)(Confdata *, char *);
-} options[] = {
-    "switch", parseswitch, "spec", parsespec, "port", parseport,
-    "size",   parsesize,   "irq",  parseirq,  "type", parsetype,
-};
-
-static void legacytopctl(struct cmdbuf *cb)
-{
-	char *opt;
-	int i, j;
-	Confdata cd;
-
-	memset(&cd, 0, sizeof cd);
-	cd.on = -1;
-	for (i = 0; i < cb->nf; i += 2) {
-		if (i + 2 > cb->nf)
-			error(Ebadarg);
-		opt = cb->f[i];
-		for (j = 0; j < nelem(options); j++)
-			if (strcmp(opt, options[j].name) == 0) {
-				options[j].parse(&cd, cb->f[i + 1]);
-				break;
-			}
-		if (j == nelem(options))
-			error(Ebadarg);
-	}
-	/* this has been rewritten to accomodate sdaoe */
-	if (cd.on < 0 || cd.spec == 0)
-		error(Ebadarg);
-	if (cd.on && cd.cf.type == nil)
-		error(Ebadarg);
-	sdconfig(cd.on, cd.spec, &cd.cf);
-}
@@ -12,15 +12,28 @@
  * copyright © 2007-8 coraid, inc.
  */
 
-#include "../port/error.h"
-#include "../port/lib.h"
-#include "../port/sd.h"
-#include "ahci.h"
-#include "dat.h"
-#include "fns.h"
-#include "io.h"
-#include "mem.h"
-#include "u.h"
+#include <vfs.h>
+#include <kfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <kthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <pmap.h>
+#include <smp.h>
+#include <trap.h>
+#include <time.h>
+#include <arch/pci.h>
+#include <ns.h>
+#include <blockdev.h>
+#include <sd.h>
+#include <ahci.h>
+
+#define ilock(x) spin_lock_irqsave(x)
+#define iunlock(x) spin_unlock_irqsave(x)
 
 enum {
 	Vatiamd = 0x1002,
@@ -29,23 +42,23 @@ enum {
 };
 
 #define dprint(...)                                                            \
-	if (debug)                                                                 \
-		iprint(__VA_ARGS__);                                                   \
-	else                                                                       \
-		USED(debug)
+	do {                                                                       \
+		if (debug)                                                             \
+			printk(__VA_ARGS__);                                               \
+	} while (0)
 #define idprint(...)                                                           \
-	if (prid)                                                                  \
-		iprint(__VA_ARGS__);                                                   \
-	else                                                                       \
-		USED(prid)
+	do {                                                                       \
+		if (prid)                                                              \
+			printk(__VA_ARGS__);                                               \
+	} while (0)
 #define aprint(...)                                                            \
-	if (datapi)                                                                \
-		iprint(__VA_ARGS__);                                                   \
-	else                                                                       \
-		USED(datapi)
+	do {                                                                       \
+		if (datapi)                                                            \
+			printk(__VA_ARGS__);                                               \
+	} while (0)
 
 #define Tname(c) tname[(c)->type]
-#define Intel(x) ((x)->pci->vid == Vintel)
+#define Intel(x) ((x)->pci->ven_id == Vintel)
 
 enum {
 	NCtlr = 16,
@@ -62,6 +75,14 @@ enum {
 
 	Obs = 0xa0, /* obsolete device bits */
 
+	/*
+	 * native command queuing.  slot 0 is for everything else, so NCQ
+	 * commands (tag == slot) use slots 1 through Nncq.
+	 */
+	Nslot = 32,
+	Nncq = Nslot - 1,
+	Nncqprd = BDEV_IO_MAX_SEGS,
+
 	/*
      * if we get more than this many interrupts per tick for a drive,
      * either the hardware is broken or we've got a bug in this driver.
@@ -123,11 +144,18 @@ static char *flagname[] = {
     "llba", "smart", "power", "nop", "atapi", "atapi16",
 };
 
-typedef struct Asleep Asleep;
-typedef struct Ctlr Ctlr;
-typedef struct Drive Drive;
+typedef struct asleep Asleep;
+typedef struct drive Drive;
 
-struct Drive {
+/* command table for an NCQ slot: an Actab with room for a whole bdev_io */
+typedef struct Ancqtab {
+	unsigned char cfis[0x40];
+	unsigned char atapi[0x10];
+	unsigned char pad[0x30];
+	Aprdt prdt[Nncqprd];
+} Ancqtab;
+
+struct drive {
 	spinlock_t Lock;
 
 	struct ctlr *ctlr;
@@ -155,7 +183,6 @@ struct Drive {
 
 	int infosz;
 	uint16_t *info;
-	uint16_t tinyinfo[2]; /* used iff malloc fails */
 
 	int driveno; /* ctlr*NCtlrdrv + unit */
 	/* controller port # != driveno when not all ports are enabled */
@@ -163,16 +190,24 @@ struct Drive {
 
 	uint32_t lastintr0;
 	uint32_t intrs;
+
+	/* NCQ, all under Lock.  ncqhold keeps slot 0 users and NCQ apart. */
+	int ncqdepth; /* 0 if the drive or hba can't */
+	int ncqhold;
+	uint32_t ncqbusy; /* slots in flight */
+	Ancqtab *ncqtab;  /* Nslot of them, slot 0 unused */
+	struct bdev_io *ncqio[Nslot];
+	struct bdev_io_tailq ncqwait; /* held off by ncqhold */
 };
 
-struct Ctlr {
+struct ctlr {
 	spinlock_t Lock;
 
 	int type;
 	int enabled;
 	struct sdev *sdev;
-	Pcidev *pci;
-	void *vec;
+	struct pci_device *pci;
+	int irq; /* registered */
 
 	/* virtual register addresses */
 	unsigned char *mmio;
@@ -191,7 +226,7 @@ struct Ctlr {
 	uint32_t intrs; /* not attributable to any drive */
 };
 
-struct Asleep {
+struct asleep {
 	struct aport *p;
 	int i;
 };
@@ -220,7 +255,7 @@ static void serrstr(uint32_t r, char *s, char *e)
 	int i;
 
 	e -= 3;
-	for (i = 0; i < nelem(stab) && s < e; i++)
+	for (i = 0; i < ARRAY_SIZE(stab) && s < e; i++)
 		if (r & (1 << i) && stab[i]) {
 			*s++ = stab[i];
 			if (SerrBad & (1 << i))
@@ -249,17 +284,163 @@ static void preg(unsigned char *reg, int n)
 
 static void dreg(char *s, struct aport *p)
 {
-	dprint("ahci: %stask=%#lx; cmd=%#lx; ci=%#lx; is=%#lx\n", s, p->task,
+	dprint("ahci: %stask=%#x; cmd=%#x; ci=%#x; is=%#x\n", s, p->task,
 	       p->cmd, p->ci, p->isr);
 }
 
+/* plan 9's ticks, which this driver keeps its timestamps in */
+static uint32_t ahcims(void)
+{
+	return tsc2msec(read_tsc());
+}
+
 static void esleep(int ms)
 {
-	struct proc *up = externup();
-	if (waserror())
+	kthread_usleep(ms * 1000);
+}
+
+/*
+ * Native command queuing.  The block layer hands us IOs through iaaio(), up
+ * to d->ncqdepth at a time.  Each goes out as a READ/WRITE FPDMA QUEUED in its
+ * own slot, with the whole scatter-gather list in that slot's PRDT, and the
+ * interrupt handler retires however many slots finished.  Everything that
+ * uses slot 0 (the sd raw path, identify, smart, flushes, etc.) waits for the
+ * NCQ commands to drain first, since ATA doesn't allow non-queued commands
+ * while queued ones are outstanding.
+ */
+
+/* build and issue io, which has at least one segment, in a free slot.
+ * d->Lock held. */
+static int ncqissue(Drive *d, struct bdev_io *io)
+{
+	int tag, i, write;
+	uint32_t avail;
+	unsigned char *c;
+	struct alist *l;
+	Ancqtab *t;
+	Aprdt *prd;
+
+	assert(io->nr_segs > 0);
+	avail = ~d->ncqbusy & ((1ULL << (d->ncqdepth + 1)) - 2);
+	if (avail == 0)
+		return -1;
+	tag = __builtin_ctz(avail);
+	write = io->flags & BREQ_WRITE;
+	t = &d->ncqtab[tag];
+	c = t->cfis;
+	memset(c, 0, 0x20);
+	c[0] = 0x27;
+	c[1] = 0x80;
+	c[2] = write ? 0x61 : 0x60;
+	c[3] = io->nr_sector; /* features: sector count */
+	c[4] = io->sector;
+	c[5] = io->sector >> 8;
+	c[6] = io->sector >> 16;
+	c[7] = 0x40; /* lba */
+	c[8] = io->sector >> 24;
+	c[9] = io->sector >> 32;
+	c[10] = io->sector >> 40;
+	c[11] = io->nr_sector >> 8;
+	c[12] = tag << 3;
+
+	for (i = 0; i < io->nr_segs; i++) {
+		prd = &t->prdt[i];
+		prd->dba = paddr_low32(io->segs[i].buf);
+		prd->dbahi = paddr_high32(io->segs[i].buf);
+		prd->count = (io->segs[i].nr_sector * d->secsize - 1) | 1;
+		/* interrupt when the last one is done */
+		if (i == io->nr_segs - 1)
+			prd->count |= 1U << 31;
+	}
+
+	l = &d->portm.list[tag];
+	l->flags = io->nr_segs * Lprdtl | 5;
+	if (write)
+		l->flags |= Lwrite;
+	l->len = 0;
+	l->ctab = paddr_low32(t);
+	l->ctabhi = paddr_high32(t);
+
+	d->ncqio[tag] = io;
+	d->ncqbusy |= 1U << tag;
+	io->drv_data = d;
+	/* sactive first, then issue */
+	d->port->sactive = 1U << tag;
+	d->port->ci = 1U << tag;
+	return 0;
+}
+
+static int ncqidle(void *v)
+{
+	Drive *d;
+
+	d = v;
+	return d->ncqbusy == 0;
+}
+
+/*
+ * keep new NCQ commands from issuing and wait for the rest to finish.  the
+ * drive owns those slots until it answers, so an aborted syscall can't cut the
+ * wait short; we just poll instead of sleeping on the rendez.
+ */
+static void ncqquiesce(Drive *d)
+{
+	ERRSTACK(1);
+
+	ilock(&d->Lock);
+	d->ncqhold++;
+	iunlock(&d->Lock);
+	while (!ncqidle(d)) {
+		if (waserror())
+			kthread_usleep(1000);
+		else
+			rendez_sleep_timeout(&d->portm.rendez, ncqidle, d, 100 * 1000);
+		poperror();
+	}
+}
+
+/* slot 0 is done; let NCQ commands go again */
+static void ncqrelease(Drive *d)
+{
+	struct bdev_io *io;
+
+	ilock(&d->Lock);
+	if (--d->ncqhold == 0) {
+		while ((io = TAILQ_FIRST(&d->ncqwait)) != NULL) {
+			if (ncqissue(d, io) == -1)
+				break;
+			TAILQ_REMOVE(&d->ncqwait, io, link);
+		}
+	}
+	iunlock(&d->Lock);
+}
+
+/*
+ * move finished NCQ commands to done, or all of them to failed if the port
+ * had an error (which stops the port and loses the rest).  d->Lock held; the
+ * caller completes them once it drops its locks.
+ */
+static void ncqretire(Drive *d, int error, struct bdev_io_tailq *done,
+                      struct bdev_io_tailq *failed)
+{
+	uint32_t fin;
+	int tag;
+
+	if (d->ncqbusy == 0)
 		return;
-	tsleep(&up->sleep, return0, 0, ms);
-	poperror();
+	if (error)
+		fin = d->ncqbusy;
+	else
+		fin = d->ncqbusy & ~(d->port->sactive | d->port->ci);
+	while (fin) {
+		tag = __builtin_ctz(fin);
+		fin &= ~(1U << tag);
+		d->ncqbusy &= ~(1U << tag);
+		TAILQ_INSERT_TAIL(error ? failed : done, d->ncqio[tag], link);
+		d->ncqio[tag] = NULL;
+	}
+	if (d->ncqbusy == 0 && d->ncqhold)
+		rendez_wakeup(&d->portm.rendez);
 }
 
 static int ahciclear(void *v)
@@ -270,12 +451,13 @@ static int ahciclear(void *v)
 	return (s->p->ci & s->i) == 0;
 }
 
+/* callers check the port afterwards, so an abort looks like a timeout */
 static void aesleep(struct aportm *pm, Asleep *a, int ms)
 {
-	struct proc *up = externup();
-	if (waserror())
-		return;
-	tsleep(&pm->Rendez, ahciclear, a, ms);
+	ERRSTACK(1);
+
+	if (!waserror())
+		rendez_sleep_timeout(&pm->rendez, ahciclear, a, ms * 1000);
 	poperror();
 }
 
@@ -283,13 +465,19 @@ static int ahciwait(struct aportc *c, int ms)
 {
 	Asleep as;
 	struct aport *p;
+	Drive *d;
+	int r;
 
+	d = container_of(c->pm, Drive, portm);
 	p = c->p;
+	ncqquiesce(d);
 	p->ci = 1;
 	as.p = p;
 	as.i = 1;
 	aesleep(c->pm, &as, ms);
-	if ((p->task & 1) == 0 && p->ci == 0)
+	r = (p->task & 1) == 0 && (p->ci & 1) == 0;
+	ncqrelease(d);
+	if (r)
 		return 0;
 	dreg("ahciwait timeout ", c->p);
 	return -1;
@@ -316,8 +504,8 @@ static void listsetup(struct aportc *pc, int flags)
 	list = pc->pm->list;
 	list->flags = flags | 5;
 	list->len = 0;
-	list->ctab = PCIWADDR(pc->pm->ctab);
-	list->ctabhi = 0;
+	list->ctab = paddr_low32(pc->pm->ctab);
+	list->ctabhi = paddr_high32(pc->pm->ctab);
 }
 
 static int nop(struct aportc *pc)
@@ -360,11 +548,7 @@ static int setudmamode(struct aportc *pc, unsigned char f)
 
 static void asleep(int ms)
 {
-	struct proc *up = externup();
-	if (up == nil)
-		delay(ms);
-	else
-		esleep(ms);
+	kthread_usleep(ms * 1000);
 }
 
 static int ahciportreset(struct aportc *c)
@@ -381,7 +565,7 @@ static int ahciportreset(struct aportc *c)
 		asleep(25);
 	}
 	p->sctl = 1 | (p->sctl & ~7);
-	delay(1);
+	udelay(1000);
 	p->sctl &= ~7;
 	return 0;
 }
@@ -399,7 +583,7 @@ static int smart(struct aportc *pc, int n)
 	c[6] = 0xc2;
 	listsetup(pc, Lwrite);
 	if (ahciwait(pc, 1000) == -1 || pc->p->task & (1 | 32)) {
-		dprint("ahci: smart fail %#lx\n", pc->p->task);
+		dprint("ahci: smart fail %#x\n", pc->p->task);
 		/* This was commented out in the original. */
 		/* preg(pc->m->fis.r, 20); */
 		return -1;
@@ -422,7 +606,7 @@ static int smartrs(struct aportc *pc)
 
 	c = pc->pm->fis.r;
 	if (ahciwait(pc, 1000) == -1 || pc->p->task & (1 | 32)) {
-		dprint("ahci: smart fail %#lx\n", pc->p->task);
+		dprint("ahci: smart fail %#x\n", pc->p->task);
 		preg(c, 20);
 		return -1;
 	}
@@ -439,7 +623,7 @@ static int ahciflushcache(struct aportc *pc)
 	c[2] = pc->pm->feat & Dllba ? 0xea : 0xe7;
 	listsetup(pc, Lwrite);
 	if (ahciwait(pc, 60000) == -1 || pc->p->task & (1 | 32)) {
-		dprint("ahciflushcache: fail %#lx\n", pc->p->task);
+		dprint("ahciflushcache: fail %#x\n", pc->p->task);
 		//		preg(pc->m->fis.r, 20);
 		return -1;
 	}
@@ -489,8 +673,8 @@ static int ahciidentify0(struct aportc *pc, void *id, int atapi)
 
 	memset(id, 0, 0x100); /* magic */
 	p = &pc->pm->ctab->prdt;
-	p->dba = PCIWADDR(id);
-	p->dbahi = 0;
+	p->dba = paddr_low32(id);
+	p->dbahi = paddr_high32(id);
 	p->count = 1 << 31 | (0x200 - 2) | 1;
 	return ahciwait(pc, 3 * 1000);
 }
@@ -524,6 +708,8 @@ static int64_t ahciidentify(struct aportc *pc, uint16_t *id)
 		i = gbit16(id + 0);
 		if (i & 1)
 			pm->feat |= Datapi16;
+	} else if (gbit16(id + 76) & (1 << 8)) {
+		pm->feat |= Dncq;
 	}
 
 	i = gbit16(id + 83);
@@ -568,7 +754,7 @@ stop:
 	return -1;
 stop1:
 	/* extra check */
-	dprint("ahci: clo clear %#lx\n", a->task);
+	dprint("ahci: clo clear %#x\n", a->task);
 	if(a->task & ASbsy)
 		return -1;
 	*p |= Ast;
@@ -669,7 +855,7 @@ static int ahcirecover(struct aportc *pc)
 
 static void *malign(int size, int align)
 {
-	return mallocalign(size, align, 0, 0);
+	return kzmalloc_align(size, MEM_WAIT, align);
 }
 
 static void setupfis(struct afis *f)
@@ -690,13 +876,13 @@ static void ahciwakeup(struct aport *p)
 	if ((s & Intpm) != Intslumber && (s & Intpm) != Intpartpwr)
 		return;
 	if ((s & Devdet) != Devpresent) { /* not (device, no phy) */
-		iprint("ahci: slumbering drive unwakable %#x\n", s);
+		printk("ahci: slumbering drive unwakable %#x\n", s);
 		return;
 	}
 	p->sctl = 3 * Aipm | 0 * Aspd | Adet;
-	delay(1);
+	udelay(1000);
 	p->sctl &= ~7;
-	//	iprint("ahci: wake %#x -> %#x\n", s, p->sstatus);
+	//	printk("ahci: wake %#x -> %#x\n", s, p->sstatus);
 }
 
 static int ahciconfigdrive(Drive *d)
@@ -711,17 +897,19 @@ static int ahciconfigdrive(Drive *d)
 	pm = d->portc.pm;
 	if (pm->list == 0) {
 		setupfis(&pm->fis);
-		pm->list = malign(sizeof *pm->list, 1024);
+		/* a full list, since NCQ uses all of the slots */
+		pm->list = malign(Nslot * sizeof *pm->list, 1024);
 		pm->ctab = malign(sizeof *pm->ctab, 128);
+		d->ncqtab = malign(Nslot * sizeof(Ancqtab), 128);
 	}
 
 	if (d->unit)
-		name = d->unit->SDperm.name;
+		name = d->unit->sdperm.name;
 	else
-		name = nil;
+		name = NULL;
 	if (p->sstatus & (Devphycomm | Devpresent) && h->cap & Hsss) {
 		/* device connected & staggered spin-up */
-		dprint("ahci: configdrive: %s: spinning up ... [%#lx]\n", name,
+		dprint("ahci: configdrive: %s: spinning up ... [%#x]\n", name,
 		       p->sstatus);
 		p->cmd |= Apod | Asud;
 		asleep(1400);
@@ -729,10 +917,10 @@ static int ahciconfigdrive(Drive *d)
 
 	p->serror = SerrAll;
 
-	p->list = PCIWADDR(pm->list);
-	p->listhi = 0;
-	p->fis = PCIWADDR(pm->fis.base);
-	p->fishi = 0;
+	p->list = paddr_low32(pm->list);
+	p->listhi = paddr_high32(pm->list);
+	p->fis = paddr_low32(pm->fis.base);
+	p->fishi = paddr_high32(pm->fis.base);
 	p->cmd |= Afre | Ast;
 
 	/* drive coming up in slumbering? */
@@ -776,8 +964,8 @@ static int ahciconf(struct ctlr *ctlr)
 	if ((u & Hsam) == 0)
 		h->ghc |= Hae;
 
-	dprint("#S/sd%c: type %s port %#p: sss %ld ncs %ld coal %ld "
-	       "%ld ports, led %ld clo %ld ems %ld\n",
+	dprint("#sd/sd%c: type %s port %p: sss %u ncs %u coal %u "
+	       "%u ports, led %u clo %u ems %u\n",
 	       ctlr->sdev->idno, tname[ctlr->type], h, (u >> 27) & 1,
 	       (u >> 8) & 0x1f, (u >> 7) & 1, (u & 0x1f) + 1, (u >> 25) & 1,
 	       (u >> 24) & 1, (u >> 6) & 1);
@@ -826,13 +1014,9 @@ static int identify(Drive *d)
 	unsigned char oserial[21];
 	struct sdunit *u;
 
-	if (d->info == nil) {
+	if (d->info == NULL) {
 		d->infosz = 512 * sizeof(uint16_t);
-		d->info = malloc(d->infosz);
-	}
-	if (d->info == nil) {
-		d->info = d->tinyinfo;
-		d->infosz = sizeof d->tinyinfo;
+		d->info = kzmalloc(d->infosz, MEM_WAIT);
 	}
 	id = d->info;
 	s = ahciidentify(&d->portc, id);
@@ -846,6 +1030,15 @@ static int identify(Drive *d)
 	u = d->unit;
 	d->sectors = s;
 	d->secsize = u->secsize;
+	ilock(&d->Lock);
+	d->ncqdepth = 0;
+	if ((d->portm.feat & Dncq) && (d->portm.feat & Dllba) &&
+	    (d->ctlr->hba->cap & Hsncq) && d->ncqtab != NULL) {
+		/* word 75 is the drive's depth - 1, cap 12:8 the hba's slots - 1 */
+		d->ncqdepth = MIN((id[75] & 0x1f) + 1, (d->ctlr->hba->cap >> 8 & 0x1f));
+		d->ncqdepth = MIN(d->ncqdepth, Nncq);
+	}
+	iunlock(&d->Lock);
 	if (d->secsize == 0)
 		d->secsize = 512; /* default */
 	d->smartrs = 0;
@@ -875,7 +1068,8 @@ static void clearci(struct aport *p)
 	}
 }
 
-static void updatedrive(Drive *d)
+static void updatedrive(Drive *d, struct bdev_io_tailq *done,
+                        struct bdev_io_tailq *failed)
 {
 	uint32_t cause, serr, s0, pr, ewake;
 	char *name;
@@ -889,12 +1083,12 @@ static void updatedrive(Drive *d)
 	serr = p->serror;
 	p->isr = cause;
 	name = "??";
-	if (d->unit && d->unit->SDperm.name)
-		name = d->unit->SDperm.name;
+	if (d->unit && d->unit->sdperm.name)
+		name = d->unit->sdperm.name;
 
 	if (p->ci == 0) {
 		d->portm.flag |= Fdone;
-		wakeup(&d->portm.Rendez);
+		rendez_wakeup(&d->portm.rendez);
 		pr = 0;
 	} else if (cause & Adps)
 		pr = 0;
@@ -904,7 +1098,7 @@ static void updatedrive(Drive *d)
 	}
 	if (cause & Adhrs) {
 		if (p->task & (1 << 5 | 1)) {
-			dprint("ahci: %s: Adhrs cause %#lx serr %#lx task %#lx\n", name,
+			dprint("ahci: %s: Adhrs cause %#x serr %#x task %#x\n", name,
 			       cause, serr, p->task);
 			d->portm.flag |= Ferror;
 			ewake = 1;
@@ -912,10 +1106,10 @@ static void updatedrive(Drive *d)
 		pr = 0;
 	}
 	if (p->task & 1 && last != cause)
-		dprint("%s: err ca %#lx serr %#lx task %#lx sstat %#lx\n", name, cause,
+		dprint("%s: err ca %#x serr %#x task %#x sstat %#x\n", name, cause,
 		       serr, p->task, p->sstatus);
 	if (pr)
-		dprint("%s: upd %#lx ta %#lx\n", name, cause, p->task);
+		dprint("%s: upd %#x ta %#x\n", name, cause, p->task);
 
 	if (cause & (Aprcs | Aifs)) {
 		s0 = d->state;
@@ -939,7 +1133,7 @@ static void updatedrive(Drive *d)
 			d->state = Doffline;
 			break;
 		}
-		dprint("%s: %s → %s [Apcrs] %#lx\n", name, diskstates[s0],
+		dprint("%s: %s → %s [Apcrs] %#x\n", name, diskstates[s0],
 		       diskstates[d->state], p->sstatus);
 		/* print pulled message here. */
 		if (s0 == Dready && d->state != Dready)
@@ -949,9 +1143,10 @@ static void updatedrive(Drive *d)
 		ewake = 1;
 	}
 	p->serror = serr;
+	ncqretire(d, ewake, done, failed);
 	if (ewake) {
 		clearci(p);
-		wakeup(&d->portm.Rendez);
+		rendez_wakeup(&d->portm.rendez);
 	}
 	last = cause;
 }
@@ -1005,7 +1200,7 @@ static void setstate(Drive *d, int state)
 
 static void resetdisk(Drive *d)
 {
-	uint state, det, stat;
+	uint32_t state, det, stat;
 	struct aport *p;
 
 	p = d->port;
@@ -1019,7 +1214,7 @@ static void resetdisk(Drive *d)
 	if (d->state != Dready || d->state != Dnew)
 		d->portm.flag |= Ferror;
 	clearci(p); /* satisfy sleep condition. */
-	wakeup(&d->portm.Rendez);
+	rendez_wakeup(&d->portm.rendez);
 	if (stat != (Devpresent | Devphycomm)) {
 		/* device absent or phy not communicating */
 		d->state = Dportreset;
@@ -1037,7 +1232,7 @@ static void resetdisk(Drive *d)
 		configdrive(d);
 	}
 	dprint("ahci: %s: resetdisk: %s → %s\n",
-	       (d->unit ? d->unit->SDperm.name : nil), diskstates[state],
+	       (d->unit ? d->unit->sdperm.name : NULL), diskstates[state],
 	       diskstates[d->state]);
 	qunlock(&d->portm.ql);
 }
@@ -1051,7 +1246,7 @@ static int newdrive(Drive *d)
 	c = &d->portc;
 	pm = &d->portm;
 
-	name = d->unit->SDperm.name;
+	name = d->unit->sdperm.name;
 	if (name == 0)
 		name = "??";
 
@@ -1074,13 +1269,13 @@ static int newdrive(Drive *d)
 	setstate(d, Dready);
 	qunlock(&c->pm->ql);
 
-	idprint("%s: %sLBA %,llu sectors: %s %s %s %s\n", d->unit->SDperm.name,
+	idprint("%s: %sLBA %llu sectors: %s %s %s %s\n", d->unit->sdperm.name,
 	        (pm->feat & Dllba ? "L" : ""), d->sectors, d->model, d->firmware,
 	        d->serial, d->mediachange ? "[mediachange]" : "");
 	return 0;
 
 lose:
-	idprint("%s: can't be initialized\n", d->unit->SDperm.name);
+	idprint("%s: can't be initialized\n", d->unit->sdperm.name);
 	setstate(d, Dnull);
 	qunlock(&c->pm->ql);
 	return -1;
@@ -1089,9 +1284,9 @@ lose:
 static void westerndigitalhung(Drive *d)
 {
 	if ((d->portm.feat & Datapi) == 0 && d->active &&
-	    TK2MS(sys->ticks - d->intick) > 5000) {
-		dprint("%s: drive hung; resetting [%#lx] ci %#lx\n",
-		       d->unit->SDperm.name, d->port->task, d->port->ci);
+	    (ahcims() - d->intick) > 5000) {
+		dprint("%s: drive hung; resetting [%#x] ci %#x\n",
+		       d->unit->sdperm.name, d->port->task, d->port->ci);
 		d->state = Dreset;
 	}
 }
@@ -1109,7 +1304,7 @@ static int doportreset(Drive *d)
 	else
 		i = 0;
 	qunlock(&d->portm.ql);
-	dprint("ahci: doportreset: portreset → %s  [task %#lx]\n",
+	dprint("ahci: doportreset: portreset → %s  [task %#x]\n",
 	       diskstates[d->state], d->port->task);
 	return i;
 }
@@ -1136,23 +1331,23 @@ static void checkdrive(Drive *d, int i)
 	uint16_t s;
 	char *name;
 
-	if (d == nil) {
-		print("checkdrive: nil d\n");
+	if (d == NULL) {
+		printk("checkdrive: NULL d\n");
 		return;
 	}
 	ilock(&d->Lock);
-	if (d->unit == nil || d->port == nil) {
+	if (d->unit == NULL || d->port == NULL) {
 		if (0)
-			print("checkdrive: nil d->%s\n", d->unit == nil ? "unit" : "port");
+			printk("checkdrive: NULL d->%s\n", d->unit == NULL ? "unit" : "port");
 		iunlock(&d->Lock);
 		return;
 	}
-	name = d->unit->SDperm.name;
+	name = d->unit->sdperm.name;
 	s = d->port->sstatus;
 	if (s)
-		d->lastseen = sys->ticks;
+		d->lastseen = ahcims();
 	if (s != olds[i]) {
-		dprint("%s: status: %06#x -> %06#x: %s\n", name, olds[i], s,
+		dprint("%s: status: %06x -> %06x: %s\n", name, olds[i], s,
 		       diskstates[d->state]);
 		olds[i] = s;
 		d->wait = 0;
@@ -1172,7 +1367,7 @@ static void checkdrive(Drive *d, int i)
 		case 0: /* no device */
 			break;
 		default:
-			dprint("%s: unknown status %06#x\n", name, s);
+			dprint("%s: unknown status %06x\n", name, s);
 		/* fall through */
 		case Intactive: /* active, no device */
 			if (++d->wait & Mphywait)
@@ -1191,7 +1386,7 @@ static void checkdrive(Drive *d, int i)
 			break;
 		case Intactive | Devphycomm | Devpresent:
 			if ((++d->wait & Midwait) == 0) {
-				dprint("%s: slow reset %06#x task=%#lx; %d\n", name, s,
+				dprint("%s: slow reset %06x task=%#x; %d\n", name, s,
 				       d->port->task, d->wait);
 				goto reset;
 			}
@@ -1211,7 +1406,7 @@ static void checkdrive(Drive *d, int i)
 	/* fallthrough */
 	case Derror:
 	case Dreset:
-		dprint("%s: reset [%s]: mode %d; status %06#x\n", name,
+		dprint("%s: reset [%s]: mode %d; status %06x\n", name,
 		       diskstates[d->state], d->mode, s);
 		iunlock(&d->Lock);
 		resetdisk(d);
@@ -1222,11 +1417,11 @@ static void checkdrive(Drive *d, int i)
 		if (d->wait++ & 0xff && (s & Intactive) == 0)
 			break;
 		/* device is active */
-		dprint("%s: portreset [%s]: mode %d; status %06#x\n", name,
+		dprint("%s: portreset [%s]: mode %d; status %06x\n", name,
 		       diskstates[d->state], d->mode, s);
 		d->portm.flag |= Ferror;
 		clearci(d->port);
-		wakeup(&d->portm.Rendez);
+		rendez_wakeup(&d->portm.rendez);
 		if ((s & Devdet) == 0) { /* no device */
 			d->state = Dmissing;
 			break;
@@ -1242,12 +1437,12 @@ static void checkdrive(Drive *d, int i)
 
 static void satakproc(void *v)
 {
-	struct proc *up = externup();
 	int i;
+
 	for (;;) {
-		tsleep(&up->sleep, return0, 0, Nms);
+		kthread_usleep(Nms * 1000);
 		for (i = 0; i < niadrive; i++)
-			if (iadrive[i] != nil)
+			if (iadrive[i] != NULL)
 				checkdrive(iadrive[i], i);
 	}
 }
@@ -1256,14 +1451,14 @@ static void isctlrjabbering(struct ctlr *c, uint32_t cause)
 {
 	uint32_t now;
 
-	now = TK2MS(sys->ticks);
+	now = ahcims();
 	if (now > c->lastintr0) {
 		c->intrs = 0;
 		c->lastintr0 = now;
 	}
 	if (++c->intrs > Maxintrspertick) {
-		iprint("sdiahci: %lu intrs per tick for no serviced "
-		       "drive; cause %#lx mport %d\n",
+		printk("sdiahci: %u intrs per tick for no serviced "
+		       "drive; cause %#x mport %d\n",
 		       c->intrs, cause, c->mport);
 		c->intrs = 0;
 	}
@@ -1273,31 +1468,34 @@ static void isdrivejabbering(Drive *d)
 {
 	uint32_t now;
 
-	now = TK2MS(sys->ticks);
+	now = ahcims();
 	if (now > d->lastintr0) {
 		d->intrs = 0;
 		d->lastintr0 = now;
 	}
 	if (++d->intrs > Maxintrspertick) {
-		iprint("sdiahci: %lu interrupts per tick for %s\n", d->intrs,
-		       d->unit->SDperm.name);
+		printk("sdiahci: %u interrupts per tick for %s\n", d->intrs,
+		       d->unit->sdperm.name);
 		d->intrs = 0;
 	}
 }
 
-static void iainterrupt(Ureg *u, void *a)
+static void iainterrupt(struct hw_trapframe *hw_tf, void *a)
 {
 	int i;
 	uint32_t cause, mask;
 	struct ctlr *c;
 	Drive *d;
+	struct bdev_io_tailq done = TAILQ_HEAD_INITIALIZER(done);
+	struct bdev_io_tailq failed = TAILQ_HEAD_INITIALIZER(failed);
+	struct bdev_io *io, *tio;
 
 	c = a;
 	ilock(&c->Lock);
 	cause = c->hba->isr;
 	if (cause == 0) {
 		isctlrjabbering(c, cause);
-		// iprint("sdiahci: interrupt for no drive\n");
+		// printk("sdiahci: interrupt for no drive\n");
 		iunlock(&c->Lock);
 		return;
 	}
@@ -1309,7 +1507,7 @@ static void iainterrupt(Ureg *u, void *a)
 		ilock(&d->Lock);
 		isdrivejabbering(d);
 		if (d->port->isr && c->hba->pi & mask)
-			updatedrive(d);
+			updatedrive(d, &done, &failed);
 		c->hba->isr = mask;
 		iunlock(&d->Lock);
 
@@ -1317,9 +1515,14 @@ static void iainterrupt(Ureg *u, void *a)
 	}
 	if (cause) {
 		isctlrjabbering(c, cause);
-		iprint("sdiachi: intr cause unserviced: %#lx\n", cause);
+		printk("sdiachi: intr cause unserviced: %#x\n", cause);
 	}
 	iunlock(&c->Lock);
+	/* completing can start more IOs, which takes the drive locks */
+	TAILQ_FOREACH_SAFE(io, &done, link, tio)
+		bdev_io_done(io, 0);
+	TAILQ_FOREACH_SAFE(io, &failed, link, tio)
+		bdev_io_done(io, EIO);
 }
 
 /* checkdrive, called from satakproc, will prod the drive while we wait */
@@ -1330,12 +1533,12 @@ static void awaitspinup(Drive *d)
 	char *name;
 
 	ilock(&d->Lock);
-	if (d->unit == nil || d->port == nil) {
-		panic("awaitspinup: nil d->unit or d->port");
+	if (d->unit == NULL || d->port == NULL) {
+		panic("awaitspinup: NULL d->unit or d->port");
 		iunlock(&d->Lock);
 		return;
 	}
-	name = (d->unit ? d->unit->SDperm.name : nil);
+	name = (d->unit ? d->unit->sdperm.name : NULL);
 	s = d->port->sstatus;
 	if (!(s & Devpresent)) { /* never going to be ready */
 		dprint("awaitspinup: %s absent, not waiting\n", name);
@@ -1370,7 +1573,7 @@ static void awaitspinup(Drive *d)
 			ilock(&d->Lock);
 			break;
 		}
-	print("awaitspinup: %s didn't spin up after 20 seconds\n", name);
+	printk("awaitspinup: %s didn't spin up after 20 seconds\n", name);
 	iunlock(&d->Lock);
 }
 
@@ -1397,47 +1600,65 @@ static int iaverify(struct sdunit *u)
 	return 1;
 }
 
+/* sd serializes enable and disable with the sdev's qlock */
 static int iaenable(struct sdev *s)
 {
-	char name[32];
 	struct ctlr *c;
-	static int once;
 
 	c = s->ctlr;
-	ilock(&c->Lock);
-	if (!c->enabled) {
-		if (once == 0) {
-			once = 1;
-			kproc("ahci", satakproc, 0);
-		}
-		if (c->ndrive == 0)
-			panic("iaenable: zero s->ctlr->ndrive");
-		pcisetbme(c->pci);
-		snprint(name, sizeof name, "%s (%s)", s->name, s->ifc->name);
-		c->vec = intrenable(c->pci->intl, iainterrupt, c, c->pci->tbdf, name);
-		/* supposed to squelch leftover interrupts here. */
-		ahcienable(c->hba);
-		c->enabled = 1;
+	if (c->enabled)
+		return 1;
+	run_once(ktask("ahci", satakproc, NULL));
+	if (c->ndrive == 0)
+		panic("iaenable: zero s->ctlr->ndrive");
+	pci_set_bus_master(c->pci);
+	/* there's no unregistering, so iadisable just masks it at the hba */
+	if (!c->irq) {
+		register_irq(c->pci->irqline, iainterrupt, c, pci_to_tbdf(c->pci));
+		c->irq = 1;
 	}
+	ilock(&c->Lock);
+	/* supposed to squelch leftover interrupts here. */
+	ahcienable(c->hba);
+	c->enabled = 1;
 	iunlock(&c->Lock);
 	return 1;
 }
 
 static int iadisable(struct sdev *s)
 {
-	char name[32];
 	struct ctlr *c;
 
 	c = s->ctlr;
 	ilock(&c->Lock);
 	ahcidisable(c->hba);
-	snprint(name, sizeof name, "%s (%s)", s->name, s->ifc->name);
-	intrdisable(c->vec);
 	c->enabled = 0;
 	iunlock(&c->Lock);
 	return 1;
 }
 
+/* start a block layer IO with NCQ.  -1 means use the bio path instead. */
+static int iaaio(struct sdunit *unit, struct bdev_io *io)
+{
+	struct ctlr *c;
+	Drive *d;
+
+	c = unit->dev->ctlr;
+	d = c->drive[unit->subno];
+	/* Nothing to DMA; the synchronous path fails it */
+	if (io->nr_segs == 0)
+		return -1;
+	ilock(&d->Lock);
+	if (d->ncqdepth == 0 || d->state != Dready) {
+		iunlock(&d->Lock);
+		return -1;
+	}
+	if (d->ncqhold || ncqissue(d, io) == -1)
+		TAILQ_INSERT_TAIL(&d->ncqwait, io, link);
+	iunlock(&d->Lock);
+	return 0;
+}
+
 static int iaonline(struct sdunit *unit)
 {
 	int r;
@@ -1462,6 +1683,7 @@ static int iaonline(struct sdunit *unit)
 		/* devsd resets this after online is called; why? */
 		unit->sectors = d->sectors;
 		unit->secsize = 512; /* default size */
+		unit->qdepth = d->ncqdepth;
 	} else if (d->state == Dready)
 		r = 1;
 	iunlock(&d->Lock);
@@ -1478,7 +1700,7 @@ static struct alist *ahcibuild(Drive *d, unsigned char *cmd, void *data, int n,
 	struct aportm *pm;
 	struct aprdt *p;
 	static unsigned char tab[2][2] = {
-	    0xc8, 0x25, 0xca, 0x35,
+	    {0xc8, 0x25}, {0xca, 0x35},
 	};
 
 	pm = &d->portm;
@@ -1518,14 +1740,14 @@ static struct alist *ahcibuild(Drive *d, unsigned char *cmd, void *data, int n,
 	if (dir == Write)
 		l->flags |= Lwrite;
 	l->len = 0;
-	l->ctab = PCIWADDR(t);
-	l->ctabhi = 0;
+	l->ctab = paddr_low32(t);
+	l->ctabhi = paddr_high32(t);
 
 	p = &t->prdt;
-	p->dba = PCIWADDR(data);
-	p->dbahi = 0;
-	if (d->unit == nil)
-		panic("ahcibuild: nil d->unit");
+	p->dba = paddr_low32(data);
+	p->dbahi = paddr_high32(data);
+	if (d->unit == NULL)
+		panic("ahcibuild: NULL d->unit");
 	p->count = 1 << 31 | (d->unit->secsize * n - 2) | 1;
 
 	return l;
@@ -1572,15 +1794,15 @@ static struct alist *ahcibuildpkt(struct aportm *pm, struct sdreq *r,
 	if (r->write != 0 && data)
 		l->flags |= Lwrite;
 	l->len = 0;
-	l->ctab = PCIWADDR(t);
-	l->ctabhi = 0;
+	l->ctab = paddr_low32(t);
+	l->ctabhi = paddr_high32(t);
 
 	if (data == 0)
 		return l;
 
 	p = &t->prdt;
-	p->dba = PCIWADDR(data);
-	p->dbahi = 0;
+	p->dba = paddr_low32(data);
+	p->dbahi = paddr_high32(data);
 	p->count = 1 << 31 | (n - 2) | 1;
 
 	return l;
@@ -1593,7 +1815,7 @@ static int waitready(Drive *d)
 	for (i = 0; i < 15000; i += 250) {
 		if (d->state == Dreset || d->state == Dportreset || d->state == Dnew)
 			return 1;
-		delta = sys->ticks - d->lastseen;
+		delta = ahcims() - d->lastseen;
 		if (d->state == Dnull || delta > 10 * 1000)
 			return -1;
 		ilock(&d->Lock);
@@ -1605,7 +1827,7 @@ static int waitready(Drive *d)
 			return 0; /* ready, present & phy. comm. */
 		esleep(250);
 	}
-	print("%s: not responding; offline\n", d->unit->SDperm.name);
+	printk("%s: not responding; offline\n", d->unit->sdperm.name);
 	setstate(d, Doffline);
 	return -1;
 }
@@ -1636,7 +1858,6 @@ static int flushcache(Drive *d)
 
 static int iariopkt(struct sdreq *r, Drive *d)
 {
-	struct proc *up = externup();
 	int n, count, try
 		, max, flag, task, wormwrite;
 	char *name;
@@ -1645,10 +1866,10 @@ static int iariopkt(struct sdreq *r, Drive *d)
 	Asleep as;
 
 	cmd = r->cmd;
-	name = d->unit->SDperm.name;
+	name = d->unit->sdperm.name;
 	p = d->port;
 
-	aprint("ahci: iariopkt: %04#x %04#x %c %d %p\n", cmd[0], cmd[2],
+	aprint("ahci: iariopkt: %04x %04x %c %d %p\n", cmd[0], cmd[2],
 	       "rw"[r->write], r->dlen, r->data);
 	if (cmd[0] == 0x5a && (cmd[2] & 0x3f) == 0x3f)
 		return sdmodesense(r, cmd, d->info, d->infosz);
@@ -1675,6 +1896,7 @@ retry:
 	}
 	/* d->portm qlock held here */
 
+	ncqquiesce(d);
 	ilock(&d->Lock);
 	d->portm.flag = 0;
 	iunlock(&d->Lock);
@@ -1682,17 +1904,15 @@ retry:
 
 	as.p = p;
 	as.i = 1;
-	d->intick = sys->ticks;
+	d->intick = ahcims();
 	d->active++;
 
-	while (waserror())
-		;
 	/* don't sleep here forever */
-	tsleep(&d->portm.Rendez, ahciclear, &as, 3 * 1000);
-	poperror();
+	aesleep(&d->portm, &as, 3 * 1000);
 	if (!ahciclear(&as)) {
+		ncqrelease(d);
 		qunlock(&d->portm.ql);
-		print("%s: ahciclear not true after 3 seconds\n", name);
+		printk("%s: ahciclear not true after 3 seconds\n", name);
 		r->status = SDcheck;
 		return SDcheck;
 	}
@@ -1703,16 +1923,17 @@ retry:
 	task = d->port->task;
 	iunlock(&d->Lock);
 
-	if (task & (Efatal << 8) || task & (ASbsy | ASdrq) && d->state == Dready) {
+	if (task & (Efatal << 8) || (task & (ASbsy | ASdrq) && d->state == Dready)) {
 		d->port->ci = 0;
 		ahcirecover(&d->portc);
 		task = d->port->task;
 		flag &= ~Fdone; /* either an error or do-over */
 	}
+	ncqrelease(d);
 	qunlock(&d->portm.ql);
 	if (flag == 0) {
 		if (++try == 10) {
-			print("%s: bad disk\n", name);
+			printk("%s: bad disk\n", name);
 			r->status = SDcheck;
 			return SDcheck;
 		}
@@ -1735,13 +1956,13 @@ retry:
 			break;
 		}
 		if (!wormwrite) {
-			print("%s: retry\n", name);
+			printk("%s: retry\n", name);
 			goto retry;
 		}
 	}
 	if (flag & Ferror) {
 		if ((task & Eidnf) == 0)
-			print("%s: i/o error task=%#x\n", name, task);
+			printk("%s: i/o error task=%#x\n", name, task);
 		r->status = SDcheck;
 		return SDcheck;
 	}
@@ -1755,7 +1976,6 @@ retry:
 
 static int iario(struct sdreq *r)
 {
-	struct proc *up = externup();
 	int i, n, count, try
 		, max, flag, task;
 	int64_t lba;
@@ -1773,7 +1993,7 @@ static int iario(struct sdreq *r)
 	if (d->portm.feat & Datapi)
 		return iariopkt(r, d);
 	cmd = r->cmd;
-	name = d->unit->SDperm.name;
+	name = d->unit->sdperm.name;
 	p = d->port;
 
 	if (r->cmd[0] == 0x35 || r->cmd[0] == 0x91) {
@@ -1788,14 +2008,14 @@ static int iario(struct sdreq *r)
 	}
 
 	if (*cmd != 0x28 && *cmd != 0x2a) {
-		print("%s: bad cmd %.2#x\n", name, cmd[0]);
+		printk("%s: bad cmd %02x\n", name, cmd[0]);
 		r->status = SDcheck;
 		return SDcheck;
 	}
 
 	lba = cmd[2] << 24 | cmd[3] << 16 | cmd[4] << 8 | cmd[5];
 	count = cmd[7] << 8 | cmd[8];
-	if (r->data == nil)
+	if (r->data == NULL)
 		return SDok;
 	if (r->dlen < count * unit->secsize)
 		count = r->dlen / unit->secsize;
@@ -1820,6 +2040,7 @@ retry:
 			goto retry;
 		}
 		/* d->portm qlock held here */
+		ncqquiesce(d);
 		ilock(&d->Lock);
 		d->portm.flag = 0;
 		iunlock(&d->Lock);
@@ -1827,17 +2048,15 @@ retry:
 
 		as.p = p;
 		as.i = 1;
-		d->intick = sys->ticks;
+		d->intick = ahcims();
 		d->active++;
 
-		while (waserror())
-			;
 		/* don't sleep here forever */
-		tsleep(&d->portm.Rendez, ahciclear, &as, 3 * 1000);
-		poperror();
+		aesleep(&d->portm, &as, 3 * 1000);
 		if (!ahciclear(&as)) {
+			ncqrelease(d);
 			qunlock(&d->portm.ql);
-			print("%s: ahciclear not true after 3 seconds\n", name);
+			printk("%s: ahciclear not true after 3 seconds\n", name);
 			r->status = SDcheck;
 			return SDcheck;
 		}
@@ -1849,23 +2068,24 @@ retry:
 		iunlock(&d->Lock);
 
 		if (task & (Efatal << 8) ||
-		    task & (ASbsy | ASdrq) && d->state == Dready) {
+		    (task & (ASbsy | ASdrq) && d->state == Dready)) {
 			d->port->ci = 0;
 			ahcirecover(&d->portc);
 			task = d->port->task;
 		}
+		ncqrelease(d);
 		qunlock(&d->portm.ql);
 		if (flag == 0) {
 			if (++try == 10) {
-				print("%s: bad disk\n", name);
+				printk("%s: bad disk\n", name);
 				r->status = SDeio;
 				return SDeio;
 			}
-			print("%s: retry blk %lld\n", name, lba);
+			printk("%s: retry blk %lld\n", name, lba);
 			goto retry;
 		}
 		if (flag & Ferror) {
-			print("%s: i/o error task=%#x @%,lld\n", name, task, lba);
+			printk("%s: i/o error task=%#x @%lld\n", name, task, lba);
 			r->status = SDeio;
 			return SDeio;
 		}
@@ -1883,62 +2103,62 @@ retry:
  * configure drives 0-5 as ahci sata (c.f. errata).
  * what about 6 & 7, as claimed by marvell 0x9123?
  */
-static int iaahcimode(Pcidev *p)
+static int iaahcimode(struct pci_device *p)
 {
-	dprint("iaahcimode: %#x %#x %#x\n", pcicfgr8(p, 0x91), pcicfgr8(p, 92),
-	       pcicfgr8(p, 93));
-	pcicfgw16(p, 0x92, pcicfgr16(p, 0x92) | 0x3f); /* ports 0-5 */
+	dprint("iaahcimode: %#x %#x %#x\n", pcidev_read8(p, 0x91), pcidev_read8(p, 92),
+	       pcidev_read8(p, 93));
+	pcidev_write16(p, 0x92, pcidev_read16(p, 0x92) | 0x3f); /* ports 0-5 */
 	return 0;
 }
 
 static void iasetupahci(struct ctlr *c)
 {
 	/* disable cmd block decoding. */
-	pcicfgw16(c->pci, 0x40, pcicfgr16(c->pci, 0x40) & ~(1 << 15));
-	pcicfgw16(c->pci, 0x42, pcicfgr16(c->pci, 0x42) & ~(1 << 15));
+	pcidev_write16(c->pci, 0x40, pcidev_read16(c->pci, 0x40) & ~(1 << 15));
+	pcidev_write16(c->pci, 0x42, pcidev_read16(c->pci, 0x42) & ~(1 << 15));
 
 	c->lmmio[0x4 / 4] |= 1 << 31;     /* enable ahci mode (ghc register) */
 	c->lmmio[0xc / 4] = (1 << 6) - 1; /* 5 ports. (supposedly ro pi reg.) */
 
 	/* enable ahci mode and 6 ports; from ich9 datasheet */
-	pcicfgw16(c->pci, 0x90, 1 << 6 | 1 << 5);
+	pcidev_write16(c->pci, 0x90, 1 << 6 | 1 << 5);
 }
 
-static int didtype(Pcidev *p)
+static int didtype(struct pci_device *p)
 {
-	switch (p->vid) {
+	switch (p->ven_id) {
 	case Vintel:
-		if ((p->did & 0xfffc) == 0x2680)
+		if ((p->dev_id & 0xfffc) == 0x2680)
 			return Tesb;
 		/*
 		 * 0x27c4 is the intel 82801 in compatibility (not sata) mode.
 		 */
-		if (p->did == 0x1e02 ||            /* c210 */
-		    p->did == 0x24d1 ||            /* 82801eb/er */
-		    (p->did & 0xfffb) == 0x27c1 || /* 82801g[bh]m ich7 */
-		    p->did == 0x2821 ||            /* 82801h[roh] */
-		    (p->did & 0xfffe) == 0x2824 || /* 82801h[b] */
-		    (p->did & 0xfeff) == 0x2829 || /* ich8/9m */
-		    (p->did & 0xfffe) == 0x2922 || /* ich9 */
-		    p->did == 0x3a02 ||            /* 82801jd/do */
-		    (p->did & 0xfefe) == 0x3a22 || /* ich10, pch */
-		    (p->did & 0xfff8) == 0x3b28)   /* pchm */
+		if (p->dev_id == 0x1e02 ||            /* c210 */
+		    p->dev_id == 0x24d1 ||            /* 82801eb/er */
+		    (p->dev_id & 0xfffb) == 0x27c1 || /* 82801g[bh]m ich7 */
+		    p->dev_id == 0x2821 ||            /* 82801h[roh] */
+		    (p->dev_id & 0xfffe) == 0x2824 || /* 82801h[b] */
+		    (p->dev_id & 0xfeff) == 0x2829 || /* ich8/9m */
+		    (p->dev_id & 0xfffe) == 0x2922 || /* ich9 */
+		    p->dev_id == 0x3a02 ||            /* 82801jd/do */
+		    (p->dev_id & 0xfefe) == 0x3a22 || /* ich10, pch */
+		    (p->dev_id & 0xfff8) == 0x3b28)   /* pchm */
 			return Tich;
 		break;
 	case Vatiamd:
-		if (p->did == 0x4380 || p->did == 0x4390 || p->did == 0x4391) {
-			print("detected sb600 vid %#x did %#x\n", p->vid, p->did);
+		if (p->dev_id == 0x4380 || p->dev_id == 0x4390 || p->dev_id == 0x4391) {
+			printk("detected sb600 vid %#x did %#x\n", p->ven_id, p->dev_id);
 			return Tsb600;
 		}
 		break;
 	case Vmarvell:
-		if (p->did == 0x9123)
-			print("ahci: marvell sata 3 controller has delusions "
+		if (p->dev_id == 0x9123)
+			printk("ahci: marvell sata 3 controller has delusions "
 			      "of something on unit 7\n");
 		break;
 	}
-	if (p->ccrb == Pcibcstore && p->ccru == Pciscsata && p->ccrp == 1) {
-		print("ahci: Tunk: vid %#4.4x did %#4.4x\n", p->vid, p->did);
+	if (p->class == 0x01 && p->subclass == 0x06 && p->progif == 1) {
+		printk("ahci: Tunk: vid %04x did %04x\n", p->ven_id, p->dev_id);
 		return Tunk;
 	}
 	return -1;
@@ -1953,17 +2173,16 @@ static int newctlr(struct ctlr *ctlr, struct sdev *sdev, int nunit)
 	ctlr->mport = ctlr->hba->cap & ((1 << 5) - 1);
 
 	i = (ctlr->hba->cap >> 20) & ((1 << 4) - 1); /* iss */
-	print("#S/sd%c: %s: %#p %s, %d ports, irq %d\n", sdev->idno, Tname(ctlr),
-	      ctlr->physio, descmode[i], nunit, ctlr->pci->intl);
+	printk("#sd/sd%c: %s: %p %s, %d ports, irq %d\n", sdev->idno, Tname(ctlr),
+	      ctlr->physio, descmode[i], nunit, ctlr->pci->irqline);
 	/* map the drives -- they don't all need to be enabled. */
 	n = 0;
-	ctlr->rawdrive = malloc(NCtlrdrv * sizeof(Drive));
-	if (ctlr->rawdrive == nil) {
-		print("ahci: out of memory\n");
-		return -1;
-	}
+	ctlr->rawdrive = kzmalloc(NCtlrdrv * sizeof(Drive), MEM_WAIT);
 	for (i = 0; i < NCtlrdrv; i++) {
 		drive = ctlr->rawdrive + i;
+		spinlock_init_irqsave(&drive->Lock);
+		qlock_init(&drive->portm.ql);
+		rendez_init(&drive->portm.rendez);
 		drive->portno = i;
 		drive->driveno = -1;
 		drive->sectors = 0;
@@ -1974,6 +2193,7 @@ static int newctlr(struct ctlr *ctlr, struct sdev *sdev, int nunit)
 		drive->port = (struct aport *)(ctlr->mmio + 0x80 * i + 0x100);
 		drive->portc.p = drive->port;
 		drive->portc.pm = &drive->portm;
+		TAILQ_INIT(&drive->ncqwait);
 		drive->driveno = n++;
 		ctlr->drive[drive->driveno] = drive;
 		iadrive[niadrive + drive->driveno] = drive;
@@ -1994,35 +2214,37 @@ static struct sdev *iapnp(void)
 {
 	int n, nunit, type;
 	uintptr_t io;
+	uint32_t iosz;
 	struct ctlr *c;
-	Pcidev *p;
+	struct pci_device *p;
 	struct sdev *head, *tail, *s;
 	static int done;
 
 	if (done++)
-		return nil;
+		return NULL;
 
 	memset(olds, 0xff, sizeof olds);
-	p = nil;
-	head = tail = nil;
-	while ((p = pcimatch(p, 0, 0)) != nil) {
+	head = tail = NULL;
+	STAILQ_FOREACH(p, &pci_devices, all_dev) {
 		type = didtype(p);
-		if (type == -1 || p->mem[Abar].bar == 0)
+		if (type == -1 || pci_get_membar(p, Abar) == 0)
 			continue;
 		if (niactlr == NCtlr) {
-			print("ahci: iapnp: %s: too many controllers\n", tname[type]);
+			printk("ahci: iapnp: %s: too many controllers\n", tname[type]);
 			break;
 		}
 		c = iactlr + niactlr;
 		s = sdevs + niactlr;
 		memset(c, 0, sizeof *c);
 		memset(s, 0, sizeof *s);
-		io = p->mem[Abar].bar & ~0xf;
+		spinlock_init_irqsave(&c->Lock);
+		io = pci_get_membar(p, Abar);
+		iosz = pci_get_membar_sz(p, Abar);
 		c->physio = (unsigned char *)io;
-		c->mmio = vmap(io, p->mem[Abar].size);
-		if (c->mmio == 0) {
-			print("ahci: %s: address %#lX in use did=%#x\n", Tname(c), io,
-			      p->did);
+		c->mmio = (unsigned char *)vmap_pmem_nocache(io, iosz);
+		if (c->mmio == NULL) {
+			printk("ahci: %s: can't map %p did=%#x\n", tname[type], io,
+			       p->dev_id);
 			continue;
 		}
 		c->lmmio = (uint32_t *)c->mmio;
@@ -2034,14 +2256,14 @@ static struct sdev *iapnp(void)
 		s->ctlr = c;
 		c->sdev = s;
 
-		if (Intel(c) && p->did != 0x2681)
+		if (Intel(c) && p->dev_id != 0x2681)
 			iasetupahci(c);
 		nunit = ahciconf(c);
 		//		ahcihbareset((Ahba*)c->mmio);
 		if (Intel(c) && iaahcimode(p) == -1)
 			break;
 		if (nunit < 1) {
-			vunmap(c->mmio, p->mem[Abar].size);
+			vunmap_vmem((uintptr_t)c->mmio, iosz);
 			continue;
 		}
 		n = newctlr(c, s, nunit);
@@ -2066,8 +2288,8 @@ static char *pflag(char *s, char *e, unsigned char f)
 
 	for (i = 0; i < 8; i++)
 		if (f & (1 << i))
-			s = seprint(s, e, "%s ", flagname[i]);
-	return seprint(s, e, "\n");
+			s = seprintf(s, e, "%s ", flagname[i]);
+	return seprintf(s, e, "\n");
 }
 
 static int iarctl(struct sdunit *u, char *p, int l)
@@ -2079,8 +2301,8 @@ static int iarctl(struct sdunit *u, char *p, int l)
 	Drive *d;
 
 	c = u->dev->ctlr;
-	if (c == nil) {
-		print("iarctl: nil u->dev->ctlr\n");
+	if (c == NULL) {
+		printk("iarctl: NULL u->dev->ctlr\n");
 		return 0;
 	}
 	d = c->drive[u->subno];
@@ -2089,48 +2311,48 @@ static int iarctl(struct sdunit *u, char *p, int l)
 	e = p + l;
 	op = p;
 	if (d->state == Dready) {
-		p = seprint(p, e, "model\t%s\n", d->model);
-		p = seprint(p, e, "serial\t%s\n", d->serial);
-		p = seprint(p, e, "firm\t%s\n", d->firmware);
+		p = seprintf(p, e, "model\t%s\n", d->model);
+		p = seprintf(p, e, "serial\t%s\n", d->serial);
+		p = seprintf(p, e, "firm\t%s\n", d->firmware);
 		if (d->smartrs == 0xff)
-			p = seprint(p, e, "smart\tenable error\n");
+			p = seprintf(p, e, "smart\tenable error\n");
 		else if (d->smartrs == 0)
-			p = seprint(p, e, "smart\tdisabled\n");
+			p = seprintf(p, e, "smart\tdisabled\n");
 		else
-			p = seprint(p, e, "smart\t%s\n", smarttab[d->portm.smart]);
-		p = seprint(p, e, "flag\t");
+			p = seprintf(p, e, "smart\t%s\n", smarttab[d->portm.smart]);
+		p = seprintf(p, e, "flag\t");
 		p = pflag(p, e, d->portm.feat);
 	} else
-		p = seprint(p, e, "no disk present [%s]\n", diskstates[d->state]);
+		p = seprintf(p, e, "no disk present [%s]\n", diskstates[d->state]);
 	serrstr(o->serror, buf, buf + sizeof buf - 1);
-	p = seprint(p, e, "reg\ttask %#lx cmd %#lx serr %#lx %s ci %#lx "
-	                  "is %#lx; sig %#lx sstatus %06#lx\n",
+	p = seprintf(p, e, "reg\ttask %#x cmd %#x serr %#x %s ci %#x "
+	                  "is %#x; sig %#x sstatus %06x\n",
 	            o->task, o->cmd, o->serror, buf, o->ci, o->isr, o->sig,
 	            o->sstatus);
-	if (d->unit == nil)
-		panic("iarctl: nil d->unit");
-	p = seprint(p, e, "geometry %llu %lu\n", d->sectors, d->unit->secsize);
+	if (d->unit == NULL)
+		panic("iarctl: NULL d->unit");
+	p = seprintf(p, e, "geometry %llu %u\n", d->sectors, d->unit->secsize);
 	return p - op;
 }
 
 static void runflushcache(Drive *d)
 {
-	int32_t t0;
+	uint32_t t0;
 
-	t0 = sys->ticks;
+	t0 = ahcims();
 	if (flushcache(d) != 0)
-		error(Eio);
-	dprint("ahci: flush in %ld ms\n", sys->ticks - t0);
+		error(EIO, "ahci: cache flush failed");
+	dprint("ahci: flush in %u ms\n", ahcims() - t0);
 }
 
 static void forcemode(Drive *d, char *mode)
 {
 	int i;
 
-	for (i = 0; i < nelem(modename); i++)
+	for (i = 0; i < ARRAY_SIZE(modename); i++)
 		if (strcmp(mode, modename[i]) == 0)
 			break;
-	if (i == nelem(modename))
+	if (i == ARRAY_SIZE(modename))
 		i = 0;
 	ilock(&d->Lock);
 	d->mode = i;
@@ -2139,14 +2361,15 @@ static void forcemode(Drive *d, char *mode)
 
 static void runsmartable(Drive *d, int i)
 {
-	struct proc *up = externup();
+	ERRSTACK(1);
+
 	if (waserror()) {
 		qunlock(&d->portm.ql);
 		d->smartrs = 0;
 		nexterror();
 	}
 	if (lockready(d) == -1)
-		error(Eio);
+		error(EIO, "ahci: drive not ready");
 	d->smartrs = smart(&d->portc, i);
 	d->portm.smart = 0;
 	qunlock(&d->portm.ql);
@@ -2157,11 +2380,11 @@ static void forcestate(Drive *d, char *state)
 {
 	int i;
 
-	for (i = 0; i < nelem(diskstates); i++)
+	for (i = 0; i < ARRAY_SIZE(diskstates); i++)
 		if (strcmp(state, diskstates[i]) == 0)
 			break;
-	if (i == nelem(diskstates))
-		error(Ebadctl);
+	if (i == ARRAY_SIZE(diskstates))
+		error(EINVAL, "ahci: unknown drive state %s", state);
 	setstate(d, i);
 }
 
@@ -2184,11 +2407,11 @@ static void changemedia(struct sdunit *u)
 
 static int iawctl(struct sdunit *u, struct cmdbuf *cmd)
 {
-	struct proc *up = externup();
+	ERRSTACK(1);
 	char **f;
 	struct ctlr *c;
 	Drive *d;
-	uint i;
+	uint32_t i;
 
 	c = u->dev->ctlr;
 	d = c->drive[u->subno];
@@ -2215,7 +2438,7 @@ static int iawctl(struct sdunit *u, struct cmdbuf *cmd)
 			nexterror();
 		}
 		if (lockready(d) == -1)
-			error(Eio);
+			error(EIO, "ahci: drive not ready");
 		nop(&d->portc);
 		qunlock(&d->portm.ql);
 		poperror();
@@ -2232,7 +2455,7 @@ static int iawctl(struct sdunit *u, struct cmdbuf *cmd)
 			nexterror();
 		}
 		if (lockready(d) == -1)
-			error(Eio);
+			error(EIO, "ahci: drive not ready");
 		d->portm.smart = 2 + smartrs(&d->portc);
 		qunlock(&d->portm.ql);
 		poperror();
@@ -2243,13 +2466,13 @@ static int iawctl(struct sdunit *u, struct cmdbuf *cmd)
 	else if (strcmp(f[0], "state") == 0)
 		forcestate(d, f[1] ? f[1] : "null");
 	else {
-		cmderror(cmd, Ebadctl);
+		cmderror(cmd, "unknown ahci control");
 		return -1;
 	}
 	return 0;
 }
 
-static char *portr(char *p, char *e, uint x)
+static char *portr(char *p, char *e, uint32_t x)
 {
 	int i, a;
 
@@ -2258,18 +2481,18 @@ static char *portr(char *p, char *e, uint x)
 	for (i = 0; i < 32; i++) {
 		if ((x & (1 << i)) == 0) {
 			if (a != -1 && i - 1 != a)
-				p = seprint(p, e, "-%d", i - 1);
+				p = seprintf(p, e, "-%d", i - 1);
 			a = -1;
 			continue;
 		}
 		if (a == -1) {
 			if (i > 0)
-				p = seprint(p, e, ", ");
-			p = seprint(p, e, "%d", a = i);
+				p = seprintf(p, e, ", ");
+			p = seprintf(p, e, "%d", a = i);
 		}
 	}
 	if (a != -1 && i - 1 != a)
-		p = seprint(p, e, "-%d", i - 1);
+		p = seprintf(p, e, "-%d", i - 1);
 	return p;
 }
 
@@ -2283,11 +2506,11 @@ static char *iartopctl(struct sdev *sdev, char *p, char *e)
 
 #define has(x, str)                                                            \
 	if (cap & (x))                                                             \
-	p = seprint(p, e, "%s ", (str))
+	p = seprintf(p, e, "%s ", (str))
 
 	ctlr = sdev->ctlr;
 	hba = ctlr->hba;
-	p = seprint(p, e, "sd%c ahci port %#p: ", sdev->idno, ctlr->physio);
+	p = seprintf(p, e, "sd%c ahci port %p: ", sdev->idno, ctlr->physio);
 	cap = hba->cap;
 	has(Hs64a, "64a");
 	has(Hsalp, "alp");
@@ -2305,8 +2528,8 @@ static char *iartopctl(struct sdev *sdev, char *p, char *e)
 	has(Hsss, "ss");
 	has(Hsxs, "sxs");
 	portr(pr, pr + sizeof pr, hba->pi);
-	return seprint(
-	    p, e, "iss %ld ncs %ld np %ld; ghc %#lx isr %#lx pi %#lx %s ver %#lx\n",
+	return seprintf(
+	    p, e, "iss %u ncs %u np %u; ghc %#x isr %#x pi %#x %s ver %#x\n",
 	    (cap >> 20) & 0xf, (cap >> 8) & 0x1f, 1 + (cap & 0x1f), hba->ghc,
 	    hba->isr, hba->pi, pr, hba->ver);
 #undef has
@@ -2320,7 +2543,7 @@ static int iawtopctl(struct sdev *sdev, struct cmdbuf *cmd)
 	f = cmd->f;
 	v = 0;
 
-	if (f[0] == nil)
+	if (f[0] == NULL)
 		return 0;
 	if (strcmp(f[0], "debug") == 0)
 		v = &debug;
@@ -2329,11 +2552,11 @@ static int iawtopctl(struct sdev *sdev, struct cmdbuf *cmd)
 	else if (strcmp(f[0], "aprint") == 0)
 		v = &datapi;
 	else
-		cmderror(cmd, Ebadctl);
+		cmderror(cmd, "unknown ahci control");
 
 	switch (cmd->nf) {
 	default:
-		cmderror(cmd, Ebadarg);
+		cmderror(cmd, "wrong number of arguments");
 	case 1:
 		*v ^= 1;
 		break;
@@ -2361,6 +2584,7 @@ struct sdifc sdiahciifc = {
     .wctl = iawctl,
 
     .bio = scsibio,
+    .aio = iaaio,
     .rtopctl = iartopctl,
     .wtopctl = iawtopctl,
 };
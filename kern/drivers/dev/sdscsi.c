@@ -7,16 +7,15 @@
  * in the LICENSE file.
  */
 
-#include "../port/error.h"
-#include "../port/lib.h"
-#include "dat.h"
-#include "fns.h"
-#include "io.h"
-#include "mem.h"
-#include "u.h"
-#include "ureg.h"
-
-#include "../port/sd.h"
+#include <vfs.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <ns.h>
+#include <sd.h>
 
 static int scsitest(struct sdreq *r)
 {
@@ -24,7 +23,7 @@ static int scsitest(struct sdreq *r)
 	memset(r->cmd, 0, sizeof(r->cmd));
 	r->cmd[1] = r->lun << 5;
 	r->clen = 6;
-	r->data = nil;
+	r->data = NULL;
 	r->dlen = 0;
 	r->flags = 0;
 
@@ -39,12 +38,8 @@ int scsiverify(struct sdunit *unit)
 	int i, status;
 	uint8_t *inquiry;
 
-	if ((r = malloc(sizeof(struct sdreq))) == nil)
-		return 0;
-	if ((inquiry = sdmalloc(sizeof(unit->inquiry))) == nil) {
-		free(r);
-		return 0;
-	}
+	r = kzmalloc(sizeof(struct sdreq), MEM_WAIT);
+	inquiry = sdmalloc(sizeof(unit->inquiry));
 	r->unit = unit;
 	r->lun = 0; /* ??? */
 
@@ -60,13 +55,14 @@ int scsiverify(struct sdunit *unit)
 
 	r->status = ~0;
 	if (unit->dev->ifc->rio(r) != SDok) {
-		free(r);
+		sdfree(inquiry);
+		kfree(r);
 		return 0;
 	}
 	memmove(unit->inquiry, inquiry, r->dlen);
-	free(inquiry);
+	sdfree(inquiry);
 
-	SET(status);
+	status = SDok;
 	for (i = 0; i < 3; i++) {
 		while ((status = scsitest(r)) == SDbusy)
 			;
@@ -107,7 +103,7 @@ int scsiverify(struct sdunit *unit)
 			r->cmd[1] = (r->lun << 5) | 0x01;
 			r->cmd[4] = 1;
 			r->clen = 6;
-			r->data = nil;
+			r->data = NULL;
 			r->dlen = 0;
 			r->flags = 0;
 
@@ -115,7 +111,7 @@ int scsiverify(struct sdunit *unit)
 			unit->dev->ifc->rio(r);
 		}
 	}
-	free(r);
+	kfree(r);
 
 	if (status == SDok || status == SDcheck)
 		return 1;
@@ -124,7 +120,6 @@ int scsiverify(struct sdunit *unit)
 
 static int scsirio(struct sdreq *r)
 {
-	struct proc *up = externup();
 	/*
 	 * Perform an I/O request, returning
 	 *	-1	failure
@@ -166,10 +161,7 @@ static int scsirio(struct sdreq *r)
 			if (r->sense[12] != 0x04 || r->sense[13] != 0x01)
 				break;
 
-			while (waserror())
-				;
-			tsleep(&up->sleep, return0, 0, 500);
-			poperror();
+			kthread_usleep(500 * 1000);
 			scsitest(r);
 			return 2;
 		default:
@@ -188,12 +180,8 @@ int scsionline(struct sdunit *unit)
 	uint8_t *p;
 	int ok, retries;
 
-	if ((r = malloc(sizeof(struct sdreq))) == nil)
-		return 0;
-	if ((p = sdmalloc(8)) == nil) {
-		free(r);
-		return 0;
-	}
+	r = kzmalloc(sizeof(struct sdreq), MEM_WAIT);
+	p = sdmalloc(8);
 
 	ok = 0;
 
@@ -250,8 +238,8 @@ int scsionline(struct sdunit *unit)
 		}
 		break;
 	}
-	free(p);
-	free(r);
+	sdfree(p);
+	kfree(r);
 
 	if (ok)
 		return ok + retries;
@@ -265,8 +253,7 @@ int scsiexec(struct sdunit *unit, int write, uint8_t *cmd, int clen, void *data,
 	struct sdreq *r;
 	int status;
 
-	if ((r = malloc(sizeof(struct sdreq))) == nil)
-		return SDmalloc;
+	r = kzmalloc(sizeof(struct sdreq), MEM_WAIT);
 	r->unit = unit;
 	r->lun = cmd[1] >> 5; /* ??? */
 	r->write = write;
@@ -304,7 +291,7 @@ int scsiexec(struct sdunit *unit, int write, uint8_t *cmd, int clen, void *data,
 		 */
 		break;
 	}
-	sdfree(r);
+	kfree(r);
 
 	return status;
 }
@@ -361,14 +348,13 @@ static void scsifmt16(struct sdreq *r, int write, int lun, uint32_t nb,
 	r->clen = 16;
 }
 
-int32_t scsibio(struct sdunit *unit, int lun, int write, void *data, int32_t nb,
-                uint64_t bno)
+long scsibio(struct sdunit *unit, int lun, int write, void *data, long nb,
+             uint64_t bno)
 {
 	struct sdreq *r;
-	int32_t rlen;
+	long rlen;
 
-	if ((r = malloc(sizeof(struct sdreq))) == nil)
-		error(Enomem);
+	r = kzmalloc(sizeof(struct sdreq), MEM_WAIT);
 	r->unit = unit;
 	r->lun = lun;
 again:
@@ -397,8 +383,8 @@ again:
 		default:
 			break;
 		case 0x01: /* recovered error */
-			print("%s: recovered error at sector %llu\n", unit->SDperm.name,
-			      bno);
+			printk("%s: recovered error at sector %llu\n", unit->sdperm.name,
+			       bno);
 			rlen = r->rlen;
 			break;
 		case 0x06: /* check condition */
@@ -423,7 +409,7 @@ again:
 		}
 		break;
 	}
-	free(r);
+	kfree(r);
 
 	return rlen;
 }
@@ -0,0 +1,206 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * #trace device, the interface to the static tracepoints (tracepoint.h).
+ *
+ * 	ctl:	write "enable NAME|all", "disable NAME|all", or "reset".  Reads
+ * 			list each event and whether it is on.
+ * 	events:	the event descriptions, one per line: id kind name fields...
+ * 	data:	binary snapshot of the per-core rings, in the format in
+ * 			ros/tracepoint.h.  The snapshot is taken when data is opened.
+ *
+ * For example:
+ *
+ * 	echo enable all > '#trace/ctl'
+ * 	(do something slow)
+ * 	echo disable all > '#trace/ctl'
+ * 	cp '#trace/data' /mnt/trace.bin
+ *
+ * and then on the host: scripts/trace2json.py trace.bin > trace.json */
+
+#include <ns.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <tracepoint.h>
+#include <syscall.h>
+
+struct dev trace_devtab;
+
+static char *devname(void)
+{
+	return trace_devtab.name;
+}
+
+enum {
+	Qdir,
+	Qctl,
+	Qevents,
+	Qdata,
+};
+
+static struct dirtab trace_dir[] = {
+	{".", {Qdir, 0, QTDIR}, 0, DMDIR | 0555},
+	{"ctl", {Qctl, 0, QTFILE}, 0, 0664},
+	{"events", {Qevents, 0, QTFILE}, 0, 0444},
+	{"data", {Qdata, 0, QTFILE}, 0, 0444},
+};
+
+/* An open data file's snapshot, in c->aux */
+struct trace_snap {
+	size_t						len;
+	void						*buf;
+};
+
+static const char trace_ctl_usage[] = "enable NAME|all, disable NAME|all, reset";
+
+static struct chan *trace_attach(char *spec)
+{
+	return devattach(devname(), spec);
+}
+
+static struct walkqid *trace_walk(struct chan *c, struct chan *nc, char **name,
+                                  int nname)
+{
+	return devwalk(c, nc, name, nname, trace_dir, ARRAY_SIZE(trace_dir),
+	               devgen);
+}
+
+static int trace_stat(struct chan *c, uint8_t *db, int n)
+{
+	return devstat(c, db, n, trace_dir, ARRAY_SIZE(trace_dir), devgen);
+}
+
+static struct chan *trace_open(struct chan *c, int omode)
+{
+	struct trace_snap *snap;
+
+	c = devopen(c, omode, trace_dir, ARRAY_SIZE(trace_dir), devgen);
+	if ((int)c->qid.path == Qdata) {
+		snap = kzmalloc(sizeof(struct trace_snap), MEM_WAIT);
+		snap->buf = tp_snapshot(&snap->len);
+		c->aux = snap;
+	}
+	return c;
+}
+
+static void trace_close(struct chan *c)
+{
+	struct trace_snap *snap;
+
+	if (!(c->flag & COPEN))
+		return;
+	if ((int)c->qid.path == Qdata) {
+		snap = c->aux;
+		kfree(snap->buf);
+		kfree(snap);
+	}
+}
+
+static long trace_read_ctl(void *va, long n, int64_t off)
+{
+	size_t bufsz = TP_NR_EVENTS * 64, len = 0;
+	char *buf = kmalloc(bufsz, MEM_WAIT);
+
+	for (int i = 0; i < TP_NR_EVENTS; i++)
+		len += snprintf(buf + len, bufsz - len, "%s %s\n", tp_descs[i].name,
+		                tp_enabled[i] ? "on" : "off");
+	n = readmem(off, va, n, buf, len);
+	kfree(buf);
+	return n;
+}
+
+static long trace_read_events(void *va, long n, int64_t off)
+{
+	size_t len;
+	char *buf = tp_describe(&len);
+
+	n = readmem(off, va, n, buf, len);
+	kfree(buf);
+	return n;
+}
+
+static long trace_read(struct chan *c, void *va, long n, int64_t off)
+{
+	struct trace_snap *snap;
+
+	switch ((int)c->qid.path) {
+	case Qdir:
+		return devdirread(c, va, n, trace_dir, ARRAY_SIZE(trace_dir), devgen);
+	case Qctl:
+		return trace_read_ctl(va, n, off);
+	case Qevents:
+		return trace_read_events(va, n, off);
+	case Qdata:
+		snap = c->aux;
+		return readmem(off, va, n, snap->buf, snap->len);
+	default:
+		panic("Bad Qid %p!", c->qid.path);
+	}
+	return -1;
+}
+
+static void trace_ctl_enable(struct cmdbuf *cb, bool on)
+{
+	int id = -1;
+
+	if (cb->nf < 2)
+		error(EINVAL, trace_ctl_usage);
+	if (strcmp(cb->f[1], "all")) {
+		id = tp_lookup(cb->f[1]);
+		if (id < 0)
+			error(ENOENT, "no tracepoint %s", cb->f[1]);
+	}
+	tp_set_enabled(id, on);
+}
+
+static long trace_write(struct chan *c, void *ubuf, long n, int64_t off)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+
+	if ((int)c->qid.path != Qctl)
+		error(EPERM, ERROR_FIXME);
+	cb = parsecmd(ubuf, n);
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	if (cb->nf < 1)
+		error(EINVAL, trace_ctl_usage);
+	if (!strcmp(cb->f[0], "enable"))
+		trace_ctl_enable(cb, TRUE);
+	else if (!strcmp(cb->f[0], "disable"))
+		trace_ctl_enable(cb, FALSE);
+	else if (!strcmp(cb->f[0], "reset"))
+		tp_reset();
+	else
+		error(EINVAL, trace_ctl_usage);
+	poperror();
+	kfree(cb);
+	return n;
+}
+
+struct dev trace_devtab __devtab = {
+	.name = "trace",
+
+	.reset = devreset,
+	.init = devinit,
+	.shutdown = devshutdown,
+	.attach = trace_attach,
+	.walk = trace_walk,
+	.stat = trace_stat,
+	.open = trace_open,
+	.create = devcreate,
+	.close = trace_close,
+	.read = trace_read,
+	.bread = devbread,
+	.write = trace_write,
+	.bwrite = devbwrite,
+	.remove = devremove,
+	.wstat = devwstat,
+	.power = devpower,
+	.chaninfo = devchaninfo,
+};
@@ -12,6 +12,10 @@
  * © 2007  coraid, inc
  */
 
+#pragma once
+
+#include <kthread.h>
+
 /* ata errors */
 enum {
 	Emed = 1 << 0,  /* media error */
@@ -283,11 +287,12 @@ enum {
 	Dnop = 1 << 3,
 	Datapi = 1 << 4,
 	Datapi16 = 1 << 5,
+	Dncq = 1 << 6,
 };
 
 typedef struct aportm {
-	QLock ql;
-	Rendez Rendez;
+	qlock_t ql;
+	struct rendez rendez;
 	unsigned char flag;
 	unsigned char feat;
 	unsigned char smart;
@@ -44,6 +44,9 @@ struct spinlock {
 	uintptr_t call_site;
 	uint32_t calling_core;
 	bool irq_okay;
+#ifdef CONFIG_LOCKSTAT
+	uint64_t lockstat_tsc;		/* when it was locked */
+#endif
 #endif
 };
 typedef struct spinlock spinlock_t;
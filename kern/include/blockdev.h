@@ -11,6 +11,8 @@
 #include <slab.h>
 #include <pagemap.h>
 #include <kthread.h>
+#include <atomic.h>
+#include <sys/queue.h>
 
 /* All block IO is done assuming a certain size sector, which is the smallest
  * possible unit of transfer between the kernel and the block layer.  This can
@@ -20,6 +22,20 @@
 #define SECTOR_SZ_LOG 9
 #define SECTOR_SZ (1 << SECTOR_SZ_LOG)
 
+struct block_device;
+struct block_request;
+struct bdev_io;
+TAILQ_HEAD(bdev_io_tailq, bdev_io);
+
+/* Driver methods.  start() hands an IO to the driver, which calls
+ * bdev_io_done() when the IO completes, from any context (usually its IRQ
+ * handler).  start() is called without the bdev's lock held, from any context,
+ * and must not block.  The block layer never has more than b_max_inflight IOs
+ * started at once, so drivers set that to their queue depth. */
+struct bdev_ops {
+	void (*start)(struct block_device *bdev, struct bdev_io *io);
+};
+
 /* Every block device is represented by one of these, with custom methods, as
  * applicable for the type of device.  Subject to massive changes. */
 #define BDEV_INLINE_NAME 10
@@ -31,10 +47,15 @@ struct block_device {
 	struct page_map				b_pm;
 	void						*b_data;			/* dev-specific use */
 	char						b_name[BDEV_INLINE_NAME];
-	// TODO: list or something of buffer heads (?)
-	// list of outstanding requests
-	// io scheduler
-	// callbacks for completion
+	struct bdev_ops				*b_ops;
+	unsigned int				b_max_inflight;		/* driver queue depth */
+	unsigned int				b_max_sectors;		/* per IO */
+	spinlock_t					b_lock;				/* protects the rest */
+	struct bdev_io_tailq		b_queue;			/* waiting to start */
+	unsigned int				b_nr_inflight;
+	bool						b_dispatching;
+	unsigned long				b_nr_ios;			/* started */
+	unsigned long				b_nr_merges;		/* IOs merged in queue */
 };
 
 /* So far, only NEEDS_ZEROED is used */
@@ -62,6 +83,7 @@ struct buffer_head *bdev_get_buffer(struct block_device *bdev,
                                     unsigned long blk_num, unsigned int blk_sz);
 void bdev_dirty_buffer(struct buffer_head *bh);
 void bdev_put_buffer(struct buffer_head *bh);
+int bdev_write_bhs(struct page *page, bool only_dirty);
 
 /* This encapsulates the work of a request (instead of having a variety of
  * slightly-different functions for things like read/write and scatter-gather
@@ -74,7 +96,6 @@ void bdev_put_buffer(struct buffer_head *bh);
  * another array of BH pointers if you want more.  The BHs do not need to be
  * linked or otherwise associated with a page mapping. */
 #define NR_INLINE_BH (PGSIZE >> SECTOR_SZ_LOG)
-struct block_request;
 struct block_request {
 	unsigned int				flags;
 	void						(*callback)(struct block_request *breq);
@@ -83,6 +104,9 @@ struct block_request {
 	struct buffer_head			**bhs;				/* BHs describing the IOs */
 	unsigned int				nr_bhs;
 	struct buffer_head			*local_bhs[NR_INLINE_BH];
+	/* Set by the block layer */
+	atomic_t					nr_pending;			/* segs not done yet */
+	int							error;
 };
 struct kmem_cache *breq_kcache;	/* for the block requests */
 
@@ -90,9 +114,38 @@ struct kmem_cache *breq_kcache;	/* for the block requests */
 #define BREQ_READ 			0x001
 #define BREQ_WRITE 			0x002
 
+/* What the drivers see.  The block layer turns each run of sector-adjacent BHs
+ * in a breq into an IO, and merges IOs for adjacent sectors while they wait in
+ * the bdev's queue, so one IO can cover several breqs.  segs[] is the
+ * scatter-gather list, in sector order: seg i starts right after seg i-1 on
+ * the device.  Buffers are KVAs. */
+#define BDEV_IO_MAX_SEGS	32
+
+struct bdev_seg {
+	struct block_request		*breq;
+	void						*buf;
+	unsigned int				nr_sector;
+};
+
+struct bdev_io {
+	TAILQ_ENTRY(bdev_io)		link;
+	struct block_device			*bdev;
+	unsigned int				flags;				/* BREQ_READ or WRITE */
+	unsigned long				sector;
+	unsigned int				nr_sector;
+	unsigned int				nr_segs;
+	struct bdev_seg				segs[BDEV_IO_MAX_SEGS];
+	void						*drv_data;			/* driver's use */
+};
+
 void block_init(void);
 struct block_device *get_bdev(char *path);
+void bdev_init(struct block_device *bdev, char *name, unsigned int sector_sz,
+               unsigned long nr_sector, struct bdev_ops *ops, void *data);
+struct block_device *make_ramdisk(char *name, void *data, size_t size);
+void bdev_make_device(struct block_device *bdev, char *path);
 void free_bhs(struct page *page);
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq);
+void bdev_io_done(struct bdev_io *io, int error);
 void generic_breq_done(struct block_request *breq);
 void sleep_on_breq(struct block_request *breq);
@@ -0,0 +1,91 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Concurrent hash table, keyed by unsigned longs.
+ *
+ * Objects embed a struct chash_node, which holds the key and the chain link, so
+ * the table never allocates per item.  The table has a power-of-two number of
+ * buckets, and writers lock one of CHASH_NR_LOCKS stripes, picked by the low
+ * bits of the key's hash.  Lookups are lockless: callers must be RCU readers,
+ * and must not free an object until a grace period after it was removed.
+ *
+ * The table grows and shrinks with the number of items.  A resize allocates the
+ * new table, and then the writers move a few buckets at a time from the old
+ * table to the new one, so no one waits on the whole table.  Until it is done,
+ * items could be in either table: lookups check the old one, then the new one.
+ * Since there are never fewer buckets than stripes, a key's stripe is the same
+ * in both tables, and one lock covers a key wherever it is.
+ *
+ * Example:
+ *
+ * 	struct foo {
+ * 		struct chash_node link;
+ * 		...
+ * 	};
+ *
+ * 	chash_init(&ht, 0);
+ * 	foo->link.key = 1234;
+ * 	chash_insert(&ht, &foo->link);
+ *
+ * 	rcu_read_lock();
+ * 	foo = chash_lookup_entry(&ht, 1234, struct foo, link);
+ * 	...
+ * 	rcu_read_unlock();
+ *
+ * 	foo = chash_remove_entry(&ht, 1234, struct foo, link);
+ * 	(free foo with call_rcu()) */
+
+#pragma once
+
+#include <ros/common.h>
+#include <atomic.h>
+#include <rcu.h>
+
+#define CHASH_NR_LOCKS			64
+#define CHASH_MIN_BUCKETS		CHASH_NR_LOCKS
+
+struct chash_node {
+	struct chash_node			*next;
+	unsigned long				key;
+};
+
+struct chash_tbl {
+	unsigned long				mask;
+	struct chash_tbl			*future;	/* being resized into this */
+	struct rcu_head				rcu;
+	struct chash_node			*buckets[];
+};
+
+struct chashtable {
+	struct chash_tbl			*tbl;
+	atomic_t					nr_items;
+	spinlock_t					resize_lock;
+	unsigned long				migrate_idx;	/* protected by resize_lock */
+	spinlock_t					locks[CHASH_NR_LOCKS];
+};
+
+void chash_init(struct chashtable *ht, unsigned long nr_buckets);
+void chash_destroy(struct chashtable *ht);
+bool chash_insert(struct chashtable *ht, struct chash_node *node);
+struct chash_node *chash_lookup(struct chashtable *ht, unsigned long key);
+struct chash_node *chash_remove(struct chashtable *ht, unsigned long key);
+void chash_for_each(struct chashtable *ht,
+                    void (*fn)(struct chash_node *node, void *opaque),
+                    void *opaque);
+
+static inline unsigned long chash_count(struct chashtable *ht)
+{
+	return atomic_read(&ht->nr_items);
+}
+
+#define chash_entry(node, type, member)                                        \
+({                                                                             \
+	struct chash_node *__node = (node);                                        \
+	__node ? container_of(__node, type, member) : NULL;                        \
+})
+
+#define chash_lookup_entry(ht, key, type, member)                              \
+	chash_entry(chash_lookup(ht, key), type, member)
+
+#define chash_remove_entry(ht, key, type, member)                              \
+	chash_entry(chash_remove(ht, key), type, member)
@@ -0,0 +1,47 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Core request data for the topology-aware (packed) core allocator. */
+
+#pragma once
+
+#include <arch/topology.h>
+
+/* The core request algorithm maintains an internal array of these: the
+ * global pcore map. Note the prov_proc, alloc_proc, and last_proc are weak
+ * (internal) references.  prov_proc and alloc_proc should only be used as a ref
+ * source while the ksched has a valid kref.  last_proc is never dereferenced;
+ * it is only compared against the proc we are allocating for.
+ *
+ * alloc_next is used for the idle list while the core is idle, and for the
+ * alloc_proc's alloc_me list while the core is allocated. */
+struct sched_pcore {
+	TAILQ_ENTRY(sched_pcore)   prov_next;    /* on a proc's prov list */
+	TAILQ_ENTRY(sched_pcore)   alloc_next;   /* on an alloc list (idle/proc) */
+	struct proc                *prov_proc;   /* who this is prov to */
+	struct proc                *alloc_proc;  /* who this is alloc to */
+	struct proc                *last_proc;   /* who this was last alloc to */
+	struct core_info           *spc_info;    /* topology of this core */
+	struct sched_pcore         *sibling;     /* hyperthread sibling, or 0 */
+};
+TAILQ_HEAD(sched_pcore_tailq, sched_pcore);
+
+struct core_request_data {
+	struct sched_pcore_tailq  alloc_me;           /* cores alloced to us */
+	struct sched_pcore_tailq  prov_alloc_me;      /* prov cores alloced us */
+	struct sched_pcore_tailq  prov_not_alloc_me;  /* maybe alloc to others */
+};
+
+static inline uint32_t spc2pcoreid(struct sched_pcore *spc)
+{
+	extern struct sched_pcore *all_pcores;
+
+	return spc - all_pcores;
+}
+
+static inline struct sched_pcore *pcoreid2spc(uint32_t pcoreid)
+{
+	extern struct sched_pcore *all_pcores;
+
+	return &all_pcores[pcoreid];
+}
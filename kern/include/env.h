@@ -16,6 +16,8 @@
 #include <arch/arch.h>
 #include <sys/queue.h>
 #include <atomic.h>
+#include <chash.h>
+#include <rcu.h>
 #include <mm.h>
 #include <vfs.h>
 #include <schedule.h>
@@ -45,6 +47,8 @@ struct proc {
 	char *binary_path;
 
 	pid_t pid;
+	struct chash_node pid_link;	/* in pid_hash, keyed by pid */
+	struct rcu_head p_rcu;		/* pid2proc() readers are lockless */
 	/* Tempting to add a struct proc *parent, but we'd need to protect the use
 	 * of that reference from concurrent parent-death (letting init inherit
 	 * children, etc), which is basically what we do when we do pid2proc.  If we
@@ -95,6 +99,9 @@ struct proc {
 	// Note this is the actual backring, not a pointer to it somewhere else
 	syscall_back_ring_t syscallbackring;
 
+	/* Syscall submission ring, see sysring.h */
+	struct sysring_ctx *sysring;
+
 	// The front ring pointers for pushing asynchronous system events out to the user
 	// Note this is the actual frontring, not a pointer to it somewhere else
 	sysevent_front_ring_t syseventfrontring;
@@ -53,6 +53,7 @@
 #define EXT2_FEATURE_INCOMPAT_RECOVER		0x0004
 #define EXT2_FEATURE_INCOMPAT_JOURNAL_DEV	0x0008
 #define EXT2_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT3_FEATURE_INCOMPAT_EXTENTS		0x0040	/* ext4-style extents */
 
 /* FS read-only features: We should mount read-only if we don't support these */
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001	/* sparse superblock */
@@ -115,6 +116,7 @@ the crap we keep around for glibc/posix is (probably still) in octal. */
 #define EXT2_INDEX_FL			0x00010000	/* hash indexed directory */
 #define EXT2_IMAGIC_FL			0x00020000	/* AFS directory */
 #define EXT3_JOURNAL_DATA_FL	0x00040000	/* journal file data */
+#define EXT4_EXTENTS_FL			0x00080000	/* i_block is an extent tree */
 #define EXT2_RESERVED_FL		0x80000000	/* reserved for ext2 library */
 
 /* Directory entry file types */
@@ -232,6 +234,41 @@ struct ext2_inode {
 	uint8_t						i_osd2[12];			/* OS dependent */
 };
 
+/* Extent trees, in ext4's on-disk format.  An extent inode's i_block[] holds
+ * the root node: a header and up to four entries.  Every other node is a whole
+ * FS block.  Leaves (depth 0) hold ext2_extents, interior nodes hold
+ * ext2_extent_idxs pointing at the next level down.  Entries in a node are
+ * sorted by logical block, and an index's ei_block is the first logical block
+ * of the node it points to.
+ *
+ * An ee_len above EXT2_EXT_MAX_LEN is an uninitialized extent (ext4 uses these
+ * for fallocate()).  We never make them. */
+#define EXT2_EXT_MAGIC			0xf30a
+#define EXT2_EXT_MAX_DEPTH		5
+#define EXT2_EXT_MAX_LEN		32768
+
+struct ext2_extent_header {
+	uint16_t					eh_magic;
+	uint16_t					eh_entries;			/* valid entries */
+	uint16_t					eh_max;				/* capacity of the node */
+	uint16_t					eh_depth;			/* 0 for leaves */
+	uint32_t					eh_generation;
+};
+
+struct ext2_extent {
+	uint32_t					ee_block;			/* first logical block */
+	uint16_t					ee_len;
+	uint16_t					ee_start_hi;		/* upper 16 bits of start */
+	uint32_t					ee_start_lo;		/* first FS block */
+};
+
+struct ext2_extent_idx {
+	uint32_t					ei_block;			/* first logical block */
+	uint32_t					ei_leaf_lo;			/* FS block of child node */
+	uint16_t					ei_leaf_hi;			/* upper 16 bits of leaf */
+	uint16_t					ei_unused;
+};
+
 /* a dir_inode of 0 means an unused entry.  reclen will go to the end of the
  * data block when it is the last entry.  These are 4-byte aligned on disk. */
 struct ext2_dirent {
@@ -253,11 +290,21 @@ struct ext2_sb_info {
 	struct ext2_sb				*e2sb;
 	struct ext2_block_group		*e2bg;
 	unsigned int				nr_bgs;
+	bool						extents;		/* new files use extents */
 };
 
-/* Inode in-memory data.  This stuff is in cpu-native endianness.  If we start
- * using the data in the actual inode and in the buffer cache, change
- * ext2_my_bh() and its two callers.  Assume this data is dirty. */
+/* Inode in-memory data.  This stuff is in cpu-native endianness, except for an
+ * extent inode's i_block, which is the on-disk extent root.  If we start using
+ * the data in the actual inode and in the buffer cache, change ext2_my_bh() and
+ * its two callers.  Assume this data is dirty.
+ *
+ * The i_rsv fields are the block reservation for sequential writers: a run of
+ * FS blocks, already taken from the bitmap, for the file blocks starting at
+ * i_rsv_lblk. */
 struct ext2_i_info {
 	uint32_t					i_block[15];		/* list of blocks reserved*/
+	uint32_t					i_rsv_lblk;			/* next ino block expected */
+	uint32_t					i_rsv_start;		/* next FS block to hand out */
+	uint32_t					i_rsv_len;			/* FS blocks left */
+	uint32_t					i_rsv_win;			/* size of the next run */
 };
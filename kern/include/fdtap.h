@@ -28,8 +28,13 @@ struct fd_tap {
 	struct event_queue			*ev_q;
 	int							ev_id;
 	void						*data;
+	struct fd_tap				*fd_next;	/* next tap on the same FD */
 };
 
 int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
-int remove_fd_tap(struct proc *p, int fd);
+int remove_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
+int poll_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
+void put_fd_taps(struct fd_tap *tap);
 int fire_tap(struct fd_tap *tap, int filter);
+int fire_tap_batched(struct fd_tap *tap, int filter);
+void flush_tap_batch(void);
@@ -29,6 +29,7 @@
 
 #pragma once
 #include <ns.h>
+#include <ros/conv_info.h>
 
 enum {
 	Addrlen = 64,
@@ -308,6 +309,7 @@ struct Proto {
 	int (*stats) (struct Proto *, char *unused_char_p_t, int);
 	int (*local) (struct conv *, char *unused_char_p_t, int);
 	int (*remote) (struct conv *, char *unused_char_p_t, int);
+	void (*info)(struct conv *, struct conv_info *);
 	int (*inuse) (struct conv *);
 	int (*gc) (struct Proto *);	/* returns true if any conversations are freed */
 	void (*newconv) (struct Proto * udp, struct conv * conv);
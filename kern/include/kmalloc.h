@@ -55,6 +55,10 @@ struct kmalloc_tag {
 		size_t num_pages;
 		uint64_t unused_force_align;
 	};
+#ifdef CONFIG_KMEM_TRACK
+	uintptr_t site;				/* who allocated it, 0 if untracked */
+	size_t size;				/* what they asked for */
+#endif
 	struct kref kref;
 	uint32_t canary;
 	int flags;
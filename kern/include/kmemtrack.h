@@ -0,0 +1,60 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Kernel memory accounting by allocation site (CONFIG_KMEM_TRACK).
+ *
+ * Every kmalloc, slab cache and kernel page allocation is charged to the code
+ * that called the allocator: how many bytes and objects it has live, and how
+ * many times it allocated.  kmalloc saves the site and size in its tag, slab
+ * objects save the site after the object, and pages save the site in their
+ * struct page, so that the free is charged back to the same site.
+ * Allocations made before kmemtrack_init() aren't tracked, nor are their frees.
+ *
+ * Page allocations are charged to whoever called the page allocator, and this
+ * includes the slab allocator growing its caches and kmalloc's large
+ * allocations.  So the "pages" entries for those overlap with the "kmalloc" and
+ * "slab" entries; they tell you how much memory the allocators themselves hold.
+ * kmalloc's own slab caches are KMC_NOTRACK, so kmallocs only show up once.
+ *
+ * Each core updates its own table, with atomics so an IRQ on the same core
+ * can't lose an update.  An object freed on a different core than it was
+ * allocated on makes the two cores' entries for the site lopsided, but the sum
+ * over the cores is right.  If a core's table is full, the update is counted as
+ * dropped, and that site's live counts will be off.
+ *
+ * The report is #kprof/kmemtrack, or the monitor's "kmemtrack". */
+
+#pragma once
+
+#include <ros/common.h>
+#include <kdebug.h>
+
+/* What kind of memory was allocated */
+enum {
+	KMEMTRACK_KMALLOC,
+	KMEMTRACK_PAGES,
+	KMEMTRACK_SLAB,
+};
+
+#ifdef CONFIG_KMEM_TRACK
+
+void kmemtrack_init(void);
+uintptr_t kmemtrack_alloc(int type, uintptr_t pc, size_t bytes);
+void kmemtrack_free(int type, uintptr_t pc, size_t bytes);
+void kmemtrack_resize(int type, uintptr_t pc, size_t old_bytes,
+                      size_t new_bytes);
+char *kmemtrack_report(int top_n, size_t *len);
+
+/* The allocator's caller, for the allocator's public entry points to pass down
+ * to where the allocation is recorded. */
+#define kmemtrack_caller() get_caller_pc()
+
+#else
+
+static inline void kmemtrack_init(void)
+{
+}
+
+#define kmemtrack_caller() ((uintptr_t)0)
+
+#endif /* CONFIG_KMEM_TRACK */
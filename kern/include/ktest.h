@@ -55,9 +55,58 @@ struct ktest_suite {
 		register_ktest_suite(&ktest_suite);                                      \
 	} while (0)
 
+/* Kernel microbenchmarks.  Instead of pass/fail, a kbench times each call of
+ * its op, on each of ctx->nr_workers cores at once, and reports the spread.
+ * setup() and teardown() are optional and run on the calling core.  setup()
+ * can return false, with the reason in ktest_msg, to skip the kbench. */
+struct kbench_ctx {
+	int nr_workers;
+	unsigned long nr_iters;
+	struct proc *p;		/* who asked for the run, if anyone */
+	void *arg;			/* for the kbench */
+};
+
+struct kbench {
+	char name[256];
+	bool (*setup)(struct kbench_ctx *ctx);
+	void (*op)(struct kbench_ctx *ctx, int worker, unsigned long iter);
+	void (*teardown)(struct kbench_ctx *ctx);
+	bool enabled;
+};
+
+struct kbench_suite {
+	SLIST_ENTRY(kbench_suite) link;
+	char name[256];
+	struct kbench *kbenches;
+	int num_kbenches;
+};
+
+#define KBENCH_SUITE(name) \
+	static struct kbench_suite kbench_suite = {{}, name, NULL, 0};
+
+#define KBENCH_REG(name, config) \
+	{"bench_" #name, NULL, bench_##name, NULL, is_defined(config)}
+
+#define KBENCH_REG_SETUP(name, config) \
+	{"bench_" #name, bench_##name##_setup, bench_##name,                      \
+	 bench_##name##_teardown, is_defined(config)}
+
+#define REGISTER_KBENCHES(kbenches, num_kbenches)                                \
+	do {                                                                         \
+		kbench_suite.kbenches = kbenches;                                        \
+		kbench_suite.num_kbenches = num_kbenches;                                \
+		register_kbench_suite(&kbench_suite);                                    \
+	} while (0)
+
 /* Global string used to report info about the last completed test */
 extern char ktest_msg[1024];
 
 void register_ktest_suite(struct ktest_suite *suite);
 void run_ktest_suite(struct ktest_suite *suite);
 void run_registered_ktest_suites();
+
+void register_kbench_suite(struct kbench_suite *suite);
+void run_kbench_suite(struct kbench_suite *suite, const char *name,
+                      int nr_cores, unsigned long nr_iters);
+void run_registered_kbench_suites(const char *name, int nr_cores,
+                                  unsigned long nr_iters);
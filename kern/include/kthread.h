@@ -13,6 +13,7 @@
 #include <sys/queue.h>
 #include <atomic.h>
 #include <setjmp.h>
+#include <kdebug.h>
 
 struct errbuf {
 	struct jmpbuf jmpbuf;
@@ -45,7 +46,15 @@ struct kthread {
 	int							flags;
 	char						*name;
 	char						generic_buf[GENBUF_SZ];
-	struct systrace_record		*strace;
+	/* systrace of the current syscall: entry TSC (0 if not traced), and the
+	 * syscall's num and args, saved at entry. */
+	uint64_t				strace_start;
+	uintreg_t				strace_sysc[7];
+	/* off-CPU profiling: when we blocked (0 if not sampled), and the user
+	 * backtrace from then.  Not on the stack, to keep sem_down's frame small. */
+	uint64_t				offcpu_start;
+	size_t					offcpu_nr_upcs;
+	uintptr_t				offcpu_upcs[MAX_BT_DEPTH];
 };
 
 /* Semaphore for kthreads to sleep on.  0 or less means you need to sleep */
@@ -58,6 +67,10 @@ struct semaphore {
 	TAILQ_ENTRY(semaphore)		link;
 	bool						is_on_list;	/* would like better sys/queue.h */
 #endif
+#ifdef CONFIG_LOCKSTAT
+	uintptr_t					lockstat_pc;	/* qlocks: who holds it */
+	uint64_t					lockstat_tsc;	/* qlocks: since when */
+#endif
 };
 
 /* omitted elements (the sem debug stuff) are initialized to 0 */
@@ -157,7 +170,13 @@ void switch_back_from_ktask(uintptr_t old_ret);
  * Not sure if they'll need irqsave or normal sems. */
 typedef struct semaphore qlock_t;
 #define qlock_init(x) sem_init((x), 1)
+#ifdef CONFIG_LOCKSTAT
+void qlock(qlock_t *q);
+void qunlock(qlock_t *q);
+bool canqlock(qlock_t *q);
+#else
 #define qlock(x) sem_down(x)
 #define qunlock(x) sem_up(x)
 #define canqlock(x) sem_trydown(x)
+#endif
 #define QLOCK_INITIALIZER(name) SEMAPHORE_INITIALIZER(name, 1)
@@ -0,0 +1,58 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Latency histograms for syscalls (one per syscall number) and page faults.
+ *
+ * These are always on.  The hot path is two TSC reads and a bucket increment
+ * in a per-core histogram, so recording doesn't take locks or share cache
+ * lines.  Each core allocates a histogram the first time it records for that
+ * key.  An IRQ on the same core can race with an update and lose it; these are
+ * just statistics.
+ *
+ * Buckets are log-linear, like HdrHistogram: each power of two of TSC ticks is
+ * split into LATHIST_SUB_BUCKETS linear buckets, so a bucket is within 1/8th of
+ * the values in it.  Reports merge the cores' histograms and give percentiles
+ * in nsec.
+ *
+ * The report is #kprof/lathist. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <arch/arch.h>
+
+#define LATHIST_SUB_SHIFT		3
+#define LATHIST_SUB_BUCKETS		(1 << LATHIST_SUB_SHIFT)
+/* Anything at or above 2^LATHIST_MAX_SHIFT ticks goes in the last bucket */
+#define LATHIST_MAX_SHIFT		40
+#define LATHIST_NR_BUCKETS		((LATHIST_MAX_SHIFT - LATHIST_SUB_SHIFT + 1) \
+                                 * LATHIST_SUB_BUCKETS)
+
+/* What is being timed.  Syscall keys are LATHIST_SYSCALL + the syscall num. */
+enum {
+	LATHIST_PGFAULT,
+	LATHIST_SYSCALL,
+};
+
+struct lathist {
+	uint64_t					count;
+	uint64_t					total;
+	uint64_t					max;
+	uint64_t					buckets[LATHIST_NR_BUCKETS];
+};
+
+void lathist_init(void);
+void lathist_record(unsigned int key, uint64_t ticks);
+void lathist_set_enabled(bool on);
+void lathist_reset(void);
+char *lathist_report(size_t *len);
+
+static inline void lathist_record_sysc(unsigned int num, uint64_t start)
+{
+	lathist_record(LATHIST_SYSCALL + num, read_tsc() - start);
+}
+
+static inline void lathist_record_pgfault(uint64_t start)
+{
+	lathist_record(LATHIST_PGFAULT, read_tsc() - start);
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Lock contention statistics (CONFIG_LOCKSTAT).
+ *
+ * Every spinlock, semaphore, and qlock acquisition is charged to the code that
+ * took the lock: how often it locked, how often it had to wait, and how many
+ * TSC cycles it spent waiting for and holding the lock.  The call site stands
+ * in for a lock class.  All of the q->locks that qbread() takes are one entry,
+ * no matter which queue they belong to.
+ *
+ * Each core records into its own table, so recording doesn't take locks or
+ * share cache lines.  Reports merge the tables.  An IRQ on the same core can
+ * race with an update and lose it; these are just statistics.
+ *
+ * The report is #kprof/lockstat. */
+
+#pragma once
+
+#include <ros/common.h>
+
+/* What kind of lock was taken */
+enum {
+	LOCKSTAT_SPIN,
+	LOCKSTAT_SEM,
+	LOCKSTAT_QLOCK,
+};
+
+/* What the report is sorted by, biggest first */
+enum {
+	LOCKSTAT_SORT_ACQUIRED,
+	LOCKSTAT_SORT_CONTENDED,
+	LOCKSTAT_SORT_WAIT,
+	LOCKSTAT_SORT_HOLD,
+};
+
+#ifdef CONFIG_LOCKSTAT
+
+void lockstat_init(void);
+void lockstat_acquired(int type, uintptr_t pc, bool contended, uint64_t wait);
+void lockstat_released(int type, uintptr_t pc, uint64_t hold);
+void lockstat_set_enabled(bool on);
+void lockstat_reset(void);
+char *lockstat_report(int sort_by, size_t *len);
+
+#else
+
+static inline void lockstat_init(void)
+{
+}
+
+#endif /* CONFIG_LOCKSTAT */
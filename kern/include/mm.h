@@ -21,6 +21,19 @@ struct proc;								/* preprocessor games */
  * freed.  There should be no other references floating around.  We still need
  * to sort out how we share memory and how we'll do private memory with these
  * VMRs. */
+/* Readahead state for a stream of accesses to a page map, kept per open file
+ * and per VMR.  All zeros is the initial state.  See pm_ra_update(). */
+#define PM_RA_NORMAL		0	/* adaptive window */
+#define PM_RA_RANDOM		1	/* no readahead */
+#define PM_RA_SEQUENTIAL	2	/* max window from the start */
+
+struct pm_ra {
+	unsigned long				ra_expect;	/* index after the last access */
+	unsigned long				ra_next;	/* first index not read ahead */
+	unsigned int				ra_size;	/* window, 0 after random access */
+	int							ra_mode;
+};
+
 struct vm_region {
 	TAILQ_ENTRY(vm_region)		vm_link;
 	TAILQ_ENTRY(vm_region)		vm_pm_link;
@@ -31,6 +44,7 @@ struct vm_region {
 	int							vm_flags;
 	struct file					*vm_file;
 	size_t						vm_foff;
+	struct pm_ra				vm_ra;		/* for faults on vm_file */
 };
 TAILQ_HEAD(vmr_tailq, vm_region);			/* Declares 'struct vmr_tailq' */
 
@@ -64,6 +78,7 @@ void *mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
               struct file *f, size_t offset);
 int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
+int madvise(struct proc *p, uintptr_t addr, size_t len, int advice);
 int munmap(struct proc *p, uintptr_t addr, size_t len);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
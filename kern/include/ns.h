@@ -965,6 +965,8 @@ long unionread(struct chan *c, void *va, long n);
 void read_exactly_n(struct chan *c, void *vp, long n);
 long sysread(int fd, void *va, long n);
 long syspread(int fd, void *va, long n, int64_t off);
+long sysreadv(int fd, struct iovec *iov, int iovcnt);
+long syspreadv(int fd, struct iovec *iov, int iovcnt, int64_t off);
 int sysremove(char *path);
 int64_t sysseek(int fd, int64_t off, int whence);
 void validstat(uint8_t * s, int n, int slashok);
@@ -972,8 +974,13 @@ int sysstat(char *path, uint8_t*, int n);
 int sysstatakaros(char *path, struct kstat *);
 long syswrite(int fd, void *va, long n);
 long syspwrite(int fd, void *va, long n, int64_t off);
+long syswritev(int fd, struct iovec *iov, int iovcnt);
+long syspwritev(int fd, struct iovec *iov, int iovcnt, int64_t off);
+long syssendfile(int out_fd, int in_fd, struct file *in_file, int64_t *offp,
+                 long count);
 int syswstat(char *path, uint8_t * buf, int n);
 struct dir *chandirstat(struct chan *c);
+struct file *chanpm_open(int fd);
 struct dir *sysdirstat(char *name);
 struct dir *sysdirfstat(int fd);
 int sysdirwstat(char *name, struct dir *dir);
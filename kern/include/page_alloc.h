@@ -33,6 +33,8 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_REFERENCED	0x040	/* page map, looked up since the last scan */
+#define PG_ACTIVE		0x080	/* page map, on the active LRU list */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -46,10 +48,14 @@ struct page {
 	struct page_map				*pg_mapping; /* for debugging... */
 	unsigned long				pg_index;
 	void						**pg_tree_slot;
+	TAILQ_ENTRY(page)			pg_lru_link;	/* page map LRU, pm_lock */
 	void						*pg_private;	/* type depends on page usage */
 	struct semaphore 			pg_sem;		/* for blocking on IO */
 	uint64_t				gpa;		/* physical address in guest */
 								/* pg_private is overloaded. */
+#ifdef CONFIG_KMEM_TRACK
+	uintptr_t				pg_alloc_site;	/* kmemtrack, 0 if untracked */
+#endif
 };
 
 /******** Externally visible global variables ************/
@@ -19,6 +19,7 @@ struct inode;
 struct block_device;
 struct chan;
 struct page_map_operations;
+TAILQ_HEAD(page_tailq, page);
 
 /* Every object that has pages, like an inode or the swap (or even direct block
  * devices) has a page_map, tracking which of its pages are currently in memory.
@@ -35,7 +36,14 @@ struct page_map {
 	spinlock_t					pm_lock;
 	struct vmr_tailq			pm_vmrs;
 	atomic_t					pm_removal;
+	/* LRU for reclaim, protected by pm_lock.  New pages start inactive. */
+	struct page_tailq			pm_active;
+	struct page_tailq			pm_inactive;
+	unsigned long				pm_nr_active;
+	TAILQ_ENTRY(page_map)		pm_link;		/* reclaim's list of all PMs */
+	atomic_t					pm_ra_inflight;	/* readahead reads */
 };
+TAILQ_HEAD(page_map_tailq, page_map);
 
 /* Operations performed on a page_map.  These are usually FS specific, which
  * get assigned when the inode is created.
@@ -58,6 +66,7 @@ struct page_map_operations {
 
 /* Page cache functions */
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
+void pm_destroy(struct page_map *pm);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
@@ -66,4 +75,13 @@ void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 int pm_remove_contig(struct page_map *pm, unsigned long index,
                      unsigned long nr_pgs);
+void pm_readahead(struct page_map *pm, unsigned long index,
+                  unsigned long nr_pgs);
+void pm_ra_update(struct page_map *pm, struct pm_ra *ra, unsigned long index,
+                  unsigned long nr_pgs, unsigned long nr_file_pgs);
 void print_page_map_info(struct page_map *pm);
+
+/* Page cache reclaim */
+void pm_reclaim_init(void);
+void pm_reclaim_kick(void);
+unsigned long pm_reclaim(unsigned long nr_pgs);
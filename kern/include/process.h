@@ -73,9 +73,8 @@ struct process_set {
 	struct proc **procs;
 };
 
-/* Can use a htable iterator to iterate through all active procs */
-extern struct hashtable *pid_hash;
-extern spinlock_t pid_hash_lock;
+/* Every active proc, keyed by pid.  Use chash_for_each() to iterate. */
+extern struct chashtable pid_hash;
 
 /* Initialization */
 void proc_init(void);
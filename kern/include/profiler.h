@@ -13,6 +13,8 @@ struct proc;
 struct file;
 struct cmdbuf;
 
+extern bool profiler_offcpu_enabled;
+
 int profiler_configure(struct cmdbuf *cb);
 void profiler_append_configure_usage(char *msgbuf, size_t buflen);
 void profiler_init(void);
@@ -24,6 +26,9 @@ void profiler_push_kernel_backtrace(uintptr_t *pc_list, size_t nr_pcs,
                                     uint64_t info);
 void profiler_push_user_backtrace(uintptr_t *pc_list, size_t nr_pcs,
                                   uint64_t info);
+void profiler_push_offcpu_backtrace(uintptr_t *kpcs, size_t nr_kpcs,
+                                    uintptr_t *upcs, size_t nr_upcs,
+                                    uint64_t start, uint64_t duration);
 void profiler_trace_data_flush(void);
 int profiler_size(void);
 int profiler_read(void *va, int n);
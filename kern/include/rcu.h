@@ -0,0 +1,49 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Read-copy-update.
+ *
+ * The kernel is not preemptive: a kthread runs until it blocks or returns, and
+ * routine kernel messages only run in between.  So once a core has run a
+ * routine KMSG, every RCU reader that was on that core has finished, as long
+ * as readers never block in their read-side critical sections.
+ * synchronize_rcu() waits for that to happen on every core.  rcu_read_lock()
+ * only has to keep the compiler from hoisting reads out of the section.
+ *
+ * Readers must not block (or do anything that could run a routine KMSG)
+ * between rcu_read_lock() and rcu_read_unlock().  IRQ handlers can be readers.
+ *
+ * call_rcu() doesn't block and can be called from any context.  Callbacks are
+ * batched and run from a ktask after a grace period, so they can block. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <atomic.h>
+
+#define __rcu
+
+struct rcu_head;
+typedef void (*rcu_callback_t)(struct rcu_head *head);
+
+struct rcu_head {
+	struct rcu_head				*next;
+	rcu_callback_t				func;
+};
+
+#define rcu_read_lock() cmb()
+#define rcu_read_unlock() cmb()
+/* Dependent loads are ordered on every arch we support */
+#define rcu_dereference(x) ACCESS_ONCE(x)
+#define rcu_dereference_protected(x, y) (x)
+/* Initialize the object before publishing the pointer to it */
+#define rcu_assign_pointer(dst, src)                                           \
+({                                                                             \
+	wmb();                                                                     \
+	ACCESS_ONCE(dst) = (src);                                                  \
+})
+#define RCU_INIT_POINTER(dst, src) (dst) = (src)
+
+void rcu_init(void);
+void synchronize_rcu(void);
+void call_rcu(struct rcu_head *head, rcu_callback_t func);
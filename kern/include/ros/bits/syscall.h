@@ -25,7 +25,6 @@
 #define SYS_mprotect				20
 /* // these are the other mmap related calls, some of which we'll implement
 #define SYS_mincore // can read page tables instead
-#define SYS_madvise
 #define SYS_mlock
 #define SYS_msync
 */
@@ -47,6 +46,9 @@
 #define SYS_nanosleep				36
 #define SYS_pop_ctx					37
 #define SYS_vmm_poke_guest			38
+#define SYS_sysring_setup			39
+#define SYS_sysring_enter			40
+#define SYS_madvise					41
 
 /* FS Syscalls */
 #define SYS_read				100
@@ -77,6 +79,11 @@
 #define SYS_fchdir				124
 #define SYS_dup_fds_to			125
 #define SYS_tap_fds				126
+#define SYS_readv				127
+#define SYS_writev				128
+#define SYS_preadv				129
+#define SYS_pwritev				130
+#define SYS_sendfile			131
 
 /* Misc syscalls */
 /* was #define SYS_gettimeofday	140 */
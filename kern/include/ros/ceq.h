@@ -49,6 +49,11 @@ struct ceq_event {
 };
 
 /* The events array and the ring buffer are provided by the consumer.
+ *
+ * The consumer can grow the events array.  It publishes the new events pointer
+ * before the new nr_events, so the producer must read them in the opposite
+ * order.  The producer might still post to an old array for a little while, so
+ * the consumer keeps the old arrays around (u_retired) and checks them too.
  *
  * Ring values are -1 for "unconsumed" and an index into *events otherwise.
  *
@@ -78,4 +83,5 @@ struct ceq {
 	atomic_t					cons_pub_idx;	/* how far has been consumed */
 	atomic_t					cons_pvt_idx;	/* next cons slot to get */
 	uint32_t					u_lock[2];		/* user space lock */
+	void						*u_retired;		/* user space, old events */
 };
@@ -0,0 +1,62 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Binary format of a conversation's info file, e.g. /net/tcp/5/info.
+ *
+ * A read returns one struct conv_info, a snapshot of the conversation.  It's
+ * meant for monitoring tools that poll many conversations, so the kernel fills
+ * it in without parsing or printing anything.  Check version and size: newer
+ * kernels may add fields at the end.
+ *
+ * The queue fields are in bytes: *_len is what's queued, and *_window is how
+ * much more the queue will take before it is full.  The rest of the fields are
+ * TCP's, and are 0 for other protocols.  Addresses are IPv6, with IPv4
+ * addresses in the v4-mapped form, and ports are in host order. */
+
+#pragma once
+
+#include <sys/types.h>
+
+#define CONV_INFO_VERSION		1
+
+/* TCP states, in proto_state */
+enum {
+	CONV_TCP_CLOSED,
+	CONV_TCP_LISTEN,
+	CONV_TCP_SYN_SENT,
+	CONV_TCP_SYN_RECEIVED,
+	CONV_TCP_ESTABLISHED,
+	CONV_TCP_FINWAIT1,
+	CONV_TCP_FINWAIT2,
+	CONV_TCP_CLOSE_WAIT,
+	CONV_TCP_CLOSING,
+	CONV_TCP_LAST_ACK,
+	CONV_TCP_TIME_WAIT,
+};
+
+struct conv_info {
+	uint32_t version;
+	uint32_t size;
+	uint32_t proto_state;
+	uint16_t lport;
+	uint16_t rport;
+	uint8_t laddr[16];
+	uint8_t raddr[16];
+	uint32_t rq_len;
+	uint32_t rq_window;
+	uint32_t wq_len;
+	uint32_t wq_window;
+	/* TCP */
+	uint32_t srtt_us;			/* smoothed round trip time */
+	uint32_t rttvar_us;			/* its mean deviation */
+	uint32_t rto_ms;			/* retransmit timeout */
+	uint32_t mss;
+	uint32_t cwnd;				/* congestion window, bytes */
+	uint32_t ssthresh;
+	uint32_t snd_wnd;			/* peer's receive window */
+	uint32_t rcv_wnd;			/* our receive window */
+	uint32_t bytes_in_flight;	/* sent, not yet acked */
+	uint32_t retransmits;		/* segments resent, over the conversation */
+	uint32_t backoff;			/* timeouts in a row */
+	uint32_t dupacks;
+} __attribute__((packed));
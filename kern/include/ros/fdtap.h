@@ -11,6 +11,10 @@
 #define FDTAP_CMD_ADD 			1
 #define FDTAP_CMD_REM 			2
 #define FDTAP_CMD_MOD 			3
+/* Fires the tap right away for any of its filters that are currently true,
+ * e.g. READABLE if there is data queued.  Used to re-arm level-triggered
+ * watchers.  Devices that can't tell return an error. */
+#define FDTAP_CMD_POLL			4
 
 /* FD Tap Event/Filter types.  These are somewhat a mix of kqueue and epoll
  * filters and are in flux.  For instance, we don't support things like
@@ -33,7 +37,11 @@
 /* When an event on FD matches filter, that event will be sent to ev_q with
  * ev_id, with an optional data blob passed back.  The specifics will depend on
  * the type of ev_q used.  For a CEQ, the event will coalesce, and the data will
- * be a 'last write wins'. */
+ * be a 'last write wins'.
+ *
+ * An FD can have several taps, so long as each has a different {ev_q, ev_id}.
+ * REM and POLL find the tap by that pair.  A REM with ev_q == 0 removes all of
+ * the FD's taps. */
 struct fd_tap_req {
 	int							fd;
 	int							cmd;
@@ -47,3 +47,19 @@ struct proftype_new_process {
 	uint32_t pid;
 	uint8_t path[0];
 } __attribute__((packed));
+
+#define PROFTYPE_OFFCPU_TRACE64	5
+
+/* A kthread was blocked (off-CPU) for duration nsec, starting at tstamp.  The
+ * first num_kern_traces PCs are where it blocked in the kernel, and the next
+ * num_user_traces PCs are the user code it was working for, if any. */
+struct proftype_offcpu_trace64 {
+	uint64_t info;
+	uint64_t tstamp;
+	uint64_t duration;
+	uint32_t pid;
+	uint16_t cpu;
+	uint16_t num_kern_traces;
+	uint16_t num_user_traces;
+	uint64_t trace[0];
+} __attribute__((packed));
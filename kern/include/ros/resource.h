@@ -19,6 +19,7 @@
 /* Flags */
 #define REQ_ASYNC			0x01 // Sync by default (?)
 #define REQ_SOFT			0x02 // just making something up
+#define REQ_SMT_SIBLINGS	0x04 // OK to get both hyperthreads of a core
 
 struct resource_req {
 	unsigned long				amt_wanted;
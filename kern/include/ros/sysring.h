@@ -0,0 +1,59 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Syscall submission ring, shared between a process and the kernel.
+ *
+ * Userspace fills in struct syscalls (the same ones used for normal async
+ * syscalls), writes pointers to them into sqes[], and bumps sq_tail.  The
+ * kernel consumes entries from sq_head to sq_tail, either when the process
+ * traps with SYS_sysring_enter (many syscalls per trap) or, for SYSRING_SQPOLL
+ * rings, when a dedicated kernel poller core notices the new tail (no trap at
+ * all).
+ *
+ * There is no completion ring.  Completion is the normal async syscall path:
+ * SC_DONE is set in the syscall's flags, and if the syscall has an ev_q, an
+ * EV_SYSCALL event is posted to it.  If a syscall does not have an ev_q and
+ * the ring has one, the kernel uses the ring's ev_q.  Point that at a CEQ or
+ * UCQ to get completions in bulk.
+ *
+ * Syscalls from a ring are run in their own kernel contexts, so a blocking
+ * syscall does not hold up the ones behind it.  Completion order is not
+ * submission order.  Syscalls that change the calling context (exec, fork,
+ * yield, etc.) fail with EINVAL when submitted through a ring.
+ *
+ * nr_entries must be a power of two.  The kernel does not trust sq_tail: if
+ * it is more than nr_entries ahead of sq_head, only nr_entries are consumed.
+ * sq_head and sr_flags are written by the kernel only. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/atomic.h>
+
+#define SYSRING_MAX_ENTRIES		4096
+
+/* Flags for SYS_sysring_setup */
+#define SYSRING_SQPOLL			0x01	/* kernel poller consumes the SQ */
+
+/* Bits in sr_flags, set by the kernel */
+#define SYSRING_NEED_WAKEUP		0x01	/* poller is asleep, sysring_enter */
+
+struct event_queue;
+struct syscall;
+
+struct sysring {
+	/* Written by userspace */
+	unsigned int				sq_tail;
+	unsigned int				nr_entries;
+	struct event_queue			*ev_q;
+	int							u_flags;	/* ignored by the kernel */
+	/* Written by the kernel */
+	unsigned int				sq_head;
+	atomic_t					sr_flags;
+	struct syscall				*sqes[];
+};
+
+static inline size_t sysring_size(unsigned int nr_entries)
+{
+	return sizeof(struct sysring) + nr_entries * sizeof(struct syscall*);
+}
@@ -0,0 +1,128 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Binary format of the syscall trace, read from /proc/PID/strace.
+ *
+ * Each read returns one or more whole systrace_records; reads smaller than a
+ * record fail.  A traced syscall produces an ENTRY record when it starts and an
+ * EXIT record when it finishes, both with the syscall's number and args.  The
+ * EXIT record has the retval and both timestamps.  Writes to the strace file
+ * become MARKER records, with the written bytes (truncated) in data.
+ *
+ * Records are buffered per core, so records from different cores can come out
+ * of order.  Sort by timestamp if that matters.  Timestamps are in TSC ticks;
+ * see procinfo's tsc_freq. */
+
+#pragma once
+
+#include <sys/types.h>
+#include <ros/bits/syscall.h>
+
+#define SYSTR_RECORD_SZ			256
+#define SYSTR_DATA_SZ			162
+
+enum {
+	SYSTR_ENTRY = 1,
+	SYSTR_EXIT,
+	SYSTR_MARKER,
+};
+
+struct systrace_record {
+	uint64_t start_timestamp;
+	uint64_t end_timestamp;
+	uint64_t syscallno;
+	uint64_t arg0;
+	uint64_t arg1;
+	uint64_t arg2;
+	uint64_t arg3;
+	uint64_t arg4;
+	uint64_t arg5;
+	uint64_t retval;
+	uint32_t pid;
+	uint32_t coreid;
+	uint32_t vcoreid;
+	uint8_t type;
+	uint8_t datalen;
+	uint8_t data[SYSTR_DATA_SZ];
+} __attribute__((packed));
+
+/* Syscall names, indexed by number, as an array initializer.  The kernel's
+ * syscall_name() and strace both use this, so they can't disagree. */
+#define SYSTRACE_SYSC_NAMES { \
+	[SYS_null] = "null", \
+	[SYS_block] = "block", \
+	[SYS_cache_buster] = "buster", \
+	[SYS_cache_invalidate] = "wbinv", \
+	[SYS_reboot] = "reboot!", \
+	[SYS_getpcoreid] = "getpcoreid", \
+	[SYS_getvcoreid] = "getvcoreid", \
+	[SYS_proc_create] = "proc_create", \
+	[SYS_proc_run] = "proc_run", \
+	[SYS_proc_destroy] = "proc_destroy", \
+	[SYS_yield] = "proc_yield", \
+	[SYS_change_vcore] = "change_vcore", \
+	[SYS_fork] = "fork", \
+	[SYS_exec] = "exec", \
+	[SYS_waitpid] = "waitpid", \
+	[SYS_mmap] = "mmap", \
+	[SYS_munmap] = "munmap", \
+	[SYS_mprotect] = "mprotect", \
+	[SYS_madvise] = "madvise", \
+	[SYS_shared_page_alloc] = "pa", \
+	[SYS_shared_page_free] = "pf", \
+	[SYS_provision] = "provision", \
+	[SYS_notify] = "notify", \
+	[SYS_self_notify] = "self_notify", \
+	[SYS_vc_entry] = "vc_entry", \
+	[SYS_halt_core] = "halt_core", \
+	[SYS_init_arsc] = "init_arsc", \
+	[SYS_change_to_m] = "change_to_m", \
+	[SYS_vmm_setup] = "vmm_setup", \
+	[SYS_vmm_poke_guest] = "vmm_poke_guest", \
+	[SYS_poke_ksched] = "poke_ksched", \
+	[SYS_abort_sysc] = "abort_sysc", \
+	[SYS_abort_sysc_fd] = "abort_sysc_fd", \
+	[SYS_populate_va] = "populate_va", \
+	[SYS_nanosleep] = "nanosleep", \
+	[SYS_pop_ctx] = "pop_ctx", \
+	[SYS_sysring_setup] = "sysring_setup", \
+	[SYS_sysring_enter] = "sysring_enter", \
+	[SYS_read] = "read", \
+	[SYS_write] = "write", \
+	[SYS_openat] = "openat", \
+	[SYS_close] = "close", \
+	[SYS_fstat] = "fstat", \
+	[SYS_stat] = "stat", \
+	[SYS_lstat] = "lstat", \
+	[SYS_fcntl] = "fcntl", \
+	[SYS_access] = "access", \
+	[SYS_umask] = "umask", \
+	[SYS_llseek] = "llseek", \
+	[SYS_link] = "link", \
+	[SYS_unlink] = "unlink", \
+	[SYS_symlink] = "symlink", \
+	[SYS_readlink] = "readlink", \
+	[SYS_chdir] = "chdir", \
+	[SYS_fchdir] = "fchdir", \
+	[SYS_getcwd] = "getcwd", \
+	[SYS_mkdir] = "mkdir", \
+	[SYS_rmdir] = "rmdir", \
+	[SYS_tcgetattr] = "tcgetattr", \
+	[SYS_tcsetattr] = "tcsetattr", \
+	[SYS_setuid] = "setuid", \
+	[SYS_setgid] = "setgid", \
+	[SYS_nbind] = "nbind", \
+	[SYS_nmount] = "nmount", \
+	[SYS_nunmount] = "nunmount", \
+	[SYS_fd2path] = "fd2path", \
+	[SYS_wstat] = "wstat", \
+	[SYS_fwstat] = "fwstat", \
+	[SYS_rename] = "rename", \
+	[SYS_dup_fds_to] = "dup_fds_to", \
+	[SYS_tap_fds] = "tap_fds", \
+	[SYS_readv] = "readv", \
+	[SYS_writev] = "writev", \
+	[SYS_preadv] = "preadv", \
+	[SYS_pwritev] = "pwritev", \
+	[SYS_sendfile] = "sendfile", \
+}
@@ -0,0 +1,41 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Binary format of the tracepoint stream, read from #trace/data.
+ *
+ * The stream starts with a tp_stream_hdr, followed by desc_len bytes of event
+ * descriptions (the same text as #trace/events), followed by the records.  The
+ * descriptions are one line per event:
+ *
+ * 	id kind name field0 field1 ...
+ *
+ * where kind is "i" (instant), "b" (begin), or "e" (end).  A begin and its end
+ * have the same name other than an _enter / _exit suffix, and the same pid and
+ * args[0].  A record's args are named by its event's fields, in order.
+ *
+ * Records are grouped by core, and are in time order within a core. */
+
+#pragma once
+
+#include <sys/types.h>
+
+#define TP_STREAM_MAGIC			0x5452414b	/* "KART" */
+#define TP_STREAM_VERSION		1
+#define TP_NR_ARGS				4
+
+struct tp_stream_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_sz;
+	uint64_t tsc_freq;
+	uint32_t nr_cores;
+	uint32_t desc_len;
+} __attribute__((packed));
+
+struct tp_record {
+	uint64_t tsc;
+	uint16_t id;
+	uint16_t coreid;
+	uint32_t pid;
+	uint64_t args[TP_NR_ARGS];
+} __attribute__((packed));
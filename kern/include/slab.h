@@ -38,6 +38,9 @@
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+/* Cache flags */
+#define KMC_NOTRACK		0x0001	/* kmemtrack: the cache's user does its own */
+
 struct kmem_slab;
 
 /* Control block for buffers for large-object slabs */
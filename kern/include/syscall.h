@@ -7,6 +7,10 @@
 #include <process.h>
 #include <kref.h>
 #include <ns.h>
+#include <rendez.h>
+#include <bitmask.h>
+#include <ros/bcq_struct.h>
+#include <ros/systrace.h>
 
 #define SYSTRACE_ON					0x01
 #define SYSTRACE_LOUD				0x02
@@ -18,54 +22,50 @@
 
 #define MAX_ASRC_BATCH				10
 
-#define SYSTR_RECORD_SZ				256
-#define SYSTR_BUF_SZ 				PGSIZE
-#define SYSTR_PRETTY_BUF_SZ			(SYSTR_BUF_SZ -                            \
-                                     sizeof(struct systrace_record))
-struct systrace_record {
-	struct systrace_record_anon {
-		uint64_t		start_timestamp, end_timestamp;
-		uintreg_t		syscallno;
-		uintreg_t		arg0;
-		uintreg_t		arg1;
-		uintreg_t		arg2;
-		uintreg_t		arg3;
-		uintreg_t		arg4;
-		uintreg_t		arg5;
-		uintreg_t		retval;
-		int				pid;
-		uint32_t		coreid;
-		uint32_t		vcoreid;
-		char			*pretty_buf;
-		uint8_t			datalen;
-	};
-	uint8_t			data[SYSTR_RECORD_SZ - sizeof(struct systrace_record_anon)];
-};
+/* Records per core in an strace's rings.  Must be a power of two. */
+#define SYSTR_RING_SZ				128
+#define SYSTR_MAX_SYSC				256
+#define SYSTR_MAX_PIDS				8
+
+DEFINE_BCQ_TYPES(systrace, struct systrace_record, SYSTR_RING_SZ);
 
 struct strace {
 	bool tracing;
 	bool inherit;
 	atomic_t nr_drops;
 	unsigned long appx_nr_sysc;
-	struct kref procs; /* when procs goes to zero, q is hung up. */
-	struct kref users; /* when users goes to zero, q and struct are freed. */
-	struct queue *q;
+	struct kref procs; /* when procs goes to zero, the rings are hung up. */
+	struct kref users; /* when users goes to zero, rings and struct are freed */
+	struct systrace_bcq *rings;	/* one per core, written by that core */
+	struct rendez rv;
+	atomic_t nr_readers_waiting;
+	bool hungup;
+	char hangup_msg[64];
+	/* Filters, set from the proc's ctl.  No filter means trace everything. */
+	bool sysc_filtered;
+	DECL_BITMASK(sysc_filter, SYSTR_MAX_SYSC);
+	int nr_pids;
+	pid_t pids[SYSTR_MAX_PIDS];
 };
 
 extern bool systrace_loud;
+long systrace_read(struct strace *s, void *va, long n);
+void systrace_write_marker(struct strace *s, void *va, long n);
+void systrace_hangup(struct strace *s);
 
 /* Syscall table */
 typedef intreg_t (*syscall_t)(struct proc *, uintreg_t, uintreg_t, uintreg_t,
                               uintreg_t, uintreg_t, uintreg_t);
 struct sys_table_entry {
 	syscall_t call;
-	char *name;
 };
 extern const struct sys_table_entry syscall_table[];
 extern const int max_syscall;
+const char *syscall_name(unsigned long num);
 /* Syscall invocation */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_calls);
 void run_local_syscall(struct syscall *sysc);
+void queue_syscall(struct proc *p, struct syscall *sysc);
 intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
                  uintreg_t a2, uintreg_t a3, uintreg_t a4, uintreg_t a5);
 void set_errno(int errno);
@@ -0,0 +1,36 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Kernel side of the syscall submission ring.  See ros/sysring.h. */
+
+#pragma once
+
+#include <ros/sysring.h>
+#include <process.h>
+#include <kthread.h>
+#include <kref.h>
+
+struct sysring_poller;
+
+struct sysring_ctx {
+	struct kref					kref;		/* p->sysring and poller passes */
+	qlock_t						qlock;		/* protects sq_head and dead */
+	bool						dead;		/* ring is gone, don't touch */
+	struct proc					*proc;		/* weak ref, o/w when polled */
+	struct sysring				*ring;		/* user address */
+	struct event_queue			*ev_q;		/* user's default ev_q */
+	unsigned int				nr_entries;
+	unsigned int				sq_head;	/* our copy, don't trust theirs */
+	int							flags;
+	struct sysring_poller		*poller;
+	TAILQ_ENTRY(sysring_ctx)	link;		/* on the poller's list */
+	TAILQ_ENTRY(sysring_ctx)	pass_link;	/* poller-private */
+};
+TAILQ_HEAD(sysring_ctx_tailq, sysring_ctx);
+
+void sysring_init(void);
+void sysring_proc_destroy(struct proc *p);
+void sysring_proc_exec(struct proc *p);
+void sysring_proc_free(struct proc *p);
+int sys_sysring_setup(struct proc *p, struct sysring *ring, int flags);
+int sys_sysring_enter(struct proc *p, unsigned int to_submit);
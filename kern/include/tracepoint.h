@@ -0,0 +1,84 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Static tracepoints.
+ *
+ * Events are declared at compile time in TRACEPOINTS, below, each with a kind
+ * and the names of its (up to TP_NR_ARGS) u64 fields.  Code fires one with:
+ *
+ * 	tracepoint(syscall_enter, (uintptr_t)sysc, sysc->num, ...);
+ *
+ * Passing more args than TP_NR_ARGS is a compile error; missing ones are 0.
+ *
+ * Every event starts out disabled, and is turned on and off at runtime through
+ * #trace/ctl.  We don't patch code, so a disabled tracepoint costs a load and a
+ * not-taken branch.  Enabled events are written to per-core overwriting
+ * trace_rings, with IRQs off, so writers never lock or share cache lines.  The
+ * rings are allocated the first time anything is enabled.
+ *
+ * #trace/data is a snapshot of the rings in the binary format in
+ * ros/tracepoint.h.  scripts/trace2json.py turns that into Chrome / Perfetto
+ * JSON. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/tracepoint.h>
+#include <compiler.h>
+
+enum {
+	TP_INSTANT,
+	TP_BEGIN,
+	TP_END,
+};
+
+/* TP(name, kind, fields) */
+#define TRACEPOINTS(TP)                                                        \
+	TP(sched_proc_switch,		TP_INSTANT,	"prev_pid next_pid")               \
+	TP(sched_kthread_restart,	TP_INSTANT,	"kthread sysc")                    \
+	TP(sched_idle,				TP_INSTANT,	"")                                \
+	TP(syscall_enter,			TP_BEGIN,	"sysc num arg0 arg1")              \
+	TP(syscall_exit,			TP_END,		"sysc num retval err")             \
+	TP(page_fault_enter,		TP_BEGIN,	"va prot")                         \
+	TP(page_fault_exit,			TP_END,		"va ret")                          \
+	TP(irq_enter,				TP_BEGIN,	"vector")                          \
+	TP(irq_exit,				TP_END,		"vector")                          \
+	TP(net_rx,					TP_INSTANT,	"ether len")                       \
+	TP(net_tx,					TP_INSTANT,	"ether len")
+
+#define __TP_ENUM(name, kind, fields) TP_##name,
+enum {
+	TRACEPOINTS(__TP_ENUM)
+	TP_NR_EVENTS
+};
+#undef __TP_ENUM
+
+struct tp_desc {
+	const char					*name;
+	int							kind;
+	const char					*fields;
+};
+
+#ifdef CONFIG_TRACEPOINTS
+
+extern const struct tp_desc tp_descs[TP_NR_EVENTS];
+extern bool tp_enabled[TP_NR_EVENTS];
+
+#define tracepoint(name, ...)                                                  \
+do {                                                                           \
+	if (unlikely(tp_enabled[TP_##name]))                                       \
+		__tracepoint(TP_##name, (uint64_t[TP_NR_ARGS]){__VA_ARGS__});         \
+} while (0)
+
+void __tracepoint(int id, uint64_t *args);
+int tp_lookup(const char *name);
+void tp_set_enabled(int id, bool on);
+void tp_reset(void);
+char *tp_describe(size_t *len);
+void *tp_snapshot(size_t *len);
+
+#else
+
+#define tracepoint(name, ...) do {} while (0)
+
+#endif /* CONFIG_TRACEPOINTS */
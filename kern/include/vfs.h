@@ -24,10 +24,12 @@
 #include <pagemap.h>
 #include <blockdev.h>
 #include <fdtap.h>
+#include <rcu.h>
 
 /* ghetto preprocessor hacks (since proc includes vfs) */
 struct page;
 struct vm_region;
+struct block;
 
 // TODO: temp typedefs, etc.  remove when we support this stuff.
 typedef int dev_t;
@@ -134,8 +136,8 @@ struct super_block {
 	struct file_tailq			s_files;		/* assigned files */
 	struct dentry_tailq			s_lru_d;		/* unused dentries (in dcache)*/
 	spinlock_t					s_lru_lock;
-	struct hashtable			*s_dcache;		/* dentry cache */
-	spinlock_t					s_dcache_lock;
+	struct dentry				**s_dcache;		/* dentry cache, RCU buckets */
+	spinlock_t					s_dcache_lock;	/* for dcache writers */
 	struct hashtable			*s_icache;		/* inode cache */
 	spinlock_t					s_icache_lock;
 	struct block_device			*s_bdev;
@@ -227,6 +229,10 @@ struct inode_operations {
 #define DENTRY_USED			0x01 	/* has a kref > 0 */
 #define DENTRY_NEGATIVE		0x02	/* cache of a failed lookup */
 #define DENTRY_DYING		0x04	/* should be freed on release */
+#define DENTRY_RCU			0x08	/* was in the dcache, RCU readers may see it */
+
+/* Number of dcache hash buckets per SB */
+#define DCACHE_NR_BUCKETS	1024
 
 /* Dentry: in memory object, corresponding to an element of a path.  E.g. /,
  * usr, bin, and vim are all dentries.  All have inodes.  Vim happens to be a
@@ -253,6 +259,8 @@ struct dentry {
 	struct qstr					d_name;			/* pts to iname and holds hash*/
 	char						d_iname[DNAME_INLINE_LEN];
 	void						*d_fs_info;
+	struct dentry				*d_hash_next;	/* dcache bucket chain */
+	struct rcu_head				d_rcu;
 };
 
 /* Checks is a struct dentry pointer if the root.
@@ -292,6 +300,7 @@ struct file {
 	spinlock_t					f_ep_lock;
 	void						*f_privdata;	/* tty/socket driver hook */
 	struct page_map				*f_mapping;		/* page cache mapping */
+	struct pm_ra				f_ra;			/* readahead state */
 
 	/* Ghetto appserver support */
 	int fd; // all it contains is an appserver fd (for pid 0, aka kernel)
@@ -387,7 +396,7 @@ struct file_desc {
 	struct file					*fd_file;
 	struct chan					*fd_chan;
 	unsigned int				fd_flags;
-	struct fd_tap				*fd_tap;
+	struct fd_tap				*fd_tap;	/* list, via fd_next */
 };
 
 /* All open files for a process */
@@ -484,8 +493,15 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
                           off64_t *offset);
 ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
                            off64_t *offset);
+ssize_t generic_file_bread(struct file *file, struct block **bpp, size_t count,
+                           off64_t offset);
+ssize_t generic_file_readv(struct file *file, const struct iovec *vector,
+                           unsigned long count, off64_t *offset);
+ssize_t generic_file_writev(struct file *file, const struct iovec *vector,
+                            unsigned long count, off64_t *offset);
 ssize_t generic_dir_read(struct file *file, char *u_buf, size_t count,
                          off64_t *offset);
+int file_advise(struct file *file, off64_t offset, off64_t len, int advice);
 struct file *alloc_file(void);
 struct file *do_file_open(char *path, int flags, int mode);
 int do_symlink(char *path, const char *symname, int mode);
@@ -10,6 +10,7 @@
 #include <smp.h>
 #include <kmalloc.h>
 #include <kdebug.h>
+#include <lockstat.h>
 
 static void increase_lock_depth(uint32_t coreid)
 {
@@ -38,21 +39,41 @@ static bool can_trace(spinlock_t *lock)
 	return TRUE;
 }
 
-/* spinlock and trylock call this after locking */
-static void post_lock(spinlock_t *lock, uint32_t coreid)
+/* spinlock and trylock call this after locking.  pc is their caller. */
+static void post_lock(spinlock_t *lock, uint32_t coreid, uintptr_t pc)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
 	if ((pcpui->__lock_checking_enabled == 1) && can_trace(lock))
 		pcpui_trace_locks(pcpui, lock);
-	lock->call_site = get_caller_pc();
+	lock->call_site = pc;
 	lock->calling_core = coreid;
 	/* TODO consider merging this with __ctx_depth (unused field) */
 	increase_lock_depth(lock->calling_core);
+#ifdef CONFIG_LOCKSTAT
+	lock->lockstat_tsc = read_tsc();
+#endif
 }
 
+#ifdef CONFIG_LOCKSTAT
+/* Locks, noting whether we had to spin and for how long. */
+static void __spin_lock_stat(spinlock_t *lock, uintptr_t pc)
+{
+	uint64_t start;
+
+	if (__spin_trylock(lock)) {
+		lockstat_acquired(LOCKSTAT_SPIN, pc, FALSE, 0);
+		return;
+	}
+	start = read_tsc();
+	__spin_lock(lock);
+	lockstat_acquired(LOCKSTAT_SPIN, pc, TRUE, read_tsc() - start);
+}
+#endif
+
 void spin_lock(spinlock_t *lock)
 {
 	uint32_t coreid = core_id_early();
+	uintptr_t pc = get_caller_pc();
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
 	/* Short circuit our lock checking, so we can print or do other things to
 	 * announce the failure that require locks.  Also avoids anything else
@@ -75,9 +96,13 @@ void spin_lock(spinlock_t *lock)
 		}
 	}
 lock:
+#ifdef CONFIG_LOCKSTAT
+	__spin_lock_stat(lock, pc);
+#else
 	__spin_lock(lock);
+#endif
 	/* Memory barriers are handled by the particular arches */
-	post_lock(lock, coreid);
+	post_lock(lock, coreid, pc);
 }
 
 /* Trylock doesn't check for irq/noirq, in case we want to try and lock a
@@ -86,14 +111,22 @@ bool spin_trylock(spinlock_t *lock)
 {
 	uint32_t coreid = core_id_early();
 	bool ret = __spin_trylock(lock);
-	if (ret)
-		post_lock(lock, coreid);
+	if (ret) {
+#ifdef CONFIG_LOCKSTAT
+		lockstat_acquired(LOCKSTAT_SPIN, get_caller_pc(), FALSE, 0);
+#endif
+		post_lock(lock, coreid, get_caller_pc());
+	}
 	return ret;
 }
 
 void spin_unlock(spinlock_t *lock)
 {
 	decrease_lock_depth(lock->calling_core);
+#ifdef CONFIG_LOCKSTAT
+	lockstat_released(LOCKSTAT_SPIN, lock->call_site,
+	                  read_tsc() - lock->lockstat_tsc);
+#endif
 	/* Memory barriers are handled by the particular arches */
 	assert(spin_locked(lock));
 	__spin_unlock(lock);
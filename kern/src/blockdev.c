@@ -10,13 +10,13 @@
 #include <slab.h>
 #include <page_alloc.h>
 #include <pmap.h>
-/* These two are needed for the fake interrupt */
-#include <alarm.h>
 #include <smp.h>
 
 struct file_operations block_f_op;
 struct page_map_operations block_pm_op;
 struct kmem_cache *breq_kcache;
+static struct kmem_cache *bdev_io_kcache;
+static atomic_t next_bdev_id;
 
 void block_init(void)
 {
@@ -24,31 +24,90 @@ void block_init(void)
 	                                __alignof__(struct block_request), 0, 0, 0);
 	bh_kcache = kmem_cache_create("buffer_heads", sizeof(struct buffer_head),
 	                              __alignof__(struct buffer_head), 0, 0, 0);
+	bdev_io_kcache = kmem_cache_create("bdev_ios", sizeof(struct bdev_io),
+	                                   __alignof__(struct bdev_io), 0, 0, 0);
 
 	#ifdef CONFIG_EXT2FS
 	/* Now probe for and init the block device for the ext2 ram disk */
 	extern uint8_t _binary_mnt_ext2fs_img_size[];
 	extern uint8_t _binary_mnt_ext2fs_img_start[];
 	/* Build and init the block device */
-	struct block_device *ram_bd = kmalloc(sizeof(struct block_device), 0);
-	memset(ram_bd, 0, sizeof(struct block_device));
-	ram_bd->b_id = 31337;
-	ram_bd->b_sector_sz = 512;
-	ram_bd->b_nr_sector = (unsigned long)_binary_mnt_ext2fs_img_size / 512;
-	kref_init(&ram_bd->b_kref, fake_release, 1);
-	pm_init(&ram_bd->b_pm, &block_pm_op, ram_bd);
-	ram_bd->b_data = _binary_mnt_ext2fs_img_start;
-	strlcpy(ram_bd->b_name, "RAMDISK", BDEV_INLINE_NAME);
+	struct block_device *ram_bd;
+	ram_bd = make_ramdisk("RAMDISK", _binary_mnt_ext2fs_img_start,
+	                      (size_t)_binary_mnt_ext2fs_img_size);
 	/* Connect it to the file system */
-	struct file *ram_bf = make_device("/dev/ramdisk", S_IRUSR | S_IWUSR,
-	                                  __S_IFBLK, &block_f_op);
-	/* make sure the inode tracks the right pm (not it's internal one) */
-	ram_bf->f_dentry->d_inode->i_mapping = &ram_bd->b_pm;
-	ram_bf->f_dentry->d_inode->i_bdev = ram_bd;	/* this holds the bd kref */
-	kref_put(&ram_bf->f_kref);
+	bdev_make_device(ram_bd, "/dev/ramdisk");
 	#endif /* CONFIG_EXT2FS */
 }
 
+/* Makes a block device file for bdev at path, e.g. /dev/ramdisk, so it can be
+ * found with get_bdev() and mounted.  The file holds bdev's initial ref. */
+void bdev_make_device(struct block_device *bdev, char *path)
+{
+	struct file *bf = make_device(path, S_IRUSR | S_IWUSR, __S_IFBLK,
+	                              &block_f_op);
+
+	/* make sure the inode tracks the right pm (not it's internal one) */
+	bf->f_dentry->d_inode->i_mapping = &bdev->b_pm;
+	bf->f_dentry->d_inode->i_bdev = bdev;	/* this holds the bd kref */
+	kref_put(&bf->f_kref);
+}
+
+/* Sets up a block device for a driver.  The bdev starts with one ref, which
+ * never goes away (bdevs aren't freed yet).  Drivers can change b_max_inflight
+ * and b_max_sectors after this, before submitting any requests. */
+void bdev_init(struct block_device *bdev, char *name, unsigned int sector_sz,
+               unsigned long nr_sector, struct bdev_ops *ops, void *data)
+{
+	memset(bdev, 0, sizeof(struct block_device));
+	bdev->b_id = atomic_fetch_and_add(&next_bdev_id, 1);
+	bdev->b_sector_sz = sector_sz;
+	bdev->b_nr_sector = nr_sector;
+	kref_init(&bdev->b_kref, fake_release, 1);
+	pm_init(&bdev->b_pm, &block_pm_op, bdev);
+	bdev->b_data = data;
+	strlcpy(bdev->b_name, name, BDEV_INLINE_NAME);
+	bdev->b_ops = ops;
+	bdev->b_max_inflight = 1;
+	bdev->b_max_sectors = UINT32_MAX;
+	spinlock_init_irqsave(&bdev->b_lock);
+	TAILQ_INIT(&bdev->b_queue);
+}
+
+/* RAM disks: b_data is the disk.  IOs complete as soon as they start, so
+ * there's no limit on how many can be in flight. */
+static void ramdisk_start(struct block_device *bdev, struct bdev_io *io)
+{
+	void *disk = bdev->b_data + io->sector * bdev->b_sector_sz;
+	size_t len;
+
+	for (int i = 0; i < io->nr_segs; i++) {
+		len = io->segs[i].nr_sector * bdev->b_sector_sz;
+		if (io->flags & BREQ_READ)
+			memcpy(io->segs[i].buf, disk, len);
+		else
+			memcpy(disk, io->segs[i].buf, len);
+		disk += len;
+	}
+	bdev_io_done(io, 0);
+}
+
+static struct bdev_ops ramdisk_ops = {
+	.start = ramdisk_start,
+};
+
+/* Makes a block device out of size bytes of memory at data.  Good for the
+ * built-in ext2 image, and for testing the block layer. */
+struct block_device *make_ramdisk(char *name, void *data, size_t size)
+{
+	struct block_device *bdev = kmalloc(sizeof(struct block_device), MEM_WAIT);
+
+	bdev_init(bdev, name, SECTOR_SZ, size >> SECTOR_SZ_LOG, &ramdisk_ops,
+	          data);
+	bdev->b_max_inflight = UINT32_MAX;
+	return bdev;
+}
+
 /* Generic helper, returns a kref'd reference out of principle. */
 struct block_device *get_bdev(char *path)
 {
@@ -79,68 +138,190 @@ void free_bhs(struct page *page)
 	page->pg_private = 0;		/* catch bugs */
 }
 
-/* This ultimately will handle the actual request processing, all the way down
- * to the driver, and will deal with blocking.  For now, we just fulfill the
- * request right away (RAM based block devs). */
+/* Starts IOs from the queue until the driver is full.  Only one core
+ * dispatches at a time; anyone else who shows up (e.g. a completion from the
+ * driver's start(), for ramdisks) leaves it to the dispatcher, who rechecks
+ * the queue after every start(). */
+static void bdev_dispatch(struct block_device *bdev)
+{
+	struct bdev_io *io;
+
+	spin_lock_irqsave(&bdev->b_lock);
+	if (bdev->b_dispatching) {
+		spin_unlock_irqsave(&bdev->b_lock);
+		return;
+	}
+	bdev->b_dispatching = TRUE;
+	while ((bdev->b_nr_inflight < bdev->b_max_inflight) &&
+	       (io = TAILQ_FIRST(&bdev->b_queue))) {
+		TAILQ_REMOVE(&bdev->b_queue, io, link);
+		bdev->b_nr_inflight++;
+		bdev->b_nr_ios++;
+		spin_unlock_irqsave(&bdev->b_lock);
+		bdev->b_ops->start(bdev, io);
+		spin_lock_irqsave(&bdev->b_lock);
+	}
+	bdev->b_dispatching = FALSE;
+	spin_unlock_irqsave(&bdev->b_lock);
+}
+
+/* Helper: can we tack nr_sector more sectors and nr_segs more segs on to io? */
+static bool io_has_room(struct bdev_io *io, unsigned int nr_sector,
+                        unsigned int nr_segs)
+{
+	return (io->nr_segs + nr_segs <= BDEV_IO_MAX_SEGS) &&
+	       (io->nr_sector + nr_sector <= io->bdev->b_max_sectors);
+}
+
+/* Tries to merge io into a queued IO that it is adjacent to, on either end.
+ * Returns TRUE if it did, in which case io is no longer needed.  Caller holds
+ * the bdev lock. */
+static bool __bdev_merge_io(struct block_device *bdev, struct bdev_io *io)
+{
+	struct bdev_io *q_io;
+
+	TAILQ_FOREACH(q_io, &bdev->b_queue, link) {
+		if (q_io->flags != io->flags)
+			continue;
+		if (!io_has_room(q_io, io->nr_sector, io->nr_segs))
+			continue;
+		if (q_io->sector + q_io->nr_sector == io->sector) {
+			memcpy(&q_io->segs[q_io->nr_segs], io->segs,
+			       io->nr_segs * sizeof(struct bdev_seg));
+		} else if (io->sector + io->nr_sector == q_io->sector) {
+			memmove(&q_io->segs[io->nr_segs], q_io->segs,
+			        q_io->nr_segs * sizeof(struct bdev_seg));
+			memcpy(q_io->segs, io->segs, io->nr_segs * sizeof(struct bdev_seg));
+			q_io->sector = io->sector;
+		} else {
+			continue;
+		}
+		q_io->nr_segs += io->nr_segs;
+		q_io->nr_sector += io->nr_sector;
+		bdev->b_nr_merges++;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void bdev_queue_io(struct block_device *bdev, struct bdev_io *io)
+{
+	spin_lock_irqsave(&bdev->b_lock);
+	if (__bdev_merge_io(bdev, io)) {
+		spin_unlock_irqsave(&bdev->b_lock);
+		kmem_cache_free(bdev_io_kcache, io);
+		return;
+	}
+	TAILQ_INSERT_TAIL(&bdev->b_queue, io, link);
+	spin_unlock_irqsave(&bdev->b_lock);
+}
+
+static void breq_put_seg(struct block_request *breq)
+{
+	if (atomic_sub_and_test(&breq->nr_pending, 1) && breq->callback)
+		breq->callback(breq);
+}
+
+/* Adds bh to the IO being built for breq, starting a new IO if bh isn't right
+ * after the current one on the device.  Returns the IO being built. */
+static struct bdev_io *breq_add_bh(struct block_device *bdev,
+                                   struct block_request *breq,
+                                   struct bdev_io *io, struct buffer_head *bh)
+{
+	struct bdev_seg *seg;
+
+	if (io && (io->sector + io->nr_sector == bh->bh_sector) &&
+	    io_has_room(io, bh->bh_nr_sector, 0)) {
+		/* Contiguous in memory too (e.g. the blocks of a page) is one seg */
+		seg = &io->segs[io->nr_segs - 1];
+		if (seg->buf + seg->nr_sector * bdev->b_sector_sz == bh->bh_buffer) {
+			seg->nr_sector += bh->bh_nr_sector;
+			io->nr_sector += bh->bh_nr_sector;
+			return io;
+		}
+		if (io_has_room(io, bh->bh_nr_sector, 1))
+			goto new_seg;
+	}
+	if (io)
+		bdev_queue_io(bdev, io);
+	io = kmem_cache_alloc(bdev_io_kcache, MEM_WAIT);
+	io->bdev = bdev;
+	io->flags = breq->flags & (BREQ_READ | BREQ_WRITE);
+	io->sector = bh->bh_sector;
+	io->nr_sector = 0;
+	io->nr_segs = 0;
+	io->drv_data = 0;
+new_seg:
+	atomic_inc(&breq->nr_pending);
+	seg = &io->segs[io->nr_segs++];
+	seg->breq = breq;
+	seg->buf = bh->bh_buffer;
+	seg->nr_sector = bh->bh_nr_sector;
+	io->nr_sector += bh->bh_nr_sector;
+	return io;
+}
+
+/* Submits breq to the device's queue.  Runs of sector-adjacent BHs become
+ * single IOs, which may be merged with other IOs still in the queue.  The
+ * breq's callback runs once all of its IOs complete, possibly before this
+ * returns, and possibly from IRQ context.  breq->error is set if any of them
+ * failed.
+ *
+ * Returns -1 without submitting anything if the breq is bad. */
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
 {
-	void *src, *dst;
-	unsigned long first_sector;
-	unsigned int nr_sector;
+	struct bdev_io *io = 0;
 
+	if (!(breq->flags & (BREQ_READ | BREQ_WRITE)))
+		panic("Need a request type!\n");
 	for (int i = 0; i < breq->nr_bhs; i++) {
-		first_sector = breq->bhs[i]->bh_sector;
-		nr_sector = breq->bhs[i]->bh_nr_sector;
 		/* Sectors are indexed starting with 0, for now. */
-		if (first_sector + nr_sector > bdev->b_nr_sector) {
+		if (breq->bhs[i]->bh_sector + breq->bhs[i]->bh_nr_sector >
+		    bdev->b_nr_sector) {
 			warn("Exceeding the num sectors!");
 			return -1;
 		}
-		if (breq->flags & BREQ_READ) {
-			dst = breq->bhs[i]->bh_buffer;
-			src = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-		} else if (breq->flags & BREQ_WRITE) {
-			dst = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-			src = breq->bhs[i]->bh_buffer;
-		} else {
-			panic("Need a request type!\n");
-		}
-		memcpy(dst, src, nr_sector << SECTOR_SZ_LOG);
 	}
-	/* Faking the device interrupt with an alarm */
-	void breq_handler(struct alarm_waiter *waiter)
-	{
-		/* In the future, we'll need to figure out which breq this was in
-		 * response to */
-		struct block_request *breq = (struct block_request*)waiter->data;
-		if (breq->callback)
-			breq->callback(breq);
-		kfree(waiter);
-	}
-	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
-	struct alarm_waiter *waiter = kmalloc(sizeof(struct alarm_waiter), 0);
-	init_awaiter(waiter, breq_handler);
-	/* Stitch things up, so we know how to find things later */
-	waiter->data = breq;
-	/* Set for 5ms. */
-	set_awaiter_rel(waiter, 5000);
-	set_alarm(tchain, waiter);
+	breq->error = 0;
+	/* Our ref, so the callback doesn't run until we've queued everything */
+	atomic_set(&breq->nr_pending, 1);
+	for (int i = 0; i < breq->nr_bhs; i++)
+		io = breq_add_bh(bdev, breq, io, breq->bhs[i]);
+	if (io)
+		bdev_queue_io(bdev, io);
+	bdev_dispatch(bdev);
+	breq_put_seg(breq);
 	return 0;
 }
 
-/* Helper method, unblocks someone blocked on sleep_on_breq(). */
+/* Drivers call this when io is done, from any context.  error is 0 or an
+ * errno.  Completes any breqs that were waiting on io and starts more IOs. */
+void bdev_io_done(struct bdev_io *io, int error)
+{
+	struct block_device *bdev = io->bdev;
+
+	for (int i = 0; i < io->nr_segs; i++) {
+		if (error)
+			io->segs[i].breq->error = error;
+		breq_put_seg(io->segs[i].breq);
+	}
+	kmem_cache_free(bdev_io_kcache, io);
+	spin_lock_irqsave(&bdev->b_lock);
+	bdev->b_nr_inflight--;
+	spin_unlock_irqsave(&bdev->b_lock);
+	bdev_dispatch(bdev);
+}
+
+/* Helper method, unblocks someone blocked on sleep_on_breq().  The breq might
+ * finish before its submitter gets around to sleeping (ramdisks always do),
+ * which is fine, since the sem keeps the signal. */
 void generic_breq_done(struct block_request *breq)
 {
 	int8_t irq_state = 0;
-	if (!sem_up_irqsave(&breq->sem, &irq_state)) {
-		/* This shouldn't happen anymore.  Let brho know if it does. */
-		warn("[kernel] no one waiting on breq %p", breq);
-	}
+	sem_up_irqsave(&breq->sem, &irq_state);
 }
 
-/* Helper, pairs with generic_breq_done().  Note we sleep here on a semaphore
- * instead of faking it with an alarm.  Ideally, this code will be the same even
- * for real block devices (that don't fake things with timer interrupts). */
+/* Helper, pairs with generic_breq_done(). */
 void sleep_on_breq(struct block_request *breq)
 {
 	int8_t irq_state = 0;
@@ -278,9 +459,62 @@ void bdev_put_buffer(struct buffer_head *bh)
 	pm_put_page(bh->bh_page);
 }
 
+/* Writes the page's BHs back to their bdev, all of them or just the dirty
+ * ones, and waits for the IO.  Returns 0 on success. */
+int bdev_write_bhs(struct page *page, bool only_dirty)
+{
+	struct buffer_head *bh;
+	struct block_request *breq;
+	struct block_device *bdev = 0;
+	int error;
+
+	if (!(atomic_read(&page->pg_flags) & PG_BUFFER))
+		return 0;
+	breq = kmem_cache_alloc(breq_kcache, 0);
+	if (!breq)
+		return -ENOMEM;
+	breq->flags = BREQ_WRITE;
+	breq->callback = generic_breq_done;
+	breq->data = 0;
+	sem_init_irqsave(&breq->sem, 0);
+	breq->bhs = breq->local_bhs;
+	breq->nr_bhs = 0;
+	for (bh = page->pg_private; bh; bh = bh->bh_next) {
+		if (only_dirty && !(bh->bh_flags & BH_DIRTY))
+			continue;
+		/* TODO: race on flag modification, like bdev_dirty_buffer() */
+		bh->bh_flags &= ~BH_DIRTY;
+		breq->bhs[breq->nr_bhs++] = bh;
+		bdev = bh->bh_bdev;
+	}
+	if (!breq->nr_bhs) {
+		kmem_cache_free(breq_kcache, breq);
+		return 0;
+	}
+	error = bdev_submit_request(bdev, breq);
+	if (!error) {
+		sleep_on_breq(breq);
+		error = breq->error;
+	}
+	if (error) {
+		for (int i = 0; i < breq->nr_bhs; i++)
+			breq->bhs[i]->bh_flags |= BH_DIRTY;
+	}
+	kmem_cache_free(breq_kcache, breq);
+	return error ? -EIO : 0;
+}
+
+/* Writes back the page's dirty blocks.  Only the blocks someone asked for are
+ * in the page, see bdev_get_buffer(). */
+int block_writepage(struct page_map *pm, struct page *page)
+{
+	return bdev_write_bhs(page, TRUE);
+}
+
 /* Block device page map ops: */
 struct page_map_operations block_pm_op = {
 	block_readpage,
+	block_writepage,
 };
 
 /* Block device file ops: for now, we don't let you do much of anything */
@@ -35,6 +35,9 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 		       msg->ev_type, ceq->nr_events);
 		return;
 	}
+	/* The consumer could be growing the CEQ.  If we saw the new nr_events, we
+	 * need to see the new events too. */
+	rmb();
 	/* ACCESS_ONCE, prevent the compiler from rereading ceq->events later, and
 	 * possibly getting a new, illegal version after our check */
 	ceq_ev = &(ACCESS_ONCE(ceq->events))[msg->ev_type];
@@ -0,0 +1,257 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Concurrent hash table.  See chash.h for the overview.
+ *
+ * Moving a bucket to the new table has to keep the old chain walkable for
+ * lockless readers.  We move the chain's last node at a time: it gets linked in
+ * at the head of its new bucket, then its old predecessor drops it.  A reader
+ * that was on that node continues into the new chain, which only has extra
+ * items to compare against, and a reader that misses it in the old table will
+ * find it in the new one. */
+
+#include <chash.h>
+#include <kmalloc.h>
+#include <assert.h>
+#include <stdio.h>
+
+/* Buckets each writer moves while a resize is going on */
+#define CHASH_MIGRATE_BATCH		4
+
+static uint32_t chash_hash(unsigned long key)
+{
+	return ((uint64_t)key * 0x9e37fffffffc0001ULL) >> 32;
+}
+
+static spinlock_t *chash_lock(struct chashtable *ht, uint32_t hash)
+{
+	return &ht->locks[hash % CHASH_NR_LOCKS];
+}
+
+static struct chash_tbl *chash_alloc_tbl(unsigned long nr_buckets, int flags)
+{
+	struct chash_tbl *tbl;
+
+	assert(IS_PWR2(nr_buckets));
+	tbl = kzmalloc(sizeof(struct chash_tbl) +
+	               nr_buckets * sizeof(struct chash_node*), flags);
+	if (!tbl)
+		return 0;
+	tbl->mask = nr_buckets - 1;
+	return tbl;
+}
+
+static void chash_free_tbl_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct chash_tbl, rcu));
+}
+
+void chash_init(struct chashtable *ht, unsigned long nr_buckets)
+{
+	unsigned long size = CHASH_MIN_BUCKETS;
+
+	while (size < nr_buckets)
+		size <<= 1;
+	ht->tbl = chash_alloc_tbl(size, MEM_WAIT);
+	atomic_init(&ht->nr_items, 0);
+	spinlock_init(&ht->resize_lock);
+	ht->migrate_idx = 0;
+	for (int i = 0; i < CHASH_NR_LOCKS; i++)
+		spinlock_init(&ht->locks[i]);
+}
+
+/* The table should be empty, and no one else can be using it. */
+void chash_destroy(struct chashtable *ht)
+{
+	struct chash_tbl *tbl, *next;
+
+	for (tbl = ht->tbl; tbl; tbl = next) {
+		next = tbl->future;
+		kfree(tbl);
+	}
+	ht->tbl = 0;
+}
+
+/* The size ht wants to be, given how many items it has. */
+static unsigned long chash_wanted_size(struct chashtable *ht,
+                                       struct chash_tbl *tbl)
+{
+	unsigned long nr_buckets = tbl->mask + 1;
+	unsigned long nr_items = chash_count(ht);
+
+	if (nr_items > nr_buckets)
+		return nr_buckets << 1;
+	if ((nr_items < nr_buckets / 4) && (nr_buckets > CHASH_MIN_BUCKETS))
+		return nr_buckets >> 1;
+	return nr_buckets;
+}
+
+/* Moves bucket idx from tbl to tbl->future.  Caller holds the resize lock. */
+static void chash_migrate_bucket(struct chashtable *ht, struct chash_tbl *tbl,
+                                 unsigned long idx)
+{
+	struct chash_tbl *new = tbl->future;
+	spinlock_t *lock = &ht->locks[idx % CHASH_NR_LOCKS];
+	struct chash_node **pp, *node, **new_bucket;
+
+	spin_lock(lock);
+	while (tbl->buckets[idx]) {
+		for (pp = &tbl->buckets[idx]; (*pp)->next; pp = &(*pp)->next)
+			;
+		node = *pp;
+		new_bucket = &new->buckets[chash_hash(node->key) & new->mask];
+		node->next = *new_bucket;
+		rcu_assign_pointer(*new_bucket, node);
+		rcu_assign_pointer(*pp, NULL);
+	}
+	spin_unlock(lock);
+}
+
+/* Called by writers: starts a resize if the table needs it, and moves a few
+ * buckets if a resize is in progress.  Whoever moves the last bucket switches
+ * over to the new table. */
+static void chash_maintain(struct chashtable *ht)
+{
+	struct chash_tbl *tbl = ACCESS_ONCE(ht->tbl);
+	struct chash_tbl *new;
+	unsigned long size;
+
+	if (!tbl->future && (chash_wanted_size(ht, tbl) == tbl->mask + 1))
+		return;
+	/* Someone else is on it (or iterating) */
+	if (!spin_trylock(&ht->resize_lock))
+		return;
+	tbl = ht->tbl;
+	if (!tbl->future) {
+		size = chash_wanted_size(ht, tbl);
+		if (size == tbl->mask + 1)
+			goto out;
+		/* We could be holding locks; we'll try again on the next write. */
+		new = chash_alloc_tbl(size, MEM_ATOMIC);
+		if (!new)
+			goto out;
+		ht->migrate_idx = 0;
+		rcu_assign_pointer(tbl->future, new);
+	}
+	for (int i = 0; i < CHASH_MIGRATE_BATCH; i++) {
+		if (ht->migrate_idx > tbl->mask)
+			break;
+		chash_migrate_bucket(ht, tbl, ht->migrate_idx++);
+	}
+	if (ht->migrate_idx > tbl->mask) {
+		/* tbl->future stays set, for readers and writers still on tbl */
+		rcu_assign_pointer(ht->tbl, tbl->future);
+		call_rcu(&tbl->rcu, chash_free_tbl_rcu);
+	}
+out:
+	spin_unlock(&ht->resize_lock);
+}
+
+/* Returns the node for key, or 0.  Caller is an RCU reader or holds key's
+ * lock. */
+struct chash_node *chash_lookup(struct chashtable *ht, unsigned long key)
+{
+	uint32_t hash = chash_hash(key);
+	struct chash_tbl *tbl;
+	struct chash_node *node;
+
+	for (tbl = rcu_dereference(ht->tbl); tbl;
+	     tbl = rcu_dereference(tbl->future)) {
+		for (node = rcu_dereference(tbl->buckets[hash & tbl->mask]);
+		     node;
+		     node = rcu_dereference(node->next)) {
+			if (node->key == key)
+				return node;
+		}
+		/* Nodes are added to the new table before they leave the old one */
+		rmb();
+	}
+	return 0;
+}
+
+/* Adds node, keyed by node->key.  Returns FALSE if the key is already in the
+ * table. */
+bool chash_insert(struct chashtable *ht, struct chash_node *node)
+{
+	uint32_t hash = chash_hash(node->key);
+	spinlock_t *lock = chash_lock(ht, hash);
+	struct chash_tbl *tbl;
+	struct chash_node **bucket;
+
+	rcu_read_lock();
+	spin_lock(lock);
+	if (chash_lookup(ht, node->key)) {
+		spin_unlock(lock);
+		rcu_read_unlock();
+		return FALSE;
+	}
+	/* New nodes go in the newest table, so a migration doesn't miss them */
+	for (tbl = ht->tbl; tbl->future; tbl = tbl->future)
+		;
+	bucket = &tbl->buckets[hash & tbl->mask];
+	node->next = *bucket;
+	rcu_assign_pointer(*bucket, node);
+	spin_unlock(lock);
+	rcu_read_unlock();
+	atomic_inc(&ht->nr_items);
+	chash_maintain(ht);
+	return TRUE;
+}
+
+/* Removes and returns the node for key, or 0.  The node's memory has to stay
+ * around for a grace period, for lockless readers. */
+struct chash_node *chash_remove(struct chashtable *ht, unsigned long key)
+{
+	uint32_t hash = chash_hash(key);
+	spinlock_t *lock = chash_lock(ht, hash);
+	struct chash_tbl *tbl;
+	struct chash_node **pp, *node = 0;
+
+	rcu_read_lock();
+	spin_lock(lock);
+	for (tbl = ht->tbl; tbl; tbl = tbl->future) {
+		for (pp = &tbl->buckets[hash & tbl->mask]; *pp; pp = &(*pp)->next) {
+			if ((*pp)->key == key) {
+				node = *pp;
+				/* node->next stays put, for readers still on node */
+				rcu_assign_pointer(*pp, node->next);
+				goto out;
+			}
+		}
+	}
+out:
+	spin_unlock(lock);
+	rcu_read_unlock();
+	if (node) {
+		atomic_dec(&ht->nr_items);
+		chash_maintain(ht);
+	}
+	return node;
+}
+
+/* Calls fn on every node, with that node's bucket locked.  Nodes added or
+ * removed during the walk might or might not be seen.  fn can't add or remove
+ * nodes in ht. */
+void chash_for_each(struct chashtable *ht,
+                    void (*fn)(struct chash_node *node, void *opaque),
+                    void *opaque)
+{
+	struct chash_tbl *tbl;
+	struct chash_node *node, *next;
+	spinlock_t *lock;
+
+	/* Holding the resize lock keeps nodes from moving between tables */
+	spin_lock(&ht->resize_lock);
+	for (tbl = ht->tbl; tbl; tbl = tbl->future) {
+		for (unsigned long i = 0; i <= tbl->mask; i++) {
+			lock = &ht->locks[i % CHASH_NR_LOCKS];
+			spin_lock(lock);
+			for (node = tbl->buckets[i]; node; node = next) {
+				next = node->next;
+				fn(node, opaque);
+			}
+			spin_unlock(lock);
+		}
+	}
+	spin_unlock(&ht->resize_lock);
+}
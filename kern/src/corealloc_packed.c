@@ -0,0 +1,358 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Topology-aware core allocation.  Like FCFS, provisioned cores are handed out
+ * first.  Beyond those, we score every idle core against the cores the process
+ * already has, and pick the cheapest one.  The costs, from most to least
+ * important:
+ * - giving a process both hyperthreads of a physical core (unless it asked for
+ *   that with REQ_SMT_SIBLINGS)
+ * - taking a core that is provisioned to someone else
+ * - spreading the process onto another NUMA node
+ * - spreading the process onto another socket.  We don't have cache topology,
+ *   so the socket stands in for the L3 domain.
+ * - sharing a physical core with another process
+ * - not being a core the process ran on before
+ *
+ * A process with no cores is started on the socket with the most idle cores,
+ * so it has room to grow without spilling onto another socket. */
+
+#include <arch/topology.h>
+#include <sys/queue.h>
+#include <env.h>
+#include <corerequest.h>
+#include <kmalloc.h>
+
+#define COST_SMT_SELF		(1 << 20)
+#define COST_PROV_OTHER		(1 << 16)
+#define COST_NUMA			(1 << 12)
+#define COST_SOCKET			(1 << 8)
+#define COST_SMT_OTHER		(1 << 2)
+#define COST_NOT_LAST		(1 << 1)
+
+/* The pcores in the system. (array gets alloced in init()).  */
+struct sched_pcore *all_pcores;
+
+/* TAILQ of all unallocated, idle (CG) cores */
+struct sched_pcore_tailq idlecores = TAILQ_HEAD_INITIALIZER(idlecores);
+
+/* Number of idle cores per socket, indexed by (absolute) socket_id. */
+static uint32_t *socket_nr_idle;
+
+/* One-off hint from the monitor, see __next_core_to_alloc(). */
+static struct sched_pcore *next_alloc_hint;
+
+static void __mark_idle(struct sched_pcore *spc)
+{
+	TAILQ_INSERT_TAIL(&idlecores, spc, alloc_next);
+	socket_nr_idle[spc->spc_info->socket_id]++;
+}
+
+static void __mark_busy(struct sched_pcore *spc)
+{
+	TAILQ_REMOVE(&idlecores, spc, alloc_next);
+	socket_nr_idle[spc->spc_info->socket_id]--;
+}
+
+/* Initialize any data assocaited with doing core allocation. */
+void corealloc_init(void)
+{
+	struct sched_pcore *spc_i, *spc_j;
+
+	all_pcores = kzmalloc(sizeof(struct sched_pcore) * num_cores, MEM_WAIT);
+	socket_nr_idle = kzmalloc(sizeof(uint32_t) *
+	                          cpu_topology_info.num_sockets, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		spc_i = pcoreid2spc(i);
+		spc_i->spc_info = &cpu_topology_info.core_list[i];
+	}
+	/* Siblings share a cpu_id (physical core).  We only track one sibling; on
+	 * machines with more than two hyperthreads per core, the others just won't
+	 * get the SMT costs. */
+	for (int i = 0; i < num_cores; i++) {
+		spc_i = pcoreid2spc(i);
+		for (int j = 0; j < num_cores; j++) {
+			spc_j = pcoreid2spc(j);
+			if ((i != j) && (spc_i->spc_info->cpu_id ==
+			                 spc_j->spc_info->cpu_id)) {
+				spc_i->sibling = spc_j;
+				break;
+			}
+		}
+	}
+	/* init the idlecore list.  if they turned off hyperthreading, give them the
+	 * odds from 1..max-1.  otherwise, give them everything by 0 (default mgmt
+	 * core).  TODO: (CG/LL) better LL/CG mgmt */
+#ifndef CONFIG_DISABLE_SMT
+	for (int i = 0; i < num_cores; i++)
+		if (!is_ll_core(i))
+			__mark_idle(pcoreid2spc(i));
+#else
+	assert(!(num_cores % 2));
+	for (int i = 1; i < num_cores; i += 2)
+		if (!is_ll_core(i))
+			__mark_idle(pcoreid2spc(i));
+#endif /* CONFIG_DISABLE_SMT */
+}
+
+/* Initialize any data associated with allocating cores to a process. */
+void corealloc_proc_init(struct proc *p)
+{
+	TAILQ_INIT(&p->ksched_data.crd.alloc_me);
+	TAILQ_INIT(&p->ksched_data.crd.prov_alloc_me);
+	TAILQ_INIT(&p->ksched_data.crd.prov_not_alloc_me);
+}
+
+/* Cost of giving spc to p, given p's per-node core counts.  Lower is better. */
+static uint32_t __core_cost(struct proc *p, struct sched_pcore *spc,
+                            uint32_t nr_alloc, uint32_t *numa_refs,
+                            uint32_t *socket_refs, uint32_t *cpu_refs)
+{
+	struct core_info *info = spc->spc_info;
+	bool smt_ok = p->procdata->res_req[RES_CORES].flags & REQ_SMT_SIBLINGS;
+	uint32_t cost = 0;
+
+	if (cpu_refs[info->cpu_id] && !smt_ok)
+		cost += COST_SMT_SELF;
+	if (spc->prov_proc && (spc->prov_proc != p))
+		cost += COST_PROV_OTHER;
+	if (nr_alloc) {
+		if (!numa_refs[info->numa_id])
+			cost += COST_NUMA;
+		if (!socket_refs[info->socket_id])
+			cost += COST_SOCKET;
+	} else {
+		/* Nothing to pack against yet.  Prefer the emptiest socket.  This
+		 * outweighs the SMT and last-ran costs, but not the NUMA cost. */
+		cost += (cpu_topology_info.cores_per_socket -
+		         MIN(socket_nr_idle[info->socket_id],
+		             cpu_topology_info.cores_per_socket)) << 3;
+	}
+	if (spc->sibling && spc->sibling->alloc_proc &&
+	    (spc->sibling->alloc_proc != p))
+		cost += COST_SMT_OTHER;
+	if (spc->last_proc != p)
+		cost += COST_NOT_LAST;
+	return cost;
+}
+
+/* Find the best core to allocate to a process as dictated by the core
+ * allocation algorithm. This code assumes that the scheduler that uses it
+ * holds a lock for the duration of the call. */
+uint32_t __find_best_core_to_alloc(struct proc *p)
+{
+	struct sched_pcore *spc_i, *best = NULL;
+	uint32_t numa_refs[cpu_topology_info.num_numa];
+	uint32_t socket_refs[cpu_topology_info.num_sockets];
+	uint32_t cpu_refs[cpu_topology_info.num_cpus];
+	uint32_t nr_alloc = 0, cost, best_cost = UINT32_MAX;
+
+	spc_i = TAILQ_FIRST(&p->ksched_data.crd.prov_not_alloc_me);
+	if (spc_i)
+		return spc2pcoreid(spc_i);
+	if (next_alloc_hint) {
+		spc_i = next_alloc_hint;
+		next_alloc_hint = NULL;
+		if (!spc_i->alloc_proc && !spc_i->prov_proc)
+			return spc2pcoreid(spc_i);
+	}
+	memset(numa_refs, 0, sizeof(numa_refs));
+	memset(socket_refs, 0, sizeof(socket_refs));
+	memset(cpu_refs, 0, sizeof(cpu_refs));
+	TAILQ_FOREACH(spc_i, &p->ksched_data.crd.alloc_me, alloc_next) {
+		numa_refs[spc_i->spc_info->numa_id]++;
+		socket_refs[spc_i->spc_info->socket_id]++;
+		cpu_refs[spc_i->spc_info->cpu_id]++;
+		nr_alloc++;
+	}
+	TAILQ_FOREACH(spc_i, &idlecores, alloc_next) {
+		cost = __core_cost(p, spc_i, nr_alloc, numa_refs, socket_refs,
+		                   cpu_refs);
+		/* Ties go to the lower core id, so allocations are deterministic. */
+		if ((cost < best_cost) ||
+		    ((cost == best_cost) && (spc_i < best))) {
+			best = spc_i;
+			best_cost = cost;
+		}
+	}
+	if (!best)
+		return -1;
+	return spc2pcoreid(best);
+}
+
+/* Track the pcore properly when it is allocated to p. This code assumes that
+ * the scheduler that uses it holds a lock for the duration of the call. */
+void __track_core_alloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	assert(spc->alloc_proc != p);	/* corruption or double-alloc */
+	spc->alloc_proc = p;
+	spc->last_proc = p;
+	/* if the pcore is prov to them and now allocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_not_alloc_me, spc, prov_next);
+		TAILQ_INSERT_TAIL(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+	}
+	/* Actually allocate the core, moving it from the idle core list to p's. */
+	__mark_busy(spc);
+	TAILQ_INSERT_TAIL(&p->ksched_data.crd.alloc_me, spc, alloc_next);
+}
+
+/* Track the pcore properly when it is deallocated from p. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * */
+void __track_core_dealloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	assert(spc->alloc_proc == p);
+	spc->alloc_proc = 0;
+	/* if the pcore is prov to them and now deallocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+		/* this is the victim list, which can be sorted so that we pick the
+		 * right victim (sort by alloc_proc reverse priority, etc).  In this
+		 * case, the core isn't alloc'd by anyone, so it should be the first
+		 * victim. */
+		TAILQ_INSERT_HEAD(&p->ksched_data.crd.prov_not_alloc_me, spc,
+		                  prov_next);
+	}
+	/* Actually dealloc the core, putting it back on the idle core list. */
+	TAILQ_REMOVE(&p->ksched_data.crd.alloc_me, spc, alloc_next);
+	__mark_idle(spc);
+}
+
+/* Bulk interface for __track_core_dealloc */
+void __track_core_dealloc_bulk(struct proc *p, uint32_t *pc_arr,
+                               uint32_t nr_cores)
+{
+	for (int i = 0; i < nr_cores; i++)
+		__track_core_dealloc(p, pc_arr[i]);
+}
+
+/* Get an idle core from our pcore list and return its core_id. Don't
+ * consider the chosen core in the future when handing out cores to a
+ * process. This code assumes that the scheduler that uses it holds a lock
+ * for the duration of the call. This will not give out provisioned cores.
+ *
+ * We take from the back of the idle list, which is the opposite end from where
+ * the packing starts for a fresh system. */
+int __get_any_idle_core(void)
+{
+	struct sched_pcore *spc;
+
+	TAILQ_FOREACH_REVERSE(spc, &idlecores, sched_pcore_tailq, alloc_next) {
+		/* Don't take cores that are provisioned to a process */
+		if (spc->prov_proc)
+			continue;
+		assert(!spc->alloc_proc);
+		__mark_busy(spc);
+		return spc2pcoreid(spc);
+	}
+	return -1;
+}
+
+/* Detect if a pcore is idle or not. */
+static bool __spc_is_idle(struct sched_pcore *spc)
+{
+	struct sched_pcore *i;
+
+	TAILQ_FOREACH(i, &idlecores, alloc_next) {
+		if (spc == i)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Same as __get_any_idle_core() except for a specific core id. */
+int __get_specific_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+	int ret = -1;
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	if (__spc_is_idle(spc) && !spc->prov_proc) {
+		assert(!spc->alloc_proc);
+		__mark_busy(spc);
+		ret = coreid;
+	}
+	return ret;
+}
+
+/* Reinsert a core obtained via __get_any_idle_core() or
+ * __get_specific_idle_core() back into the idlecore map. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * This will not give out provisioned cores. */
+void __put_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	__mark_idle(spc);
+}
+
+/* One off function to make 'pcoreid' the next core chosen by the core
+ * allocation algorithm (so long as no provisioned cores are still idle).
+ * This code assumes that the scheduler that uses it holds a lock for the
+ * duration of the call. */
+void __next_core_to_alloc(uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	if (pcoreid >= num_cores)
+		return;
+	spc = pcoreid2spc(pcoreid);
+	if (__spc_is_idle(spc)) {
+		next_alloc_hint = spc;
+		printk("Pcore %d will be given out next (from the idles)\n", pcoreid);
+	}
+}
+
+/* One off function to sort the idle core list for debugging in the kernel
+ * monitor.  The packer doesn't depend on the order of the idle list, so this
+ * only changes how print_idle_core_map() looks.  This code assumes that the
+ * scheduler that uses it holds a lock for the duration of the call. */
+void __sort_idle_cores(void)
+{
+	struct sched_pcore *spc_i, *spc_j, *temp;
+	struct sched_pcore_tailq sorter = TAILQ_HEAD_INITIALIZER(sorter);
+	bool added;
+
+	TAILQ_CONCAT(&sorter, &idlecores, alloc_next);
+	TAILQ_FOREACH_SAFE(spc_i, &sorter, alloc_next, temp) {
+		TAILQ_REMOVE(&sorter, spc_i, alloc_next);
+		added = FALSE;
+		/* don't need foreach_safe since we break after we muck with the list */
+		TAILQ_FOREACH(spc_j, &idlecores, alloc_next) {
+			if (spc_i < spc_j) {
+				TAILQ_INSERT_BEFORE(spc_j, spc_i, alloc_next);
+				added = TRUE;
+				break;
+			}
+		}
+		if (!added)
+			TAILQ_INSERT_TAIL(&idlecores, spc_i, alloc_next);
+	}
+}
+
+/* Print the map of idle cores that are still allocatable through our core
+ * allocation algorithm. */
+void print_idle_core_map(void)
+{
+	struct sched_pcore *spc_i;
+	/* not locking, so we can look at this without deadlocking. */
+	printk("Idle cores (unlocked!):\n");
+	TAILQ_FOREACH(spc_i, &idlecores, alloc_next)
+		printk("Core %d (numa %d, socket %d, cpu %d), prov to %d (%p)\n",
+		       spc2pcoreid(spc_i), spc_i->spc_info->numa_id,
+		       spc_i->spc_info->socket_id, spc_i->spc_info->cpu_id,
+		       spc_i->prov_proc ? spc_i->prov_proc->pid : 0,
+		       spc_i->prov_proc);
+	for (int i = 0; i < cpu_topology_info.num_sockets; i++)
+		printk("Socket %d: %d idle\n", i, socket_nr_idle[i]);
+}
@@ -95,6 +95,19 @@ static void post_ev_msg(struct proc *p, struct event_mbox *mbox,
 	}
 }
 
+/* Posts nr messages to the mbox, same rules as post_ev_msg().  UCQs reserve
+ * their slots in bulk, the other mboxes are cheap enough per message. */
+static void post_ev_msgs(struct proc *p, struct event_mbox *mbox,
+                         struct event_msg *msgs, int nr, int ev_flags)
+{
+	if ((mbox->type == EV_MBOX_UCQ) && (nr > 1)) {
+		send_ucq_msgs(&mbox->ucq, p, msgs, nr);
+		return;
+	}
+	for (int i = 0; i < nr; i++)
+		post_ev_msg(p, mbox, &msgs[i], ev_flags);
+}
+
 /* Helper: use this when sending a message to a VCPD mbox.  It just posts to the
  * ev_mbox and sets notif pending.  Note this uses a userspace address for the
  * VCPD (though not a user's pointer). */
@@ -361,6 +374,17 @@ static void send_indir(struct proc *p, struct event_queue *ev_q,
  * where the kernel suggests, set EVENT_VCORE_APPRO(priate). */
 void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
                 uint32_t vcoreid)
+{
+	send_event_batch(p, ev_q, msg, 1, vcoreid);
+}
+
+/* Sends nr msgs to ev_q, as if by send_event(), but with one pass through the
+ * ev_q's flags: the msgs are posted together, and the vcore gets at most one
+ * alert (INDIR / IPI) and the process at most one wakeup for all of them.
+ * Round-robin ev_qs advance once per batch.  SPAM_PUBLIC ev_qs still spam each
+ * message. */
+void send_event_batch(struct proc *p, struct event_queue *ev_q,
+                      struct event_msg *msgs, int nr, uint32_t vcoreid)
 {
 	uintptr_t old_proc;
 	struct event_mbox *ev_mbox = 0;
@@ -413,7 +437,8 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	 * we'll prefer to send it to whatever vcoreid we determined at this point
 	 * (via APPRO or whatever). */
 	if (ev_q->ev_flags & EVENT_SPAM_PUBLIC) {
-		spam_public_msg(p, msg, vcoreid, ev_q->ev_flags);
+		for (int i = 0; i < nr; i++)
+			spam_public_msg(p, &msgs[i], vcoreid, ev_q->ev_flags);
 		goto wakeup;
 	}
 	/* We aren't spamming and we know the default vcore, and now we need to
@@ -437,7 +462,7 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 		printk("[kernel] Illegal addr for ev_mbox\n");
 		goto out;
 	}
-	post_ev_msg(p, ev_mbox, msg, ev_q->ev_flags);
+	post_ev_msgs(p, ev_mbox, msgs, nr, ev_q->ev_flags);
 	wmb();	/* ensure ev_msg write is before alerting the vcore */
 	/* Prod/alert a vcore with an IPI or INDIR, if desired.  INDIR will also
 	 * call try_notify (IPI) later */
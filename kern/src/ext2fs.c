@@ -25,6 +25,8 @@ struct file_operations ext2_f_op_file;
 struct file_operations ext2_f_op_dir;
 struct file_operations ext2_f_op_sym;
 
+struct ext2_inode *ext2_get_diskinode(struct inode *inode);
+
 /* EXT2 Internal Functions */
 
 /* Useful helper functions. */
@@ -157,45 +159,79 @@ void ext2_dirty_metablock(struct super_block *sb, void *buffer)
 		bdev_dirty_buffer(bh);
 }
 
-/* Helper for alloc_block.  It will try to alloc a block from the BG, starting
- * with blk_idx (relative number within the BG).   If successful, it will return
- * the FS block number via *block_num.  TODO: concurrency protection */
+/* Helper for alloc_blocks.  It will try to alloc a run of up to *nr_blks
+ * blocks from the BG, starting with blk_idx (relative number within the BG).
+ * We take the first free run of the full length, and settle for the first free
+ * block (and whatever free blocks follow it) if there isn't one.  If
+ * successful, it will return the FS block number of the run via *block_num and
+ * its length via *nr_blks.  TODO: concurrency protection */
 static bool ext2_tryalloc(struct super_block *sb, struct ext2_block_group *bg,
-                          unsigned int blk_idx, uint32_t *block_num)
+                          unsigned int blk_idx, unsigned int *nr_blks,
+                          uint32_t *block_num)
 {
 	uint8_t *blk_bitmap;
 	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)sb->s_fs_info;
 	unsigned int blks_per_bg = le32_to_cpu(e2sbi->e2sb->s_blocks_per_group);
-	bool found = FALSE;
+	unsigned int want = *nr_blks, idx, run_start = 0, run_len = 0;
+	int first_free = -1;
 
 	/* Check to see if there are any free blocks */
-	if (!le32_to_cpu(bg->bg_free_blocks_cnt))
+	if (!le16_to_cpu(bg->bg_free_blocks_cnt))
 		return FALSE;
-	/* Check the bitmap for your desired block.  We'll loop through the whole
-	 * BG, starting with the one we want first. */
+	/* Check the bitmap for a run.  We'll loop through the whole BG, starting
+	 * with the one we want first.  Runs don't wrap around the end of the BG. */
 	blk_bitmap = ext2_get_metablock(sb, bg->bg_block_bitmap);
 	for (int i = 0; i < blks_per_bg; i++) {
-		if (!(GET_BITMASK_BIT(blk_bitmap, blk_idx))) {
-			SET_BITMASK_BIT(blk_bitmap, blk_idx);
-			bg->bg_free_blocks_cnt--;
-			ext2_dirty_metablock(sb, blk_bitmap);
-			found = TRUE;
+		idx = (blk_idx + i) % blks_per_bg;
+		if (!idx)
+			run_len = 0;
+		/* Skip fully allocated bytes of the bitmap */
+		if (!(idx % 8) && (idx + 8 <= blks_per_bg) &&
+		    (blk_bitmap[idx / 8] == 0xff)) {
+			run_len = 0;
+			i += 7;
+			continue;
+		}
+		if (GET_BITMASK_BIT(blk_bitmap, idx)) {
+			run_len = 0;
+			continue;
+		}
+		if (!run_len)
+			run_start = idx;
+		if (first_free < 0)
+			first_free = idx;
+		if (++run_len == want)
 			break;
+	}
+	if (run_len != want) {
+		if (first_free < 0) {
+			ext2_put_metablock(sb, blk_bitmap);
+			return FALSE;
+		}
+		run_start = first_free;
+		for (run_len = 1; run_len < want; run_len++) {
+			idx = run_start + run_len;
+			if ((idx == blks_per_bg) || GET_BITMASK_BIT(blk_bitmap, idx))
+				break;
 		}
-		/* Note: the wrap-around hasn't been tested yet */
-		blk_idx = (blk_idx + 1) % blks_per_bg;
 	}
+	for (int i = 0; i < run_len; i++)
+		SET_BITMASK_BIT(blk_bitmap, run_start + i);
+	bg->bg_free_blocks_cnt = cpu_to_le16(le16_to_cpu(bg->bg_free_blocks_cnt) -
+	                                     run_len);
+	ext2_dirty_metablock(sb, blk_bitmap);
 	ext2_put_metablock(sb, blk_bitmap);
-	if (found)
-		*block_num = ext2_bgidx2block(sb, bg, blk_idx);
-	return found;
+	*nr_blks = run_len;
+	*block_num = ext2_bgidx2block(sb, bg, run_start);
+	return TRUE;
 }
 
-/* This allocates a fresh block for the inode, preferably 'fetish' (name
- * courtesy of L.F.), returning the FS block number that's been allocated.
- * Note, Linux does some block preallocation here.  Consider doing the same (off
- * the in-memory inode).  Note the lack of concurrency protections here. */
-uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
+/* This allocates a run of up to *nr_blks fresh blocks for the inode,
+ * preferably starting at 'fetish' (name courtesy of L.F.), returning the FS
+ * block number of the first one.  The run's length is returned in *nr_blks,
+ * and is at least 1.  Note the lack of concurrency protections here. */
+uint32_t ext2_alloc_blocks(struct inode *inode, uint32_t fetish,
+                           unsigned int *nr_blks)
 {
 	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)inode->i_sb->s_fs_info;
 	struct ext2_block_group *fetish_bg, *bg_i = e2sbi->e2bg;
@@ -203,11 +239,16 @@ uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
 	bool found = FALSE;
 	uint32_t retval = 0;
 
+	/* Our callers often want the block after some other block, which might be
+	 * past the end of the FS. */
+	if ((fetish >= le32_to_cpu(e2sbi->e2sb->s_blocks_cnt)) ||
+	    (fetish < le32_to_cpu(e2sbi->e2sb->s_first_data_block)))
+		fetish = le32_to_cpu(e2sbi->e2sb->s_first_data_block);
 	/* Get our ideal starting point */
 	fetish_bg = ext2_block2bg(inode->i_sb, fetish);
 	blk_idx = ext2_block2bgidx(inode->i_sb, fetish);
-	/* Try to find a free block in the BG of the one we desire */
-	found = ext2_tryalloc(inode->i_sb, fetish_bg, blk_idx, &retval);
+	/* Try to find free blocks in the BG of the one we desire */
+	found = ext2_tryalloc(inode->i_sb, fetish_bg, blk_idx, nr_blks, &retval);
 	if (found)
 		return retval;
 
@@ -217,7 +258,7 @@ uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
 	for (int i = 0; i < e2sbi->nr_bgs; i++, bg_i++) {
 		if (bg_i == fetish_bg)
 			continue;
-		found = ext2_tryalloc(inode->i_sb, bg_i, 0, &retval);
+		found = ext2_tryalloc(inode->i_sb, bg_i, 0, nr_blks, &retval);
 		if (found)
 			break;
 	}
@@ -226,6 +267,81 @@ uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
 	return retval;
 }
 
+/* This allocates a single fresh block for the inode, preferably 'fetish'. */
+uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
+{
+	unsigned int nr_blks = 1;
+
+	return ext2_alloc_blocks(inode, fetish, &nr_blks);
+}
+
+/* Gives back nr_blks blocks, starting at block_num.  The run can't cross a BG
+ * boundary, which is true of anything ext2_alloc_blocks() gave out. */
+static void ext2_free_blocks(struct super_block *sb, uint32_t block_num,
+                             unsigned int nr_blks)
+{
+	struct ext2_block_group *bg;
+	unsigned int blk_idx;
+	uint8_t *blk_bitmap;
+
+	if (!nr_blks)
+		return;
+	bg = ext2_block2bg(sb, block_num);
+	blk_idx = ext2_block2bgidx(sb, block_num);
+	blk_bitmap = ext2_get_metablock(sb, bg->bg_block_bitmap);
+	for (int i = 0; i < nr_blks; i++) {
+		assert(GET_BITMASK_BIT(blk_bitmap, blk_idx + i));
+		CLR_BITMASK_BIT(blk_bitmap, blk_idx + i);
+	}
+	bg->bg_free_blocks_cnt = cpu_to_le16(le16_to_cpu(bg->bg_free_blocks_cnt) +
+	                                     nr_blks);
+	ext2_dirty_metablock(sb, blk_bitmap);
+	ext2_put_metablock(sb, blk_bitmap);
+}
+
+/* Drops whatever is left of the inode's block reservation. */
+static void ext2_discard_rsv(struct inode *inode)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+
+	ext2_free_blocks(inode->i_sb, e2ii->i_rsv_start, e2ii->i_rsv_len);
+	e2ii->i_rsv_len = 0;
+}
+
+/* Allocates the FS block for a regular file's ino_block, preferably 'goal'.
+ *
+ * Sequential writers allocate out of a per-inode reservation.  When it runs
+ * out, we take a new contiguous run from the bitmap, starting at the goal, and
+ * double the size of the next run (up to EXT2_RSV_MAX).  An allocation that
+ * doesn't follow the previous one gives back the rest of the reservation and
+ * starts over with a small run.  The reserved blocks are marked in the bitmap,
+ * so a crash leaks them until the next fsck. */
+#define EXT2_RSV_MIN			8
+#define EXT2_RSV_MAX			1024
+
+static uint32_t ext2_alloc_inoblock(struct inode *inode, uint32_t ino_block,
+                                    uint32_t goal)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+	unsigned int nr_blks;
+
+	if (!S_ISREG(inode->i_mode))
+		return ext2_alloc_block(inode, goal);
+	if ((ino_block != e2ii->i_rsv_lblk) || !e2ii->i_rsv_win) {
+		ext2_discard_rsv(inode);
+		e2ii->i_rsv_win = EXT2_RSV_MIN;
+	}
+	if (!e2ii->i_rsv_len) {
+		nr_blks = e2ii->i_rsv_win;
+		e2ii->i_rsv_start = ext2_alloc_blocks(inode, goal, &nr_blks);
+		e2ii->i_rsv_len = nr_blks;
+		e2ii->i_rsv_win = MIN(e2ii->i_rsv_win * 2, EXT2_RSV_MAX);
+	}
+	e2ii->i_rsv_lblk = ino_block + 1;
+	e2ii->i_rsv_len--;
+	return e2ii->i_rsv_start++;
+}
+
 /* Inode Management */
 
 /* Helper for alloc_diskinode.  It will try to alloc a disk inode from the BG.
@@ -419,37 +535,361 @@ uint32_t *ext2_lookup_inotable_slot(struct inode *inode, uint32_t ino_block)
 	return blk_slot;
 }
 
-/* Determines the FS block id for a given inode block id.  Convenience wrapper
- * that may go away soon. */
+/* Extent Trees */
+
+static bool ext2_is_extent_inode(struct inode *inode)
+{
+	return inode->i_flags & EXT4_EXTENTS_FL ? TRUE : FALSE;
+}
+
+static struct ext2_extent_header *ext2_ext_root(struct inode *inode)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+	return (struct ext2_extent_header*)e2ii->i_block;
+}
+
+static struct ext2_extent *ext2_ext_first(struct ext2_extent_header *eh)
+{
+	return (struct ext2_extent*)(eh + 1);
+}
+
+static struct ext2_extent_idx *ext2_ext_first_idx(struct ext2_extent_header *eh)
+{
+	return (struct ext2_extent_idx*)(eh + 1);
+}
+
+static unsigned int ext2_ext_len(struct ext2_extent *ex)
+{
+	unsigned int len = le16_to_cpu(ex->ee_len);
+	return len > EXT2_EXT_MAX_LEN ? len - EXT2_EXT_MAX_LEN : len;
+}
+
+static void ext2_ext_init_hdr(struct ext2_extent_header *eh, size_t node_sz,
+                              unsigned int depth)
+{
+	eh->eh_magic = cpu_to_le16(EXT2_EXT_MAGIC);
+	eh->eh_entries = 0;
+	eh->eh_max = cpu_to_le16((node_sz - sizeof(struct ext2_extent_header)) /
+	                         sizeof(struct ext2_extent));
+	eh->eh_depth = cpu_to_le16(depth);
+	eh->eh_generation = 0;
+}
+
+/* Sets up an empty extent root in a new inode's block info */
+static void ext2_ext_init_root(struct ext2_i_info *e2ii)
+{
+	memset(e2ii->i_block, 0, sizeof(e2ii->i_block));
+	ext2_ext_init_hdr((struct ext2_extent_header*)e2ii->i_block,
+	                  sizeof(e2ii->i_block), 0);
+}
+
+/* The root lives in the inode, so changing it means writing the disk inode. */
+static void ext2_ext_sync_root(struct inode *inode)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+	struct ext2_inode *disk_inode = ext2_get_diskinode(inode);
+
+	memcpy(disk_inode->i_block, e2ii->i_block, sizeof(e2ii->i_block));
+	ext2_dirty_metablock(inode->i_sb, disk_inode);
+	ext2_put_metablock(inode->i_sb, disk_inode);
+}
+
+/* Returns the last entry in the node that starts at or before lblk, or -1 if
+ * there isn't one.  Leaf and index entries are the same size, and both start
+ * with their first logical block, so this works for either. */
+static int ext2_ext_bsearch(struct ext2_extent_header *eh, uint32_t lblk)
+{
+	struct ext2_extent *ex = ext2_ext_first(eh);
+	int lo = 0, hi = le16_to_cpu(eh->eh_entries) - 1, mid, ret = -1;
+
+	static_assert(sizeof(struct ext2_extent) == sizeof(struct ext2_extent_idx));
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (le32_to_cpu(ex[mid].ee_block) <= lblk) {
+			ret = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return ret;
+}
+
+/* One level of a walk down the tree.  p_idx is the entry we followed (interior
+ * nodes) or the entry at or before the block we want (leaves, -1 for none). */
+struct ext2_ext_path {
+	struct ext2_extent_header	*p_hdr;
+	int							p_idx;
+};
+
+/* Walks the tree down to the leaf that holds (or would hold) lblk, filling in
+ * path[0] (the root) through path[depth] (the leaf).  Returns the depth.  The
+ * non-root nodes are metablocks; release them with ext2_ext_put_path(). */
+static int ext2_ext_find(struct inode *inode, uint32_t lblk,
+                         struct ext2_ext_path *path)
+{
+	struct ext2_extent_header *eh = ext2_ext_root(inode);
+	struct ext2_extent_idx *ei;
+	int depth = le16_to_cpu(eh->eh_depth);
+
+	assert(le16_to_cpu(eh->eh_magic) == EXT2_EXT_MAGIC);
+	assert(depth <= EXT2_EXT_MAX_DEPTH);
+	for (int i = 0; i < depth; i++) {
+		assert(eh->eh_entries);
+		path[i].p_hdr = eh;
+		/* Blocks before the first index still go down the first one */
+		path[i].p_idx = MAX(ext2_ext_bsearch(eh, lblk), 0);
+		ei = &ext2_ext_first_idx(eh)[path[i].p_idx];
+		eh = ext2_get_metablock(inode->i_sb, le32_to_cpu(ei->ei_leaf_lo));
+		assert(le16_to_cpu(eh->eh_magic) == EXT2_EXT_MAGIC);
+	}
+	path[depth].p_hdr = eh;
+	path[depth].p_idx = ext2_ext_bsearch(eh, lblk);
+	return depth;
+}
+
+static void ext2_ext_put_path(struct inode *inode, struct ext2_ext_path *path,
+                              int depth)
+{
+	for (int i = 1; i <= depth; i++)
+		ext2_put_metablock(inode->i_sb, path[i].p_hdr);
+}
+
+static void ext2_ext_dirty(struct inode *inode, struct ext2_extent_header *eh)
+{
+	if (eh == ext2_ext_root(inode))
+		ext2_ext_sync_root(inode);
+	else
+		ext2_dirty_metablock(inode->i_sb, eh);
+}
+
+/* Returns the FS block for the extent inode's lblk, or 0 for a hole. */
+static uint32_t ext2_ext_map(struct inode *inode, uint32_t lblk)
+{
+	struct ext2_ext_path path[EXT2_EXT_MAX_DEPTH + 1];
+	struct ext2_extent *ex;
+	uint32_t retval = 0;
+	int depth;
+
+	depth = ext2_ext_find(inode, lblk, path);
+	if (path[depth].p_idx >= 0) {
+		ex = &ext2_ext_first(path[depth].p_hdr)[path[depth].p_idx];
+		if (lblk - le32_to_cpu(ex->ee_block) < ext2_ext_len(ex))
+			retval = le32_to_cpu(ex->ee_start_lo) + lblk -
+			         le32_to_cpu(ex->ee_block);
+	}
+	ext2_ext_put_path(inode, path, depth);
+	return retval;
+}
+
+/* Allocs and zeros a new tree node at depth, returning its FS block number and
+ * the (incref'd) metablock in *eh_p. */
+static uint32_t ext2_ext_new_node(struct inode *inode, unsigned int depth,
+                                  struct ext2_extent_header **eh_p)
+{
+	uint32_t blkid;
+	struct ext2_extent_header *eh;
+
+	blkid = ext2_alloc_block(inode, ext2_bgidx2block(inode->i_sb,
+	                                                 ext2_inode2bg(inode), 0));
+	eh = ext2_get_metablock(inode->i_sb, blkid);
+	memset(eh, 0, inode->i_sb->s_blocksize);
+	ext2_ext_init_hdr(eh, inode->i_sb->s_blocksize, depth);
+	inode->i_blocks += inode->i_sb->s_blocksize >> 9;
+	*eh_p = eh;
+	return blkid;
+}
+
+/* Moves the root's entries into a new node, leaving the root as an interior
+ * node with one entry pointing at it.  The tree gets one level deeper. */
+static void ext2_ext_grow(struct inode *inode)
+{
+	struct ext2_extent_header *root = ext2_ext_root(inode);
+	struct ext2_extent_header *eh;
+	struct ext2_extent_idx *ei;
+	unsigned int depth = le16_to_cpu(root->eh_depth);
+	uint32_t blkid;
+
+	if (depth == EXT2_EXT_MAX_DEPTH)
+		panic("Extent tree for inode %lu is too deep!", inode->i_ino);
+	blkid = ext2_ext_new_node(inode, depth, &eh);
+	memcpy(ext2_ext_first(eh), ext2_ext_first(root),
+	       le16_to_cpu(root->eh_entries) * sizeof(struct ext2_extent));
+	eh->eh_entries = root->eh_entries;
+	ext2_dirty_metablock(inode->i_sb, eh);
+	ext2_put_metablock(inode->i_sb, eh);
+	ei = ext2_ext_first_idx(root);
+	/* ei_block is the first entry's block, which is in the same spot */
+	ei->ei_leaf_lo = cpu_to_le32(blkid);
+	ei->ei_leaf_hi = 0;
+	ei->ei_unused = 0;
+	root->eh_entries = cpu_to_le16(1);
+	root->eh_depth = cpu_to_le16(depth + 1);
+	ext2_ext_sync_root(inode);
+}
+
+/* Inserts an entry at slot idx of eh, which has room. */
+static void ext2_ext_insert_at(struct ext2_extent_header *eh, int idx,
+                               void *entry)
+{
+	struct ext2_extent *ex = ext2_ext_first(eh);
+	unsigned int nr = le16_to_cpu(eh->eh_entries);
+
+	assert(nr < le16_to_cpu(eh->eh_max));
+	memmove(&ex[idx + 1], &ex[idx], (nr - idx) * sizeof(struct ext2_extent));
+	memcpy(&ex[idx], entry, sizeof(struct ext2_extent));
+	eh->eh_entries = cpu_to_le16(nr + 1);
+}
+
+/* Splits the full node at path[level], whose parent has room, moving its upper
+ * entries into a new sibling.  If we're appending to the node, only the last
+ * entry moves, so sequential writers leave full nodes behind them.  O/w, we
+ * split it in half. */
+static void ext2_ext_split(struct inode *inode, struct ext2_ext_path *path,
+                           int level)
+{
+	struct ext2_extent_header *eh = path[level].p_hdr, *new_eh;
+	struct ext2_extent_idx ei;
+	unsigned int nr = le16_to_cpu(eh->eh_entries), split;
+	uint32_t blkid;
+
+	assert(level > 0);
+	split = path[level].p_idx == nr - 1 ? nr - 1 : nr / 2;
+	blkid = ext2_ext_new_node(inode, le16_to_cpu(eh->eh_depth), &new_eh);
+	memcpy(ext2_ext_first(new_eh), &ext2_ext_first(eh)[split],
+	       (nr - split) * sizeof(struct ext2_extent));
+	new_eh->eh_entries = cpu_to_le16(nr - split);
+	eh->eh_entries = cpu_to_le16(split);
+	ext2_dirty_metablock(inode->i_sb, new_eh);
+	ext2_dirty_metablock(inode->i_sb, eh);
+	/* Link the new node into the parent, right after the old one */
+	ei.ei_block = ext2_ext_first(new_eh)->ee_block;
+	ei.ei_leaf_lo = cpu_to_le32(blkid);
+	ei.ei_leaf_hi = 0;
+	ei.ei_unused = 0;
+	ext2_put_metablock(inode->i_sb, new_eh);
+	ext2_ext_insert_at(path[level - 1].p_hdr, path[level - 1].p_idx + 1, &ei);
+	ext2_ext_dirty(inode, path[level - 1].p_hdr);
+}
+
+/* Maps the extent inode's lblk, which must be a hole, to FS block blkid.
+ * Usually this just grows the extent before lblk.  If the leaf is full, we
+ * split it (and any full parents), or grow the tree if the root is full too,
+ * and try again. */
+static void ext2_ext_insert(struct inode *inode, uint32_t lblk, uint32_t blkid)
+{
+	struct ext2_ext_path path[EXT2_EXT_MAX_DEPTH + 1];
+	struct ext2_extent_header *leaf;
+	struct ext2_extent_idx *ei;
+	struct ext2_extent *ex, new_ex;
+	unsigned int len;
+	int depth, level, idx;
+
+	while (1) {
+		depth = ext2_ext_find(inode, lblk, path);
+		leaf = path[depth].p_hdr;
+		idx = path[depth].p_idx;
+		if (idx >= 0) {
+			ex = &ext2_ext_first(leaf)[idx];
+			len = ext2_ext_len(ex);
+			assert(lblk - le32_to_cpu(ex->ee_block) >= len);
+			if ((le32_to_cpu(ex->ee_block) + len == lblk) &&
+			    (le32_to_cpu(ex->ee_start_lo) + len == blkid) &&
+			    (le16_to_cpu(ex->ee_len) < EXT2_EXT_MAX_LEN)) {
+				ex->ee_len = cpu_to_le16(len + 1);
+				ext2_ext_dirty(inode, leaf);
+				break;
+			}
+		}
+		if (le16_to_cpu(leaf->eh_entries) < le16_to_cpu(leaf->eh_max)) {
+			new_ex.ee_block = cpu_to_le32(lblk);
+			new_ex.ee_len = cpu_to_le16(1);
+			new_ex.ee_start_hi = 0;
+			new_ex.ee_start_lo = cpu_to_le32(blkid);
+			ext2_ext_insert_at(leaf, idx + 1, &new_ex);
+			ext2_ext_dirty(inode, leaf);
+			/* A new first entry of a leaf moves the keys above it */
+			for (level = depth - 1; level >= 0; level--) {
+				ei = &ext2_ext_first_idx(path[level].p_hdr)[path[level].p_idx];
+				if (le32_to_cpu(ei->ei_block) <= lblk)
+					break;
+				ei->ei_block = cpu_to_le32(lblk);
+				ext2_ext_dirty(inode, path[level].p_hdr);
+			}
+			break;
+		}
+		/* Find the lowest node with room, and split the one below it */
+		for (level = depth - 1; level >= 0; level--) {
+			if (le16_to_cpu(path[level].p_hdr->eh_entries) <
+			    le16_to_cpu(path[level].p_hdr->eh_max))
+				break;
+		}
+		if (level < 0)
+			ext2_ext_grow(inode);
+		else
+			ext2_ext_split(inode, path, level + 1);
+		ext2_ext_put_path(inode, path, depth);
+	}
+	ext2_ext_put_path(inode, path, depth);
+}
+
+/* Determines the FS block id for a given inode block id, or 0 if there isn't
+ * one.  Note that for non-extent inodes, this will alloc indirect tables. */
 uint32_t ext2_find_inoblock(struct inode *inode, unsigned int ino_block)
 {
-	uint32_t retval, *buf = ext2_lookup_inotable_slot(inode, ino_block);
+	uint32_t retval, *buf;
+
+	if (ext2_is_extent_inode(inode))
+		return ext2_ext_map(inode, ino_block);
+	buf = ext2_lookup_inotable_slot(inode, ino_block);
 	retval = *buf;
 	ext2_put_metablock(inode->i_sb, buf);
 	return retval;
 }
 
+/* Maps the inode's ino_block, which has no block yet, to FS block blkid. */
+static void ext2_link_inoblock(struct inode *inode, unsigned int ino_block,
+                               uint32_t blkid)
+{
+	uint32_t *blk_slot;
+
+	if (ext2_is_extent_inode(inode)) {
+		ext2_ext_insert(inode, ino_block, blkid);
+		return;
+	}
+	blk_slot = ext2_lookup_inotable_slot(inode, ino_block);
+	*blk_slot = cpu_to_le32(blkid);
+	ext2_dirty_metablock(inode->i_sb, blk_slot);
+	ext2_put_metablock(inode->i_sb, blk_slot);
+}
+
+/* Picks a goal for allocating the inode's ino_block: right after the file's
+ * previous block, if there is one, o/w the start of the inode's BG. */
+static uint32_t ext2_inoblock_goal(struct inode *inode, unsigned int ino_block)
+{
+	uint32_t prev = ino_block ? ext2_find_inoblock(inode, ino_block - 1) : 0;
+
+	if (prev)
+		return prev + 1;
+	return ext2_bgidx2block(inode->i_sb, ext2_inode2bg(inode), 0);
+}
+
 /* Returns an incref'd metadata block for the contents of the ino block.  Don't
  * use this for regular files - use their inode's page cache instead (used for
  * directories for now).  If there isn't a block allocated yet, it will provide
  * a zeroed one. */
 void *ext2_get_ino_metablock(struct inode *inode, unsigned long ino_block)
 {
-	uint32_t blkid, *retval, *blk_slot;
-	blk_slot = ext2_lookup_inotable_slot(inode, ino_block);
-	blkid = le32_to_cpu(*blk_slot);
-	if (blkid) {
-		ext2_put_metablock(inode->i_sb, blk_slot);
+	uint32_t blkid, *retval;
+
+	blkid = ext2_find_inoblock(inode, ino_block);
+	if (blkid)
 		return ext2_get_metablock(inode->i_sb, blkid);
-	}
 	/* If there isn't a block there, alloc and insert one.  This block will be
 	 * the next big chunk of "file" data for this inode. */
-	blkid = ext2_alloc_block(inode, ext2_bgidx2block(inode->i_sb,
-	                                                 ext2_inode2bg(inode),
-	                                                 0));
-	*blk_slot = cpu_to_le32(blkid);
-	ext2_dirty_metablock(inode->i_sb, blk_slot);
-	ext2_put_metablock(inode->i_sb, blk_slot);
+	blkid = ext2_alloc_inoblock(inode, ino_block,
+	                            ext2_inoblock_goal(inode, ino_block));
+	ext2_link_inoblock(inode, ino_block, blkid);
 	inode->i_blocks += inode->i_sb->s_blocksize >> 9;	/* inc by 1 FS block */
 	inode->i_size += inode->i_sb->s_blocksize;
 	retval = ext2_get_metablock(inode->i_sb, blkid);
@@ -609,6 +1049,10 @@ struct super_block *ext2_get_sb(struct fs_type *fs, int flags,
 	blks_per_group = le32_to_cpu(e2sb->s_blocks_per_group);
 	((struct ext2_sb_info*)sb->s_fs_info)->nr_bgs = num_blks / blks_per_group +
 	                                       (num_blks % blks_per_group ? 1 : 0);
+	/* New files get extent trees if the FS was made with them */
+	((struct ext2_sb_info*)sb->s_fs_info)->extents =
+	        le32_to_cpu(e2sb->s_feature_incompat) & EXT3_FEATURE_INCOMPAT_EXTENTS ?
+	        TRUE : FALSE;
 
 	/* Final stages of initializing the sb, mostly FS-independent */
 	init_sb(sb, vmnt, &ext2_d_op, EXT2_ROOT_INO, 0);
@@ -630,65 +1074,61 @@ struct fs_type ext2_fs_type = {"EXT2", 0, ext2_get_sb, ext2_kill_sb, {0, 0},
 
 /* Page Map Operations */
 
-/* Sets up the bidirectional mapping between the page and its buffer heads.  As
- * a future optimization, we could try and detect if all of the blocks are
- * contiguous (either before or after making them) and compact them to one BH.
- * Note there is an assumption that the file has at least one block in it. */
+/* Sets up the bidirectional mapping between the page and its buffer heads.
+ * Blocks that are contiguous on disk share a BH, so a page whose blocks are
+ * all contiguous is a single request to the device.  Note there is an
+ * assumption that the file has at least one block in it. */
 int ext2_mappage(struct page_map *pm, struct page *page)
 {
-	struct buffer_head *bh;
+	struct buffer_head *bh = 0, *new_bh;
 	struct inode *inode = (struct inode*)pm->pm_host;
 	assert(!page->pg_private);		/* double check that we aren't bh-mapped */
 	assert(inode->i_mapping == pm);	/* double check we are the inode for pm */
 	struct block_device *bdev = inode->i_sb->s_bdev;
 	unsigned int blk_per_pg = PGSIZE / inode->i_sb->s_blocksize;
 	unsigned int sct_per_blk = inode->i_sb->s_blocksize / bdev->b_sector_sz;
-	uint32_t ino_blk_num, fs_blk_num = 0, *fs_blk_slot;
+	unsigned int bh_flags;
+	uint32_t ino_blk_num, fs_blk_num, goal = 0;
 
-	bh = kmem_cache_alloc(bh_kcache, 0);
-	page->pg_private = bh;
 	for (int i = 0; i < blk_per_pg; i++) {
-		/* free_bh() can handle having a halfway aborted mappage() */
-		if (!bh)
-			return -ENOMEM;
-		bh->bh_page = page;							/* weak ref */
-		bh->bh_buffer = page2kva(page) + i * inode->i_sb->s_blocksize;
-		bh->bh_flags = 0;							/* whatever... */
-		bh->bh_bdev = bdev;							/* uncounted ref */
-		/* compute the first sector of the FS block for the ith buf in the pg */
 		ino_blk_num = page->pg_index * blk_per_pg + i;
-		fs_blk_slot = ext2_lookup_inotable_slot(inode, ino_blk_num);
-		/* If there isn't a block there, lets get one.  The previous fs_blk_num
-		 * is our hint (or we have to compute one). */
-		if (!*fs_blk_slot) {
-			if (!fs_blk_num) {
-				fs_blk_num = ext2_bgidx2block(inode->i_sb,
-				                              ext2_inode2bg(inode), 0);
-			}
-			fs_blk_num = ext2_alloc_block(inode, fs_blk_num + 1);
-			/* Link it, and dirty the inode indirect block */
-			*fs_blk_slot = cpu_to_le32(fs_blk_num);
-			ext2_dirty_metablock(inode->i_sb, fs_blk_slot);
+		fs_blk_num = ext2_find_inoblock(inode, ino_blk_num);
+		bh_flags = 0;
+		/* If there isn't a block there, lets get one.  The previous block in
+		 * the file is our hint. */
+		if (!fs_blk_num) {
+			if (!goal)
+				goal = ext2_inoblock_goal(inode, ino_blk_num);
+			fs_blk_num = ext2_alloc_inoblock(inode, ino_blk_num, goal);
+			ext2_link_inoblock(inode, ino_blk_num, fs_blk_num);
 			/* the block is still on disk, and we don't want its contents */
-			bh->bh_flags = BH_NEEDS_ZEROED;			/* talking to readpage */
+			bh_flags = BH_NEEDS_ZEROED;				/* talking to readpage */
 			/* update our num blocks, with 512B each "block" (ext2-style) */
 			inode->i_blocks += inode->i_sb->s_blocksize >> 9;
-		} else {	/* there is a block there already */
-			fs_blk_num = *fs_blk_slot;
 		}
-		ext2_put_metablock(inode->i_sb, fs_blk_slot);
+		goal = fs_blk_num + 1;
+		/* Contiguous with the previous BH, so just grow it */
+		if (bh && (bh->bh_flags == bh_flags) &&
+		    (bh->bh_sector + bh->bh_nr_sector == fs_blk_num * sct_per_blk)) {
+			bh->bh_nr_sector += sct_per_blk;
+			continue;
+		}
+		new_bh = kmem_cache_alloc(bh_kcache, 0);
+		/* free_bh() can handle having a halfway aborted mappage() */
+		if (!new_bh)
+			return -ENOMEM;
+		if (bh)
+			bh->bh_next = new_bh;
+		else
+			page->pg_private = new_bh;
+		bh = new_bh;
+		bh->bh_page = page;							/* weak ref */
+		bh->bh_buffer = page2kva(page) + i * inode->i_sb->s_blocksize;
+		bh->bh_flags = bh_flags;
+		bh->bh_bdev = bdev;							/* uncounted ref */
 		bh->bh_sector = fs_blk_num * sct_per_blk;
 		bh->bh_nr_sector = sct_per_blk;
-		/* Stop if we're the last block in the page.  We could be going beyond
-		 * the end of the file, in which case the next BHs will be zeroed. */
-		if (i == blk_per_pg - 1) {
-			bh->bh_next = 0;
-			break;
-		} else {
-			/* get and link to the next BH. */
-			bh->bh_next = kmem_cache_alloc(bh_kcache, 0);
-			bh = bh->bh_next;
-		}
+		bh->bh_next = 0;
 	}
 	return 0;
 }
@@ -729,7 +1169,7 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 			breq->nr_bhs++;
 			i++;
 		} else {
-			memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
+			memset(bh->bh_buffer, 0, bh->bh_nr_sector * bdev->b_sector_sz);
 			bh->bh_flags |= BH_DIRTY;
 			atomic_or(&bh->bh_page->pg_flags, PG_DIRTY);
 		}
@@ -754,9 +1194,11 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
+/* Writes the whole page back.  The VFS only tracks dirtiness per page, so we
+ * write every block in it, including any past EOF. */
 int ext2_writepage(struct page_map *pm, struct page *page)
 {
-	return -1;
+	return bdev_write_bhs(page, FALSE);
 }
 
 /* Super Operations */
@@ -782,6 +1224,8 @@ struct inode *ext2_alloc_inode(struct super_block *sb)
  * inode is still on disc is irrelevant. */
 void ext2_dealloc_inode(struct inode *inode)
 {
+	if (inode->i_fs_info)
+		ext2_discard_rsv(inode);
 	kmem_cache_free(ext2_i_kcache, inode->i_fs_info);
 }
 
@@ -847,11 +1291,17 @@ void ext2_read_inode(struct inode *inode)
 	inode->i_flags = le32_to_cpu(my_ino->i_flags);
 	inode->i_socket = FALSE;		/* for now */
 	/* Copy over the other inode stuff that isn't in the VFS inode.  For now,
-	 * it's just the block pointers */
+	 * it's just the block pointers (or the extent root, which we keep in its
+	 * on-disk format). */
 	inode->i_fs_info = kmem_cache_alloc(ext2_i_kcache, 0);
 	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
-	for (int i = 0; i < 15; i++)
-		e2ii->i_block[i] = le32_to_cpu(my_ino->i_block[i]);
+	memset(e2ii, 0, sizeof(struct ext2_i_info));
+	if (ext2_is_extent_inode(inode)) {
+		memcpy(e2ii->i_block, my_ino->i_block, sizeof(e2ii->i_block));
+	} else {
+		for (int i = 0; i < 15; i++)
+			e2ii->i_block[i] = le32_to_cpu(my_ino->i_block[i]);
+	}
 	/* TODO: (HASH) unused: inode->i_hash add to hash (saves on disc reading) */
 	/* TODO: we could consider saving a pointer to the disk inode and pinning
 	 * its buffer in memory, but for now we'll just free it. */
@@ -1087,6 +1537,7 @@ int ext2_create(struct inode *dir, struct dentry *dentry, int mode,
 {
 	struct inode *inode = dentry->d_inode;
 	struct ext2_block_group *dir_bg = ext2_inode2bg(dir);
+	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)dir->i_sb->s_fs_info;
 	struct ext2_inode *disk_inode;
 	struct ext2_i_info *e2ii;
 	uint32_t dir_block;
@@ -1096,14 +1547,19 @@ int ext2_create(struct inode *dir, struct dentry *dentry, int mode,
 	SET_FTYPE(inode->i_mode, __S_IFREG);
 	inode->i_fop = &ext2_f_op_file;
 	inode->i_ino = ext2_alloc_diskinode(inode, dir_bg);
+	if (e2sbi->extents)
+		inode->i_flags |= EXT4_EXTENTS_FL;
 	/* Initialize disk inode (this will be different for short symlinks) */
 	disk_inode = ext2_get_diskinode(inode);
 	ext2_init_diskinode(disk_inode, inode);
 	/* Initialize the e2ii (might get rid of this cache of block info) */
 	inode->i_fs_info = kmem_cache_alloc(ext2_i_kcache, 0);
 	e2ii = (struct ext2_i_info*)inode->i_fs_info;
-	for (int i = 0; i < 15; i++)
-		e2ii->i_block[i] = le32_to_cpu(disk_inode->i_block[i]);
+	memset(e2ii, 0, sizeof(struct ext2_i_info));
+	if (ext2_is_extent_inode(inode)) {
+		ext2_ext_init_root(e2ii);
+		memcpy(disk_inode->i_block, e2ii->i_block, sizeof(e2ii->i_block));
+	}
 	/* Dirty and put the disk inode */
 	ext2_dirty_metablock(dentry->d_sb, disk_inode);
 	ext2_put_metablock(dentry->d_sb, disk_inode);
@@ -1413,7 +1869,7 @@ unsigned int ext2_poll(struct file *file, struct poll_table_struct *poll_table)
 ssize_t ext2_readv(struct file *file, const struct iovec *vector,
                   unsigned long count, off64_t *offset)
 {
-	return -1;
+	return generic_file_readv(file, vector, count, offset);
 }
 
 /* Writes count bytes to a file, starting from (and modifiying) offset, and
@@ -1421,7 +1877,7 @@ ssize_t ext2_readv(struct file *file, const struct iovec *vector,
 ssize_t ext2_writev(struct file *file, const struct iovec *vector,
                   unsigned long count, off64_t *offset)
 {
-	return -1;
+	return generic_file_writev(file, vector, count, offset);
 }
 
 /* Write the contents of file to the page.  Will sort the params later */
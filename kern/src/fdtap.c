@@ -11,7 +11,23 @@
 #include <kmalloc.h>
 #include <syscall.h>
 #include <error.h>
+#include <percpu.h>
+#include <smp.h>
+#include <trap.h>
 
+#define TAP_BATCH_SZ 64
+
+/* Tap events from fire_tap_batched(), waiting to be sent.  Each entry holds a
+ * ref on its proc, since the tap could be gone by the time we flush. */
+struct tap_batch {
+	unsigned int				nr;
+	bool						flushing;
+	bool						kmsg_pending;
+	struct proc					*procs[TAP_BATCH_SZ];
+	struct event_queue			*ev_qs[TAP_BATCH_SZ];
+	struct event_msg			msgs[TAP_BATCH_SZ];
+};
+static DEFINE_PERCPU(struct tap_batch, tap_batches);
 
 static void tap_min_release(struct kref *kref)
 {
@@ -27,8 +43,37 @@ static void tap_full_release(struct kref *kref)
 	tap_min_release(kref);
 }
 
+/* Finds the tap on fdesc for {ev_q, ev_id}.  Caller holds the fdt lock. */
+static struct fd_tap *__find_fd_tap(struct file_desc *fdesc,
+                                    struct event_queue *ev_q, int ev_id)
+{
+	struct fd_tap *tap_i;
+
+	for (tap_i = fdesc->fd_tap; tap_i; tap_i = tap_i->fd_next) {
+		if ((tap_i->ev_q == ev_q) && (tap_i->ev_id == ev_id))
+			return tap_i;
+	}
+	return 0;
+}
+
+/* Removes tap from fdesc's list, returning TRUE if it was there.  Caller holds
+ * the fdt lock. */
+static bool __unlink_fd_tap(struct file_desc *fdesc, struct fd_tap *tap)
+{
+	struct fd_tap **pp;
+
+	for (pp = &fdesc->fd_tap; *pp; pp = &(*pp)->fd_next) {
+		if (*pp == tap) {
+			*pp = tap->fd_next;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 /* Adds a tap with the file/qid of the underlying device for the requested FD.
- * The FD must be a chan, and the device must support the filter requested.
+ * The FD must be a chan, and the device must support the filter requested.  An
+ * FD can have multiple taps, but only one per {ev_q, ev_id}.
  *
  * Returns -1 or some other device-specific non-zero number on failure, 0 on
  * success. */
@@ -66,8 +111,9 @@ int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
 		goto out_with_lock;
 	}
 	chan = fdt->fd[fd].fd_chan;
-	if (fdt->fd[fd].fd_tap) {
-		set_error(EBUSY, "FD %d already has a tap", fd);
+	if (__find_fd_tap(&fdt->fd[fd], tap->ev_q, tap->ev_id)) {
+		set_error(EBUSY, "FD %d already has a tap for ev_q %p, ev_id %d", fd,
+		          tap->ev_q, tap->ev_id);
 		goto out_with_lock;
 	}
 	if (!devtab[chan->type].tapfd) {
@@ -82,6 +128,7 @@ int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
 	/* One for the FD table, one for us to keep the removal of *this* tap from
 	 * happening until we've attempted to register with the device. */
 	kref_init(&tap->kref, tap_full_release, 2);
+	tap->fd_next = fdt->fd[fd].fd_tap;
 	fdt->fd[fd].fd_tap = tap;
 	/* As soon as we unlock, another thread can come in and remove our old tap
 	 * from the table and decref it.  Our ref keeps us from removing it yet,
@@ -97,8 +144,11 @@ int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
 		/* we failed, so we need to make sure *our* tap is removed.  We haven't
 		 * decreffed, so we know our tap pointer is unique. */
 		spin_lock(&fdt->lock);
-		if (fdt->fd[fd].fd_tap == tap) {
-			fdt->fd[fd].fd_tap = 0;
+		/* The FD could have been closed and reopened, so we only look for
+		 * our tap in the FD's list if the FD is still open. */
+		if ((fd < fdt->max_fdset) &&
+		    GET_BITMASK_BIT(fdt->open_fds->fds_bits, fd) &&
+		    __unlink_fd_tap(&fdt->fd[fd], tap)) {
 			/* normally we can't decref a tap while holding a lock, but we
 			 * know we have another reference so this won't trigger a release */
 			kref_put(&tap->kref);
@@ -118,24 +168,98 @@ out_with_lock:
 	return -1;
 }
 
-/* Removes the FD tap associated with FD.  Returns 0 on success, -1 with
- * errno/errstr on failure. */
-int remove_fd_tap(struct proc *p, int fd)
+/* Helper: returns the open FD's tap list, or 0 with errno set.  Caller holds
+ * the fdt lock. */
+static struct file_desc *__get_tapped_fd(struct fd_table *fdt, int fd)
+{
+	if ((fd < 0) || (fd >= fdt->max_fdset) ||
+	    !GET_BITMASK_BIT(fdt->open_fds->fds_bits, fd)) {
+		set_errno(EBADF);
+		return 0;
+	}
+	if (!fdt->fd[fd].fd_tap) {
+		set_error(EBADF, "FD %d was not tapped", fd);
+		return 0;
+	}
+	return &fdt->fd[fd];
+}
+
+/* Removes FD taps.  If tap_req->ev_q is set, we only remove the tap for that
+ * {ev_q, ev_id}, o/w we remove all of the FD's taps.  Returns 0 on success, -1
+ * with errno/errstr on failure. */
+int remove_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
 {
 	struct fd_table *fdt = &p->open_files;
+	struct file_desc *fdesc;
 	struct fd_tap *tap;
 
 	spin_lock(&fdt->lock);
-	tap = fdt->fd[fd].fd_tap;
-	fdt->fd[fd].fd_tap = 0;
-	spin_unlock(&fdt->lock);
-	if (tap) {
-		kref_put(&tap->kref);
-		return 0;
+	fdesc = __get_tapped_fd(fdt, tap_req->fd);
+	if (!fdesc) {
+		spin_unlock(&fdt->lock);
+		return -1;
+	}
+	if (!tap_req->ev_q) {
+		tap = fdesc->fd_tap;
+		fdesc->fd_tap = 0;
 	} else {
-		set_error(EBADF, "FD %d was not tapped", fd);
+		tap = __find_fd_tap(fdesc, tap_req->ev_q, tap_req->ev_id);
+		if (tap) {
+			__unlink_fd_tap(fdesc, tap);
+			tap->fd_next = 0;
+		}
+	}
+	spin_unlock(&fdt->lock);
+	if (!tap) {
+		set_error(ENOENT, "FD %d has no tap for ev_q %p, ev_id %d",
+		          tap_req->fd, tap_req->ev_q, tap_req->ev_id);
+		return -1;
+	}
+	put_fd_taps(tap);
+	return 0;
+}
+
+/* Asks the device to fire the FD's tap for {ev_q, ev_id} for any events that
+ * are currently true.  Returns 0 on success, -1 with errno/errstr on failure,
+ * including if the device can't poll. */
+int poll_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
+{
+	struct fd_table *fdt = &p->open_files;
+	struct file_desc *fdesc;
+	struct fd_tap *tap;
+	int ret;
+
+	spin_lock(&fdt->lock);
+	fdesc = __get_tapped_fd(fdt, tap_req->fd);
+	if (!fdesc) {
+		spin_unlock(&fdt->lock);
+		return -1;
+	}
+	tap = __find_fd_tap(fdesc, tap_req->ev_q, tap_req->ev_id);
+	if (!tap) {
+		spin_unlock(&fdt->lock);
+		set_error(ENOENT, "FD %d has no tap for ev_q %p, ev_id %d",
+		          tap_req->fd, tap_req->ev_q, tap_req->ev_id);
 		return -1;
 	}
+	/* The FD table's ref keeps the tap alive until we get ours. */
+	kref_get(&tap->kref, 1);
+	spin_unlock(&fdt->lock);
+	ret = devtab[tap->chan->type].tapfd(tap->chan, tap, FDTAP_CMD_POLL);
+	kref_put(&tap->kref);
+	return ret;
+}
+
+/* Drops the FD table's refs on a list of taps, e.g. from a closed FD.  This can
+ * block, so don't hold any locks. */
+void put_fd_taps(struct fd_tap *tap)
+{
+	struct fd_tap *next;
+
+	for (; tap; tap = next) {
+		next = tap->fd_next;
+		kref_put(&tap->kref);
+	}
 }
 
 /* Fires off tap, with the events of filter having occurred.  Returns -1 on
@@ -165,3 +289,92 @@ int fire_tap(struct fd_tap *tap, int filter)
 	poperror();
 	return 0;
 }
+
+/* Sends a run of batched msgs that are all for the same proc and ev_q. */
+static void send_tap_msgs(struct proc *p, struct event_queue *ev_q,
+                          struct event_msg *msgs, int nr)
+{
+	ERRSTACK(1);
+
+	if (waserror()) {
+		/* Same deal as in fire_tap() */
+		warn("Batched taps for proc %d threw %s", p->pid, current_errstr());
+		poperror();
+		return;
+	}
+	send_event_batch(p, ev_q, msgs, nr, 0);
+	poperror();
+}
+
+/* Sends everything batched on this core.  Consecutive events for the same
+ * {proc, ev_q} (the common case, e.g. all of an epoll set's taps) go out with
+ * one send_event_batch(), so they share a single alert and wakeup.
+ *
+ * Don't hold any locks: dropping our proc refs could free a proc.  If we block
+ * while sending, events fired in the meantime on this core skip the batch. */
+void flush_tap_batch(void)
+{
+	struct tap_batch *batch = PERCPU_VARPTR(tap_batches);
+	unsigned int i, run;
+
+	if (batch->flushing || !batch->nr)
+		return;
+	batch->flushing = TRUE;
+	for (i = 0; i < batch->nr; i += run) {
+		for (run = 1; i + run < batch->nr; run++) {
+			if ((batch->procs[i + run] != batch->procs[i]) ||
+			    (batch->ev_qs[i + run] != batch->ev_qs[i]))
+				break;
+		}
+		send_tap_msgs(batch->procs[i], batch->ev_qs[i], &batch->msgs[i], run);
+	}
+	for (i = 0; i < batch->nr; i++)
+		proc_decref(batch->procs[i]);
+	batch->nr = 0;
+	wmb();	/* we might have blocked and moved cores, so order the reset */
+	batch->flushing = FALSE;
+}
+
+static void __flush_tap_batch(uint32_t srcid, long a0, long a1, long a2)
+{
+	PERCPU_VAR(tap_batches).kmsg_pending = FALSE;
+	flush_tap_batch();
+}
+
+/* Like fire_tap(), but the event is queued on this core and sent later with
+ * the rest of the core's batch, either when the caller calls flush_tap_batch()
+ * or when the core gets around to its routine kernel messages (e.g. the
+ * network ktask blocks for more packets).  For device paths that fire lots of
+ * taps in a burst.  Safe to call while holding the device's tap lock.
+ *
+ * If the batch is full or being flushed, or we're in IRQ context (the batch
+ * isn't IRQ-safe), this just calls fire_tap(). */
+int fire_tap_batched(struct fd_tap *tap, int filter)
+{
+	struct tap_batch *batch;
+	struct event_msg *ev_msg;
+	int fire_filt = tap->filter & filter;
+
+	if (!fire_filt)
+		return 0;
+	if (in_irq_ctx(&per_cpu_info[core_id()]))
+		return fire_tap(tap, filter);
+	batch = PERCPU_VARPTR(tap_batches);
+	if (batch->flushing || (batch->nr == TAP_BATCH_SZ))
+		return fire_tap(tap, filter);
+	if (!batch->kmsg_pending) {
+		batch->kmsg_pending = TRUE;
+		send_kernel_message(core_id(), __flush_tap_batch, 0, 0, 0,
+		                    KMSG_ROUTINE);
+	}
+	proc_incref(tap->proc, 1);
+	batch->procs[batch->nr] = tap->proc;
+	batch->ev_qs[batch->nr] = tap->ev_q;
+	ev_msg = &batch->msgs[batch->nr];
+	memset(ev_msg, 0, sizeof(struct event_msg));
+	ev_msg->ev_type = tap->ev_id;
+	ev_msg->ev_arg2 = fire_filt;
+	ev_msg->ev_arg3 = tap->data;
+	batch->nr++;
+	return 0;
+}
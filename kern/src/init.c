@@ -27,6 +27,7 @@
 #include <kmalloc.h>
 #include <hashtable.h>
 #include <radix.h>
+#include <rcu.h>
 #include <mm.h>
 #include <frontend.h>
 #include <ex_table.h>
@@ -45,6 +46,9 @@
 #include <ip.h>
 #include <acpi.h>
 #include <coreboot_tables.h>
+#include <lockstat.h>
+#include <lathist.h>
+#include <kmemtrack.h>
 
 #define MAX_BOOT_CMDLINE_SIZE 4096
 
@@ -148,18 +152,23 @@ void kernel_init(multiboot_info_t *mboot_info)
 	acpiinit();
 	topology_init();
 	percpu_init();
+	lockstat_init();
+	lathist_init();
+	kmemtrack_init();
 	kthread_init();					/* might need to tweak when this happens */
 	vmr_init();
 	file_init();
 	page_check();
 	idt_init();
 	kernel_msg_init();
+	rcu_init();
 	timer_init();
 	vfs_init();
 	devfs_init();
 	time_init();
 	arch_init();
 	block_init();
+	pm_reclaim_init();
 	enable_irq();
 	run_linker_funcs();
 	/* reset/init devtab after linker funcs 3 and 4.  these run NIC and medium
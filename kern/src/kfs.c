@@ -679,7 +679,7 @@ unsigned int kfs_poll(struct file *file, struct poll_table_struct *poll_table)
 ssize_t kfs_readv(struct file *file, const struct iovec *vector,
                   unsigned long count, off64_t *offset)
 {
-	return -1;
+	return generic_file_readv(file, vector, count, offset);
 }
 
 /* Writes count bytes to a file, starting from (and modifiying) offset, and
@@ -687,7 +687,7 @@ ssize_t kfs_readv(struct file *file, const struct iovec *vector,
 ssize_t kfs_writev(struct file *file, const struct iovec *vector,
                   unsigned long count, off64_t *offset)
 {
-	return -1;
+	return generic_file_writev(file, vector, count, offset);
 }
 
 /* Write the contents of file to the page.  Will sort the params later */
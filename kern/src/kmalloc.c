@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <slab.h>
 #include <assert.h>
+#include <kmemtrack.h>
 
 #define kmallocdebug(args...)  //printk(args)
 
@@ -30,16 +31,29 @@ void kmalloc_init(void)
 	 * since we adjusted the KMALLOC_SMALLEST based on that. */
 	static_assert(ALIGNED(sizeof(struct kmalloc_tag), 16));
 	/* build caches of common sizes.  this size will later include the tag and
-	 * the actual returned buffer. */
+	 * the actual returned buffer.  kmemtrack charges kmallocs through the tag,
+	 * not through the caches. */
 	size_t ksize = KMALLOC_SMALLEST;
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
 		kmalloc_caches[i] = kmem_cache_create("kmalloc_cache", ksize,
-		                                      KMALLOC_ALIGNMENT, 0, 0, 0);
+		                                      KMALLOC_ALIGNMENT, KMC_NOTRACK,
+		                                      0, 0);
 		ksize <<= 1;
 	}
 }
 
-void *kmalloc(size_t size, int flags)
+/* Charges the allocation to site, and saves what we need to uncharge it. */
+static void __kmalloc_track(struct kmalloc_tag *tag, size_t size,
+                            uintptr_t site)
+{
+#ifdef CONFIG_KMEM_TRACK
+	tag->site = kmemtrack_alloc(KMEMTRACK_KMALLOC, site, size);
+	tag->size = size;
+#endif
+}
+
+/* site is who called the public kmalloc function, for kmemtrack. */
+static void *__kmalloc(size_t size, int flags, uintptr_t site)
 {
 	// reserve space for bookkeeping and preserve alignment
 	size_t ksize = size + sizeof(struct kmalloc_tag);
@@ -63,6 +77,7 @@ void *kmalloc(size_t size, int flags)
 		tag->num_pages = num_pgs;
 		tag->canary = KMALLOC_CANARY;
 		kref_init(&tag->kref, __kfree_release, 1);
+		__kmalloc_track(tag, size, site);
 		return buf + sizeof(struct kmalloc_tag);
 	}
 	// else, alloc from the appropriate cache
@@ -75,19 +90,26 @@ void *kmalloc(size_t size, int flags)
 	tag->my_cache = kmalloc_caches[cache_id];
 	tag->canary = KMALLOC_CANARY;
 	kref_init(&tag->kref, __kfree_release, 1);
+	__kmalloc_track(tag, size, site);
 	return buf + sizeof(struct kmalloc_tag);
 }
 
+void *kmalloc(size_t size, int flags)
+{
+	return __kmalloc(size, flags, kmemtrack_caller());
+}
+
 void *kzmalloc(size_t size, int flags)
 {
-	void *v = kmalloc(size, flags);
+	void *v = __kmalloc(size, flags, kmemtrack_caller());
 	if (!v)
 		return v;
 	memset(v, 0, size);
 	return v;
 }
 
-void *kmalloc_align(size_t size, int flags, size_t align)
+static void *__kmalloc_align(size_t size, int flags, size_t align,
+                             uintptr_t site)
 {
 	void *addr, *retaddr;
 	int *tag_flags, offset;
@@ -98,7 +120,7 @@ void *kmalloc_align(size_t size, int flags, size_t align)
 	 * 'align'. */
 	assert(align < (1 << (32 - KMALLOC_ALIGN_SHIFT)));
 	assert(IS_PWR2(align));
-	addr = kmalloc(size + align, flags);
+	addr = __kmalloc(size + align, flags, site);
 	if (!addr)
 		return 0;
 	if (ALIGNED(addr, align))
@@ -113,9 +135,14 @@ void *kmalloc_align(size_t size, int flags, size_t align)
 	return retaddr;
 }
 
+void *kmalloc_align(size_t size, int flags, size_t align)
+{
+	return __kmalloc_align(size, flags, align, kmemtrack_caller());
+}
+
 void *kzmalloc_align(size_t size, int flags, size_t align)
 {
-	void *v = kmalloc_align(size, flags, align);
+	void *v = __kmalloc_align(size, flags, align, kmemtrack_caller());
 	if (!v)
 		return v;
 	memset(v, 0, size);
@@ -169,11 +196,18 @@ void *krealloc(void* buf, size_t size, int flags)
 		} else {
 			panic("Probably a bad tag, flags %p\n", tag->flags);
 		}
-		if (osize >= size)
+		if (osize >= size) {
+#ifdef CONFIG_KMEM_TRACK
+			if (tag->site)
+				kmemtrack_resize(KMEMTRACK_KMALLOC, tag->site, tag->size,
+				                 size);
+			tag->size = size;
+#endif
 			return buf;
+		}
 	}
 
-	nbuf = kmalloc(size, flags);
+	nbuf = __kmalloc(size, flags, kmemtrack_caller());
 
 	/* would be more interesting to user error(...) here. */
 	/* but in any event, NEVER destroy buf! */
@@ -214,6 +248,11 @@ int kmalloc_refcnt(void *buf)
 static void __kfree_release(struct kref *kref)
 {
 	struct kmalloc_tag *tag = container_of(kref, struct kmalloc_tag, kref);
+
+#ifdef CONFIG_KMEM_TRACK
+	if (tag->site)
+		kmemtrack_free(KMEMTRACK_KMALLOC, tag->site, tag->size);
+#endif
 	if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE)
 		kmem_cache_free(tag->my_cache, tag);
 	else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES)
@@ -246,9 +285,11 @@ struct sized_alloc *sized_kzmalloc(size_t size, int flags)
 {
 	struct sized_alloc *sza;
 
-	sza = kzmalloc(sizeof(struct sized_alloc) + size, flags);
+	sza = __kmalloc(sizeof(struct sized_alloc) + size, flags,
+	                kmemtrack_caller());
 	if (!sza)
 		return NULL;
+	memset(sza, 0, sizeof(struct sized_alloc) + size);
 	sza->buf = sza + 1;
 	sza->size = size;
 	return sza;
@@ -0,0 +1,216 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Kernel memory accounting by allocation site.  See kmemtrack.h for the
+ * overview.
+ *
+ * The per-core tables are open-addressed, keyed by call site, like lockstat's.
+ * A site claims an empty slot with a CAS, and slots are never freed: a site
+ * whose memory is all freed keeps its slot and its allocation count.  There is
+ * no reset, since clearing the live counts would leave the frees of existing
+ * objects with nothing to subtract from. */
+
+#include <kmemtrack.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <smp.h>
+#include <sort.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define KMEMTRACK_NR_SITES		2048	/* per core, power of two */
+#define KMEMTRACK_NR_PROBES		16
+#define KMEMTRACK_NR_MERGED		(KMEMTRACK_NR_SITES * 4)
+
+struct kmemtrack_site {
+	uintptr_t					pc;
+	int							type;
+	int64_t						live_bytes;
+	int64_t						live_objs;
+	uint64_t					nr_allocs;
+};
+
+struct kmemtrack_core {
+	struct kmemtrack_site		sites[KMEMTRACK_NR_SITES];
+	uint64_t					nr_dropped;
+};
+
+static struct kmemtrack_core *kmemtrack_cores;
+
+static const char *kmemtrack_type_names[] = {
+	[KMEMTRACK_KMALLOC] = "kmalloc",
+	[KMEMTRACK_PAGES] = "pages",
+	[KMEMTRACK_SLAB] = "slab",
+};
+
+void kmemtrack_init(void)
+{
+	struct kmemtrack_core *cores;
+
+	cores = kzmalloc(sizeof(struct kmemtrack_core) * num_cores, MEM_WAIT);
+	wmb();	/* tables are zeroed before anyone sees them */
+	kmemtrack_cores = cores;
+}
+
+static unsigned long kmemtrack_hash(uintptr_t pc)
+{
+	return ((uint64_t)pc * 0x9e37fffffffc0001ULL) >> 32;
+}
+
+/* Finds or claims pc's slot in tbl.  Returns 0 if there isn't room. */
+static struct kmemtrack_site *kmemtrack_find(struct kmemtrack_site *tbl,
+                                             size_t nr_slots, int nr_probes,
+                                             uintptr_t pc, int type)
+{
+	unsigned long idx = kmemtrack_hash(pc);
+	struct kmemtrack_site *site;
+
+	for (int i = 0; i < nr_probes; i++) {
+		site = &tbl[(idx + i) & (nr_slots - 1)];
+		if (site->pc == pc)
+			return site;
+		if (!site->pc && atomic_cas_ptr((void**)&site->pc, 0, (void*)pc)) {
+			site->type = type;
+			return site;
+		}
+		/* An IRQ could have claimed it for pc */
+		if (site->pc == pc)
+			return site;
+	}
+	return 0;
+}
+
+static struct kmemtrack_site *kmemtrack_get_site(int type, uintptr_t pc)
+{
+	struct kmemtrack_core *kc;
+	struct kmemtrack_site *site;
+
+	if (!kmemtrack_cores || !pc)
+		return 0;
+	kc = &kmemtrack_cores[core_id_early()];
+	site = kmemtrack_find(kc->sites, KMEMTRACK_NR_SITES, KMEMTRACK_NR_PROBES,
+	                      pc, type);
+	if (!site)
+		__sync_fetch_and_add(&kc->nr_dropped, 1);
+	return site;
+}
+
+/* Charges bytes to pc.  Returns the pc to save with the object and pass to
+ * kmemtrack_free(), which is 0 if the allocation wasn't tracked. */
+uintptr_t kmemtrack_alloc(int type, uintptr_t pc, size_t bytes)
+{
+	struct kmemtrack_site *site = kmemtrack_get_site(type, pc);
+
+	if (!site)
+		return 0;
+	__sync_fetch_and_add(&site->live_bytes, bytes);
+	__sync_fetch_and_add(&site->live_objs, 1);
+	__sync_fetch_and_add(&site->nr_allocs, 1);
+	return pc;
+}
+
+/* Gives back bytes that were charged to pc by kmemtrack_alloc(). */
+void kmemtrack_free(int type, uintptr_t pc, size_t bytes)
+{
+	struct kmemtrack_site *site = kmemtrack_get_site(type, pc);
+
+	if (!site)
+		return;
+	__sync_fetch_and_sub(&site->live_bytes, bytes);
+	__sync_fetch_and_sub(&site->live_objs, 1);
+}
+
+/* Changes the size of an object charged to pc, e.g. a krealloc in place. */
+void kmemtrack_resize(int type, uintptr_t pc, size_t old_bytes,
+                      size_t new_bytes)
+{
+	struct kmemtrack_site *site = kmemtrack_get_site(type, pc);
+
+	if (!site)
+		return;
+	__sync_fetch_and_add(&site->live_bytes,
+	                     (int64_t)new_bytes - (int64_t)old_bytes);
+}
+
+static void kmemtrack_merge(struct kmemtrack_site *to,
+                            struct kmemtrack_site *from)
+{
+	to->live_bytes += from->live_bytes;
+	to->live_objs += from->live_objs;
+	to->nr_allocs += from->nr_allocs;
+}
+
+static int kmemtrack_cmp(const void *a, const void *b)
+{
+	const struct kmemtrack_site *sa = a, *sb = b;
+
+	if (sa->live_bytes == sb->live_bytes)
+		return 0;
+	return sa->live_bytes > sb->live_bytes ? -1 : 1;
+}
+
+/* Returns a kmalloc'd table of the top_n sites by live bytes, merged across
+ * cores, followed by the totals.  top_n <= 0 lists every site.  Its length is
+ * in *len.  Returns 0 if kmemtrack hasn't started yet. */
+char *kmemtrack_report(int top_n, size_t *len)
+{
+	struct kmemtrack_site *merged, *site, *from;
+	size_t nr_sites = 0, bufsz, off = 0;
+	int64_t total_bytes[ARRAY_SIZE(kmemtrack_type_names)] = {0};
+	uint64_t nr_dropped = 0;
+	char *buf, *name;
+
+	if (!kmemtrack_cores)
+		return 0;
+	merged = kzmalloc(sizeof(struct kmemtrack_site) * KMEMTRACK_NR_MERGED,
+	                  MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		nr_dropped += kmemtrack_cores[i].nr_dropped;
+		for (int j = 0; j < KMEMTRACK_NR_SITES; j++) {
+			from = &kmemtrack_cores[i].sites[j];
+			if (!from->pc)
+				continue;
+			site = kmemtrack_find(merged, KMEMTRACK_NR_MERGED,
+			                      KMEMTRACK_NR_MERGED, from->pc, from->type);
+			if (!site) {
+				nr_dropped++;
+				continue;
+			}
+			kmemtrack_merge(site, from);
+		}
+	}
+	/* Pack them at the front, for sorting */
+	for (int i = 0; i < KMEMTRACK_NR_MERGED; i++) {
+		if (merged[i].pc)
+			merged[nr_sites++] = merged[i];
+	}
+	sort(merged, nr_sites, sizeof(struct kmemtrack_site), kmemtrack_cmp);
+	for (int i = 0; i < nr_sites; i++)
+		total_bytes[merged[i].type] += merged[i].live_bytes;
+	if (top_n > 0)
+		nr_sites = MIN(nr_sites, top_n);
+
+	bufsz = (nr_sites + 4) * 128;
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	off += snprintf(buf + off, bufsz - off, "%-7s %14s %10s %12s  %s\n",
+	                "type", "live-bytes", "live-objs", "allocs", "site");
+	for (int i = 0; i < nr_sites; i++) {
+		site = &merged[i];
+		name = get_fn_name(site->pc);
+		off += snprintf(buf + off, bufsz - off,
+		                "%-7s %14lld %10lld %12llu  %p %.64s\n",
+		                kmemtrack_type_names[site->type], site->live_bytes,
+		                site->live_objs, site->nr_allocs, site->pc,
+		                name ? name : "?");
+		kfree(name);
+	}
+	off += snprintf(buf + off, bufsz - off,
+	                "total: kmalloc %lld bytes, slab %lld bytes, pages %lld bytes\n",
+	                total_bytes[KMEMTRACK_KMALLOC], total_bytes[KMEMTRACK_SLAB],
+	                total_bytes[KMEMTRACK_PAGES]);
+	off += snprintf(buf + off, bufsz - off, "dropped: %llu\n", nr_dropped);
+	kfree(merged);
+	*len = MIN(off, bufsz);
+	return buf;
+}
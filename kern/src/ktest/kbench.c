@@ -0,0 +1,265 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Kernel microbenchmark runner.
+ *
+ * A run of a kbench on N cores sends a routine kmsg to N - 1 other cores and
+ * runs the last worker on the calling core.  The workers spin until all of
+ * them have arrived, then each times nr_iters calls of the op with the TSC.
+ * The samples from all workers are merged and sorted, and we print one line
+ * per run:
+ *
+ *	KBENCH suite=S name=N cores=C iters=I min_cyc= med_cyc= p99_cyc= max_cyc=
+ *	       min_ns= med_ns= p99_ns= max_ns=
+ *
+ * (all on one line), which is meant to be grepped out of the console and
+ * compared between builds.
+ *
+ * The remote workers run as RKMs, so a core that is busy running a process
+ * won't start its worker until the process gives up the core.  We only send
+ * workers to cores that no process owns, and if a worker still hasn't arrived
+ * after KBENCH_START_TIMEOUT_USEC, we report the run as FAILED instead of
+ * waiting forever.  A worker that arrives after that just leaves. */
+
+#include <ktest.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <process.h>
+#include <smp.h>
+#include <sort.h>
+#include <string.h>
+#include <time.h>
+#include <trap.h>
+
+#ifndef CONFIG_KBENCH_NR_ITERS
+#define CONFIG_KBENCH_NR_ITERS 10000
+#endif
+
+#define KBENCH_START_TIMEOUT_USEC	1000000
+#define KBENCH_ABORTED				-1
+
+/* Each worker has a ref, since one that shows up late can outlive the run. */
+struct kbench_run {
+	struct kbench				*kb;
+	struct kbench_ctx			ctx;
+	uint64_t					*samples;
+	struct kref					kref;
+	atomic_t					nr_ready;	/* or KBENCH_ABORTED */
+	atomic_t					nr_done;
+};
+
+/* Global linked list used to store registered kbench suites */
+SLIST_HEAD(kbench_suiteq, kbench_suite);
+static struct kbench_suiteq kbench_suiteq =
+	SLIST_HEAD_INITIALIZER(kbench_suiteq);
+
+void register_kbench_suite(struct kbench_suite *suite)
+{
+	SLIST_INSERT_HEAD(&kbench_suiteq, suite, link);
+}
+
+static void kbench_run_release(struct kref *kref)
+{
+	struct kbench_run *run = container_of(kref, struct kbench_run, kref);
+
+	kfree(run->samples);
+	kfree(run);
+}
+
+/* Checks in at the start line.  Returns FALSE if the run was aborted. */
+static bool kbench_join(struct kbench_run *run)
+{
+	long ready;
+
+	do {
+		ready = atomic_read(&run->nr_ready);
+		if (ready == KBENCH_ABORTED)
+			return FALSE;
+	} while (!atomic_cas(&run->nr_ready, ready, ready + 1));
+	return TRUE;
+}
+
+/* Waits for every worker to join.  Worker 0, on the calling core, gives up
+ * after the timeout.  It can only abort while someone is missing, so either
+ * all of the workers run the op or none of them do.  Returns FALSE if the run
+ * was aborted. */
+static bool kbench_wait_start(struct kbench_run *run, int worker)
+{
+	uint64_t start = read_tsc();
+	long ready;
+
+	while ((ready = atomic_read(&run->nr_ready)) != run->ctx.nr_workers) {
+		if (ready == KBENCH_ABORTED)
+			return FALSE;
+		if (!worker &&
+		    tsc2usec(read_tsc() - start) > KBENCH_START_TIMEOUT_USEC &&
+		    atomic_cas(&run->nr_ready, ready, KBENCH_ABORTED))
+			return FALSE;
+		cpu_relax();
+	}
+	return TRUE;
+}
+
+/* Returns FALSE if the run was aborted before the op ran. */
+static bool kbench_worker(struct kbench_run *run, int worker)
+{
+	uint64_t *samples = run->samples + worker * run->ctx.nr_iters;
+	uint64_t start;
+
+	if (!kbench_join(run) || !kbench_wait_start(run, worker))
+		return FALSE;
+	for (unsigned long i = 0; i < run->ctx.nr_iters; i++) {
+		start = start_timing();
+		run->kb->op(&run->ctx, worker, i);
+		samples[i] = stop_timing(start);
+	}
+	atomic_inc(&run->nr_done);
+	return TRUE;
+}
+
+static void __kbench_worker(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kbench_run *run = (struct kbench_run*)a0;
+
+	/* Ops like IPIs and alarms need IRQs, and RKMs start with them off */
+	enable_irq();
+	kbench_worker(run, (int)a1);
+	disable_irq();
+	kref_put(&run->kref);
+}
+
+/* Fills cores with up to nr cores that no process owns, other than the calling
+ * core, starting with the ones after it.  Returns how many it found. */
+static int kbench_idle_cores(int *cores, int nr)
+{
+	int coreid = core_id();
+	int n = 0, c;
+
+	for (int i = 1; (i < num_cores) && (n < nr); i++) {
+		c = (coreid + i) % num_cores;
+		if (ACCESS_ONCE(per_cpu_info[c].owning_proc))
+			continue;
+		if (cores)
+			cores[n] = c;
+		n++;
+	}
+	return n;
+}
+
+static int kbench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void kbench_report(struct kbench_suite *suite, struct kbench_run *run)
+{
+	size_t nr = run->ctx.nr_workers * run->ctx.nr_iters;
+	uint64_t *s = run->samples;
+	uint64_t min, med, p99, max;
+
+	sort(s, nr, sizeof(uint64_t), kbench_cmp);
+	min = s[0];
+	med = s[nr / 2];
+	p99 = s[MIN(nr * 99 / 100, nr - 1)];
+	max = s[nr - 1];
+	printk("KBENCH suite=%s name=%s cores=%d iters=%lu min_cyc=%llu med_cyc=%llu p99_cyc=%llu max_cyc=%llu min_ns=%llu med_ns=%llu p99_ns=%llu max_ns=%llu\n",
+	       suite->name, run->kb->name, run->ctx.nr_workers, run->ctx.nr_iters,
+	       min, med, p99, max, tsc2nsec(min), tsc2nsec(med), tsc2nsec(p99),
+	       tsc2nsec(max));
+}
+
+/* Runs kb on nr_cores cores: the calling core and idle ones after it. */
+static void kbench_run_on(struct kbench_suite *suite, struct kbench *kb,
+                          int nr_cores, unsigned long nr_iters)
+{
+	struct kbench_run *run;
+	int *cores;
+	bool started;
+
+	cores = kmalloc(sizeof(int) * nr_cores, MEM_WAIT);
+	if (kbench_idle_cores(cores, nr_cores - 1) < nr_cores - 1) {
+		printk("\tSKIPPED [%s]   not enough idle cores for %d workers\n",
+		       kb->name, nr_cores);
+		kfree(cores);
+		return;
+	}
+	run = kzmalloc(sizeof(struct kbench_run), MEM_WAIT);
+	run->kb = kb;
+	run->ctx.nr_workers = nr_cores;
+	run->ctx.nr_iters = nr_iters;
+	run->ctx.p = current;
+	kref_init(&run->kref, kbench_run_release, 1);
+	atomic_init(&run->nr_ready, 0);
+	atomic_init(&run->nr_done, 0);
+	if (kb->setup && !kb->setup(&run->ctx)) {
+		printk("\tSKIPPED [%s]   %s\n", kb->name, ktest_msg);
+		kfree(cores);
+		kref_put(&run->kref);
+		return;
+	}
+	run->samples = kmalloc(sizeof(uint64_t) * nr_cores * nr_iters, MEM_WAIT);
+	for (int i = 1; i < nr_cores; i++) {
+		kref_get(&run->kref, 1);
+		send_kernel_message(cores[i - 1], __kbench_worker, (long)run, i, 0,
+		                    KMSG_ROUTINE);
+	}
+	kfree(cores);
+	started = kbench_worker(run, 0);
+	/* Once they started, the workers are in the kernel and will finish */
+	while (started && (atomic_read(&run->nr_done) < nr_cores))
+		cpu_relax();
+	if (kb->teardown)
+		kb->teardown(&run->ctx);
+	if (started)
+		kbench_report(suite, run);
+	else
+		printk("\tFAILED [%s]   not all %d workers started within %d usec\n",
+		       kb->name, nr_cores, KBENCH_START_TIMEOUT_USEC);
+	kref_put(&run->kref);
+}
+
+/* Runs the suite's enabled kbenches, or just the one called name.  nr_cores == 0
+ * runs each on one core and then on all the idle cores; nr_iters == 0 uses the
+ * Kconfig default. */
+void run_kbench_suite(struct kbench_suite *suite, const char *name,
+                      int nr_cores, unsigned long nr_iters)
+{
+	int nr_idle;
+
+	if (!nr_iters)
+		nr_iters = CONFIG_KBENCH_NR_ITERS;
+	nr_cores = MIN(nr_cores, num_cores);
+	printk("<-- BEGIN_KERNEL_%s_BENCHMARKS -->\n", suite->name);
+	for (int i = 0; i < suite->num_kbenches; i++) {
+		struct kbench *kb = &suite->kbenches[i];
+
+		if (name && strcmp(name, kb->name))
+			continue;
+		if (!kb->enabled) {
+			printk("\tDISABLED [%s]\n", kb->name);
+			continue;
+		}
+		if (nr_cores) {
+			kbench_run_on(suite, kb, nr_cores, nr_iters);
+			continue;
+		}
+		kbench_run_on(suite, kb, 1, nr_iters);
+		nr_idle = kbench_idle_cores(NULL, num_cores);
+		if (nr_idle)
+			kbench_run_on(suite, kb, nr_idle + 1, nr_iters);
+	}
+	printk("<-- END_KERNEL_%s_BENCHMARKS -->\n", suite->name);
+}
+
+void run_registered_kbench_suites(const char *name, int nr_cores,
+                                  unsigned long nr_iters)
+{
+	struct kbench_suite *suite;
+
+	SLIST_FOREACH(suite, &kbench_suiteq, link)
+		run_kbench_suite(suite, name, nr_cores, nr_iters);
+}
@@ -0,0 +1,227 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Microbenchmarks of kernel primitives.  See kbench.c for how they are run and
+ * what they print.  Each op is one iteration: an alloc and its free, a qio write
+ * and the read that drains it, an IPI and its ack, etc. */
+
+#include <ktest.h>
+#include <alarm.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <linker_func.h>
+#include <mm.h>
+#include <ns.h>
+#include <process.h>
+#include <slab.h>
+#include <smp.h>
+#include <trap.h>
+#include <ros/mman.h>
+
+KBENCH_SUITE("PRIMITIVES")
+
+#define KBENCH_OBJ_SZ		64
+
+void bench_kmalloc(struct kbench_ctx *ctx, int worker, unsigned long iter)
+{
+	kfree(kmalloc(KBENCH_OBJ_SZ, MEM_WAIT));
+}
+
+/* All workers share the cache, so multi-core runs include its locking. */
+bool bench_kmem_cache_setup(struct kbench_ctx *ctx)
+{
+	ctx->arg = kmem_cache_create("kbench", KBENCH_OBJ_SZ, __alignof__(int), 0,
+	                             0, 0);
+	return true;
+}
+
+void bench_kmem_cache(struct kbench_ctx *ctx, int worker, unsigned long iter)
+{
+	struct kmem_cache *kc = ctx->arg;
+
+	kmem_cache_free(kc, kmem_cache_alloc(kc, MEM_WAIT));
+}
+
+void bench_kmem_cache_teardown(struct kbench_ctx *ctx)
+{
+	kmem_cache_destroy(ctx->arg);
+}
+
+bool bench_qio_setup(struct kbench_ctx *ctx)
+{
+	struct queue **qs;
+
+	qs = kzmalloc(sizeof(struct queue*) * ctx->nr_workers, MEM_WAIT);
+	for (int i = 0; i < ctx->nr_workers; i++)
+		qs[i] = qopen(4 * KBENCH_OBJ_SZ, 0, 0, 0);
+	ctx->arg = qs;
+	return true;
+}
+
+void bench_qio(struct kbench_ctx *ctx, int worker, unsigned long iter)
+{
+	struct queue **qs = ctx->arg;
+	uint8_t buf[KBENCH_OBJ_SZ];
+
+	qwrite(qs[worker], buf, sizeof(buf));
+	qread(qs[worker], buf, sizeof(buf));
+}
+
+void bench_qio_teardown(struct kbench_ctx *ctx)
+{
+	struct queue **qs = ctx->arg;
+
+	for (int i = 0; i < ctx->nr_workers; i++)
+		qfree(qs[i]);
+	kfree(qs);
+}
+
+void bench_block_alloc(struct kbench_ctx *ctx, int worker, unsigned long iter)
+{
+	freeb(block_alloc(KBENCH_OBJ_SZ, MEM_WAIT));
+}
+
+struct kbench_alarm {
+	struct alarm_waiter			waiter;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static void kbench_alarm_handler(struct alarm_waiter *waiter)
+{
+	/* The op unsets it long before it could go off */
+	warn("kbench alarm fired");
+}
+
+bool bench_alarm_setup(struct kbench_ctx *ctx)
+{
+	struct kbench_alarm *alarms;
+
+	alarms = kzmalloc_align(sizeof(struct kbench_alarm) * ctx->nr_workers,
+	                        MEM_WAIT, ARCH_CL_SIZE);
+	for (int i = 0; i < ctx->nr_workers; i++)
+		init_awaiter(&alarms[i].waiter, kbench_alarm_handler);
+	ctx->arg = alarms;
+	return true;
+}
+
+void bench_alarm(struct kbench_ctx *ctx, int worker, unsigned long iter)
+{
+	struct kbench_alarm *alarms = ctx->arg;
+	struct alarm_waiter *waiter = &alarms[worker].waiter;
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+
+	set_awaiter_rel(waiter, 1000000);
+	set_alarm(tchain, waiter);
+	unset_alarm(tchain, waiter);
+}
+
+void bench_alarm_teardown(struct kbench_ctx *ctx)
+{
+	kfree(ctx->arg);
+}
+
+/* A yield is a save of this kthread, an RKM, and a restart of it. */
+void bench_kthread_yield(struct kbench_ctx *ctx, int worker,
+                         unsigned long iter)
+{
+	kthread_yield();
+}
+
+struct kbench_ipi {
+	bool						acked;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static void __kbench_ipi_ack(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kbench_ipi *ipi = (struct kbench_ipi*)a0;
+
+	ipi->acked = TRUE;
+}
+
+bool bench_ipi_setup(struct kbench_ctx *ctx)
+{
+	ctx->arg = kzmalloc_align(sizeof(struct kbench_ipi) * ctx->nr_workers,
+	                          MEM_WAIT, ARCH_CL_SIZE);
+	return true;
+}
+
+/* Round trip of an immediate kmsg to the next core.  That core is often
+ * running a worker too, but immediate kmsgs get through even if it isn't. */
+void bench_ipi(struct kbench_ctx *ctx, int worker, unsigned long iter)
+{
+	struct kbench_ipi *ipi = &((struct kbench_ipi*)ctx->arg)[worker];
+
+	ipi->acked = FALSE;
+	send_kernel_message((core_id() + 1) % num_cores, __kbench_ipi_ack,
+	                    (long)ipi, 0, 0, KMSG_IMMEDIATE);
+	while (!ACCESS_ONCE(ipi->acked))
+		cpu_relax();
+}
+
+void bench_ipi_teardown(struct kbench_ctx *ctx)
+{
+	kfree(ctx->arg);
+}
+
+/* Page faults need an address space, so this only runs when a process asked
+ * for the benchmarks (e.g. through #regress).  Each worker gets its own anon
+ * mapping in that process and faults in a new page per iteration. */
+bool bench_pagefault_setup(struct kbench_ctx *ctx)
+{
+	uintptr_t *bases;
+	void *addr;
+
+	if (!ctx->p) {
+		snprintf(ktest_msg, sizeof(ktest_msg), "no process to fault in");
+		return false;
+	}
+	bases = kzmalloc(sizeof(uintptr_t) * ctx->nr_workers, MEM_WAIT);
+	for (int i = 0; i < ctx->nr_workers; i++) {
+		addr = do_mmap(ctx->p, 0, ctx->nr_iters * PGSIZE,
+		               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		               NULL, 0);
+		if (addr == MAP_FAILED) {
+			for (int j = 0; j < i; j++)
+				munmap(ctx->p, bases[j], ctx->nr_iters * PGSIZE);
+			kfree(bases);
+			snprintf(ktest_msg, sizeof(ktest_msg), "mmap failed");
+			return false;
+		}
+		bases[i] = (uintptr_t)addr;
+	}
+	ctx->arg = bases;
+	return true;
+}
+
+void bench_pagefault(struct kbench_ctx *ctx, int worker, unsigned long iter)
+{
+	uintptr_t *bases = ctx->arg;
+
+	handle_page_fault(ctx->p, bases[worker] + iter * PGSIZE, PROT_WRITE);
+}
+
+void bench_pagefault_teardown(struct kbench_ctx *ctx)
+{
+	uintptr_t *bases = ctx->arg;
+
+	for (int i = 0; i < ctx->nr_workers; i++)
+		munmap(ctx->p, bases[i], ctx->nr_iters * PGSIZE);
+	kfree(bases);
+}
+
+static struct kbench kbenches[] = {
+	KBENCH_REG(kmalloc,					CONFIG_BENCH_kmalloc),
+	KBENCH_REG_SETUP(kmem_cache,		CONFIG_BENCH_kmem_cache),
+	KBENCH_REG_SETUP(qio,				CONFIG_BENCH_qio),
+	KBENCH_REG(block_alloc,				CONFIG_BENCH_block_alloc),
+	KBENCH_REG_SETUP(alarm,				CONFIG_BENCH_alarm),
+	KBENCH_REG(kthread_yield,			CONFIG_BENCH_kthread_yield),
+	KBENCH_REG_SETUP(ipi,				CONFIG_BENCH_ipi),
+	KBENCH_REG_SETUP(pagefault,			CONFIG_BENCH_pagefault),
+};
+
+static int num_kbenches = sizeof(kbenches) / sizeof(struct kbench);
+
+linker_func_1(register_kbenches)
+{
+	REGISTER_KBENCHES(kbenches, num_kbenches);
+}
@@ -33,6 +33,7 @@
 #include <slab.h>
 #include <kmalloc.h>
 #include <hashtable.h>
+#include <chash.h>
 #include <radix.h>
 #include <circular_buffer.h>
 #include <monitor.h>
@@ -43,6 +44,8 @@
 #include <ucq.h>
 #include <setjmp.h>
 #include <sort.h>
+#include <blockdev.h>
+#include <sd.h>
 
 #include <apipe.h>
 #include <rwlock.h>
@@ -2389,6 +2392,337 @@ bool test_cmdline_parse(void)
 	return TRUE;
 }
 
+static void test_breq_done(struct block_request *breq)
+{
+	(*(int*)breq->data)++;
+}
+
+static void test_breq_init(struct block_request *breq, unsigned int flags,
+                           struct buffer_head *bhs, int nr_bhs, int *nr_done)
+{
+	memset(breq, 0, sizeof(struct block_request));
+	breq->flags = flags;
+	breq->callback = test_breq_done;
+	breq->data = nr_done;
+	breq->bhs = breq->local_bhs;
+	for (int i = 0; i < nr_bhs; i++)
+		breq->bhs[i] = &bhs[i];
+	breq->nr_bhs = nr_bhs;
+}
+
+static void test_bh_init(struct buffer_head *bh, void *buf,
+                         unsigned long sector, unsigned int nr_sector)
+{
+	memset(bh, 0, sizeof(struct buffer_head));
+	bh->bh_buffer = buf;
+	bh->bh_sector = sector;
+	bh->bh_nr_sector = nr_sector;
+}
+
+/* Block layer on a ramdisk: BH runs become single IOs, queued IOs merge, and
+ * the data makes it to and from the disk. */
+bool test_blockdev(void)
+{
+	#define TEST_BDEV_SECTORS 64
+	struct block_device *bdev;
+	struct block_request breq, breq2, breq3;
+	struct buffer_head bhs[8];
+	uint8_t *disk, *buf;
+	unsigned long nr_ios;
+	int nr_done = 0;
+
+	disk = kmalloc(TEST_BDEV_SECTORS * SECTOR_SZ, MEM_WAIT);
+	buf = kzmalloc(8 * SECTOR_SZ, MEM_WAIT);
+	for (int i = 0; i < TEST_BDEV_SECTORS * SECTOR_SZ; i++)
+		disk[i] = i / SECTOR_SZ;
+	bdev = make_ramdisk("ktest", disk, TEST_BDEV_SECTORS * SECTOR_SZ);
+
+	/* 8 adjacent sectors into one buffer: one IO */
+	for (int i = 0; i < 8; i++)
+		test_bh_init(&bhs[i], buf + i * SECTOR_SZ, 8 + i, 1);
+	test_breq_init(&breq, BREQ_READ, bhs, 8, &nr_done);
+	nr_ios = bdev->b_nr_ios;
+	KT_ASSERT(!bdev_submit_request(bdev, &breq));
+	KT_ASSERT_M("Ramdisk breqs should be done on return", nr_done == 1);
+	KT_ASSERT_M("Adjacent BHs should be one IO", bdev->b_nr_ios == nr_ios + 1);
+	KT_ASSERT(!breq.error);
+	for (int i = 0; i < 8; i++)
+		KT_ASSERT_M("Read the wrong data", buf[i * SECTOR_SZ] == 8 + i);
+
+	/* Two runs: two IOs */
+	test_bh_init(&bhs[0], buf, 20, 2);
+	test_bh_init(&bhs[1], buf + 2 * SECTOR_SZ, 40, 2);
+	test_breq_init(&breq, BREQ_READ, bhs, 2, &nr_done);
+	nr_ios = bdev->b_nr_ios;
+	KT_ASSERT(!bdev_submit_request(bdev, &breq));
+	KT_ASSERT(nr_done == 2);
+	KT_ASSERT_M("Split BHs should be two IOs", bdev->b_nr_ios == nr_ios + 2);
+	KT_ASSERT(buf[0] == 20 && buf[2 * SECTOR_SZ] == 40);
+
+	/* Writes land on the disk */
+	memset(buf, 0xaa, SECTOR_SZ);
+	test_bh_init(&bhs[0], buf, 50, 1);
+	test_breq_init(&breq, BREQ_WRITE, bhs, 1, &nr_done);
+	KT_ASSERT(!bdev_submit_request(bdev, &breq));
+	KT_ASSERT(nr_done == 3);
+	KT_ASSERT(disk[50 * SECTOR_SZ] == 0xaa && disk[51 * SECTOR_SZ] == 51);
+
+	/* With the device "busy", adjacent breqs merge in the queue, then both
+	 * complete once the device takes the merged IO. */
+	bdev->b_max_inflight = 0;
+	test_bh_init(&bhs[0], buf, 4, 1);
+	test_bh_init(&bhs[1], buf + SECTOR_SZ, 5, 1);
+	test_breq_init(&breq, BREQ_READ, &bhs[0], 1, &nr_done);
+	test_breq_init(&breq2, BREQ_READ, &bhs[1], 1, &nr_done);
+	KT_ASSERT(!bdev_submit_request(bdev, &breq));
+	KT_ASSERT(!bdev_submit_request(bdev, &breq2));
+	KT_ASSERT_M("Queued breqs should not finish", nr_done == 3);
+	KT_ASSERT_M("Adjacent IOs should merge", bdev->b_nr_merges == 1);
+	nr_ios = bdev->b_nr_ios;
+	bdev->b_max_inflight = 1;
+	/* An empty breq just kicks the queue */
+	test_breq_init(&breq3, BREQ_READ, bhs, 0, &nr_done);
+	KT_ASSERT(!bdev_submit_request(bdev, &breq3));
+	KT_ASSERT(nr_done == 6);
+	KT_ASSERT(bdev->b_nr_ios == nr_ios + 1);
+	KT_ASSERT(buf[0] == 4 && buf[SECTOR_SZ] == 5);
+
+	/* Out of range */
+	test_bh_init(&bhs[0], buf, TEST_BDEV_SECTORS - 1, 2);
+	test_breq_init(&breq, BREQ_READ, bhs, 1, &nr_done);
+	KT_ASSERT(bdev_submit_request(bdev, &breq) == -1);
+
+	/* Ramdisks are never freed, so we leave bdev around. */
+	kfree(buf);
+	return TRUE;
+}
+
+/* A fake sd controller with one unit over a kmalloc'd disk.  Its aio holds on
+ * to IOs until the test finishes them. */
+#define TEST_SD_SECTORS 64
+
+static struct {
+	uint8_t *disk;
+	struct bdev_io *ios[4];
+	int nr_ios;
+	bool no_aio;
+} test_sd;
+
+static int test_sd_verify(struct sdunit *unit)
+{
+	unit->inquiry[0] = SDperdisk;
+	return 1;
+}
+
+static int test_sd_online(struct sdunit *unit)
+{
+	unit->sectors = TEST_SD_SECTORS;
+	unit->secsize = SECTOR_SZ;
+	unit->qdepth = ARRAY_SIZE(test_sd.ios);
+	return 1;
+}
+
+static long test_sd_bio(struct sdunit *unit, int lun, int write, void *data,
+                        long nb, uint64_t bno)
+{
+	uint8_t *d = test_sd.disk + bno * SECTOR_SZ;
+
+	if (write)
+		memcpy(d, data, nb * SECTOR_SZ);
+	else
+		memcpy(data, d, nb * SECTOR_SZ);
+	return nb * SECTOR_SZ;
+}
+
+static int test_sd_aio(struct sdunit *unit, struct bdev_io *io)
+{
+	if (test_sd.no_aio || test_sd.nr_ios == ARRAY_SIZE(test_sd.ios))
+		return -1;
+	test_sd.ios[test_sd.nr_ios++] = io;
+	return 0;
+}
+
+/* Finishes the held IOs, last one first. */
+static void test_sd_finish_ios(void)
+{
+	struct bdev_io *ios[ARRAY_SIZE(test_sd.ios)];
+	int nr_ios = test_sd.nr_ios;
+	uint64_t sector;
+
+	memcpy(ios, test_sd.ios, sizeof(ios));
+	test_sd.nr_ios = 0;
+	for (int i = nr_ios - 1; i >= 0; i--) {
+		sector = ios[i]->sector;
+		for (int j = 0; j < ios[i]->nr_segs; j++) {
+			test_sd_bio(NULL, 0, ios[i]->flags & BREQ_WRITE,
+			            ios[i]->segs[j].buf, ios[i]->segs[j].nr_sector, sector);
+			sector += ios[i]->segs[j].nr_sector;
+		}
+		bdev_io_done(ios[i], 0);
+	}
+}
+
+static struct sdifc test_sdifc = {
+	.name = "ktest",
+	.verify = test_sd_verify,
+	.online = test_sd_online,
+	.bio = test_sd_bio,
+	.aio = test_sd_aio,
+};
+
+static void test_sd_breq_init(struct block_request *breq, unsigned int flags,
+                              struct buffer_head *bh)
+{
+	memset(breq, 0, sizeof(struct block_request));
+	breq->flags = flags;
+	breq->callback = generic_breq_done;
+	sem_init_irqsave(&breq->sem, 0);
+	breq->bhs = breq->local_bhs;
+	breq->bhs[0] = bh;
+	breq->nr_bhs = 1;
+}
+
+/* sd's block device: a controller with aio gets several IOs at once, including
+ * overlapping reads, and they can finish in any order.  IOs it turns down go
+ * through bio instead. */
+bool test_sd_bdev(void)
+{
+	struct sdev *sdev;
+	struct block_device *bdev;
+	struct block_request breqs[4];
+	struct buffer_head bhs[4];
+	uint8_t *buf;
+	static const unsigned long sectors[4] = {8, 8, 20, 40};
+
+	test_sd.disk = kmalloc(TEST_SD_SECTORS * SECTOR_SZ, MEM_WAIT);
+	for (int i = 0; i < TEST_SD_SECTORS * SECTOR_SZ; i++)
+		test_sd.disk[i] = i / SECTOR_SZ;
+	buf = kzmalloc(4 * 2 * SECTOR_SZ, MEM_WAIT);
+	sdev = kzmalloc(sizeof(struct sdev), MEM_WAIT);
+	sdev->ifc = &test_sdifc;
+	sdev->idno = 'Z';
+	sdev->nunit = 1;
+	sdadddevs(sdev);
+	bdev = sdgetbdev(sdev->idno, 0);
+	KT_ASSERT_M("Unit should have a block device", bdev);
+	KT_ASSERT(bdev->b_nr_sector == TEST_SD_SECTORS);
+
+	for (int i = 0; i < 4; i++) {
+		test_bh_init(&bhs[i], buf + i * 2 * SECTOR_SZ, sectors[i], 2);
+		test_sd_breq_init(&breqs[i], BREQ_READ, &bhs[i]);
+		KT_ASSERT(!bdev_submit_request(bdev, &breqs[i]));
+	}
+	KT_ASSERT_M("All four reads should be in flight at once",
+	            test_sd.nr_ios == 4);
+	test_sd_finish_ios();
+	for (int i = 0; i < 4; i++) {
+		sleep_on_breq(&breqs[i]);
+		KT_ASSERT(!breqs[i].error);
+		KT_ASSERT_M("Read the wrong data",
+		            buf[i * 2 * SECTOR_SZ] == sectors[i] &&
+		            buf[(i * 2 + 1) * SECTOR_SZ] == sectors[i] + 1);
+	}
+
+	/* Turned down IOs go to sd's ktask and bio */
+	test_sd.no_aio = TRUE;
+	memset(buf, 0xaa, SECTOR_SZ);
+	test_bh_init(&bhs[0], buf, 50, 1);
+	test_sd_breq_init(&breqs[0], BREQ_WRITE, &bhs[0]);
+	KT_ASSERT(!bdev_submit_request(bdev, &breqs[0]));
+	sleep_on_breq(&breqs[0]);
+	KT_ASSERT(!breqs[0].error);
+	KT_ASSERT(test_sd.disk[50 * SECTOR_SZ] == 0xaa);
+	KT_ASSERT(test_sd.nr_ios == 0);
+
+	/* The sdev and its unit stay registered with sd, like ramdisks do. */
+	kfree(buf);
+	return TRUE;
+}
+
+bool test_pm_reclaim(void)
+{
+	#define TEST_PM_PAGES 16
+	struct block_device *bdev;
+	struct page_map *pm;
+	struct buffer_head *bh;
+	uint8_t *disk;
+
+	disk = kzmalloc(TEST_PM_PAGES * PGSIZE, MEM_WAIT);
+	bdev = make_ramdisk("pmtest", disk, TEST_PM_PAGES * PGSIZE);
+	pm = &bdev->b_pm;
+	/* Block 0 warns, so start at 1 */
+	for (int i = 1; i < TEST_PM_PAGES; i++) {
+		bh = bdev_get_buffer(bdev, i, PGSIZE);
+		if (i == 3) {
+			memset(bh->bh_buffer, 0xab, PGSIZE);
+			bdev_dirty_buffer(bh);
+		}
+		bdev_put_buffer(bh);
+	}
+	KT_ASSERT(pm->pm_num_pages == TEST_PM_PAGES - 1);
+	KT_ASSERT_M("Dirty buffer shouldn't be on disk yet", disk[3 * PGSIZE] == 0);
+	/* Reclaim works on every PM, and ours was never referenced after it was
+	 * loaded, so it'll empty out before reclaim runs out of pages. */
+	while (pm->pm_num_pages && pm_reclaim(TEST_PM_PAGES))
+		;
+	KT_ASSERT_M("Unreferenced pages should be reclaimed", !pm->pm_num_pages);
+	KT_ASSERT_M("Dirty page should be written back",
+	            disk[3 * PGSIZE] == 0xab && disk[4 * PGSIZE - 1] == 0xab);
+	KT_ASSERT(disk[4 * PGSIZE] == 0);
+	/* Pages come back from the disk */
+	bh = bdev_get_buffer(bdev, 3, PGSIZE);
+	KT_ASSERT(((uint8_t*)bh->bh_buffer)[0] == 0xab);
+	/* Reclaim leaves pages that are in use alone */
+	while (pm_reclaim(TEST_PM_PAGES))
+		;
+	KT_ASSERT_M("Pages in use should stay", pm->pm_num_pages == 1);
+	bdev_put_buffer(bh);
+	return TRUE;
+}
+
+/* Grows the table well past its initial size, which resizes while items are
+ * going in, then shrinks it back down. */
+bool test_chash(void)
+{
+	#define NR_CHASH_ITEMS 2000
+	struct chashtable ht;
+	struct chash_node *nodes, *node;
+	unsigned long seen = 0;
+
+	void count_node(struct chash_node *node, void *opaque)
+	{
+		(*(unsigned long*)opaque)++;
+	}
+
+	nodes = kzmalloc(sizeof(struct chash_node) * NR_CHASH_ITEMS, MEM_WAIT);
+	chash_init(&ht, 0);
+	for (int i = 0; i < NR_CHASH_ITEMS; i++) {
+		nodes[i].key = i * 7;
+		KT_ASSERT(chash_insert(&ht, &nodes[i]));
+	}
+	KT_ASSERT_M("Duplicate key went in", !chash_insert(&ht, &nodes[0]));
+	KT_ASSERT(chash_count(&ht) == NR_CHASH_ITEMS);
+	for (int i = 0; i < NR_CHASH_ITEMS; i++)
+		KT_ASSERT(chash_lookup(&ht, i * 7) == &nodes[i]);
+	KT_ASSERT(!chash_lookup(&ht, 1));
+	chash_for_each(&ht, count_node, &seen);
+	KT_ASSERT(seen == NR_CHASH_ITEMS);
+	/* Take out every other one, then the rest */
+	for (int i = 0; i < NR_CHASH_ITEMS; i += 2)
+		KT_ASSERT(chash_remove(&ht, i * 7) == &nodes[i]);
+	for (int i = 0; i < NR_CHASH_ITEMS; i++) {
+		node = chash_lookup(&ht, i * 7);
+		KT_ASSERT(i % 2 ? node == &nodes[i] : !node);
+	}
+	for (int i = 1; i < NR_CHASH_ITEMS; i += 2)
+		KT_ASSERT(chash_remove(&ht, i * 7) == &nodes[i]);
+	KT_ASSERT(!chash_remove(&ht, 7));
+	KT_ASSERT(chash_count(&ht) == 0);
+	chash_destroy(&ht);
+	kfree(nodes);
+	return TRUE;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2432,6 +2766,10 @@ static struct ktest ktests[] = {
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
 	KTEST_REG(sort,               CONFIG_TEST_sort),
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
+	KTEST_REG(blockdev,           CONFIG_TEST_blockdev),
+	KTEST_REG(sd_bdev,            CONFIG_TEST_sd_bdev),
+	KTEST_REG(pm_reclaim,         CONFIG_TEST_pm_reclaim),
+	KTEST_REG(chash,              CONFIG_TEST_chash),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 linker_func_1(register_pb_ktests)
@@ -13,6 +13,9 @@
 #include <schedule.h>
 #include <kstack.h>
 #include <arch/uaccess.h>
+#include <kdebug.h>
+#include <lockstat.h>
+#include <tracepoint.h>
 
 uintptr_t get_kstack(void)
 {
@@ -70,6 +73,8 @@ void restart_kthread(struct kthread *kthread)
 	/* Avoid messy complications.  The kthread will enable_irqsave() when it
 	 * comes back up. */
 	disable_irq();
+	tracepoint(sched_kthread_restart, (uintptr_t)kthread,
+	           (uintptr_t)kthread->sysc);
 	/* Free any spare, since we need the current to become the spare.  Without
 	 * the spare, we can't free our current kthread/stack (we could free the
 	 * kthread, but not the stack, since we're still on it).  And we can't free
@@ -336,15 +341,56 @@ static void __attribute__((noinline, noreturn)) __unlock_and_idle(void)
 	smp_idle();
 }
 
+/* Off-CPU profiling: called when kthread is about to block.  We grab the user
+ * backtrace now, since when we wake up, the core's user context might not be
+ * ours. */
+static void offcpu_begin(struct per_cpu_info *pcpui, struct kthread *kthread)
+{
+	struct user_context *ctx = pcpui->cur_ctx;
+
+	kthread->offcpu_nr_upcs = 0;
+	/* Only if we're working on a syscall for the proc that owns the core's
+	 * context.  Restarted syscalls might not be, and ktasks never are. */
+	if (ctx && kthread->sysc && !is_ktask(kthread) && pcpui->owning_proc &&
+	    (pcpui->owning_proc == pcpui->cur_proc))
+		kthread->offcpu_nr_upcs =
+			backtrace_user_list(get_user_ctx_pc(ctx), get_user_ctx_fp(ctx),
+			                    kthread->offcpu_upcs, MAX_BT_DEPTH);
+	kthread->offcpu_start = nsec();
+}
+
+/* Off-CPU profiling: called when kthread wakes up.  Our kernel stack is the
+ * same as when we blocked, so we take the kernel backtrace now, starting from
+ * our caller.  Noinline, so only the profiler pays for kpcs' stack space. */
+static void __attribute__((noinline)) offcpu_end(struct kthread *kthread)
+{
+	uintptr_t kpcs[MAX_BT_DEPTH];
+	size_t nr_kpcs;
+	uint64_t start = kthread->offcpu_start;
+
+	kthread->offcpu_start = 0;
+	nr_kpcs = backtrace_list(get_caller_pc(), *(uintptr_t*)read_bp(), kpcs,
+	                         MAX_BT_DEPTH);
+	profiler_push_offcpu_backtrace(kpcs, nr_kpcs, kthread->offcpu_upcs,
+	                               kthread->offcpu_nr_upcs, start,
+	                               nsec() - start);
+}
+
 /* This downs the semaphore and suspends the current kernel context on its
  * waitqueue if there are no pending signals.  Note that the case where the
- * signal is already there is not optimized. */
-void sem_down(struct semaphore *sem)
+ * signal is already there is not optimized.
+ *
+ * ls_type and ls_pc are what lockstat charges the down to, if it is on. */
+static void __sem_down(struct semaphore *sem, int ls_type, uintptr_t ls_pc)
 {
 	struct kthread *kthread, *new_kthread;
 	register uintptr_t new_stacktop;
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	bool irqs_were_on = irq_is_enabled();
+#ifdef CONFIG_LOCKSTAT
+	uint64_t ls_start = read_tsc();
+	bool ls_contended = FALSE;
+#endif
 
 	assert(can_block(pcpui));
 	/* Make sure we aren't holding any locks (only works if SPINLOCK_DEBUG) */
@@ -362,9 +408,15 @@ void sem_down(struct semaphore *sem)
 #else
 	if (sem_trydown(sem))
 		goto block_return_path;
+#endif
+#ifdef CONFIG_LOCKSTAT
+	/* Set before the setjmp, so it's still set when we wake up */
+	ls_contended = TRUE;
 #endif
 	/* We're probably going to sleep, so get ready.  We'll check again later. */
 	kthread = pcpui->cur_kthread;
+	if (unlikely(profiler_offcpu_enabled))
+		offcpu_begin(pcpui, kthread);
 	/* We need to have a spare slot for restart, so we also use it when
 	 * sleeping.  Right now, we need a new kthread to take over if/when our
 	 * current kthread sleeps.  Use the spare, and if not, get a new one.
@@ -449,6 +501,7 @@ void sem_down(struct semaphore *sem)
 	spin_unlock(&sem->lock);
 	debug_unlock_semlist();
 	printd("[kernel] Didn't sleep, unwinding...\n");
+	kthread->offcpu_start = 0;
 	/* Restore the core's current and default stacktop */
 	if (kthread->flags & KTH_SAVE_ADDR_SPACE) {
 		proc_decref(kthread->proc);
@@ -466,6 +519,13 @@ void sem_down(struct semaphore *sem)
 #endif /* CONFIG_KTHREAD_POISON */
 block_return_path:
 	printd("[kernel] Returning from being 'blocked'! at %llu\n", read_tsc());
+#ifdef CONFIG_LOCKSTAT
+	lockstat_acquired(ls_type, ls_pc, ls_contended, read_tsc() - ls_start);
+#endif
+	/* We could have woken up on another core, so pcpui might be stale */
+	kthread = per_cpu_info[core_id()].cur_kthread;
+	if (unlikely(kthread->offcpu_start))
+		offcpu_end(kthread);
 	/* restart_kthread and longjmp did not reenable IRQs.  We need to make sure
 	 * irqs are on if they were on when we started to block.  If they were
 	 * already on and we short-circuited the block, it's harmless to reenable
@@ -475,6 +535,11 @@ block_return_path:
 	return;
 }
 
+void sem_down(struct semaphore *sem)
+{
+	__sem_down(sem, LOCKSTAT_SEM, get_caller_pc());
+}
+
 /* Ups the semaphore.  If it was < 0, we need to wake up someone, which we do.
  * Returns TRUE if we woke someone, FALSE o/w (used for debugging in some
  * places).  If we need more control, we can implement a version of the old
@@ -518,7 +583,7 @@ bool sem_trydown_irqsave(struct semaphore *sem, int8_t *irq_state)
 void sem_down_irqsave(struct semaphore *sem, int8_t *irq_state)
 {
 	disable_irqsave(irq_state);
-	sem_down(sem);
+	__sem_down(sem, LOCKSTAT_SEM, get_caller_pc());
 	enable_irqsave(irq_state);
 }
 
@@ -531,6 +596,34 @@ bool sem_up_irqsave(struct semaphore *sem, int8_t *irq_state)
 	return retval;
 }
 
+#ifdef CONFIG_LOCKSTAT
+/* With lockstat, qlocks are functions, so that their holders are charged to
+ * whoever qlocked them and their hold times are recorded. */
+void qlock(qlock_t *q)
+{
+	__sem_down(q, LOCKSTAT_QLOCK, get_caller_pc());
+	q->lockstat_pc = get_caller_pc();
+	q->lockstat_tsc = read_tsc();
+}
+
+bool canqlock(qlock_t *q)
+{
+	if (!sem_trydown(q))
+		return FALSE;
+	lockstat_acquired(LOCKSTAT_QLOCK, get_caller_pc(), FALSE, 0);
+	q->lockstat_pc = get_caller_pc();
+	q->lockstat_tsc = read_tsc();
+	return TRUE;
+}
+
+void qunlock(qlock_t *q)
+{
+	lockstat_released(LOCKSTAT_QLOCK, q->lockstat_pc,
+	                  read_tsc() - q->lockstat_tsc);
+	sem_up(q);
+}
+#endif /* CONFIG_LOCKSTAT */
+
 /* Sem debugging */
 
 #ifdef CONFIG_SEMAPHORE_DEBUG
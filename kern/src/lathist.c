@@ -0,0 +1,213 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Syscall and page fault latency histograms.  See lathist.h for the overview.
+ *
+ * Each core has a table of histogram pointers, one per key.  A core allocates a
+ * key's histogram the first time it records for it, with MEM_ATOMIC, since we
+ * could be anywhere.  Histograms are never freed, other than zeroed by a reset.
+ * If the allocation fails, the sample is counted as dropped. */
+
+#include <lathist.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <syscall.h>
+#include <smp.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+struct lathist_core {
+	struct lathist				**hists;
+	uint64_t					nr_dropped;
+};
+
+static struct lathist_core *lathist_cores;
+static unsigned int lathist_nr_keys;
+static bool lathist_enabled;
+
+void lathist_init(void)
+{
+	struct lathist_core *cores;
+
+	lathist_nr_keys = LATHIST_SYSCALL + max_syscall;
+	cores = kzmalloc(sizeof(struct lathist_core) * num_cores, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++)
+		cores[i].hists = kzmalloc(sizeof(struct lathist *) * lathist_nr_keys,
+		                          MEM_WAIT);
+	lathist_cores = cores;
+	wmb();	/* tables are set up before anyone sees lathist_enabled */
+	lathist_enabled = TRUE;
+}
+
+static unsigned int lathist_bucket(uint64_t ticks)
+{
+	unsigned int shift;
+
+	if (ticks < LATHIST_SUB_BUCKETS)
+		return ticks;
+	shift = LOG2_DOWN(ticks);
+	if (shift >= LATHIST_MAX_SHIFT)
+		return LATHIST_NR_BUCKETS - 1;
+	return (shift - LATHIST_SUB_SHIFT + 1) * LATHIST_SUB_BUCKETS +
+	       ((ticks >> (shift - LATHIST_SUB_SHIFT)) & (LATHIST_SUB_BUCKETS - 1));
+}
+
+/* The largest value that lands in bucket b */
+static uint64_t lathist_bucket_top(unsigned int b)
+{
+	unsigned int shift, sub;
+
+	if (b < LATHIST_SUB_BUCKETS)
+		return b;
+	shift = b / LATHIST_SUB_BUCKETS + LATHIST_SUB_SHIFT - 1;
+	sub = b % LATHIST_SUB_BUCKETS;
+	return ((uint64_t)(LATHIST_SUB_BUCKETS + sub + 1)
+	        << (shift - LATHIST_SUB_SHIFT)) - 1;
+}
+
+static struct lathist *lathist_alloc(struct lathist_core *lc,
+                                     struct lathist **slot)
+{
+	struct lathist *h = kzmalloc(sizeof(struct lathist), MEM_ATOMIC);
+
+	if (!h) {
+		lc->nr_dropped++;
+		return 0;
+	}
+	/* An IRQ on this core could have beaten us to it */
+	if (!atomic_cas_ptr((void**)slot, 0, h)) {
+		kfree(h);
+		h = *slot;
+	}
+	return h;
+}
+
+/* Records that key took ticks. */
+void lathist_record(unsigned int key, uint64_t ticks)
+{
+	struct lathist_core *lc;
+	struct lathist *h;
+
+	if (!lathist_enabled || (key >= lathist_nr_keys))
+		return;
+	lc = &lathist_cores[core_id()];
+	h = lc->hists[key];
+	if (unlikely(!h)) {
+		h = lathist_alloc(lc, &lc->hists[key]);
+		if (!h)
+			return;
+	}
+	h->count++;
+	h->total += ticks;
+	h->max = MAX(h->max, ticks);
+	h->buckets[lathist_bucket(ticks)]++;
+}
+
+void lathist_set_enabled(bool on)
+{
+	if (!lathist_cores)
+		return;
+	lathist_enabled = on;
+}
+
+/* Zeroes the histograms.  Cores that are recording while we clear can leave
+ * behind partial counts, so turn it off first for a clean slate. */
+void lathist_reset(void)
+{
+	struct lathist *h;
+
+	if (!lathist_cores)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		lathist_cores[i].nr_dropped = 0;
+		for (int j = 0; j < lathist_nr_keys; j++) {
+			h = lathist_cores[i].hists[j];
+			if (h)
+				memset(h, 0, sizeof(struct lathist));
+		}
+	}
+}
+
+static void lathist_merge(struct lathist *to, struct lathist *from)
+{
+	to->count += from->count;
+	to->total += from->total;
+	to->max = MAX(to->max, from->max);
+	for (int i = 0; i < LATHIST_NR_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+}
+
+/* Returns the nsec at or below which permille of h's samples fall. */
+static uint64_t lathist_percentile(struct lathist *h, unsigned int permille)
+{
+	uint64_t rank = MAX((h->count * permille + 999) / 1000, 1);
+	uint64_t seen = 0;
+
+	for (int i = 0; i < LATHIST_NR_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return tsc2nsec(MIN(lathist_bucket_top(i), h->max));
+	}
+	return tsc2nsec(h->max);
+}
+
+static const char *lathist_key_name(unsigned int key, char *buf, size_t bufsz)
+{
+	unsigned int num;
+
+	if (key == LATHIST_PGFAULT)
+		return "pagefault";
+	num = key - LATHIST_SYSCALL;
+	if (syscall_name(num))
+		return syscall_name(num);
+	snprintf(buf, bufsz, "sys%u", num);
+	return buf;
+}
+
+/* Returns a kmalloc'd table of every key's latency, merged across cores, with
+ * its length in *len.  Keys that never ran are skipped.  Returns 0 if lathist
+ * hasn't started yet. */
+char *lathist_report(size_t *len)
+{
+	struct lathist *merged, *h;
+	size_t bufsz, off = 0;
+	uint64_t nr_dropped = 0;
+	char *buf, name[16];
+
+	if (!lathist_cores)
+		return 0;
+	merged = kmalloc(sizeof(struct lathist), MEM_WAIT);
+	bufsz = (lathist_nr_keys + 2) * 128;
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	off += snprintf(buf + off, bufsz - off,
+	                "%-16s %12s %10s %10s %10s %10s %10s %12s\n", "name",
+	                "count", "mean-ns", "p50-ns", "p90-ns", "p99-ns",
+	                "p99.9-ns", "max-ns");
+	for (int i = 0; i < num_cores; i++)
+		nr_dropped += lathist_cores[i].nr_dropped;
+	for (int key = 0; key < lathist_nr_keys; key++) {
+		memset(merged, 0, sizeof(struct lathist));
+		for (int i = 0; i < num_cores; i++) {
+			h = lathist_cores[i].hists[key];
+			if (h)
+				lathist_merge(merged, h);
+		}
+		if (!merged->count)
+			continue;
+		off += snprintf(buf + off, bufsz - off,
+		                "%-16s %12llu %10llu %10llu %10llu %10llu %10llu %12llu\n",
+		                lathist_key_name(key, name, sizeof(name)),
+		                merged->count, tsc2nsec(merged->total / merged->count),
+		                lathist_percentile(merged, 500),
+		                lathist_percentile(merged, 900),
+		                lathist_percentile(merged, 990),
+		                lathist_percentile(merged, 999),
+		                tsc2nsec(merged->max));
+	}
+	off += snprintf(buf + off, bufsz - off, "dropped: %llu\n", nr_dropped);
+	kfree(merged);
+	*len = MIN(off, bufsz);
+	return buf;
+}
@@ -0,0 +1,246 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Lock contention statistics.  See lockstat.h for the overview.
+ *
+ * The per-core tables are open-addressed, keyed by call site.  A site claims an
+ * empty slot with a CAS (only an IRQ on this core could race with us), and
+ * slots are never freed, other than by a reset.  If a site can't find a slot
+ * within a few probes, its acquisition is counted as dropped. */
+
+#include <lockstat.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <kdebug.h>
+#include <smp.h>
+#include <sort.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define LOCKSTAT_NR_SITES		1024	/* per core, power of two */
+#define LOCKSTAT_NR_PROBES		16
+/* The merged table has room for sites that show up on different cores */
+#define LOCKSTAT_NR_MERGED		(LOCKSTAT_NR_SITES * 4)
+
+struct lockstat_site {
+	uintptr_t					pc;
+	int							type;
+	uint64_t					nr_acquired;
+	uint64_t					nr_contended;
+	uint64_t					wait_total;
+	uint64_t					wait_max;
+	uint64_t					hold_total;
+	uint64_t					hold_max;
+};
+
+struct lockstat_core {
+	struct lockstat_site		sites[LOCKSTAT_NR_SITES];
+	uint64_t					nr_dropped;
+};
+
+static struct lockstat_core *lockstat_cores;
+static bool lockstat_enabled;
+
+static const char *lockstat_type_names[] = {
+	[LOCKSTAT_SPIN] = "spin",
+	[LOCKSTAT_SEM] = "sem",
+	[LOCKSTAT_QLOCK] = "qlock",
+};
+
+/* Locks are taken long before this, so until then, nothing is recorded. */
+void lockstat_init(void)
+{
+	lockstat_cores = kzmalloc(sizeof(struct lockstat_core) * num_cores,
+	                          MEM_WAIT);
+	wmb();	/* tables are zeroed before anyone sees lockstat_enabled */
+	lockstat_enabled = TRUE;
+}
+
+static unsigned long lockstat_hash(uintptr_t pc)
+{
+	return ((uint64_t)pc * 0x9e37fffffffc0001ULL) >> 32;
+}
+
+/* Finds or claims pc's slot in tbl.  Returns 0 if there isn't room. */
+static struct lockstat_site *lockstat_find(struct lockstat_site *tbl,
+                                           size_t nr_slots, int nr_probes,
+                                           uintptr_t pc, int type)
+{
+	unsigned long idx = lockstat_hash(pc);
+	struct lockstat_site *site;
+
+	for (int i = 0; i < nr_probes; i++) {
+		site = &tbl[(idx + i) & (nr_slots - 1)];
+		if (site->pc == pc)
+			return site;
+		if (!site->pc && atomic_cas_ptr((void**)&site->pc, 0, (void*)pc)) {
+			site->type = type;
+			return site;
+		}
+		/* An IRQ could have claimed it for pc */
+		if (site->pc == pc)
+			return site;
+	}
+	return 0;
+}
+
+static struct lockstat_site *lockstat_get_site(int type, uintptr_t pc)
+{
+	struct lockstat_core *lc;
+	struct lockstat_site *site;
+
+	if (!lockstat_enabled || !pc)
+		return 0;
+	lc = &lockstat_cores[core_id_early()];
+	site = lockstat_find(lc->sites, LOCKSTAT_NR_SITES, LOCKSTAT_NR_PROBES, pc,
+	                     type);
+	if (!site)
+		lc->nr_dropped++;
+	return site;
+}
+
+/* Records an acquisition at pc.  wait is how many cycles it waited, if it was
+ * contended. */
+void lockstat_acquired(int type, uintptr_t pc, bool contended, uint64_t wait)
+{
+	struct lockstat_site *site = lockstat_get_site(type, pc);
+
+	if (!site)
+		return;
+	site->nr_acquired++;
+	if (contended) {
+		site->nr_contended++;
+		site->wait_total += wait;
+		site->wait_max = MAX(site->wait_max, wait);
+	}
+}
+
+/* Records that the lock taken at pc was held for hold cycles. */
+void lockstat_released(int type, uintptr_t pc, uint64_t hold)
+{
+	struct lockstat_site *site = lockstat_get_site(type, pc);
+
+	if (!site)
+		return;
+	site->hold_total += hold;
+	site->hold_max = MAX(site->hold_max, hold);
+}
+
+void lockstat_set_enabled(bool on)
+{
+	if (!lockstat_cores)
+		return;
+	lockstat_enabled = on;
+}
+
+/* Clears the tables.  Cores that are recording while we clear can leave behind
+ * partial entries, so turn it off first for a clean slate. */
+void lockstat_reset(void)
+{
+	if (!lockstat_cores)
+		return;
+	memset(lockstat_cores, 0, sizeof(struct lockstat_core) * num_cores);
+}
+
+static void lockstat_merge(struct lockstat_site *to, struct lockstat_site *from)
+{
+	to->nr_acquired += from->nr_acquired;
+	to->nr_contended += from->nr_contended;
+	to->wait_total += from->wait_total;
+	to->wait_max = MAX(to->wait_max, from->wait_max);
+	to->hold_total += from->hold_total;
+	to->hold_max = MAX(to->hold_max, from->hold_max);
+}
+
+static int lockstat_sort_by;
+
+static uint64_t lockstat_sort_key(const struct lockstat_site *site)
+{
+	switch (lockstat_sort_by) {
+	case LOCKSTAT_SORT_ACQUIRED:
+		return site->nr_acquired;
+	case LOCKSTAT_SORT_CONTENDED:
+		return site->nr_contended;
+	case LOCKSTAT_SORT_HOLD:
+		return site->hold_total;
+	case LOCKSTAT_SORT_WAIT:
+	default:
+		return site->wait_total;
+	}
+}
+
+static int lockstat_cmp(const void *a, const void *b)
+{
+	uint64_t ka = lockstat_sort_key(a);
+	uint64_t kb = lockstat_sort_key(b);
+
+	if (ka == kb)
+		return 0;
+	return ka > kb ? -1 : 1;
+}
+
+/* Returns a kmalloc'd table of every call site's stats, merged across cores and
+ * sorted by sort_by.  Its length is in *len.  Returns 0 if lockstat hasn't
+ * started yet. */
+char *lockstat_report(int sort_by, size_t *len)
+{
+	static qlock_t report_lock = QLOCK_INITIALIZER(report_lock);
+	struct lockstat_site *merged, *site, *from;
+	size_t nr_sites = 0, bufsz, off = 0;
+	uint64_t nr_dropped = 0;
+	char *buf, *name;
+
+	if (!lockstat_cores)
+		return 0;
+	merged = kzmalloc(sizeof(struct lockstat_site) * LOCKSTAT_NR_MERGED,
+	                  MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		nr_dropped += lockstat_cores[i].nr_dropped;
+		for (int j = 0; j < LOCKSTAT_NR_SITES; j++) {
+			from = &lockstat_cores[i].sites[j];
+			if (!from->pc)
+				continue;
+			site = lockstat_find(merged, LOCKSTAT_NR_MERGED, LOCKSTAT_NR_MERGED,
+			                     from->pc, from->type);
+			if (!site) {
+				nr_dropped += from->nr_acquired;
+				continue;
+			}
+			lockstat_merge(site, from);
+		}
+	}
+	/* Pack them at the front, for sorting */
+	for (int i = 0; i < LOCKSTAT_NR_MERGED; i++) {
+		if (merged[i].pc)
+			merged[nr_sites++] = merged[i];
+	}
+	/* sort()'s comparator has no argument for the key */
+	qlock(&report_lock);
+	lockstat_sort_by = sort_by;
+	sort(merged, nr_sites, sizeof(struct lockstat_site), lockstat_cmp);
+	qunlock(&report_lock);
+
+	bufsz = (nr_sites + 3) * 192;
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	off += snprintf(buf + off, bufsz - off,
+	                "%-5s %12s %10s %16s %14s %16s %14s  %s\n", "type",
+	                "acquired", "contended", "wait-total", "wait-max",
+	                "hold-total", "hold-max", "site");
+	for (int i = 0; i < nr_sites; i++) {
+		site = &merged[i];
+		name = get_fn_name(site->pc);
+		off += snprintf(buf + off, bufsz - off,
+		                "%-5s %12llu %10llu %16llu %14llu %16llu %14llu  %p %.64s\n",
+		                lockstat_type_names[site->type], site->nr_acquired,
+		                site->nr_contended, site->wait_total, site->wait_max,
+		                site->hold_total, site->hold_max, site->pc,
+		                name ? name : "?");
+		kfree(name);
+	}
+	off += snprintf(buf + off, bufsz - off, "dropped: %llu\n", nr_dropped);
+	kfree(merged);
+	*len = MIN(off, bufsz);
+	return buf;
+}
@@ -229,6 +229,12 @@ void manager_jenkins()
 		printk("<-- END_KERNEL_TESTS -->\n");
 	#endif
 
+	#ifdef CONFIG_KBENCHES
+		printk("<-- BEGIN_KERNEL_BENCHMARKS -->\n");
+		run_registered_kbench_suites(NULL, 0, 0);
+		printk("<-- END_KERNEL_BENCHMARKS -->\n");
+	#endif
+
 	// Run userspace tests (from config specified path).
 	#ifdef CONFIG_USERSPACE_TESTING
 	if (strlen(CONFIG_USERSPACE_TESTING_SCRIPT) != 0) {
@@ -23,8 +23,11 @@
 #include <slab.h>
 #include <kmalloc.h>
 #include <vfs.h>
+#include <ns.h>
 #include <smp.h>
 #include <profiler.h>
+#include <tracepoint.h>
+#include <lathist.h>
 
 struct kmem_cache *vmr_kcache;
 
@@ -123,6 +126,7 @@ struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 	old_vmr->vm_end = va;
 	new_vmr->vm_prot = old_vmr->vm_prot;
 	new_vmr->vm_flags = old_vmr->vm_flags;
+	new_vmr->vm_ra = old_vmr->vm_ra;
 	if (old_vmr->vm_file) {
 		kref_get(&old_vmr->vm_file->f_kref, 1);
 		new_vmr->vm_file = old_vmr->vm_file;
@@ -144,7 +148,8 @@ int merge_vmr(struct vm_region *first, struct vm_region *second)
 	if ((first->vm_end != second->vm_base) ||
 	    (first->vm_prot != second->vm_prot) ||
 	    (first->vm_flags != second->vm_flags) ||
-	    (first->vm_file != second->vm_file))
+	    (first->vm_file != second->vm_file) ||
+	    (first->vm_ra.ra_mode != second->vm_ra.ra_mode))
 		return -1;
 	if ((first->vm_file) && (second->vm_foff != first->vm_foff +
 	                         first->vm_end - first->vm_base))
@@ -369,6 +374,7 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 		vmr->vm_flags = vm_i->vm_flags;
 		vmr->vm_file = vm_i->vm_file;
 		vmr->vm_foff = vm_i->vm_foff;
+		vmr->vm_ra = vm_i->vm_ra;
 		if (vm_i->vm_file) {
 			kref_get(&vm_i->vm_file->f_kref, 1);
 			pm_add_vmr(file2pm(vm_i->vm_file), vmr);
@@ -443,10 +449,11 @@ void *mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 	}
 	if (fd != -1) {
 		file = get_file_from_fd(&p->open_files, fd);
-		if (!file) {
-			set_errno(EBADF);
+		/* 9ns chans get a VFS file backed by the chan's page cache */
+		if (!file)
+			file = chanpm_open(fd);
+		if (!file)
 			return MAP_FAILED;
-		}
 	}
 	/* Check for overflow.  This helps do_mmap and populate_va, among others. */
 	if (offset + len < offset) {
@@ -818,6 +825,78 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	return 0;
 }
 
+/* Only readahead hints for now.  NORMAL, RANDOM, and SEQUENTIAL set the
+ * readahead mode used when faulting on file-backed VMRs, and WILLNEED starts
+ * reading the range's file pages.  DONTNEED is accepted and ignored. */
+int madvise(struct proc *p, uintptr_t addr, size_t len, int advice)
+{
+	struct vm_region *vmr;
+	struct file *file;
+	uintptr_t start, stop;
+	unsigned long idx, nr_file_pgs;
+	int mode = -1;	/* readahead mode, if the advice sets one */
+
+	printd("madvise: (addr %p, len %p, advice %d)\n", addr, len, advice);
+	if (!len)
+		return 0;
+	if ((addr % PGSIZE) || (addr < MMAP_LOWEST_VA)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	uintptr_t end = ROUNDUP(addr + len, PGSIZE);
+	if (end > UMAPTOP || addr > end) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+	switch (advice) {
+	case MADV_NORMAL:
+		mode = PM_RA_NORMAL;
+		break;
+	case MADV_RANDOM:
+		mode = PM_RA_RANDOM;
+		break;
+	case MADV_SEQUENTIAL:
+		mode = PM_RA_SEQUENTIAL;
+		break;
+	case MADV_WILLNEED:
+	case MADV_DONTNEED:
+		break;
+	default:
+		set_errno(EINVAL);
+		return -1;
+	}
+	spin_lock(&p->vmr_lock);
+	if (advice == MADV_WILLNEED) {
+		/* pm_readahead() doesn't block, so this is safe under the lock */
+		for (vmr = find_first_vmr(p, addr); vmr && vmr->vm_base < end;
+		     vmr = TAILQ_NEXT(vmr, vm_link)) {
+			file = vmr->vm_file;
+			if (!file)
+				continue;
+			start = MAX(addr, vmr->vm_base);
+			stop = MIN(end, vmr->vm_end);
+			idx = (start - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
+			nr_file_pgs = nr_pages(file->f_dentry->d_inode->i_size);
+			if (idx >= nr_file_pgs)
+				continue;
+			pm_readahead(file->f_mapping, idx,
+			             MIN((stop - start) >> PGSHIFT, nr_file_pgs - idx));
+		}
+	} else if (mode != -1) {
+		p->vmr_history++;
+		isolate_vmrs(p, addr, end - addr);
+		vmr = find_first_vmr(p, addr);
+		while (vmr && vmr->vm_base < end) {
+			memset(&vmr->vm_ra, 0, sizeof(struct pm_ra));
+			vmr->vm_ra.ra_mode = mode;
+			vmr = merge_me(vmr);
+			vmr = TAILQ_NEXT(vmr, vm_link);
+		}
+	}
+	spin_unlock(&p->vmr_lock);
+	return 0;
+}
+
 int munmap(struct proc *p, uintptr_t addr, size_t len)
 {
 	printd("munmap(addr %x, len %x)\n", addr, len);
@@ -995,6 +1074,7 @@ static int __hpf(struct proc *p, uintptr_t va, int prot, bool file_ok)
 	int ret = 0;
 	bool first = TRUE;
 	va = ROUNDDOWN(va,PGSIZE);
+	tracepoint(page_fault_enter, va, prot);
 
 refault:
 	/* read access to the VMRs TODO: RCU */
@@ -1017,8 +1097,10 @@ refault:
 			goto out;
 		}
 	} else {
-		if (!file_ok)
-			return -EACCES;
+		if (!file_ok) {
+			ret = -EACCES;
+			goto out;
+		}
 		/* If this fails, either something got screwed up with the VMR, or the
 		 * permissions changed after mmap/mprotect.  Either way, I want to know
 		 * (though it's not critical). */
@@ -1040,6 +1122,8 @@ refault:
 			ret = -ESPIPE; /* linux sends a SIGBUS at access time */
 			goto out;
 		}
+		pm_ra_update(vmr->vm_file->f_mapping, &vmr->vm_ra, f_idx, 1,
+		             nr_pages(vmr->vm_file->f_dentry->d_inode->i_size));
 		ret = pm_load_page_nowait(vmr->vm_file->f_mapping, f_idx, &a_page);
 		if (ret) {
 			if (ret != -EAGAIN)
@@ -1052,7 +1136,7 @@ refault:
 			first = FALSE;
 			kref_put(&vmr->vm_file->f_kref);
 			if (ret)
-				return ret;
+				goto out_unlocked;
 			goto refault;
 		}
 		/* If we want a private map, we'll preemptively give you a new page.  We
@@ -1087,17 +1171,30 @@ out_put_pg:
 		pm_put_page(a_page);
 out:
 	spin_unlock(&p->vmr_lock);
+out_unlocked:
+	tracepoint(page_fault_exit, va, ret);
+	return ret;
+}
+
+/* Helper, times the fault for #kprof/lathist */
+static int __hpf_timed(struct proc *p, uintptr_t va, int prot, bool file_ok)
+{
+	uint64_t start = read_tsc();
+	int ret;
+
+	ret = __hpf(p, va, prot, file_ok);
+	lathist_record_pgfault(start);
 	return ret;
 }
 
 int handle_page_fault(struct proc *p, uintptr_t va, int prot)
 {
-	return __hpf(p, va, prot, TRUE);
+	return __hpf_timed(p, va, prot, TRUE);
 }
 
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot)
 {
-	return __hpf(p, va, prot, FALSE);
+	return __hpf_timed(p, va, prot, FALSE);
 }
 
 /* Attempts to populate the pages, as if there was a page faults.  Bails on
@@ -24,6 +24,7 @@
 #include <trap.h>
 #include <time.h>
 #include <percpu.h>
+#include <kmemtrack.h>
 
 #include <ros/memlayout.h>
 #include <ros/event.h>
@@ -73,6 +74,7 @@ static command_t commands[] = {
 	{ "ks", "Kernel scheduler hacks", mon_ks},
 	{ "gfp", "Get free pages", mon_gfp },
 	{ "coreinfo", "Print diagnostics for a core", mon_coreinfo},
+	{ "kmemtrack", "Top kernel memory users: kmemtrack [N]", mon_kmemtrack},
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -996,14 +998,14 @@ int mon_fs(int argc, char **argv, struct hw_trapframe *hw_tf)
 			printk("Superblock for %s\n", sb->s_name);
 			printk("DENTRY     FLAGS      REFCNT NAME\n");
 			printk("--------------------------------\n");
-			/* Hash helper */
-			void print_dcache_entry(void *item, void *opaque)
-			{
-				struct dentry *d_i = (struct dentry*)item;
-				printk("%p %p %02d     %s\n", d_i, d_i->d_flags,
-				       kref_refcnt(&d_i->d_kref), d_i->d_name.name);
+			spin_lock(&sb->s_dcache_lock);
+			for (int i = 0; i < DCACHE_NR_BUCKETS; i++) {
+				for (struct dentry *d_i = sb->s_dcache[i]; d_i;
+				     d_i = d_i->d_hash_next)
+					printk("%p %p %02d     %s\n", d_i, d_i->d_flags,
+					       kref_refcnt(&d_i->d_kref), d_i->d_name.name);
 			}
-			hash_for_each(sb->s_dcache, print_dcache_entry, NULL);
+			spin_unlock(&sb->s_dcache_lock);
 		}
 		if (argc < 3)
 			return 0;
@@ -1289,3 +1291,27 @@ int mon_coreinfo(int argc, char **argv, struct hw_trapframe *hw_tf)
 	}
 	return 0;
 }
+
+/* Prints the top N (default 20) kernel memory allocation sites. */
+int mon_kmemtrack(int argc, char **argv, struct hw_trapframe *hw_tf)
+{
+#ifdef CONFIG_KMEM_TRACK
+	int top_n = 20;
+	size_t len;
+	char *buf;
+
+	if (argc >= 2)
+		top_n = strtol(argv[1], 0, 0);
+	buf = kmemtrack_report(top_n, &len);
+	if (!buf) {
+		printk("kmemtrack hasn't started yet\n");
+		return 1;
+	}
+	printk("%s", buf);
+	kfree(buf);
+	return 0;
+#else
+	printk("Build with CONFIG_KMEM_TRACK for kmemtrack\n");
+	return 1;
+#endif
+}
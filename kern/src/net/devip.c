@@ -71,7 +71,8 @@ enum {
 	Qlocal,
 	Qremote,
 	Qstatus,
-	Qsnoop,
+	Qinfo,
+	Qsnoop,	/* ipifc only, so it must be the last conv file */
 
 	Logtype = 5,
 	Masktype = (1 << Logtype) - 1,
@@ -170,6 +171,9 @@ static int ip3gen(struct chan *c, int i, struct dir *dp)
 		case Qstatus:
 			p = "status";
 			break;
+		case Qinfo:
+			return founddevdir(c, q, "info", sizeof(struct conv_info),
+			                   cv->owner, 0444, dp);
 	}
 	return founddevdir(c, q, p, 0, cv->owner, 0444, dp);
 }
@@ -291,6 +295,7 @@ ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d, int unused_int,
 		case Qremote:
 		case Qstatus:
 		case Qsnoop:
+		case Qinfo:
 			return ip3gen(c, TYPE(c->qid), dp);
 	}
 	return -1;
@@ -437,6 +442,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 		case Qprotodir:
 		case Qconvdir:
 		case Qstatus:
+		case Qinfo:
 		case Qremote:
 		case Qlocal:
 		case Qstats:
@@ -740,6 +746,32 @@ enum {
 	Statelen = 32 * 1024,
 };
 
+/* Fills in a conversation's info file.  This is polled across lots of
+ * conversations, so no allocations and no text. */
+static long convinforead(struct conv *c, void *a, long n, uint32_t offset)
+{
+	struct conv_info info;
+
+	memset(&info, 0, sizeof(info));
+	info.version = CONV_INFO_VERSION;
+	info.size = sizeof(info);
+	ipmove(info.laddr, c->laddr);
+	ipmove(info.raddr, c->raddr);
+	info.lport = c->lport;
+	info.rport = c->rport;
+	if (c->rq) {
+		info.rq_len = qlen(c->rq);
+		info.rq_window = qwindow(c->rq);
+	}
+	if (c->wq) {
+		info.wq_len = qlen(c->wq);
+		info.wq_window = qwindow(c->wq);
+	}
+	if (c->p->info)
+		c->p->info(c, &info);
+	return readmem(offset, a, n, &info, sizeof(info));
+}
+
 static long ipread(struct chan *ch, void *a, long n, int64_t off)
 {
 	struct conv *c;
@@ -824,6 +856,9 @@ static long ipread(struct chan *ch, void *a, long n, int64_t off)
 		case Qsnoop:
 			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
 			return qread(c->sq, a, n);
+		case Qinfo:
+			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			return convinforead(c, a, n, offset);
 		case Qstats:
 			x = f->p[PROTO(ch->qid)];
 			if (x->stats == NULL)
@@ -1327,13 +1362,31 @@ static void ip_wake_cb(struct queue *q, void *data, int filter)
 	 * than block those.
 	 * - if fire_tap takes a while, holding the lock only slows down other
 	 * events on this *same* conversation, or other tap registration.  not a
-	 * huge deal. */
+	 * huge deal.
+	 *
+	 * A burst of packets can wake a lot of conversations at once, so we batch
+	 * the events.  They go out together when the network ktask finishes its
+	 * pass (flush_tap_batch()). */
 	spin_lock(&conv->tap_lock);
 	SLIST_FOREACH(tap_i, &conv->data_taps, link)
-		fire_tap(tap_i, filter);
+		fire_tap_batched(tap_i, filter);
 	spin_unlock(&conv->tap_lock);
 }
 
+/* The tap events that are currently true for conv's data file. */
+static int ip_data_ready(struct conv *conv)
+{
+	int filter = 0;
+
+	if (qcanread(conv->rq))
+		filter |= FDTAP_FILT_READABLE;
+	if (qisclosed(conv->rq))
+		filter |= FDTAP_FILT_READABLE | FDTAP_FILT_HANGUP;
+	if (qwritable(conv->wq))
+		filter |= FDTAP_FILT_WRITABLE;
+	return filter;
+}
+
 int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 {
 	struct conv *conv = chan2conv(chan);
@@ -1370,6 +1423,10 @@ int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 					}
 					ret = 0;
 					break;
+				case (FDTAP_CMD_POLL):
+					fire_tap(tap, ip_data_ready(conv));
+					ret = 0;
+					break;
 				default:
 					set_errno(ENOSYS);
 					set_errstr("Unsupported #%s data tap command %p",
@@ -1395,6 +1452,11 @@ int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 					SLIST_REMOVE(&conv->listen_taps, tap, fd_tap, link);
 					ret = 0;
 					break;
+				case (FDTAP_CMD_POLL):
+					if (conv->incall)
+						fire_tap(tap, FDTAP_FILT_READABLE);
+					ret = 0;
+					break;
 				default:
 					set_errno(ENOSYS);
 					set_errstr("Unsupported #%s listen tap command %p",
@@ -1588,7 +1650,7 @@ static void fire_listener_taps(struct conv *conv)
 		return;
 	spin_lock(&conv->tap_lock);
 	SLIST_FOREACH(tap_i, &conv->listen_taps, link)
-		fire_tap(tap_i, FDTAP_FILT_READABLE);
+		fire_tap_batched(tap_i, FDTAP_FILT_READABLE);
 	spin_unlock(&conv->tap_lock);
 }
 
@@ -39,6 +39,11 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <fdtap.h>
+
+/* FD tap events from incoming packets are batched.  The readers flush them
+ * after this many packets, in case they never block waiting for more. */
+#define ETHER_TAP_PASS 32
 
 typedef struct Etherhdr Etherhdr;
 struct Etherhdr {
@@ -430,6 +435,7 @@ static void etherread4(void *a)
 	struct Ipifc *ifc;
 	struct block *bp;
 	Etherrock *er;
+	unsigned int nr_pkts = 0;
 
 	ifc = a;
 	er = ifc->arg;
@@ -458,6 +464,8 @@ static void etherread4(void *a)
 			ipiput4(er->f, ifc, bp);
 		runlock(&ifc->rwlock);
 		poperror();
+		if (!(++nr_pkts % ETHER_TAP_PASS))
+			flush_tap_batch();
 	}
 	poperror();
 }
@@ -471,6 +479,7 @@ static void etherread6(void *a)
 	struct Ipifc *ifc;
 	struct block *bp;
 	Etherrock *er;
+	unsigned int nr_pkts = 0;
 
 	ifc = a;
 	er = ifc->arg;
@@ -499,6 +508,8 @@ static void etherread6(void *a)
 			ipiput6(er->f, ifc, bp);
 		runlock(&ifc->rwlock);
 		poperror();
+		if (!(++nr_pkts % ETHER_TAP_PASS))
+			flush_tap_batch();
 	}
 	poperror();
 }
@@ -285,6 +285,7 @@ struct Tcpctl {
 	uint64_t time;				/* time Finwait2 or Syn_received was sent */
 	int nochecksum;				/* non-zero means don't send checksums */
 	int flgcnt;					/* number of flags in the sequence (FIN,SEQ) */
+	uint32_t rexmits;			/* segments resent, for the info file */
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -486,6 +487,26 @@ static int tcpstate(struct conv *c, char *state, int n)
 					s->katimer.start, s->katimer.count);
 }
 
+static void tcpinfo(struct conv *c, struct conv_info *info)
+{
+	Tcpctl *s = (Tcpctl *) (c->ptcl);
+
+	static_assert((int)Time_wait == (int)CONV_TCP_TIME_WAIT);
+	info->proto_state = s->state;
+	info->srtt_us = ((uint64_t)s->srtt * 1000) >> LOGAGAIN;
+	info->rttvar_us = ((uint64_t)s->mdev * 1000) >> LOGDGAIN;
+	info->rto_ms = s->timer.start * MSPTICK;
+	info->mss = s->mss;
+	info->cwnd = s->cwind;
+	info->ssthresh = s->ssthresh;
+	info->snd_wnd = s->snd.wnd;
+	info->rcv_wnd = s->rcv.wnd;
+	info->bytes_in_flight = s->snd.nxt - s->snd.una;
+	info->retransmits = s->rexmits;
+	info->backoff = s->backoff;
+	info->dupacks = s->snd.dupacks;
+}
+
 static int tcpinuse(struct conv *c)
 {
 	Tcpctl *s;
@@ -2586,6 +2607,7 @@ void tcpoutput(struct conv *s)
 				   s->raddr, s->rport, s->laddr, s->lport, tcb->snd.ptr,
 				   tcb->snd.nxt);
 			tpriv->stats[RetransSegs]++;
+			tcb->rexmits++;
 		}
 
 		tcb->snd.ptr += ssize;
@@ -3199,6 +3221,7 @@ void tcpinit(struct Fs *fs)
 	tcp->announce = tcpannounce;
 	tcp->ctl = tcpctl;
 	tcp->state = tcpstate;
+	tcp->info = tcpinfo;
 	tcp->create = tcpcreate;
 	tcp->close = tcpclose;
 	tcp->shutdown = tcpshutdown;
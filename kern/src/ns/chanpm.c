@@ -0,0 +1,395 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Page cache for chans.
+ *
+ * The VM maps VFS files, since it works off of a file's page_map.  To mmap a
+ * chan-backed file (devmnt / 9P, or any other 9ns device file), we give it a
+ * VFS inode in a private superblock.  The inode's page_map reads and writes
+ * pages with the device's read and write, and mmap() gets a VFS file for that
+ * inode, so the rest of the VM doesn't know the difference.
+ *
+ * There's one inode per device file, found by the chan's type, dev, and
+ * qid.path, so every process that maps the file shares the same pages.  The
+ * inode holds a chan to do its I/O with, and it lives as long as someone has
+ * the file mapped.  If the file's qid.vers changed while no one had it mapped,
+ * the next mmap() gets a new inode, so it doesn't see stale pages.
+ *
+ * Only mmap() goes through this page cache.  read() and write() on the chan
+ * still go straight to the device.
+ *
+ * The pages are read and written at their offsets, so the file has to act like
+ * a file.  9ns has no notion of seeking, so we refuse the devices that are
+ * streams, where a read consumes what it returns, and anything with no length,
+ * which covers most other streams and synthetic files. */
+
+#include <ns.h>
+#include <vfs.h>
+#include <pagemap.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <pmap.h>
+#include <smp.h>
+#include <assert.h>
+#include <error.h>
+#include <stdio.h>
+#include <string.h>
+
+struct chanpm {
+	TAILQ_ENTRY(chanpm)			link;		/* protected by chanpm_lock */
+	struct dentry				*dentry;	/* weak ref, see chanpm_lookup() */
+	int							type;
+	uint32_t					dev;
+	uint64_t					path;
+	uint32_t					vers;
+	spinlock_t					lock;		/* protects c */
+	struct chan					*c;
+};
+TAILQ_HEAD(chanpm_tailq, chanpm);
+
+static struct chanpm_tailq chanpms = TAILQ_HEAD_INITIALIZER(chanpms);
+static spinlock_t chanpm_lock = SPINLOCK_INITIALIZER;
+static struct super_block *chanpm_sb;
+static atomic_t chanpm_next_ino;
+
+static struct super_operations chanpm_s_op;
+static struct file_operations chanpm_f_op;
+static struct page_map_operations chanpm_pm_op;
+
+static void chanpm_init(void)
+{
+	struct super_block *sb = get_sb();
+	struct vfsmount *vmnt = kzmalloc(sizeof(struct vfsmount), MEM_WAIT);
+
+	/* Never mounted anywhere.  dentry_open() wants a vfsmount to ref. */
+	TAILQ_INIT(&vmnt->mnt_child_mounts);
+	kref_init(&vmnt->mnt_kref, fake_release, 1);
+	vmnt->mnt_sb = sb;
+	vmnt->mnt_devname = "chanpm";
+	sb->s_op = &chanpm_s_op;
+	sb->s_mount = vmnt;
+	sb->s_blocksize = PGSIZE;
+	atomic_init(&chanpm_next_ino, 1);
+	chanpm_sb = sb;
+}
+
+/* Devices whose files are streams: reading at an offset doesn't give you that
+ * part of a file. */
+static const char *chanpm_stream_devs[] = {
+	"pipe",
+	"cons",
+	"ip",
+	"ether",
+};
+
+static bool chanpm_is_stream(struct chan *c)
+{
+	for (int i = 0; i < ARRAY_SIZE(chanpm_stream_devs); i++) {
+		if (!strcmp(devtab[c->type].name, chanpm_stream_devs[i]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Returns a ref'd chan to do cpm's I/O with. */
+static struct chan *chanpm_get_chan(struct chanpm *cpm)
+{
+	struct chan *c;
+
+	spin_lock(&cpm->lock);
+	c = cpm->c;
+	chan_incref(c);
+	spin_unlock(&cpm->lock);
+	return c;
+}
+
+/* Switches cpm over to c if c can write and cpm's chan can't, so that shared
+ * mappings can write back. */
+static void chanpm_offer_chan(struct chanpm *cpm, struct chan *c)
+{
+	struct chan *old = 0;
+
+	if (!(c->mode & O_WRITE))
+		return;
+	spin_lock(&cpm->lock);
+	if (!(cpm->c->mode & O_WRITE)) {
+		old = cpm->c;
+		chan_incref(c);
+		cpm->c = c;
+	}
+	spin_unlock(&cpm->lock);
+	cclose(old);
+}
+
+static bool chanpm_match(struct chanpm *cpm, struct chan *c)
+{
+	struct inode *inode = cpm->dentry->d_inode;
+
+	if ((cpm->type != c->type) || (cpm->dev != c->dev) ||
+	    (cpm->path != c->qid.path))
+		return FALSE;
+	/* A new version is a new file, unless someone still has the old one
+	 * mapped.  They keep sharing the old pages. */
+	return (cpm->vers == c->qid.vers) || !TAILQ_EMPTY(&inode->i_pm.pm_vmrs);
+}
+
+/* Returns a ref'd dentry for c's file, if someone already has one.
+ *
+ * The list has a weak ref on the dentry: when the last ref goes away, the
+ * inode goes with it, and chanpm_dealloc_inode() pulls it off the list.  Until
+ * then, the dentry is still around, but we can't use it anymore. */
+static struct dentry *chanpm_lookup(struct chan *c)
+{
+	struct chanpm *cpm;
+	struct dentry *dentry = 0;
+
+	spin_lock(&chanpm_lock);
+	TAILQ_FOREACH(cpm, &chanpms, link) {
+		if (!chanpm_match(cpm, c))
+			continue;
+		if (kref_get_not_zero(&cpm->dentry->d_kref, 1)) {
+			dentry = cpm->dentry;
+			break;
+		}
+	}
+	spin_unlock(&chanpm_lock);
+	return dentry;
+}
+
+/* Makes a new dentry and inode for c's file, which has size bytes.  Returns 0
+ * with errno set on failure. */
+static struct dentry *chanpm_create(struct chan *c, size_t size)
+{
+	struct chanpm *cpm;
+	struct dentry *dentry;
+	struct inode *inode;
+
+	cpm = kzmalloc(sizeof(struct chanpm), MEM_WAIT);
+	dentry = get_dentry_with_ops(chanpm_sb, 0, c->name ? c->name->s : "chan",
+	                             &dummy_d_op);
+	if (!dentry) {
+		kfree(cpm);
+		return 0;
+	}
+	/* No one looks it up by name; it goes away with its last user */
+	dentry->d_flags |= DENTRY_DYING;
+	inode = get_inode(dentry);
+	if (!inode) {
+		kref_put(&dentry->d_kref);
+		kfree(cpm);
+		return 0;
+	}
+	/* dentry->d_inode keeps the other ref */
+	kref_put(&inode->i_kref);
+	inode->i_ino = atomic_fetch_and_add(&chanpm_next_ino, 1);
+	inode->i_mode = S_IRWXU | S_IRWXG | S_IRWXO;
+	SET_FTYPE(inode->i_mode, __S_IFREG);
+	inode->i_nlink = 1;
+	inode->i_size = size;
+	inode->i_fop = &chanpm_f_op;
+	inode->i_fs_info = cpm;
+	/* inode_release() takes it back out */
+	icache_put(chanpm_sb, inode);
+	cpm->dentry = dentry;
+	cpm->type = c->type;
+	cpm->dev = c->dev;
+	cpm->path = c->qid.path;
+	cpm->vers = c->qid.vers;
+	spinlock_init(&cpm->lock);
+	chan_incref(c);
+	cpm->c = c;
+	/* If someone else raced us, lookups find ours first, and theirs works
+	 * until it goes away.  Their pages just aren't shared with ours. */
+	spin_lock(&chanpm_lock);
+	TAILQ_INSERT_HEAD(&chanpms, cpm, link);
+	spin_unlock(&chanpm_lock);
+	return dentry;
+}
+
+/* Returns a VFS file for the chan open at fd, sharing the page cache of the
+ * file the chan is open on, for mmap().  Returns 0 with errno set on failure. */
+struct file *chanpm_open(int fd)
+{
+	ERRSTACK(2);
+	struct chan *c;
+	struct dir *dir;
+	struct dentry *dentry;
+	struct file *file;
+
+	run_once(chanpm_init());
+	if (waserror()) {
+		poperror();
+		return 0;
+	}
+	c = fdtochan(&current->open_files, fd, -1, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	if ((c->qid.type & (QTDIR | QTAPPEND)) || chanpm_is_stream(c))
+		error(ENODEV, "can't mmap %s", c->name ? c->name->s : "chan");
+	dir = chandirstat(c);
+	if (!dir)
+		error(EFAIL, "can't stat %s", c->name ? c->name->s : "chan");
+	if (!dir->length) {
+		kfree(dir);
+		error(ENODEV, "can't mmap %s, it has no length",
+		      c->name ? c->name->s : "chan");
+	}
+	dentry = chanpm_lookup(c);
+	if (dentry) {
+		dentry->d_inode->i_size = dir->length;
+		chanpm_offer_chan(dentry->d_inode->i_fs_info, c);
+	} else {
+		dentry = chanpm_create(c, dir->length);
+	}
+	kfree(dir);
+	if (!dentry)
+		error(get_errno(), "can't make an inode for %s",
+		      c->name ? c->name->s : "chan");
+	file = dentry_open(dentry, c->mode & O_ACCMODE);
+	kref_put(&dentry->d_kref);
+	poperror();
+	cclose(c);
+	poperror();
+	return file;
+}
+
+/* Page map ops */
+
+static int chanpm_readpage(struct page_map *pm, struct page *page)
+{
+	ERRSTACK(1);
+	struct chan *c = chanpm_get_chan(pm->pm_host->i_fs_info);
+	void *kva = page2kva(page);
+	off64_t off = (off64_t)page->pg_index << PGSHIFT;
+	size_t amt = 0;
+	long n;
+
+	if (waserror()) {
+		cclose(c);
+		poperror();
+		/* The page stays !UPTODATE, and the next loader will try again */
+		return -EIO;
+	}
+	while (amt < PGSIZE) {
+		n = devtab[c->type].read(c, kva + amt, PGSIZE - amt, off + amt);
+		if (!n)
+			break;
+		amt += n;
+	}
+	poperror();
+	cclose(c);
+	memset(kva + amt, 0, PGSIZE - amt);
+	atomic_or(&page->pg_flags, PG_UPTODATE);
+	return 0;
+}
+
+/* Writes back the part of the page that is in the file.  Mappings can't grow
+ * the file; page faults past EOF fail. */
+static int chanpm_writepage(struct page_map *pm, struct page *page)
+{
+	ERRSTACK(1);
+	struct inode *inode = pm->pm_host;
+	off64_t off = (off64_t)page->pg_index << PGSHIFT;
+	struct chan *c;
+	size_t amt;
+
+	if (off >= inode->i_size)
+		return 0;
+	amt = MIN(PGSIZE, inode->i_size - off);
+	c = chanpm_get_chan(inode->i_fs_info);
+	if (waserror()) {
+		cclose(c);
+		poperror();
+		/* pm_remove_contig() leaves it dirty */
+		return -EIO;
+	}
+	if (devtab[c->type].write(c, page2kva(page), amt, off) != amt)
+		error(EIO, "short writeback to %s", c->name ? c->name->s : "chan");
+	poperror();
+	cclose(c);
+	return 0;
+}
+
+static struct page_map_operations chanpm_pm_op = {
+	chanpm_readpage,
+	chanpm_writepage,
+};
+
+/* Super block ops.  Our inodes never hit the disk, so we only need to alloc and
+ * free them. */
+
+static struct inode *chanpm_alloc_inode(struct super_block *sb)
+{
+	struct inode *inode = kmem_cache_alloc(inode_kcache, 0);
+
+	if (!inode)
+		return 0;
+	memset(inode, 0, sizeof(struct inode));
+	inode->i_op = &dummy_i_op;
+	inode->i_pm.pm_op = &chanpm_pm_op;
+	return inode;
+}
+
+/* Called from inode_release(), after the pages were written back */
+static void chanpm_dealloc_inode(struct inode *inode)
+{
+	struct chanpm *cpm = inode->i_fs_info;
+
+	spin_lock(&chanpm_lock);
+	TAILQ_REMOVE(&chanpms, cpm, link);
+	spin_unlock(&chanpm_lock);
+	cclose(cpm->c);
+	kfree(cpm);
+}
+
+static struct super_operations chanpm_s_op = {
+	chanpm_alloc_inode,
+	chanpm_dealloc_inode,
+	0,	/* read_inode */
+	0,	/* dirty_inode */
+	0,	/* write_inode */
+	0,	/* put_inode */
+	0,	/* drop_inode */
+	0,	/* delete_inode */
+	0,	/* put_super */
+	0,	/* write_super */
+	0,	/* sync_fs */
+	0,	/* remount_fs */
+	0,	/* umount_begin */
+};
+
+/* File ops.  The files only exist for their VMRs. */
+
+static int chanpm_mmap(struct file *file, struct vm_region *vmr)
+{
+	return 0;
+}
+
+static int chanpm_file_open(struct inode *inode, struct file *file)
+{
+	return 0;
+}
+
+static int chanpm_release(struct inode *inode, struct file *file)
+{
+	return 0;
+}
+
+static struct file_operations chanpm_f_op = {
+	0,	/* llseek */
+	0,	/* read */
+	0,	/* write */
+	0,	/* readdir */
+	chanpm_mmap,
+	chanpm_file_open,
+	0,	/* flush */
+	chanpm_release,
+	0,	/* fsync */
+	0,	/* poll */
+	0,	/* readv */
+	0,	/* writev */
+	0,	/* sendpage */
+	0,	/* check_flags */
+};
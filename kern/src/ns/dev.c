@@ -462,6 +462,8 @@ long devbwrite(struct chan *c, struct block *bp, uint32_t offset)
 	ERRSTACK(1);
 	long n;
 
+	/* write() wants one buffer, and bp might have extra_data (writev) */
+	bp = linearizeblock(bp);
 	if (waserror()) {
 		freeb(bp);
 		nexterror();
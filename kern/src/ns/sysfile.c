@@ -38,6 +38,7 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <umem.h>
 #include <ip.h>
 
 enum {
@@ -749,6 +750,126 @@ long syspread(int fd, void *va, long n, int64_t off)
 	return rread(fd, va, n, &off);
 }
 
+/* Vectored I/O to chans goes through a bounce buffer of at most this much, so
+ * that a device sees one read or write for the whole iovec (per chunk). */
+#define RWV_BOUNCE_SZ (64 * 1024)
+
+static long iov_total(struct iovec *iov, int iovcnt)
+{
+	long total = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	return total;
+}
+
+/* Copies amt bytes from buf out to the user's iovecs, starting skip bytes into
+ * them. */
+static void bounce_to_iov(struct iovec *iov, int iovcnt, size_t skip,
+                          uint8_t *buf, size_t amt)
+{
+	size_t seg;
+
+	for (int i = 0; (i < iovcnt) && amt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		seg = MIN(iov[i].iov_len - skip, amt);
+		if (memcpy_to_user(current, iov[i].iov_base + skip, buf, seg))
+			error(EFAULT, "bad readv buffer %p", iov[i].iov_base);
+		buf += seg;
+		amt -= seg;
+		skip = 0;
+	}
+}
+
+/* Copies amt bytes from the user's iovecs into buf, starting skip bytes into
+ * them. */
+static void iov_to_bounce(struct iovec *iov, int iovcnt, size_t skip,
+                          uint8_t *buf, size_t amt)
+{
+	size_t seg;
+
+	for (int i = 0; (i < iovcnt) && amt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		seg = MIN(iov[i].iov_len - skip, amt);
+		if (memcpy_from_user(current, buf, iov[i].iov_base + skip, seg))
+			error(EFAULT, "bad writev buffer %p", iov[i].iov_base);
+		buf += seg;
+		amt -= seg;
+		skip = 0;
+	}
+}
+
+/* Vectored rread().  The device gets one read per RWV_BOUNCE_SZ, and we stop
+ * after a short one, so we don't block on a stream that gave us what it had.
+ * The caller checked and copied in the iovec array; the iov_bases are still
+ * user addresses. */
+static long rreadv(int fd, struct iovec *iov, int iovcnt, int64_t *offp)
+{
+	ERRSTACK(2);
+	struct chan *c;
+	int64_t off;
+	long total = iov_total(iov, iovcnt);
+	long sofar = 0, amt, n;
+	uint8_t *buf = kmalloc(MIN(total, RWV_BOUNCE_SZ) + 1, MEM_WAIT);
+
+	if (waserror()) {
+		kfree(buf);
+		poperror();
+		return -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_READ, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	/* Directories are read a kdirent at a time, see rread() */
+	if (c->qid.type & QTDIR)
+		error(EISDIR, "can't readv a directory");
+	if (offp == NULL) {
+		spin_lock(&c->lock);	/* lock for int64_t assignment */
+		off = c->offset;
+		spin_unlock(&c->lock);
+	} else {
+		off = *offp;
+	}
+	if (off < 0)
+		error(EINVAL, ERROR_FIXME);
+	while (sofar < total) {
+		amt = MIN(total - sofar, RWV_BOUNCE_SZ);
+		n = devtab[c->type].read(c, buf, amt, off + sofar);
+		if (offp == NULL) {
+			spin_lock(&c->lock);
+			c->offset += n;
+			spin_unlock(&c->lock);
+		}
+		bounce_to_iov(iov, iovcnt, sofar, buf, n);
+		sofar += n;
+		if (n < amt)
+			break;
+	}
+	poperror();
+	cclose(c);
+	poperror();
+	kfree(buf);
+	return sofar;
+}
+
+long sysreadv(int fd, struct iovec *iov, int iovcnt)
+{
+	return rreadv(fd, iov, iovcnt, NULL);
+}
+
+long syspreadv(int fd, struct iovec *iov, int iovcnt, int64_t off)
+{
+	return rreadv(fd, iov, iovcnt, &off);
+}
+
 int sysremove(char *path)
 {
 	ERRSTACK(2);
@@ -1030,6 +1151,310 @@ long syspwrite(int fd, void *va, long n, int64_t off)
 	return rwrite(fd, va, n, &off);
 }
 
+/* Builds a block out of the user's iovecs, with one extra_data buffer per
+ * iovec, so queue-based devices can take the whole write as one block. */
+static struct block *iov_to_block(struct iovec *iov, int iovcnt, size_t skip,
+                                  size_t amt)
+{
+	ERRSTACK(1);
+	struct block *bp = block_alloc(0, MEM_WAIT);
+	void *buf = kmalloc(amt, MEM_WAIT);
+
+	/* The block frees buf from here on */
+	block_append_extra(bp, (uintptr_t)buf, 0, amt, MEM_WAIT);
+	if (waserror()) {
+		freeb(bp);
+		nexterror();
+	}
+	iov_to_bounce(iov, iovcnt, skip, buf, amt);
+	poperror();
+	return bp;
+}
+
+/* Writes the user's iovecs to c at off with the device's bwrite, one block of
+ * up to RWV_BOUNCE_SZ at a time, stopping after a short one.  Like a write(),
+ * a writev of up to RWV_BOUNCE_SZ is one qio insertion. */
+static long block_writev(struct chan *c, struct iovec *iov, int iovcnt,
+                         long total, int64_t off)
+{
+	long sofar = 0, amt, m;
+
+	while (sofar < total) {
+		amt = MIN(total - sofar, RWV_BOUNCE_SZ);
+		/* bwrite consumes the block, even on error */
+		m = devtab[c->type].bwrite(c, iov_to_block(iov, iovcnt, sofar, amt),
+		                           off + sofar);
+		sofar += m;
+		if (m < amt)
+			break;
+	}
+	return sofar;
+}
+
+/* Writes the user's iovecs to c at off, one device write per RWV_BOUNCE_SZ,
+ * stopping after a short one. */
+static long bounce_writev(struct chan *c, struct iovec *iov, int iovcnt,
+                          long total, int64_t off)
+{
+	ERRSTACK(1);
+	uint8_t *buf = kmalloc(MIN(total, RWV_BOUNCE_SZ) + 1, MEM_WAIT);
+	long sofar = 0, amt, m;
+
+	if (waserror()) {
+		kfree(buf);
+		nexterror();
+	}
+	while (sofar < total) {
+		amt = MIN(total - sofar, RWV_BOUNCE_SZ);
+		iov_to_bounce(iov, iovcnt, sofar, buf, amt);
+		m = devtab[c->type].write(c, buf, amt, off + sofar);
+		sofar += m;
+		if (m < amt)
+			break;
+	}
+	poperror();
+	kfree(buf);
+	return sofar;
+}
+
+/* Vectored rwrite().  Devices with their own bwrite (pipes, #ip data files)
+ * get blocks from block_writev().  Everyone else goes through
+ * bounce_writev(). */
+static long rwritev(int fd, struct iovec *iov, int iovcnt, int64_t *offp)
+{
+	ERRSTACK(3);
+	struct chan *c;
+	struct dir *dir;
+	int64_t off;
+	long total = iov_total(iov, iovcnt);
+	long m;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	if (c->qid.type & QTDIR)
+		error(EISDIR, ERROR_FIXME);
+	if (offp == NULL) {
+		/* Same as rwrite(): O_APPEND moves us to the end, and we reserve the
+		 * range, giving back whatever we don't write. */
+		if (c->flag & O_APPEND) {
+			dir = chandirstat(c);
+			if (!dir)
+				error(EFAIL, "internal error: stat error in append write");
+			spin_lock(&c->lock);
+			c->offset = dir->length;
+			spin_unlock(&c->lock);
+			kfree(dir);
+		}
+		spin_lock(&c->lock);
+		off = c->offset;
+		c->offset += total;
+		spin_unlock(&c->lock);
+	} else {
+		off = *offp;
+	}
+	if (waserror()) {
+		if (offp == NULL) {
+			spin_lock(&c->lock);
+			c->offset -= total;
+			spin_unlock(&c->lock);
+		}
+		nexterror();
+	}
+	if (off < 0)
+		error(EINVAL, ERROR_FIXME);
+	if (devtab[c->type].bwrite != devbwrite)
+		m = block_writev(c, iov, iovcnt, total, off);
+	else
+		m = bounce_writev(c, iov, iovcnt, total, off);
+	poperror();
+	if (offp == NULL && m < total) {
+		spin_lock(&c->lock);
+		c->offset -= total - m;
+		spin_unlock(&c->lock);
+	}
+	poperror();
+	cclose(c);
+	poperror();
+	return m;
+}
+
+long syswritev(int fd, struct iovec *iov, int iovcnt)
+{
+	return rwritev(fd, iov, iovcnt, NULL);
+}
+
+long syspwritev(int fd, struct iovec *iov, int iovcnt, int64_t off)
+{
+	return rwritev(fd, iov, iovcnt, &off);
+}
+
+/* sendfile() moves at most this much per bread/bwrite */
+#define SENDFILE_CHUNK (64 * 1024)
+
+/* Gets up to n bytes of c at off as a block list.  Devices with their own
+ * bread (pipes, #ip data files) hand over their blocks.  Everyone else reads
+ * into a new block; devbread() would truncate the offset. */
+static struct block *sendfile_bread(struct chan *c, long n, int64_t off)
+{
+	ERRSTACK(1);
+	struct block *bp;
+
+	if (devtab[c->type].bread != devbread)
+		return devtab[c->type].bread(c, n, off);
+	bp = block_alloc(n, MEM_WAIT);
+	if (waserror()) {
+		freeb(bp);
+		nexterror();
+	}
+	bp->wp += devtab[c->type].read(c, bp->wp, n, off);
+	poperror();
+	return bp;
+}
+
+/* Gives bp to c, which consumes it, even on error.  Returns the amount
+ * written. */
+static long sendfile_bwrite(struct chan *c, struct block *bp, int64_t off)
+{
+	ERRSTACK(1);
+	long m;
+
+	if (devtab[c->type].bwrite != devbwrite)
+		return devtab[c->type].bwrite(c, bp, off);
+	/* Same as devbwrite(), but with the whole offset */
+	bp = linearizeblock(concatblock(bp));
+	if (waserror()) {
+		freeb(bp);
+		nexterror();
+	}
+	m = devtab[c->type].write(c, bp->rp, BLEN(bp), off);
+	poperror();
+	freeb(bp);
+	return m;
+}
+
+/* Copies up to count bytes from in_fd to out_fd, without going through the
+ * user's memory.  The data moves as blocks, from in_fd's bread to out_fd's
+ * bwrite, a chunk at a time, stopping after a short read or write.  If in_fd
+ * is a VFS file, in_file is that file, and we read from its page cache.
+ *
+ * With offp, we read from *offp and advance it, instead of in_fd's offset.
+ * out_fd's offset always moves, and O_APPEND starts at the end. */
+long syssendfile(int out_fd, int in_fd, struct file *in_file, int64_t *offp,
+                 long count)
+{
+	ERRSTACK(4);
+	struct chan *in = NULL, *out;
+	struct block *bp;
+	struct dir *dir;
+	int64_t in_off, out_off;
+	/* volatile, since we read it after an error in the copy loop */
+	volatile long sofar = 0;
+	long amt, n, m;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	out = fdtochan(&current->open_files, out_fd, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(out);
+		nexterror();
+	}
+	if (!in_file)
+		in = fdtochan(&current->open_files, in_fd, O_READ, 1, 1);
+	if (waserror()) {
+		if (in)
+			cclose(in);
+		nexterror();
+	}
+	if ((out->qid.type & QTDIR) || (in && (in->qid.type & QTDIR)))
+		error(EISDIR, "can't sendfile a directory");
+	if (count < 0)
+		error(EINVAL, "negative count %ld", count);
+	if (offp)
+		in_off = *offp;
+	else if (in_file)
+		in_off = in_file->f_pos;
+	else {
+		spin_lock(&in->lock);	/* lock for int64_t assignment */
+		in_off = in->offset;
+		spin_unlock(&in->lock);
+	}
+	if (in_off < 0)
+		error(EINVAL, "negative offset %lld", in_off);
+	if (out->flag & O_APPEND) {
+		dir = chandirstat(out);
+		if (!dir)
+			error(EFAIL, "internal error: stat error in append write");
+		spin_lock(&out->lock);
+		out->offset = dir->length;
+		spin_unlock(&out->lock);
+		kfree(dir);
+	}
+	spin_lock(&out->lock);
+	out_off = out->offset;
+	spin_unlock(&out->lock);
+	/* Like a short write: once anything moved (and the offsets with it), an
+	 * error just ends the transfer early. */
+	if (waserror()) {
+		if (!sofar)
+			nexterror();
+	} else {
+		while (sofar < count) {
+			amt = MIN(count - sofar, SENDFILE_CHUNK);
+			if (in_file) {
+				bp = NULL;
+				if (generic_file_bread(in_file, &bp, amt,
+				                       in_off + sofar) < 0)
+					error(get_errno(),
+					      "reading the page cache failed");
+			} else {
+				bp = sendfile_bread(in, amt, in_off + sofar);
+			}
+			if (!bp)
+				break;
+			n = blocklen(bp);
+			if (!n) {
+				freeblist(bp);
+				break;
+			}
+			m = sendfile_bwrite(out, bp, out_off + sofar);
+			if (!offp) {
+				if (in_file) {
+					in_file->f_pos += m;
+				} else {
+					spin_lock(&in->lock);
+					in->offset += m;
+					spin_unlock(&in->lock);
+				}
+			}
+			spin_lock(&out->lock);
+			out->offset += m;
+			spin_unlock(&out->lock);
+			sofar += m;
+			if ((m < n) || (n < amt))
+				break;
+		}
+	}
+	poperror();
+	if (offp)
+		*offp = in_off + sofar;
+	poperror();
+	if (in)
+		cclose(in);
+	poperror();
+	cclose(out);
+	poperror();
+	return sofar;
+}
+
 int syswstat(char *path, uint8_t * buf, int n)
 {
 	ERRSTACK(2);
@@ -14,6 +14,7 @@
 #include <string.h>
 #include <kmalloc.h>
 #include <blockdev.h>
+#include <kmemtrack.h>
 
 #define l1 (available_caches.l1)
 #define l2 (available_caches.l2)
@@ -63,6 +64,7 @@ static void __page_init(struct page *page)
 	if(i < (base_color+range)) {                                            \
 		*page = BSD_LIST_FIRST(&colored_page_free_list[i]);                 \
 		BSD_LIST_REMOVE(*page, pg_link);                                    \
+		nr_free_pages--;                                                    \
 		__page_init(*page);                                                 \
 		return i;                                                           \
 	}                                                                       \
@@ -97,6 +99,7 @@ static ssize_t __colored_page_alloc(uint8_t* map, page_t** page,
 static void __real_page_alloc(struct page *page)
 {
 	BSD_LIST_REMOVE(page, pg_link);
+	nr_free_pages--;
 	__page_init(page);
 }
 
@@ -129,6 +132,7 @@ error_t upage_alloc(struct proc* p, page_t** page, int zero)
 	ssize_t ret = __colored_page_alloc(p->cache_colors_map,
 	                                     page, p->next_cache_color);
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	pm_reclaim_kick();
 
 	if (ret >= 0) {
 		if(zero)
@@ -139,8 +143,15 @@ error_t upage_alloc(struct proc* p, page_t** page, int zero)
 	return ret;
 }
 
-/* Allocates a refcounted page of memory for the kernel's use */
-error_t kpage_alloc(page_t** page)
+/* Charges a freshly allocated page to site, for kmemtrack. */
+static void __page_track(struct page *page, uintptr_t site)
+{
+#ifdef CONFIG_KMEM_TRACK
+	page->pg_alloc_site = kmemtrack_alloc(KMEMTRACK_PAGES, site, PGSIZE);
+#endif
+}
+
+static error_t __kpage_alloc(page_t **page, uintptr_t site)
 {
 	ssize_t ret;
 	spin_lock_irqsave(&colored_page_free_list_lock);
@@ -151,25 +162,38 @@ error_t kpage_alloc(page_t** page)
 	if (ret >= 0) {
 		global_next_color = ret;
 		ret = ESUCCESS;
+		__page_track(*page, site);
 	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	pm_reclaim_kick();
 
 	return ret;
 }
 
-/* Helper: allocates a refcounted page of memory for the kernel's use and
- * returns the kernel address (kernbase), or 0 on error. */
-void *kpage_alloc_addr(void)
+/* Allocates a refcounted page of memory for the kernel's use */
+error_t kpage_alloc(page_t** page)
+{
+	return __kpage_alloc(page, kmemtrack_caller());
+}
+
+static void *__kpage_alloc_addr(uintptr_t site)
 {
 	struct page *a_page;
-	if (kpage_alloc(&a_page))
+	if (__kpage_alloc(&a_page, site))
 		return 0;
 	return page2kva(a_page);
 }
 
+/* Helper: allocates a refcounted page of memory for the kernel's use and
+ * returns the kernel address (kernbase), or 0 on error. */
+void *kpage_alloc_addr(void)
+{
+	return __kpage_alloc_addr(kmemtrack_caller());
+}
+
 void *kpage_zalloc_addr(void)
 {
-	void *retval = kpage_alloc_addr();
+	void *retval = __kpage_alloc_addr(kmemtrack_caller());
 	if (retval)
 		memset(retval, 0, PGSIZE);
 	return retval;
@@ -184,7 +208,7 @@ void *kpage_zalloc_addr(void)
  *
  * @return The KVA of the first page, NULL otherwise.
  */
-void *get_cont_pages(size_t order, int flags)
+static void *__get_cont_pages(size_t order, int flags, uintptr_t site)
 {
 	size_t npages = 1 << order;
 
@@ -220,11 +244,17 @@ void *get_cont_pages(size_t order, int flags)
 	for(int i=0; i<npages; i++) {
 		page_t* page;
 		__page_alloc_specific(&page, first+i);
+		__page_track(page, site);
 	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
 	return ppn2kva(first);
 }
 
+void *get_cont_pages(size_t order, int flags)
+{
+	return __get_cont_pages(order, flags, kmemtrack_caller());
+}
+
 /**
  * @brief Allocated 2^order contiguous physical pages.  Will increment the
  * reference count for the pages. Get them from NUMA node node.
@@ -237,7 +267,7 @@ void *get_cont_pages(size_t order, int flags)
  */
 void *get_cont_pages_node(int node, size_t order, int flags)
 {
-	return get_cont_pages(order, flags);
+	return __get_cont_pages(order, flags, kmemtrack_caller());
 }
 
 /**
@@ -360,6 +390,10 @@ static void page_release(struct kref *kref)
 {
 	struct page *page = container_of(kref, struct page, pg_kref);
 
+#ifdef CONFIG_KMEM_TRACK
+	if (page->pg_alloc_site)
+		kmemtrack_free(KMEMTRACK_PAGES, page->pg_alloc_site, PGSIZE);
+#endif
 	if (atomic_read(&page->pg_flags) & PG_BUFFER)
 		free_bhs(page);
 	/* Give our page back to the free list.  The protections for this are that
@@ -369,6 +403,7 @@ static void page_release(struct kref *kref)
 	   page,
 	   pg_link
 	);
+	nr_free_pages++;
 }
 
 /* Helper when initializing a page - just to prevent the proliferation of
@@ -9,9 +9,48 @@
 #include <atomic.h>
 #include <radix.h>
 #include <kref.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <sort.h>
+#include <ns.h>
+#include <trap.h>
+#include <smp.h>
 #include <assert.h>
 #include <stdio.h>
 
+/* Every PM, for the reclaimer.  pm_list_lock protects the list, and the
+ * reclaim qlock keeps PMs from going away while reclaim works on them. */
+static struct page_map_tailq pm_list = TAILQ_HEAD_INITIALIZER(pm_list);
+static spinlock_t pm_list_lock = SPINLOCK_INITIALIZER;
+static unsigned long pm_list_len;
+static qlock_t pm_reclaim_qlock = QLOCK_INITIALIZER(pm_reclaim_qlock);
+
+/* Page cache stats, in #vars */
+static atomic_t pm_nr_pages;		/* in all PMs */
+static atomic_t pm_nr_writeback;	/* written back for removal */
+static atomic_t pm_nr_readahead;	/* pages read ahead */
+static unsigned long pm_nr_scanned;	/* the rest are under the reclaim qlock */
+static unsigned long pm_nr_reclaimed;
+static unsigned long pm_nr_direct_reclaim;
+static unsigned long pm_nr_reclaim_wakeups;
+static unsigned long pm_reclaim_low;	/* free pages that wake the reclaimer */
+static unsigned long pm_reclaim_high;	/* free pages where it stops */
+
+DEVVARS_ENTRY(nr_free_pages, "ug");
+DEVVARS_ENTRY(pm_nr_pages, "ug");
+DEVVARS_ENTRY(pm_nr_writeback, "ug");
+DEVVARS_ENTRY(pm_nr_readahead, "ug");
+DEVVARS_ENTRY(pm_nr_scanned, "ug");
+DEVVARS_ENTRY(pm_nr_reclaimed, "ug");
+DEVVARS_ENTRY(pm_nr_direct_reclaim, "ug");
+DEVVARS_ENTRY(pm_nr_reclaim_wakeups, "ug");
+DEVVARS_ENTRY(pm_reclaim_low, "ug");
+DEVVARS_ENTRY(pm_reclaim_high, "ug");
+
+static int __pm_remove_contig(struct page_map *pm, unsigned long index,
+                              unsigned long nr_pgs, bool reclaim);
+static bool pm_direct_reclaim(void);
+
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
 	/* note that the VMR being reverse-mapped by the PM is protected by the PM's
@@ -103,6 +142,47 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
 	atomic_set(&pm->pm_removal, 0);
+	TAILQ_INIT(&pm->pm_active);
+	TAILQ_INIT(&pm->pm_inactive);
+	pm->pm_nr_active = 0;
+	atomic_set(&pm->pm_ra_inflight, 0);
+	spin_lock(&pm_list_lock);
+	TAILQ_INSERT_TAIL(&pm_list, pm, pm_link);
+	pm_list_len++;
+	spin_unlock(&pm_list_lock);
+}
+
+/* Tears down a PM whose host is going away: takes it off the reclaimer's list
+ * and removes every page, writing back the dirty ones.  No one can have
+ * references on the pages, or VMRs. */
+void pm_destroy(struct page_map *pm)
+{
+	struct page *page;
+	unsigned long index;
+
+	qlock(&pm_reclaim_qlock);
+	spin_lock(&pm_list_lock);
+	TAILQ_REMOVE(&pm_list, pm, pm_link);
+	pm_list_len--;
+	spin_unlock(&pm_list_lock);
+	qunlock(&pm_reclaim_qlock);
+	/* readahead holds refs on its pages until the reads finish */
+	while (atomic_read(&pm->pm_ra_inflight))
+		kthread_usleep(1000);
+	while (1) {
+		spin_lock(&pm->pm_lock);
+		page = TAILQ_FIRST(&pm->pm_inactive);
+		if (!page)
+			page = TAILQ_FIRST(&pm->pm_active);
+		index = page ? page->pg_index : 0;
+		spin_unlock(&pm->pm_lock);
+		if (!page)
+			break;
+		if (!pm_remove_contig(pm, index, 1)) {
+			warn("Unable to remove page %lu from dying PM %p", index, pm);
+			break;
+		}
+	}
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -134,6 +214,9 @@ static struct page *pm_find_page(struct page_map *pm, unsigned long index)
 		slot_val = pm_slot_inc_refcnt(slot_val);	/* not a page kref */
 	} while (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val));
 	assert(page->pg_tree_slot == tree_slot);
+	/* for the reclaimer's clock.  skip the atomic if it's already set */
+	if (!(atomic_read(&page->pg_flags) & PG_REFERENCED))
+		atomic_or(&page->pg_flags, PG_REFERENCED);
 out:
 	spin_unlock(&pm->pm_lock);
 	return page;
@@ -173,7 +256,9 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	}
 	page->pg_tree_slot = tree_slot;
 	pm->pm_num_pages++;
+	TAILQ_INSERT_TAIL(&pm->pm_inactive, page, pg_lru_link);
 	spin_unlock(&pm->pm_lock);
+	atomic_inc(&pm_nr_pages);
 	return 0;
 }
 
@@ -197,7 +282,8 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 
 	page = pm_find_page(pm, index);
 	while (!page) {
-		if (kpage_alloc(&page))
+		if (kpage_alloc(&page) &&
+		    (!pm_direct_reclaim() || kpage_alloc(&page)))
 			return -ENOMEM;
 		/* important that UP_TO_DATE is not set.  once we put it in the PM,
 		 * others can find it, and we still need to fill it. */
@@ -238,7 +324,13 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	/* fall through */
 load_locked_page:
 	error = pm->pm_op->readpage(pm, page);
-	assert(!error);
+	if (error) {
+		/* The page stays in the PM, !UPTODATE, and whoever wants it next will
+		 * try the read again. */
+		unlock_page(page);
+		pm_put_page(page);
+		return error;
+	}
 	assert(atomic_read(&page->pg_flags) & PG_UPTODATE);
 	unlock_page(page);
 	*pp = page;
@@ -262,6 +354,106 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+/* Readahead.
+ *
+ * pm_readahead() inserts each missing page locked and !UPTODATE, then sends a
+ * routine KMSG to this core to read it.  Each KMSG gets its own kthread, so the
+ * reads block and overlap independently, and the block layer can merge them.
+ * Anyone who wants one of the pages in the meantime blocks on the page lock in
+ * pm_load_page(), just like with any other loader.
+ *
+ * pm_ra_update() decides when to call it.  Each stream of accesses (an open
+ * file, a VMR) has a struct pm_ra.  An access that starts at or just before
+ * where the last one ended is sequential.  Once a stream is sequential, we read
+ * ahead a window past the access, starting at PM_RA_MIN pages and doubling each
+ * time the reader gets within half a window of the end of what we've read, up
+ * to PM_RA_MAX.  A random access closes the window.  The state isn't locked;
+ * concurrent accessors of one stream just make for worse guesses. */
+
+#define PM_RA_MIN				4
+#define PM_RA_MAX				64
+
+static void __pm_ra_readpage(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct page_map *pm = (struct page_map*)a0;
+	struct page *page = (struct page*)a1;
+
+	/* If this fails, the page stays !UPTODATE, and pm_load_page() retries */
+	pm->pm_op->readpage(pm, page);
+	unlock_page(page);
+	pm_put_page(page);
+	atomic_dec(&pm->pm_ra_inflight);
+}
+
+static bool pm_has_page(struct page_map *pm, unsigned long index)
+{
+	void *slot_val;
+
+	spin_lock(&pm->pm_lock);
+	slot_val = radix_lookup(&pm->pm_tree, index);
+	spin_unlock(&pm->pm_lock);
+	return pm_slot_get_page(slot_val) ? TRUE : FALSE;
+}
+
+/* Starts reading [index, index + nr_pgs) into the cache, without blocking.
+ * Stops early if memory is low; readahead doesn't reclaim. */
+void pm_readahead(struct page_map *pm, unsigned long index,
+                  unsigned long nr_pgs)
+{
+	struct page *page;
+
+	for (unsigned long i = index; i < index + nr_pgs; i++) {
+		if (pm_has_page(pm, i))
+			continue;
+		if (nr_free_pages < pm_reclaim_low || kpage_alloc(&page))
+			break;
+		atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP);
+		page->pg_sem.nr_signals = 0;	/* preemptively locking */
+		if (pm_insert_page(pm, i, page)) {
+			page_decref(page);
+			continue;
+		}
+		/* the KMSG gets our slot ref */
+		atomic_inc(&pm->pm_ra_inflight);
+		atomic_inc(&pm_nr_readahead);
+		send_kernel_message(core_id(), __pm_ra_readpage, (long)pm, (long)page,
+		                    0, KMSG_ROUTINE);
+	}
+}
+
+/* Tells readahead about an access to [index, index + nr_pgs) of pm, which has
+ * nr_file_pgs pages of data.  Call before loading the pages. */
+void pm_ra_update(struct page_map *pm, struct pm_ra *ra, unsigned long index,
+                  unsigned long nr_pgs, unsigned long nr_file_pgs)
+{
+	unsigned long end = index + nr_pgs;
+	unsigned long start, stop;
+	bool seq;
+
+	if (ra->ra_mode == PM_RA_RANDOM)
+		return;
+	/* re-reading the last page, e.g. small reads, counts as sequential */
+	seq = (index == ra->ra_expect) || (index + 1 == ra->ra_expect);
+	ra->ra_expect = end;
+	if (!seq) {
+		ra->ra_next = 0;
+		if (ra->ra_mode != PM_RA_SEQUENTIAL) {
+			ra->ra_size = 0;
+			return;
+		}
+	}
+	if (!ra->ra_size)
+		ra->ra_size = ra->ra_mode == PM_RA_SEQUENTIAL ? PM_RA_MAX : PM_RA_MIN;
+	if (end + ra->ra_size / 2 < ra->ra_next)
+		return;
+	start = MAX(ra->ra_next, end);
+	stop = MIN(end + ra->ra_size, nr_file_pgs);
+	if (start < stop)
+		pm_readahead(pm, start, stop - start);
+	ra->ra_next = MAX(stop, start);
+	ra->ra_size = MIN(ra->ra_size * 2, PM_RA_MAX);
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -358,9 +550,18 @@ static void shootdown_and_reset_ptrstore(void *proc_ptrs[], int *arr_idx)
 
 /* Attempts to remove pages from the pm, from [index, index + nr_pgs).  Returns
  * the number of pages removed.  There can only be one remover at a time per PM
- * - others will return 0. */
+ * - others will return 0.
+ *
+ * Dirty pages are written back first.  For reclaim, pages that fail writeback
+ * (or are redirtied) stay in the PM; o/w, they are removed anyway. */
 int pm_remove_contig(struct page_map *pm, unsigned long index,
                      unsigned long nr_pgs)
+{
+	return __pm_remove_contig(pm, index, nr_pgs, FALSE);
+}
+
+static int __pm_remove_contig(struct page_map *pm, unsigned long index,
+                              unsigned long nr_pgs, bool reclaim)
 {
 	unsigned long i;
 	int nr_removed = 0;
@@ -540,8 +741,12 @@ handle_dirty:
 	 * are still the only remover. still can have new refs that clear REMOVAL */
 	spin_unlock(&pm->pm_lock);
 	/* could batch these up, etc. */
-	for (int j = 0; j < ptr_free_idx; j++)
-		pm->pm_op->writepage(pm, (struct page*)ptr_store[j]);
+	for (int j = 0; j < ptr_free_idx; j++) {
+		page = (struct page*)ptr_store[j];
+		atomic_inc(&pm_nr_writeback);
+		if (!pm->pm_op->writepage || pm->pm_op->writepage(pm, page))
+			atomic_or(&page->pg_flags, PG_DIRTY);
+	}
 	ptr_free_idx = 0;
 	spin_lock(&pm->pm_lock);
 	/* bailed out of the dirty check loop earlier, need to finish and WB.  i is
@@ -570,6 +775,12 @@ handle_dirty:
 			atomic_and(&page->pg_flags, ~PG_REMOVAL);
 			continue;
 		}
+		/* Reclaim only drops clean pages.  The slot's REMOVAL can stay set,
+		 * it's just a spurious removal. */
+		if (reclaim && (atomic_read(&page->pg_flags) & PG_DIRTY)) {
+			atomic_and(&page->pg_flags, ~PG_REMOVAL);
+			continue;
+		}
 		if (pm_slot_check_refcnt(slot_val))
 			warn("Unexpected refcnt in PM remove!");
 		/* Note that we keep slot REMOVAL set, so the radix tree thinks it's
@@ -582,6 +793,12 @@ handle_dirty:
 		/* at this point, we're free at last!  When we update the radix tree, it
 		 * still thinks it has an item.  This is fine.  Lookups will now fail
 		 * (since the page is 0), and insertions will block on the write lock.*/
+		if (atomic_read(&page->pg_flags) & PG_ACTIVE) {
+			TAILQ_REMOVE(&pm->pm_active, page, pg_lru_link);
+			pm->pm_nr_active--;
+		} else {
+			TAILQ_REMOVE(&pm->pm_inactive, page, pg_lru_link);
+		}
 		atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
 		page_decref(page);
 		nr_removed++;
@@ -589,6 +806,7 @@ handle_dirty:
 	}
 	pm->pm_num_pages -= nr_removed;
 	spin_unlock(&pm->pm_lock);
+	atomic_add(&pm_nr_pages, -nr_removed);
 	atomic_set(&pm->pm_removal, 0);
 	return nr_removed;
 }
@@ -597,7 +815,8 @@ void print_page_map_info(struct page_map *pm)
 {
 	struct vm_region *vmr_i;
 	printk("Page Map %p\n", pm);
-	printk("\tNum pages: %lu\n", pm->pm_num_pages);
+	printk("\tNum pages: %lu (%lu active)\n", pm->pm_num_pages,
+	       pm->pm_nr_active);
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
 		printk("\tVMR proc %d: (%p - %p): 0x%08x, 0x%08x, %p, %p\n",
@@ -606,3 +825,192 @@ void print_page_map_info(struct page_map *pm)
 	}
 	spin_unlock(&pm->pm_lock);
 }
+
+/* Page cache reclaim.
+ *
+ * Each PM keeps its pages on two LRU lists.  New pages start on the inactive
+ * list, and lookups set PG_REFERENCED, which is cheap enough for the fast path.
+ * The reclaimer is a clock over those lists: it promotes referenced inactive
+ * pages to the active list, evicts unreferenced ones, and keeps the active list
+ * from growing past half of the PM by aging its head back to the inactive list.
+ * Pages mapped into processes only get referenced when they are faulted in, so
+ * hot mmapped pages can be evicted, in which case they get soft-faulted back in.
+ *
+ * Eviction is pm_remove_contig(), which unmaps the page from any VMRs and
+ * writes back dirty pages before dropping them.  Pages that can't be written
+ * back (e.g. KFS) stay until their PM is destroyed.
+ *
+ * The reclaim ktask sleeps until an allocation notices free pages below
+ * pm_reclaim_low, then reclaims until there are pm_reclaim_high.  pm_load_page()
+ * also reclaims directly if the page allocator comes up empty. */
+
+#define PM_RECLAIM_BATCH		32		/* max pages per PM per visit */
+#define PM_RECLAIM_SCAN			64		/* max LRU entries per PM per visit */
+#define PM_RECLAIM_ROUNDS		3		/* passes over all PMs per call */
+#define PM_RECLAIM_BACKOFF_USEC	10000
+
+static struct rendez pm_reclaim_rv;
+static bool pm_reclaim_active;
+
+static int __pm_cmp_idx(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long*)a;
+	unsigned long y = *(const unsigned long*)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Runs the clock over pm's lists and evicts up to nr_pgs pages.  Returns the
+ * number evicted.  Caller holds the reclaim qlock. */
+static unsigned long __pm_reclaim_one(struct page_map *pm, unsigned long nr_pgs)
+{
+	unsigned long victims[PM_RECLAIM_BATCH];
+	int nr_victims = 0, i, j;
+	unsigned long nr_scan, nr_done = 0;
+	struct page *page;
+	int flags;
+
+	nr_pgs = MIN(nr_pgs, PM_RECLAIM_BATCH);
+	spin_lock(&pm->pm_lock);
+	for (i = 0; (i < PM_RECLAIM_SCAN) &&
+	            (pm->pm_nr_active > pm->pm_num_pages / 2); i++) {
+		page = TAILQ_FIRST(&pm->pm_active);
+		TAILQ_REMOVE(&pm->pm_active, page, pg_lru_link);
+		if (atomic_read(&page->pg_flags) & PG_REFERENCED) {
+			atomic_and(&page->pg_flags, ~PG_REFERENCED);
+			TAILQ_INSERT_TAIL(&pm->pm_active, page, pg_lru_link);
+		} else {
+			atomic_and(&page->pg_flags, ~PG_ACTIVE);
+			pm->pm_nr_active--;
+			TAILQ_INSERT_TAIL(&pm->pm_inactive, page, pg_lru_link);
+		}
+	}
+	nr_scan = MIN(PM_RECLAIM_SCAN, pm->pm_num_pages - pm->pm_nr_active);
+	for (i = 0; (i < nr_scan) && (nr_victims < nr_pgs); i++) {
+		page = TAILQ_FIRST(&pm->pm_inactive);
+		if (!page)
+			break;
+		pm_nr_scanned++;
+		TAILQ_REMOVE(&pm->pm_inactive, page, pg_lru_link);
+		flags = atomic_read(&page->pg_flags);
+		if (flags & PG_REFERENCED) {
+			atomic_and(&page->pg_flags, ~PG_REFERENCED);
+			atomic_or(&page->pg_flags, PG_ACTIVE);
+			pm->pm_nr_active++;
+			TAILQ_INSERT_TAIL(&pm->pm_active, page, pg_lru_link);
+			continue;
+		}
+		/* to the back of the line, in case removal doesn't work out */
+		TAILQ_INSERT_TAIL(&pm->pm_inactive, page, pg_lru_link);
+		if ((flags & (PG_LOCKED | PG_REMOVAL)) ||
+		    pm_slot_check_refcnt(*page->pg_tree_slot))
+			continue;
+		victims[nr_victims++] = page->pg_index;
+	}
+	spin_unlock(&pm->pm_lock);
+	/* pm_remove_contig() walks the VMRs once per call, so do runs */
+	sort(victims, nr_victims, sizeof(unsigned long), __pm_cmp_idx);
+	for (i = 0; i < nr_victims; i = j) {
+		for (j = i + 1; j < nr_victims; j++) {
+			if (victims[j] != victims[j - 1] + 1)
+				break;
+		}
+		nr_done += __pm_remove_contig(pm, victims[i], j - i, TRUE);
+	}
+	return nr_done;
+}
+
+static unsigned long __pm_reclaim(unsigned long nr_pgs)
+{
+	struct page_map *pm;
+	unsigned long nr_done = 0, nr_pms;
+
+	for (int round = 0; round < PM_RECLAIM_ROUNDS; round++) {
+		spin_lock(&pm_list_lock);
+		nr_pms = pm_list_len;
+		spin_unlock(&pm_list_lock);
+		for (unsigned long i = 0; i < nr_pms; i++) {
+			if (nr_done >= nr_pgs)
+				goto out;
+			/* the clock hand over PMs: take the head, put it at the back */
+			spin_lock(&pm_list_lock);
+			pm = TAILQ_FIRST(&pm_list);
+			if (pm) {
+				TAILQ_REMOVE(&pm_list, pm, pm_link);
+				TAILQ_INSERT_TAIL(&pm_list, pm, pm_link);
+			}
+			spin_unlock(&pm_list_lock);
+			if (!pm)
+				goto out;
+			nr_done += __pm_reclaim_one(pm, nr_pgs - nr_done);
+		}
+	}
+out:
+	pm_nr_reclaimed += nr_done;
+	return nr_done;
+}
+
+/* Evicts up to nr_pgs pages from the page cache, returning how many.  Blocks. */
+unsigned long pm_reclaim(unsigned long nr_pgs)
+{
+	unsigned long ret;
+
+	qlock(&pm_reclaim_qlock);
+	ret = __pm_reclaim(nr_pgs);
+	qunlock(&pm_reclaim_qlock);
+	return ret;
+}
+
+/* For when the page allocator fails.  This can happen during reclaim itself
+ * (writeback needs pages), so we don't wait for the reclaimer. */
+static bool pm_direct_reclaim(void)
+{
+	unsigned long ret;
+
+	if (!canqlock(&pm_reclaim_qlock))
+		return FALSE;
+	pm_nr_direct_reclaim++;
+	ret = __pm_reclaim(PM_RECLAIM_BATCH);
+	qunlock(&pm_reclaim_qlock);
+	return ret ? TRUE : FALSE;
+}
+
+static int __pm_below_low(void *arg)
+{
+	return nr_free_pages < pm_reclaim_low;
+}
+
+static void pm_reclaim_ktask(void *arg)
+{
+	while (1) {
+		rendez_sleep(&pm_reclaim_rv, __pm_below_low, 0);
+		pm_reclaim_active = TRUE;
+		pm_nr_reclaim_wakeups++;
+		while (nr_free_pages < pm_reclaim_high) {
+			if (!pm_reclaim(PM_RECLAIM_BATCH)) {
+				/* nothing we can evict right now, try again later */
+				kthread_usleep(PM_RECLAIM_BACKOFF_USEC);
+				break;
+			}
+		}
+		pm_reclaim_active = FALSE;
+	}
+}
+
+/* Called by the page allocator, from any context, after it hands out pages. */
+void pm_reclaim_kick(void)
+{
+	if (nr_free_pages < pm_reclaim_low && !pm_reclaim_active)
+		rendez_wakeup(&pm_reclaim_rv);
+}
+
+/* Watermarks are a fraction of the memory free at boot: wake up at 1/32, stop
+ * at 1/16. */
+void pm_reclaim_init(void)
+{
+	rendez_init(&pm_reclaim_rv);
+	pm_reclaim_high = nr_free_pages / 16;
+	wmb();	/* rendez is ready before pm_reclaim_kick() can see low */
+	pm_reclaim_low = nr_free_pages / 32;
+	ktask("pm_reclaim", pm_reclaim_ktask, 0);
+}
@@ -25,7 +25,7 @@
 physaddr_t max_pmem = 0;	/* Total amount of physical memory (bytes) */
 physaddr_t max_paddr = 0;	/* Maximum addressable physical address */
 size_t max_nr_pages = 0;	/* Number of addressable physical memory pages */
-size_t nr_free_pages = 0;	/* TODO: actually track this, after init */
+size_t nr_free_pages = 0;	/* protected by the free list lock */
 struct page *pages = 0;
 struct multiboot_info *multiboot_kaddr = 0;
 uintptr_t boot_freemem = 0;
@@ -16,15 +16,18 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
-#include <hashtable.h>
+#include <chash.h>
+#include <rcu.h>
 #include <slab.h>
 #include <sys/queue.h>
 #include <frontend.h>
 #include <monitor.h>
 #include <elf.h>
 #include <arsc_server.h>
+#include <sysring.h>
 #include <kmalloc.h>
 #include <ros/procinfo.h>
+#include <tracepoint.h>
 
 struct kmem_cache *proc_cache;
 
@@ -42,8 +45,7 @@ static void restore_vc_fp_state(struct preempt_data *vcpd);
 #define PID_MAX 32767 // goes from 0 to 32767, with 0 reserved
 static DECL_BITMASK(pid_bmask, PID_MAX + 1);
 spinlock_t pid_bmask_lock = SPINLOCK_INITIALIZER;
-struct hashtable *pid_hash;
-spinlock_t pid_hash_lock; // initialized in proc_init
+struct chashtable pid_hash;
 
 /* Finds the next free entry (zero) entry in the pid_bitmask.  Set means busy.
  * PID 0 is reserved (in proc_init).  A return value of 0 is a failure (and
@@ -177,63 +179,56 @@ int __proc_set_state(struct proc *p, uint32_t state)
 
 /* Returns a pointer to the proc with the given pid, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0).  The
+ * lookup is lockless: the struct proc is freed a grace period after it leaves
+ * the pid_hash, so p stays valid for our get_not_zero(). */
 struct proc *pid2proc(pid_t pid)
 {
-	spin_lock(&pid_hash_lock);
-	struct proc *p = hashtable_search(pid_hash, (void*)(long)pid);
-	if (p)
-		if (!kref_get_not_zero(&p->p_kref, 1))
-			p = 0;
-	spin_unlock(&pid_hash_lock);
+	struct proc *p;
+
+	rcu_read_lock();
+	p = chash_lookup_entry(&pid_hash, pid, struct proc, pid_link);
+	if (p && !kref_get_not_zero(&p->p_kref, 1))
+		p = 0;
+	rcu_read_unlock();
 	return p;
 }
 
+struct pid_nth_arg {
+	unsigned int				n;
+	struct proc					*p;
+};
+
+static void __pid_nth(struct chash_node *node, void *opaque)
+{
+	struct pid_nth_arg *arg = opaque;
+	struct proc *p = container_of(node, struct proc, pid_link);
+
+	if (arg->p)
+		return;
+	/* if this process is not valid, it doesn't count */
+	if (!kref_get_not_zero(&p->p_kref, 1))
+		return;
+	/* this one counts */
+	if (!arg->n) {
+		printd("pid_nth: at end, p %p\n", p);
+		arg->p = p;
+		return;
+	}
+	kref_put(&p->p_kref);
+	arg->n--;
+}
+
 /* Used by devproc for successive reads of the proc table.
  * Returns a pointer to the nth proc, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0). */
 struct proc *pid_nth(unsigned int n)
 {
-	struct proc *p;
-	spin_lock(&pid_hash_lock);
-	if (!hashtable_count(pid_hash)) {
-		spin_unlock(&pid_hash_lock);
-		return NULL;
-	}
-	struct hashtable_itr *iter = hashtable_iterator(pid_hash);
-	p = hashtable_iterator_value(iter);
-
-	while (p) {
-		/* if this process is not valid, it doesn't count,
-		 * so continue
-		 */
-
-		if (kref_get_not_zero(&p->p_kref, 1)) {
-			/* this one counts */
-			if (! n){
-				printd("pid_nth: at end, p %p\n", p);
-				break;
-			}
-			kref_put(&p->p_kref);
-			n--;
-		}
-		if (!hashtable_iterator_advance(iter)) {
-			p = NULL;
-			break;
-		}
-		p = hashtable_iterator_value(iter);
-	}
+	struct pid_nth_arg arg = {n, 0};
 
-	spin_unlock(&pid_hash_lock);
-	kfree(iter);
-	return p;
+	chash_for_each(&pid_hash, __pid_nth, &arg);
+	return arg.p;
 }
 
 /* Performs any initialization related to processes, such as create the proc
@@ -247,10 +242,7 @@ void proc_init(void)
 	             MAX(ARCH_CL_SIZE, __alignof__(struct proc)), 0, 0, 0);
 	/* Init PID mask and hash.  pid 0 is reserved. */
 	SET_BITMASK_BIT(pid_bmask, 0);
-	spinlock_init(&pid_hash_lock);
-	spin_lock(&pid_hash_lock);
-	pid_hash = create_hashtable(100, __generic_hash, __generic_eq);
-	spin_unlock(&pid_hash_lock);
+	chash_init(&pid_hash, 0);
 	schedule_init();
 
 	atomic_init(&num_envs, 0);
@@ -444,9 +436,9 @@ void __proc_ready(struct proc *p)
 	/* Tell the ksched about us.  TODO: do we need to worry about the ksched
 	 * doing stuff to us before we're added to the pid_hash? */
 	__sched_proc_register(p);
-	spin_lock(&pid_hash_lock);
-	hashtable_insert(pid_hash, (void*)(long)p->pid, p);
-	spin_unlock(&pid_hash_lock);
+	p->pid_link.key = p->pid;
+	if (!chash_insert(&pid_hash, &p->pid_link))
+		panic("PID %d was already in the pid_hash", p->pid);
 }
 
 /* Creates a process from the specified file, argvs, and envps. */
@@ -471,13 +463,19 @@ static int __cb_assert_no_pg(struct proc *p, pte_t pte, void *va, void *arg)
 	return 0;
 }
 
+/* Frees the struct proc once RCU readers that found it are done with it. */
+static void __proc_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(proc_cache, container_of(head, struct proc, p_rcu));
+}
+
 /* This is called by kref_put(), once the last reference to the process is
  * gone.  Don't call this otherwise (it will panic).  It will clean up the
  * address space and deallocate any other used memory. */
 static void __proc_free(struct kref *kref)
 {
 	struct proc *p = container_of(kref, struct proc, p_kref);
-	void *hash_ret;
+	struct chash_node *hash_ret;
 	physaddr_t pa;
 
 	printd("[PID %d] freeing proc: %d\n", current ? current->pid : 0, p->pid);
@@ -500,6 +498,7 @@ static void __proc_free(struct kref *kref)
 	/* now we'll finally decref files for the file-backed vmrs */
 	unmap_and_destroy_vmrs(p);
 	frontend_proc_free(p);	/* TODO: please remove me one day */
+	sysring_proc_free(p);
 	/* Free any colors allocated to this process */
 	if (p->cache_colors_map != global_cache_colors_map) {
 		for(int i = 0; i < llc_cache->num_colors; i++)
@@ -507,9 +506,7 @@ static void __proc_free(struct kref *kref)
 		cache_colors_map_free(p->cache_colors_map);
 	}
 	/* Remove us from the pid_hash and give our PID back (in that order). */
-	spin_lock(&pid_hash_lock);
-	hash_ret = hashtable_remove(pid_hash, (void*)(long)p->pid);
-	spin_unlock(&pid_hash_lock);
+	hash_ret = chash_remove(&pid_hash, p->pid);
 	/* might not be in the hash/ready, if we failed during proc creation */
 	if (hash_ret)
 		put_free_pid(p->pid);
@@ -530,8 +527,8 @@ static void __proc_free(struct kref *kref)
 
 	atomic_dec(&num_envs);
 
-	/* Dealloc the struct proc */
-	kmem_cache_free(proc_cache, p);
+	/* Dealloc the struct proc, once lockless pid2proc()s are done with it */
+	call_rcu(&p->p_rcu, __proc_free_rcu);
 }
 
 /* Whether or not actor can control target.  TODO: do something reasonable here.
@@ -569,6 +566,8 @@ static void __set_proc_current(struct proc *p)
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	/* If the process wasn't here, then we need to load its address space. */
 	if (p != pcpui->cur_proc) {
+		tracepoint(sched_proc_switch,
+		           pcpui->cur_proc ? pcpui->cur_proc->pid : 0, p->pid);
 		proc_incref(p, 1);
 		lcr3(p->env_cr3);
 		/* This is "leaving the process context" of the previous proc.  The
@@ -899,6 +898,8 @@ void proc_destroy(struct proc *p)
 	 * Also note that any mmap'd files will still be mmapped.  You can close the
 	 * file after mmapping, with no effect. */
 	close_fdt(&p->open_files, FALSE);
+	/* A polled sysring holds a ref on us, which an idle poller won't drop */
+	sysring_proc_destroy(p);
 	/* Abort any abortable syscalls.  This won't catch every sleeper, but future
 	 * abortable sleepers are already prevented via the DYING_ABORT state.
 	 * (signalled DYING_ABORT, no new sleepers will block, and now we wake all
@@ -2283,10 +2284,10 @@ void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 
 void print_allpids(void)
 {
-	void print_proc_state(void *item, void *opaque)
+	void print_proc_state(struct chash_node *node, void *opaque)
 	{
-		struct proc *p = (struct proc*)item;
-		assert(p);
+		struct proc *p = container_of(node, struct proc, pid_link);
+
 		/* this actually adds an extra space, since no progname is ever
 		 * PROGNAME_SZ bytes, due to the \0 counted in PROGNAME. */
 		printk("%8d %-*s %-10s %6d\n", p->pid, PROC_PROGNAME_SZ, p->progname,
@@ -2299,16 +2300,14 @@ void print_allpids(void)
 	printk("     PID Name %-*s State      Parent    \n",
 	       PROC_PROGNAME_SZ - 5, "");
 	printk("------------------------------%s\n", dashes);
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, print_proc_state, NULL);
-	spin_unlock(&pid_hash_lock);
+	chash_for_each(&pid_hash, print_proc_state, NULL);
 }
 
 void proc_get_set(struct process_set *pset)
 {
-	void enum_proc(void *item, void *opaque)
+	void enum_proc(struct chash_node *node, void *opaque)
 	{
-		struct proc *p = (struct proc*) item;
+		struct proc *p = container_of(node, struct proc, pid_link);
 		struct process_set *pset = (struct process_set *) opaque;
 
 		if (pset->num_processes < pset->size) {
@@ -2332,9 +2331,7 @@ void proc_get_set(struct process_set *pset)
 		if (!pset->procs)
 			error(-ENOMEM, ERROR_FIXME);
 
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, enum_proc, pset);
-		spin_unlock(&pid_hash_lock);
+		chash_for_each(&pid_hash, enum_proc, pset);
 
 	} while (pset->num_processes == pset->size);
 }
@@ -2427,11 +2424,10 @@ void print_proc_info(pid_t pid)
 void check_my_owner(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	void shazbot(void *item, void *opaque)
+	void shazbot(struct chash_node *node, void *opaque)
 	{
-		struct proc *p = (struct proc*)item;
+		struct proc *p = container_of(node, struct proc, pid_link);
 		struct vcore *vc_i;
-		assert(p);
 		spin_lock(&p->proc_lock);
 		TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
 			/* this isn't true, a __startcore could be on the way and we're
@@ -2443,9 +2439,8 @@ void check_my_owner(void)
 					continue;
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
-				spin_unlock(&p->proc_lock);
-				spin_unlock(&pid_hash_lock);
-				monitor(0);
+				/* Can't drop into the monitor with the pid_hash locked */
+				*(bool*)opaque = TRUE;
 			}
 		}
 		spin_unlock(&p->proc_lock);
@@ -2453,8 +2448,10 @@ void check_my_owner(void)
 	assert(!irq_is_enabled());
 	extern int booting;
 	if (!booting && !pcpui->owning_proc) {
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, shazbot, NULL);
-		spin_unlock(&pid_hash_lock);
+		bool orphaned = FALSE;
+
+		chash_for_each(&pid_hash, shazbot, &orphaned);
+		if (orphaned)
+			monitor(0);
 	}
 }
@@ -19,7 +19,11 @@
  * - profiler_control_trace() controls the per-core trace collection.  When it
  *   is disabled, it also flushes the per-core blocks to the central queue.
  * - The collection of mmap and comm samples is independent of trace collection.
- *   Those will occur whenever the profiler is open (refcnt check, for now). */
+ *   Those will occur whenever the profiler is open (refcnt check, for now).
+ * - Off-CPU profiling (prof_offcpu) records a backtrace and the blocked time
+ *   whenever a kthread blocks and wakes up, so time spent in sem_down (rendez,
+ *   qio, blocking syscalls) shows up too.  The samples are tagged with the
+ *   info the user gave us, the same way perfmon tags PMU samples. */
 
 #include <ros/common.h>
 #include <ros/mman.h>
@@ -61,6 +65,8 @@ static qlock_t profiler_mtx = QLOCK_INITIALIZER(profiler_mtx);
 static struct kref profiler_kref;
 static struct profiler_cpu_context *profiler_percpu_ctx;
 static struct queue *profiler_queue;
+static uint64_t profiler_offcpu_info;
+bool profiler_offcpu_enabled;
 
 static inline struct profiler_cpu_context *profiler_get_cpu_ctx(int cpu)
 {
@@ -198,6 +204,50 @@ static void profiler_push_user_trace64(struct profiler_cpu_context *cpu_buf,
 	}
 }
 
+static void profiler_push_offcpu_trace64(struct profiler_cpu_context *cpu_buf,
+                                         const uintptr_t *kpcs, size_t nr_kpcs,
+                                         const uintptr_t *upcs, size_t nr_upcs,
+                                         uint64_t start, uint64_t duration)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	size_t size = sizeof(struct proftype_offcpu_trace64) +
+		(nr_kpcs + nr_upcs) * sizeof(uint64_t);
+	struct block *b;
+	void *resptr, *ptr;
+
+	assert(!irq_is_enabled());
+	resptr = profiler_cpu_buffer_write_reserve(
+	    cpu_buf, size + profiler_max_envelope_size(), &b);
+	ptr = resptr;
+
+	if (likely(ptr)) {
+		struct proftype_offcpu_trace64 *record;
+
+		ptr = vb_encode_uint64(ptr, PROFTYPE_OFFCPU_TRACE64);
+		ptr = vb_encode_uint64(ptr, size);
+
+		record = (struct proftype_offcpu_trace64 *) ptr;
+		ptr += size;
+
+		record->info = profiler_offcpu_info;
+		record->tstamp = start;
+		record->duration = duration;
+		if (is_ktask(pcpui->cur_kthread) || !pcpui->cur_proc)
+			record->pid = -1;
+		else
+			record->pid = pcpui->cur_proc->pid;
+		record->cpu = cpu_buf->cpu;
+		record->num_kern_traces = nr_kpcs;
+		record->num_user_traces = nr_upcs;
+		for (size_t i = 0; i < nr_kpcs; i++)
+			record->trace[i] = (uint64_t) kpcs[i];
+		for (size_t i = 0; i < nr_upcs; i++)
+			record->trace[nr_kpcs + i] = (uint64_t) upcs[i];
+
+		profiler_cpu_buffer_write_commit(cpu_buf, b, ptr - resptr);
+	}
+}
+
 static void profiler_push_pid_mmap(struct proc *p, uintptr_t addr, size_t msize,
                                    size_t offset, const char *path)
 {
@@ -355,6 +405,18 @@ int profiler_configure(struct cmdbuf *cb)
 			cb->f[1], 1024, 16 * 1024, 1024 * 1024);
 		return 1;
 	}
+	if (!strcmp(cb->f[0], "prof_offcpu")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_offcpu INFO|off");
+		if (!strcmp(cb->f[1], "off")) {
+			profiler_offcpu_enabled = FALSE;
+		} else {
+			profiler_offcpu_info = strtoul(cb->f[1], NULL, 0);
+			wmb();	/* info is set before anyone sees we're enabled */
+			profiler_offcpu_enabled = TRUE;
+		}
+		return 1;
+	}
 
 	return 0;
 }
@@ -364,6 +426,7 @@ void profiler_append_configure_usage(char *msgbuf, size_t buflen)
 	const char * const cmds[] = {
 		"prof_qlimit",
 		"prof_cpubufsz",
+		"prof_offcpu",
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(cmds); i++) {
@@ -521,6 +584,27 @@ void profiler_push_user_backtrace(uintptr_t *pc_list, size_t nr_pcs,
 	}
 }
 
+/* Called when a kthread wakes up after being blocked for duration nsec.  kpcs is
+ * where it blocked, upcs is the user code it blocked for (nr_upcs can be 0). */
+void profiler_push_offcpu_backtrace(uintptr_t *kpcs, size_t nr_kpcs,
+                                    uintptr_t *upcs, size_t nr_upcs,
+                                    uint64_t start, uint64_t duration)
+{
+	if (kref_get_not_zero(&profiler_kref, 1)) {
+		int8_t irq_state = 0;
+		struct profiler_cpu_context *cpu_buf;
+
+		/* Unlike the PMU samples, we're not in IRQ context */
+		disable_irqsave(&irq_state);
+		cpu_buf = profiler_get_cpu_ctx(core_id());
+		if (profiler_percpu_ctx && cpu_buf->tracing)
+			profiler_push_offcpu_trace64(cpu_buf, kpcs, nr_kpcs, upcs, nr_upcs,
+			                             start, duration);
+		enable_irqsave(&irq_state);
+		kref_put(&profiler_kref);
+	}
+}
+
 int profiler_size(void)
 {
 	return profiler_queue ? qlen(profiler_queue) : 0;
@@ -0,0 +1,94 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Read-copy-update.  See rcu.h for how the grace periods work. */
+
+#include <rcu.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <smp.h>
+#include <trap.h>
+#include <assert.h>
+
+struct rcu_gp {
+	atomic_t					nr_cores_left;
+	struct semaphore			done;
+};
+
+static spinlock_t rcu_cb_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static struct rcu_head *rcu_cbs;
+static struct rcu_head **rcu_cbs_tail = &rcu_cbs;
+static struct rendez rcu_rv;
+static bool rcu_ready;
+
+/* Routine KMSG.  By the time it runs, this core's readers are done. */
+static void __rcu_quiescent(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct rcu_gp *gp = (struct rcu_gp*)a0;
+
+	if (atomic_sub_and_test(&gp->nr_cores_left, 1))
+		sem_up(&gp->done);
+}
+
+/* Waits until every RCU reader that started before the call has finished.
+ * Blocks, so it can't be called from a read-side critical section. */
+void synchronize_rcu(void)
+{
+	struct rcu_gp gp;
+
+	atomic_init(&gp.nr_cores_left, num_cores);
+	sem_init(&gp.done, 0);
+	for (int i = 0; i < num_cores; i++)
+		send_kernel_message(i, __rcu_quiescent, (long)&gp, 0, 0,
+		                    KMSG_ROUTINE);
+	sem_down(&gp.done);
+}
+
+/* Runs func(head) after a grace period.  The usual use is to free the object
+ * head is embedded in. */
+void call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+	head->func = func;
+	head->next = 0;
+	spin_lock_irqsave(&rcu_cb_lock);
+	*rcu_cbs_tail = head;
+	rcu_cbs_tail = &head->next;
+	spin_unlock_irqsave(&rcu_cb_lock);
+	/* Before rcu_init(), the callbacks just pile up */
+	if (rcu_ready)
+		rendez_wakeup(&rcu_rv);
+}
+
+static int rcu_has_cbs(void *arg)
+{
+	return ACCESS_ONCE(rcu_cbs) != 0;
+}
+
+/* Takes every callback queued so far, waits out one grace period for all of
+ * them, and runs them. */
+static void rcu_ktask(void *arg)
+{
+	struct rcu_head *batch, *next;
+
+	while (1) {
+		rendez_sleep(&rcu_rv, rcu_has_cbs, 0);
+		spin_lock_irqsave(&rcu_cb_lock);
+		batch = rcu_cbs;
+		rcu_cbs = 0;
+		rcu_cbs_tail = &rcu_cbs;
+		spin_unlock_irqsave(&rcu_cb_lock);
+		synchronize_rcu();
+		for (; batch; batch = next) {
+			next = batch->next;
+			batch->func(batch);
+		}
+	}
+}
+
+void rcu_init(void)
+{
+	rendez_init(&rcu_rv);
+	wmb();	/* rendez is ready before call_rcu() sees rcu_ready */
+	rcu_ready = TRUE;
+	ktask("rcu", rcu_ktask, 0);
+}
@@ -16,6 +16,7 @@
 #include <alarm.h>
 #include <sys/queue.h>
 #include <arsc_server.h>
+#include <sysring.h>
 
 /* Process Lists.  'unrunnable' is a holding list for SCPs that are running or
  * waiting or otherwise not considered for sched decisions. */
@@ -114,6 +115,7 @@ void schedule_init(void)
 	send_kernel_message(arsc_coreid, arsc_server, 0, 0, 0, KMSG_ROUTINE);
 	printk("Using core %d for the ARSC server\n", arsc_coreid);
 #endif /* CONFIG_ARSC_SERVER */
+	sysring_init();
 }
 
 /* Round-robins on whatever list it's on */
@@ -709,13 +711,11 @@ void print_resources(struct proc *p)
 void print_all_resources(void)
 {
 	/* Hash helper */
-	void __print_resources(void *item, void *opaque)
+	void __print_resources(struct chash_node *node, void *opaque)
 	{
-		print_resources((struct proc*)item);
+		print_resources(container_of(node, struct proc, pid_link));
 	}
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, __print_resources, NULL);
-	spin_unlock(&pid_hash_lock);
+	chash_for_each(&pid_hash, __print_resources, NULL);
 }
 
 void next_core_to_alloc(uint32_t pcoreid)
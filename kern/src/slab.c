@@ -16,10 +16,19 @@
 #include <assert.h>
 #include <pmap.h>
 #include <kmalloc.h>
+#include <kmemtrack.h>
 
 struct kmem_cache_list kmem_caches;
 spinlock_t kmem_caches_lock;
 
+/* With kmemtrack, each object has a slot after its link/bufctl pointer for the
+ * site that allocated it. */
+#ifdef CONFIG_KMEM_TRACK
+#define SLAB_TRACK_SZ sizeof(uintptr_t)
+#else
+#define SLAB_TRACK_SZ 0
+#endif
+
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
 static bool kmem_cache_grow(struct kmem_cache *cp);
@@ -153,6 +162,11 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
+static uintptr_t *__obj_site(struct kmem_cache *cp, void *buf)
+{
+	return (uintptr_t*)(buf + cp->obj_size + sizeof(uintptr_t));
+}
+
 /* Front end: clients of caches use these */
 void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 {
@@ -197,6 +211,13 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 	}
 	cp->nr_cur_alloc++;
 	spin_unlock_irqsave(&cp->cache_lock);
+#ifdef CONFIG_KMEM_TRACK
+	*__obj_site(cp, retval) = 0;
+	if (!(cp->flags & KMC_NOTRACK))
+		*__obj_site(cp, retval) = kmemtrack_alloc(KMEMTRACK_SLAB,
+		                                          kmemtrack_caller(),
+		                                          cp->obj_size);
+#endif
 	return retval;
 }
 
@@ -211,6 +232,10 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
 
+#ifdef CONFIG_KMEM_TRACK
+	if (*__obj_site(cp, buf))
+		kmemtrack_free(KMEMTRACK_SLAB, *__obj_site(cp, buf), cp->obj_size);
+#endif
 	spin_lock_irqsave(&cp->cache_lock);
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
 		// find its slab
@@ -263,7 +288,8 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab = (struct kmem_slab*)(page2kva(a_page) + PGSIZE -
 		                             sizeof(struct kmem_slab));
 		// Need to add room for the next free item pointer in the object buffer.
-		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
+		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t) +
+		                           SLAB_TRACK_SZ, cp->align);
 		a_slab->num_busy_obj = 0;
 		a_slab->num_total_obj = (PGSIZE - sizeof(struct kmem_slab)) /
 		                        a_slab->obj_size;
@@ -285,7 +311,8 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		if (!a_slab)
 			return FALSE;
 		// TODO: hash table for back reference (BUF)
-		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
+		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t) +
+		                           SLAB_TRACK_SZ, cp->align);
 		/* Figure out how much memory we want.  We need at least min_pgs.  We'll
 		 * ask for the next highest order (power of 2) number of pages */
 		size_t min_pgs = ROUNDUP(NUM_BUF_PER_SLAB * a_slab->obj_size, PGSIZE) /
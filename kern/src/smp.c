@@ -20,6 +20,7 @@
 #include <kmalloc.h>
 #include <core_set.h>
 #include <completion.h>
+#include <tracepoint.h>
 
 struct all_cpu_work {
 	struct completion comp;
@@ -65,6 +66,7 @@ static void __attribute__((noinline, noreturn)) __smp_idle(void)
 	disable_irq();	/* might not be needed - need to look at KMSGs closely */
 	clear_rkmsg(pcpui);
 	pcpui->cur_kthread->flags = KTH_DEFAULT_FLAGS;
+	tracepoint(sched_idle);
 	enable_irq();	/* one-shot change to get any IRQs before we halt later */
 	while (1) {
 		disable_irq();
@@ -27,15 +27,19 @@
 #include <colored_caches.h>
 #include <hashtable.h>
 #include <bitmask.h>
+#include <ros/bcq.h>
 #include <vfs.h>
 #include <devfs.h>
 #include <smp.h>
 #include <arsc_server.h>
+#include <sysring.h>
 #include <event.h>
 #include <kprof.h>
 #include <termios.h>
 #include <manager.h>
 #include <ros/procinfo.h>
+#include <tracepoint.h>
+#include <lathist.h>
 
 static int execargs_stringer(struct proc *p, char *d, size_t slen,
 			     char *path, size_t path_l,
@@ -44,132 +48,128 @@ static int execargs_stringer(struct proc *p, char *d, size_t slen,
 /* Global, used by the kernel monitor for syscall debugging. */
 bool systrace_loud = FALSE;
 
-/* Helper, given the trace record, pretty-print the trace's contents into the
- * trace's pretty buf.  'entry' says whether we're an entry record or not
- * (exit).  Returns the number of bytes put into the pretty_buf. */
-static size_t systrace_fill_pretty_buf(struct systrace_record *trace,
-                                       bool entry)
+/* Helper, prints the trace to the console for systrace_loud.  'Entry' records
+ * have retval set to --- and begin with E.  Exit records begin with X.  Loud
+ * mode is for debugging, so it's OK to allocate here. */
+static void systrace_print(struct systrace_record *trace)
 {
-	size_t len = 0;
 	struct timespec ts_start = tsc2timespec(trace->start_timestamp);
 	struct timespec ts_end = tsc2timespec(trace->end_timestamp);
+	size_t bufsz = trace->datalen * 4 + 3;
+	char *buf = kmalloc(bufsz, MEM_ATOMIC);
+	char ret[NUMSIZE64 + 3] = "---";
 
-	/* Slightly different formats between entry and exit.  Entry has retval set
-	 * to ---, and begins with E.  Exit begins with X. */
-	if (entry) {
-		len = snprintf(trace->pretty_buf, SYSTR_PRETTY_BUF_SZ - len,
-		      "E [%7d.%09d]-[%7d.%09d] Syscall %3d (%12s):(0x%llx, 0x%llx, "
-		      "0x%llx, 0x%llx, 0x%llx, 0x%llx) ret: --- proc: %d core: %d "
-		      "vcore: %d data: ",
-		               ts_start.tv_sec,
-		               ts_start.tv_nsec,
-		               ts_end.tv_sec,
-		               ts_end.tv_nsec,
-		               trace->syscallno,
-		               syscall_table[trace->syscallno].name,
-		               trace->arg0,
-		               trace->arg1,
-		               trace->arg2,
-		               trace->arg3,
-		               trace->arg4,
-		               trace->arg5,
-		               trace->pid,
-		               trace->coreid,
-		               trace->vcoreid);
-	} else {
-		len = snprintf(trace->pretty_buf, SYSTR_PRETTY_BUF_SZ - len,
-		      "X [%7d.%09d]-[%7d.%09d] Syscall %3d (%12s):(0x%llx, 0x%llx, "
-		      "0x%llx, 0x%llx, 0x%llx, 0x%llx) ret: 0x%llx proc: %d core: %d "
-		      "vcore: %d data: ",
-		               ts_start.tv_sec,
-		               ts_start.tv_nsec,
-		               ts_end.tv_sec,
-		               ts_end.tv_nsec,
-		               trace->syscallno,
-		               syscall_table[trace->syscallno].name,
-		               trace->arg0,
-		               trace->arg1,
-		               trace->arg2,
-		               trace->arg3,
-		               trace->arg4,
-		               trace->arg5,
-		               trace->retval,
-		               trace->pid,
-		               trace->coreid,
-		               trace->vcoreid);
-	}
-	len += printdump(trace->pretty_buf + len, trace->datalen,
-	                 SYSTR_PRETTY_BUF_SZ - len - 1,
-	                 trace->data);
-	len += snprintf(trace->pretty_buf + len, SYSTR_PRETTY_BUF_SZ - len, "\n");
-	return len;
+	if (!buf)
+		return;
+	buf[printdump(buf, trace->datalen, bufsz - 1, trace->data)] = 0;
+	if (trace->type == SYSTR_MARKER) {
+		printk("M [%7d.%09d] proc: %d core: %d data: %s\n", ts_start.tv_sec,
+		       ts_start.tv_nsec, trace->pid, trace->coreid, buf);
+		kfree(buf);
+		return;
+	}
+	if (trace->type == SYSTR_EXIT)
+		snprintf(ret, sizeof(ret), "0x%llx", trace->retval);
+	printk("%c [%7d.%09d]-[%7d.%09d] Syscall %3d (%12s):(0x%llx, 0x%llx, "
+	       "0x%llx, 0x%llx, 0x%llx, 0x%llx) ret: %s proc: %d core: %d "
+	       "vcore: %d data: %s\n",
+	       trace->type == SYSTR_ENTRY ? 'E' : 'X',
+	       ts_start.tv_sec, ts_start.tv_nsec, ts_end.tv_sec, ts_end.tv_nsec,
+	       trace->syscallno, syscall_name(trace->syscallno),
+	       trace->arg0, trace->arg1, trace->arg2, trace->arg3, trace->arg4,
+	       trace->arg5, ret, trace->pid, trace->coreid, trace->vcoreid, buf);
+	kfree(buf);
+}
+
+/* Puts the trace in this core's ring of s.  Never blocks or allocates; if the
+ * reader fell behind, the trace is dropped. */
+static void systrace_enqueue(struct strace *s, struct systrace_record *trace)
+{
+	/* Producers are this core and markers, so we almost never fail the CAS */
+	if (bcq_enqueue(&s->rings[core_id()], trace, SYSTR_RING_SZ, 0)) {
+		atomic_inc(&s->nr_drops);
+		return;
+	}
+	mb();	/* enqueue before reading waiters; pairs with systrace_read() */
+	if (atomic_read(&s->nr_readers_waiting))
+		rendez_wakeup(&s->rv);
 }
 
 /* Helper: spits out our trace to the various sinks. */
 static void systrace_output(struct systrace_record *trace,
-                            struct strace *strace, bool entry)
+                            struct strace *strace)
 {
-	size_t pretty_len;
-
-	pretty_len = systrace_fill_pretty_buf(trace, entry);
 	if (strace)
-		qiwrite(strace->q, trace->pretty_buf, pretty_len);
+		systrace_enqueue(strace, trace);
 	if (systrace_loud)
-		printk("%s", trace->pretty_buf);
+		systrace_print(trace);
+}
+
+/* Returns TRUE if p's strace wants syscall num from p. */
+static bool systrace_wants(struct strace *s, struct proc *p, unsigned int num)
+{
+	if (s->sysc_filtered) {
+		if (num >= SYSTR_MAX_SYSC || !GET_BITMASK_BIT(s->sysc_filter, num))
+			return FALSE;
+	}
+	if (!s->nr_pids)
+		return TRUE;
+	for (int i = 0; i < s->nr_pids; i++) {
+		if (s->pids[i] == p->pid)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Helper, fills in the parts of trace common to entry and exit records. */
+static void systrace_fill_record(struct systrace_record *trace, int type,
+                                 struct proc *p, uintreg_t *sysc_args)
+{
+	memset(trace, 0, sizeof(struct systrace_record));
+	trace->type = type;
+	trace->syscallno = sysc_args[0];
+	trace->arg0 = sysc_args[1];
+	trace->arg1 = sysc_args[2];
+	trace->arg2 = sysc_args[3];
+	trace->arg3 = sysc_args[4];
+	trace->arg4 = sysc_args[5];
+	trace->arg5 = sysc_args[6];
+	trace->pid = p->pid;
+	trace->coreid = core_id();
+	trace->vcoreid = proc_get_vcoreid(p);
 }
 
 /* Starts a trace for p running sysc, attaching it to kthread.  Pairs with
- * systrace_finish_trace(). */
+ * systrace_finish_trace().  The records are built on the stack and copied into
+ * the per-core rings, so there's nothing to allocate or free. */
 static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 {
 	struct proc *p = current;
-	struct systrace_record *trace;
+	struct strace *strace = p->strace;
+	struct systrace_record trace;
 	uintreg_t data_arg;
 	size_t data_len = 0;
 
-	kthread->strace = 0;
-	if (!p->strace_on && !systrace_loud)
+	static_assert(sizeof(struct systrace_record) == SYSTR_RECORD_SZ);
+	kthread->strace_start = 0;
+	if (!p->strace_on || !strace || !systrace_wants(strace, p, sysc->num))
+		strace = NULL;
+	if (!strace && !systrace_loud)
 		return;
-	trace = kmalloc(SYSTR_BUF_SZ, MEM_ATOMIC);
-	if (p->strace) {
-		/* We're using qiwrite below, which has no flow control.  We'll do it
-		 * manually.  TODO: consider a block_alloc and qpass, though note that
-		 * we actually write the same trace in twice (entry and exit).
-		 * Alternatively, we can add another qio method that has flow control
-		 * and non blocking. */
-		if (qfull(p->strace->q)) {
-			atomic_inc(&p->strace->nr_drops);
-			kfree(trace);
-			return;
-		}
-		if (!trace)
-			atomic_inc(&p->strace->nr_drops);
-		/* Avoiding the atomic op.  We sacrifice accuracy for less overhead. */
-		p->strace->appx_nr_sysc++;
-	}
-	if (!trace)
-		return;
-	/* if you ever need to debug just one strace function, this is
-	 * handy way to do it: just bail out if it's not the one you
-	 * want.
-	 * if (sysc->num != SYS_exec)
-	 * return; */
-	trace->start_timestamp = read_tsc();
-	trace->end_timestamp = 0;
-	trace->syscallno = sysc->num;
-	trace->arg0 = sysc->arg0;
-	trace->arg1 = sysc->arg1;
-	trace->arg2 = sysc->arg2;
-	trace->arg3 = sysc->arg3;
-	trace->arg4 = sysc->arg4;
-	trace->arg5 = sysc->arg5;
-	trace->retval = 0;
-	trace->pid = p->pid;
-	trace->coreid = core_id();
-	trace->vcoreid = proc_get_vcoreid(p);
-	trace->pretty_buf = (char*)trace + sizeof(struct systrace_record);
-	trace->datalen = 0;
-	trace->data[0] = 0;
+	/* Avoiding the atomic op.  We sacrifice accuracy for less overhead. */
+	if (strace)
+		strace->appx_nr_sysc++;
+	/* The user can change sysc while we run, and exec replaces it, so we save
+	 * what we traced for the exit record. */
+	kthread->strace_sysc[0] = sysc->num;
+	kthread->strace_sysc[1] = sysc->arg0;
+	kthread->strace_sysc[2] = sysc->arg1;
+	kthread->strace_sysc[3] = sysc->arg2;
+	kthread->strace_sysc[4] = sysc->arg3;
+	kthread->strace_sysc[5] = sysc->arg4;
+	kthread->strace_sysc[6] = sysc->arg5;
+	systrace_fill_record(&trace, SYSTR_ENTRY, p, kthread->strace_sysc);
+	trace.start_timestamp = read_tsc();
 
 	switch (sysc->num) {
 	case SYS_write:
@@ -181,32 +181,32 @@ static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 		data_len = sysc->arg2;
 		break;
 	case SYS_exec:
-		trace->datalen = execargs_stringer(current,
-						   (char *)trace->data,
-						   sizeof(trace->data),
-						   (char *)sysc->arg0,
-						   sysc->arg1,
-						   (char *)sysc->arg2,
-						   sysc->arg3);
+		trace.datalen = execargs_stringer(current,
+						  (char *)trace.data,
+						  sizeof(trace.data),
+						  (char *)sysc->arg0,
+						  sysc->arg1,
+						  (char *)sysc->arg2,
+						  sysc->arg3);
 		break;
 	case SYS_proc_create:
-		trace->datalen = execargs_stringer(current,
-						   (char *)trace->data,
-						   sizeof(trace->data),
-						   (char *)sysc->arg0,
-						   sysc->arg1,
-						   (char *)sysc->arg2,
-						   sysc->arg3);
+		trace.datalen = execargs_stringer(current,
+						  (char *)trace.data,
+						  sizeof(trace.data),
+						  (char *)sysc->arg0,
+						  sysc->arg1,
+						  (char *)sysc->arg2,
+						  sysc->arg3);
 		break;
 	}
 	if (data_len) {
-		trace->datalen = MIN(sizeof(trace->data), data_len);
-		copy_from_user(trace->data, (void*)data_arg, trace->datalen);
+		trace.datalen = MIN(sizeof(trace.data), data_len);
+		copy_from_user(trace.data, (void*)data_arg, trace.datalen);
 	}
 
-	systrace_output(trace, p->strace, TRUE);
+	systrace_output(&trace, strace);
 
-	kthread->strace = trace;
+	kthread->strace_start = trace.start_timestamp;
 }
 
 /* Finishes the trace on kthread for p, with retval being the return from the
@@ -214,32 +214,113 @@ static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 static void systrace_finish_trace(struct kthread *kthread, long retval)
 {
 	struct proc *p = current;
-	struct systrace_record *trace;
+	struct strace *strace = p->strace;
+	struct systrace_record trace;
 	long data_arg;
 	size_t data_len = 0;
 
-	if (!kthread->strace)
+	if (!kthread->strace_start)
 		return;
-	trace = kthread->strace;
-	trace->end_timestamp = read_tsc();
-	trace->retval = retval;
-
-	/* Only try to do the trace data if we didn't do it on entry */
-	if (!trace->datalen) {
-		switch (trace->syscallno) {
-		case SYS_read:
-			data_arg = trace->arg1;
-			data_len = retval < 0 ? 0 : retval;
-			break;
+	/* The entry passed the filters; tracing might have been turned off since */
+	if (!p->strace_on)
+		strace = NULL;
+	systrace_fill_record(&trace, SYSTR_EXIT, p, kthread->strace_sysc);
+	trace.start_timestamp = kthread->strace_start;
+	trace.end_timestamp = read_tsc();
+	trace.retval = retval;
+	kthread->strace_start = 0;
+
+	/* Only SYS_read has data on exit; the others did theirs on entry */
+	switch (trace.syscallno) {
+	case SYS_read:
+		data_arg = trace.arg1;
+		data_len = retval < 0 ? 0 : retval;
+		break;
+	}
+	trace.datalen = MIN(sizeof(trace.data), data_len);
+	if (trace.datalen)
+		copy_from_user(trace.data, (void*)data_arg, trace.datalen);
+
+	if (strace || systrace_loud)
+		systrace_output(&trace, strace);
+}
+
+static int systrace_has_work(void *arg)
+{
+	struct strace *s = arg;
+
+	if (s->hungup)
+		return TRUE;
+	for (int i = 0; i < num_cores; i++) {
+		if (!bcq_empty(&s->rings[i]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Reads as many whole records from s's rings as fit in n bytes of va.  Blocks
+ * until there is at least one.  Once every traced process is gone and the
+ * rings are drained, this throws, with the hangup message as the errstr. */
+long systrace_read(struct strace *s, void *va, long n)
+{
+	struct systrace_record trace;
+	long amt = 0;
+	bool hungup;
+
+	if (n < sizeof(struct systrace_record))
+		error(EINVAL, "strace reads must be at least %d bytes",
+		      sizeof(struct systrace_record));
+	while (1) {
+		/* Check before draining, so we don't miss the final records */
+		hungup = ACCESS_ONCE(s->hungup);
+		rmb();
+		for (int i = 0; i < num_cores; i++) {
+			while (amt + sizeof(struct systrace_record) <= n) {
+				if (bcq_dequeue(&s->rings[i], &trace, SYSTR_RING_SZ))
+					break;
+				/* Copy from the stack, since va might fault */
+				memmove(va + amt, &trace, sizeof(struct systrace_record));
+				amt += sizeof(struct systrace_record);
+			}
 		}
-		trace->datalen = MIN(sizeof(trace->data), data_len);
-		if (trace->datalen)
-			copy_from_user(trace->data, (void*)data_arg, trace->datalen);
+		if (amt)
+			return amt;
+		if (hungup)
+			error(EPIPE, s->hangup_msg);
+		atomic_inc(&s->nr_readers_waiting);
+		mb();	/* announce the wait before checking; pairs with enqueue */
+		rendez_sleep(&s->rv, systrace_has_work, s);
+		atomic_dec(&s->nr_readers_waiting);
 	}
+}
+
+/* Puts the first bytes of va in s as a marker record. */
+void systrace_write_marker(struct strace *s, void *va, long n)
+{
+	struct systrace_record trace;
 
-	systrace_output(trace, p->strace, FALSE);
-	kfree(kthread->strace);
-	kthread->strace = 0;
+	if (s->hungup)
+		error(EPIPE, "strace is hung up");
+	memset(&trace, 0, sizeof(struct systrace_record));
+	trace.type = SYSTR_MARKER;
+	trace.start_timestamp = read_tsc();
+	trace.pid = current ? current->pid : 0;
+	trace.coreid = core_id();
+	trace.datalen = MIN(sizeof(trace.data), n);
+	memmove(trace.data, va, trace.datalen);
+	systrace_enqueue(s, &trace);
+}
+
+/* Called once the last traced process is gone.  Wakes the readers, who will
+ * drain the rings and then get an error. */
+void systrace_hangup(struct strace *s)
+{
+	snprintf(s->hangup_msg, sizeof(s->hangup_msg),
+	         "Traced ~%lu syscs, Dropped %lu", s->appx_nr_sysc,
+	         atomic_read(&s->nr_drops));
+	wmb();	/* msg before hungup */
+	s->hungup = TRUE;
+	rendez_wakeup(&s->rv);
 }
 
 #ifdef CONFIG_SYSCALL_STRING_SAVING
@@ -1002,6 +1083,8 @@ static int sys_exec(struct proc *p, char *path, size_t path_l,
 	p->procinfo->heap_bottom = 0;
 	/* When we destroy our memory regions, accessing cur_sysc would PF */
 	pcpui->cur_kthread->sysc = 0;
+	/* The sysring lives in the old image */
+	sysring_proc_exec(p);
 	unmap_and_destroy_vmrs(p);
 	/* close the CLOEXEC ones */
 	close_fdt(&p->open_files, TRUE);
@@ -1229,6 +1312,11 @@ static intreg_t sys_munmap(struct proc *p, void *addr, size_t len)
 	return munmap(p, (uintptr_t)addr, len);
 }
 
+static intreg_t sys_madvise(struct proc *p, void *addr, size_t len, int advice)
+{
+	return madvise(p, (uintptr_t)addr, len, advice);
+}
+
 static ssize_t sys_shared_page_alloc(env_t* p1,
                                      void **_addr, pid_t p2_id,
                                      int p1_flags, int p2_flags
@@ -1576,6 +1664,168 @@ static intreg_t sys_write(struct proc *p, int fd, const void *buf, size_t len)
 	return ret;
 }
 
+/* Copies in and checks a user's iovec array.  Returns a kmalloc'd copy (the
+ * iov_bases are still user addresses), or 0 with errno set. */
+static struct iovec *copy_in_iov(struct proc *p, const struct iovec *u_iov,
+                                 int iovcnt)
+{
+	struct iovec *iov;
+	size_t total = 0;
+
+	if ((iovcnt < 0) || (iovcnt > UIO_MAXIOV)) {
+		set_error(EINVAL, "iovcnt %d out of range", iovcnt);
+		return 0;
+	}
+	iov = kmalloc(sizeof(struct iovec) * MAX(iovcnt, 1), MEM_WAIT);
+	if (memcpy_from_user_errno(p, iov, u_iov, sizeof(struct iovec) * iovcnt)) {
+		kfree(iov);
+		return 0;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+		/* The sum has to fit in the ssize_t we return */
+		if ((iov[i].iov_len > INT64_MAX) || (total > INT64_MAX)) {
+			set_error(EINVAL, "iovec lengths overflow");
+			kfree(iov);
+			return 0;
+		}
+	}
+	return iov;
+}
+
+/* Backs readv and preadv.  offset is -1 for readv. */
+static intreg_t __sys_readv(struct proc *p, int fd, const struct iovec *u_iov,
+                            int iovcnt, off64_t offset)
+{
+	struct iovec *iov = copy_in_iov(p, u_iov, iovcnt);
+	struct file *file;
+	ssize_t ret;
+
+	if (!iov)
+		return -1;
+	sysc_save_str("readv on fd %d", fd);
+	file = get_file_from_fd(&p->open_files, fd);
+	/* VFS */
+	if (file) {
+		if (!file->f_op->readv) {
+			set_errno(EINVAL);
+			ret = -1;
+		} else {
+			ret = file->f_op->readv(file, iov, iovcnt,
+			                        offset < 0 ? &file->f_pos : &offset);
+		}
+		kref_put(&file->f_kref);
+	} else if (offset < 0) {
+		ret = sysreadv(fd, iov, iovcnt);
+	} else {
+		ret = syspreadv(fd, iov, iovcnt, offset);
+	}
+	kfree(iov);
+	return ret;
+}
+
+static intreg_t sys_readv(struct proc *p, int fd, const struct iovec *iov,
+                          int iovcnt)
+{
+	return __sys_readv(p, fd, iov, iovcnt, -1);
+}
+
+static intreg_t sys_preadv(struct proc *p, int fd, const struct iovec *iov,
+                           int iovcnt, off64_t offset)
+{
+	if (offset < 0) {
+		set_error(EINVAL, "negative offset %lld", offset);
+		return -1;
+	}
+	return __sys_readv(p, fd, iov, iovcnt, offset);
+}
+
+/* Backs writev and pwritev.  offset is -1 for writev. */
+static intreg_t __sys_writev(struct proc *p, int fd, const struct iovec *u_iov,
+                             int iovcnt, off64_t offset)
+{
+	struct iovec *iov = copy_in_iov(p, u_iov, iovcnt);
+	struct file *file;
+	ssize_t ret;
+
+	if (!iov)
+		return -1;
+	sysc_save_str("writev on fd %d", fd);
+	file = get_file_from_fd(&p->open_files, fd);
+	/* VFS */
+	if (file) {
+		if (!file->f_op->writev) {
+			set_errno(EINVAL);
+			ret = -1;
+		} else {
+			ret = file->f_op->writev(file, iov, iovcnt,
+			                         offset < 0 ? &file->f_pos : &offset);
+		}
+		kref_put(&file->f_kref);
+	} else if (offset < 0) {
+		ret = syswritev(fd, iov, iovcnt);
+	} else {
+		ret = syspwritev(fd, iov, iovcnt, offset);
+	}
+	kfree(iov);
+	return ret;
+}
+
+static intreg_t sys_writev(struct proc *p, int fd, const struct iovec *iov,
+                           int iovcnt)
+{
+	return __sys_writev(p, fd, iov, iovcnt, -1);
+}
+
+static intreg_t sys_pwritev(struct proc *p, int fd, const struct iovec *iov,
+                            int iovcnt, off64_t offset)
+{
+	if (offset < 0) {
+		set_error(EINVAL, "negative offset %lld", offset);
+		return -1;
+	}
+	return __sys_writev(p, fd, iov, iovcnt, offset);
+}
+
+/* Copies count bytes from in_fd to out_fd in the kernel.  out_fd has to be a
+ * chan; in_fd can be a VFS file, which we read from the page cache.  If u_off
+ * is set, we read from there and write back the new offset, and in_fd's
+ * offset stays put. */
+static intreg_t sys_sendfile(struct proc *p, int out_fd, int in_fd,
+                             off64_t *u_off, size_t count)
+{
+	struct file *file;
+	off64_t offset;
+	ssize_t ret;
+
+	if (count > INT64_MAX) {
+		set_error(EINVAL, "count %lu too big", count);
+		return -1;
+	}
+	if (u_off && memcpy_from_user_errno(p, &offset, u_off, sizeof(offset)))
+		return -1;
+	sysc_save_str("sendfile fd %d to fd %d", in_fd, out_fd);
+	if ((file = get_file_from_fd(&p->open_files, out_fd))) {
+		kref_put(&file->f_kref);
+		set_error(EINVAL, "can't sendfile to a VFS file");
+		return -1;
+	}
+	file = get_file_from_fd(&p->open_files, in_fd);
+	/* VFS: only regular files have a page cache to read from */
+	if (file && !S_ISREG(file->f_dentry->d_inode->i_mode)) {
+		kref_put(&file->f_kref);
+		set_error(EINVAL, "can only sendfile from a regular VFS file");
+		return -1;
+	}
+	ret = syssendfile(out_fd, in_fd, file, u_off ? &offset : NULL, count);
+	if (file)
+		kref_put(&file->f_kref);
+	if ((ret >= 0) && u_off &&
+	    memcpy_to_user_errno(p, u_off, &offset, sizeof(offset)))
+		return -1;
+	return ret;
+}
+
 /* Checks args/reads in the path, opens the file (relative to fromfd if the path
  * is not absolute), and inserts it into the process's open file list. */
 static intreg_t sys_openat(struct proc *p, int fromfd, const char *path,
@@ -1804,8 +2054,7 @@ intreg_t sys_fcntl(struct proc *p, int fd, int cmd, unsigned long arg1,
 			retval = 0;
 			break;
 		case (F_ADVISE):
-			/* TODO  (if we keep the VFS)*/
-			retval = 0;
+			retval = file_advise(file, arg1, arg2, arg3);
 			break;
 		default:
 			warn("Unsupported fcntl cmd %d\n", cmd);
@@ -2493,7 +2742,9 @@ static int handle_tap_req(struct proc *p, struct fd_tap_req *req)
 		case (FDTAP_CMD_ADD):
 			return add_fd_tap(p, req);
 		case (FDTAP_CMD_REM):
-			return remove_fd_tap(p, req->fd);
+			return remove_fd_tap(p, req);
+		case (FDTAP_CMD_POLL):
+			return poll_fd_tap(p, req);
 		default:
 			set_error(ENOSYS, "FD Tap Command %d not supported", req->cmd);
 			return -1;
@@ -2522,81 +2773,99 @@ static intreg_t sys_tap_fds(struct proc *p, struct fd_tap_req *tap_reqs,
 /************** Syscall Invokation **************/
 
 const struct sys_table_entry syscall_table[] = {
-	[SYS_null] = {(syscall_t)sys_null, "null"},
-	[SYS_block] = {(syscall_t)sys_block, "block"},
-	[SYS_cache_buster] = {(syscall_t)sys_cache_buster, "buster"},
-	[SYS_cache_invalidate] = {(syscall_t)sys_cache_invalidate, "wbinv"},
-	[SYS_reboot] = {(syscall_t)reboot, "reboot!"},
-	[SYS_getpcoreid] = {(syscall_t)sys_getpcoreid, "getpcoreid"},
-	[SYS_getvcoreid] = {(syscall_t)sys_getvcoreid, "getvcoreid"},
-	[SYS_proc_create] = {(syscall_t)sys_proc_create, "proc_create"},
-	[SYS_proc_run] = {(syscall_t)sys_proc_run, "proc_run"},
-	[SYS_proc_destroy] = {(syscall_t)sys_proc_destroy, "proc_destroy"},
-	[SYS_yield] = {(syscall_t)sys_proc_yield, "proc_yield"},
-	[SYS_change_vcore] = {(syscall_t)sys_change_vcore, "change_vcore"},
-	[SYS_fork] = {(syscall_t)sys_fork, "fork"},
-	[SYS_exec] = {(syscall_t)sys_exec, "exec"},
-	[SYS_waitpid] = {(syscall_t)sys_waitpid, "waitpid"},
-	[SYS_mmap] = {(syscall_t)sys_mmap, "mmap"},
-	[SYS_munmap] = {(syscall_t)sys_munmap, "munmap"},
-	[SYS_mprotect] = {(syscall_t)sys_mprotect, "mprotect"},
-	[SYS_shared_page_alloc] = {(syscall_t)sys_shared_page_alloc, "pa"},
-	[SYS_shared_page_free] = {(syscall_t)sys_shared_page_free, "pf"},
-	[SYS_provision] = {(syscall_t)sys_provision, "provision"},
-	[SYS_notify] = {(syscall_t)sys_notify, "notify"},
-	[SYS_self_notify] = {(syscall_t)sys_self_notify, "self_notify"},
-	[SYS_vc_entry] = {(syscall_t)sys_vc_entry, "vc_entry"},
-	[SYS_halt_core] = {(syscall_t)sys_halt_core, "halt_core"},
+	[SYS_null] = {(syscall_t)sys_null},
+	[SYS_block] = {(syscall_t)sys_block},
+	[SYS_cache_buster] = {(syscall_t)sys_cache_buster},
+	[SYS_cache_invalidate] = {(syscall_t)sys_cache_invalidate},
+	[SYS_reboot] = {(syscall_t)reboot},
+	[SYS_getpcoreid] = {(syscall_t)sys_getpcoreid},
+	[SYS_getvcoreid] = {(syscall_t)sys_getvcoreid},
+	[SYS_proc_create] = {(syscall_t)sys_proc_create},
+	[SYS_proc_run] = {(syscall_t)sys_proc_run},
+	[SYS_proc_destroy] = {(syscall_t)sys_proc_destroy},
+	[SYS_yield] = {(syscall_t)sys_proc_yield},
+	[SYS_change_vcore] = {(syscall_t)sys_change_vcore},
+	[SYS_fork] = {(syscall_t)sys_fork},
+	[SYS_exec] = {(syscall_t)sys_exec},
+	[SYS_waitpid] = {(syscall_t)sys_waitpid},
+	[SYS_mmap] = {(syscall_t)sys_mmap},
+	[SYS_munmap] = {(syscall_t)sys_munmap},
+	[SYS_mprotect] = {(syscall_t)sys_mprotect},
+	[SYS_madvise] = {(syscall_t)sys_madvise},
+	[SYS_shared_page_alloc] = {(syscall_t)sys_shared_page_alloc},
+	[SYS_shared_page_free] = {(syscall_t)sys_shared_page_free},
+	[SYS_provision] = {(syscall_t)sys_provision},
+	[SYS_notify] = {(syscall_t)sys_notify},
+	[SYS_self_notify] = {(syscall_t)sys_self_notify},
+	[SYS_vc_entry] = {(syscall_t)sys_vc_entry},
+	[SYS_halt_core] = {(syscall_t)sys_halt_core},
 #ifdef CONFIG_ARSC_SERVER
-	[SYS_init_arsc] = {(syscall_t)sys_init_arsc, "init_arsc"},
+	[SYS_init_arsc] = {(syscall_t)sys_init_arsc},
 #endif
-	[SYS_change_to_m] = {(syscall_t)sys_change_to_m, "change_to_m"},
-	[SYS_vmm_setup] = {(syscall_t)sys_vmm_setup, "vmm_setup"},
-	[SYS_vmm_poke_guest] = {(syscall_t)sys_vmm_poke_guest, "vmm_poke_guest"},
-	[SYS_poke_ksched] = {(syscall_t)sys_poke_ksched, "poke_ksched"},
-	[SYS_abort_sysc] = {(syscall_t)sys_abort_sysc, "abort_sysc"},
-	[SYS_abort_sysc_fd] = {(syscall_t)sys_abort_sysc_fd, "abort_sysc_fd"},
-	[SYS_populate_va] = {(syscall_t)sys_populate_va, "populate_va"},
-	[SYS_nanosleep] = {(syscall_t)sys_nanosleep, "nanosleep"},
-	[SYS_pop_ctx] = {(syscall_t)sys_pop_ctx, "pop_ctx"},
-
-	[SYS_read] = {(syscall_t)sys_read, "read"},
-	[SYS_write] = {(syscall_t)sys_write, "write"},
-	[SYS_openat] = {(syscall_t)sys_openat, "openat"},
-	[SYS_close] = {(syscall_t)sys_close, "close"},
-	[SYS_fstat] = {(syscall_t)sys_fstat, "fstat"},
-	[SYS_stat] = {(syscall_t)sys_stat, "stat"},
-	[SYS_lstat] = {(syscall_t)sys_lstat, "lstat"},
-	[SYS_fcntl] = {(syscall_t)sys_fcntl, "fcntl"},
-	[SYS_access] = {(syscall_t)sys_access, "access"},
-	[SYS_umask] = {(syscall_t)sys_umask, "umask"},
-	[SYS_llseek] = {(syscall_t)sys_llseek, "llseek"},
-	[SYS_link] = {(syscall_t)sys_link, "link"},
-	[SYS_unlink] = {(syscall_t)sys_unlink, "unlink"},
-	[SYS_symlink] = {(syscall_t)sys_symlink, "symlink"},
-	[SYS_readlink] = {(syscall_t)sys_readlink, "readlink"},
-	[SYS_chdir] = {(syscall_t)sys_chdir, "chdir"},
-	[SYS_fchdir] = {(syscall_t)sys_fchdir, "fchdir"},
-	[SYS_getcwd] = {(syscall_t)sys_getcwd, "getcwd"},
-	[SYS_mkdir] = {(syscall_t)sys_mkdir, "mkdir"},
-	[SYS_rmdir] = {(syscall_t)sys_rmdir, "rmdir"},
-	[SYS_tcgetattr] = {(syscall_t)sys_tcgetattr, "tcgetattr"},
-	[SYS_tcsetattr] = {(syscall_t)sys_tcsetattr, "tcsetattr"},
-	[SYS_setuid] = {(syscall_t)sys_setuid, "setuid"},
-	[SYS_setgid] = {(syscall_t)sys_setgid, "setgid"},
+	[SYS_change_to_m] = {(syscall_t)sys_change_to_m},
+	[SYS_vmm_setup] = {(syscall_t)sys_vmm_setup},
+	[SYS_vmm_poke_guest] = {(syscall_t)sys_vmm_poke_guest},
+	[SYS_poke_ksched] = {(syscall_t)sys_poke_ksched},
+	[SYS_abort_sysc] = {(syscall_t)sys_abort_sysc},
+	[SYS_abort_sysc_fd] = {(syscall_t)sys_abort_sysc_fd},
+	[SYS_populate_va] = {(syscall_t)sys_populate_va},
+	[SYS_nanosleep] = {(syscall_t)sys_nanosleep},
+	[SYS_pop_ctx] = {(syscall_t)sys_pop_ctx},
+	[SYS_sysring_setup] = {(syscall_t)sys_sysring_setup},
+	[SYS_sysring_enter] = {(syscall_t)sys_sysring_enter},
+
+	[SYS_read] = {(syscall_t)sys_read},
+	[SYS_write] = {(syscall_t)sys_write},
+	[SYS_openat] = {(syscall_t)sys_openat},
+	[SYS_close] = {(syscall_t)sys_close},
+	[SYS_fstat] = {(syscall_t)sys_fstat},
+	[SYS_stat] = {(syscall_t)sys_stat},
+	[SYS_lstat] = {(syscall_t)sys_lstat},
+	[SYS_fcntl] = {(syscall_t)sys_fcntl},
+	[SYS_access] = {(syscall_t)sys_access},
+	[SYS_umask] = {(syscall_t)sys_umask},
+	[SYS_llseek] = {(syscall_t)sys_llseek},
+	[SYS_link] = {(syscall_t)sys_link},
+	[SYS_unlink] = {(syscall_t)sys_unlink},
+	[SYS_symlink] = {(syscall_t)sys_symlink},
+	[SYS_readlink] = {(syscall_t)sys_readlink},
+	[SYS_chdir] = {(syscall_t)sys_chdir},
+	[SYS_fchdir] = {(syscall_t)sys_fchdir},
+	[SYS_getcwd] = {(syscall_t)sys_getcwd},
+	[SYS_mkdir] = {(syscall_t)sys_mkdir},
+	[SYS_rmdir] = {(syscall_t)sys_rmdir},
+	[SYS_tcgetattr] = {(syscall_t)sys_tcgetattr},
+	[SYS_tcsetattr] = {(syscall_t)sys_tcsetattr},
+	[SYS_setuid] = {(syscall_t)sys_setuid},
+	[SYS_setgid] = {(syscall_t)sys_setgid},
 	/* special! */
-	[SYS_nbind] ={(syscall_t)sys_nbind, "nbind"},
-	[SYS_nmount] ={(syscall_t)sys_nmount, "nmount"},
-	[SYS_nunmount] ={(syscall_t)sys_nunmount, "nunmount"},
-	[SYS_fd2path] ={(syscall_t)sys_fd2path, "fd2path"},
-	[SYS_wstat] ={(syscall_t)sys_wstat, "wstat"},
-	[SYS_fwstat] ={(syscall_t)sys_fwstat, "fwstat"},
-	[SYS_rename] ={(syscall_t)sys_rename, "rename"},
-	[SYS_dup_fds_to] = {(syscall_t)sys_dup_fds_to, "dup_fds_to"},
-	[SYS_tap_fds] = {(syscall_t)sys_tap_fds, "tap_fds"},
+	[SYS_nbind] ={(syscall_t)sys_nbind},
+	[SYS_nmount] ={(syscall_t)sys_nmount},
+	[SYS_nunmount] ={(syscall_t)sys_nunmount},
+	[SYS_fd2path] ={(syscall_t)sys_fd2path},
+	[SYS_wstat] ={(syscall_t)sys_wstat},
+	[SYS_fwstat] ={(syscall_t)sys_fwstat},
+	[SYS_rename] ={(syscall_t)sys_rename},
+	[SYS_dup_fds_to] = {(syscall_t)sys_dup_fds_to},
+	[SYS_tap_fds] = {(syscall_t)sys_tap_fds},
+	[SYS_readv] = {(syscall_t)sys_readv},
+	[SYS_writev] = {(syscall_t)sys_writev},
+	[SYS_preadv] = {(syscall_t)sys_preadv},
+	[SYS_pwritev] = {(syscall_t)sys_pwritev},
+	[SYS_sendfile] = {(syscall_t)sys_sendfile},
 };
 const int max_syscall = sizeof(syscall_table)/sizeof(syscall_table[0]);
 
+static const char *const syscall_names[] = SYSTRACE_SYSC_NAMES;
+
+/* Returns num's name, or 0 if there's no such syscall. */
+const char *syscall_name(unsigned long num)
+{
+	if (num >= COUNT_OF(syscall_names))
+		return 0;
+	return syscall_names[num];
+}
+
 /* Executes the given syscall.
  *
  * Note tf is passed in, which points to the tf of the context on the kernel
@@ -2636,7 +2905,7 @@ intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
 		/* Can't trust coreid and vcoreid anymore, need to check the trace */
 		printk("[%16llu] Syscall %3d (%12s):(%p, %p, %p, %p, "
 		       "%p, %p) proc: %d\n", read_tsc(),
-		       sc_num, syscall_table[sc_num].name, a0, a1, a2, a3,
+		       sc_num, syscall_name(sc_num), a0, a1, a2, a3,
 		       a4, a5, p->pid);
 		if (sc_num != SYS_fork)
 			printk("YOU SHOULD PANIC: errstack mismatch");
@@ -2649,6 +2918,8 @@ void run_local_syscall(struct syscall *sysc)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct proc *p = pcpui->cur_proc;
+	unsigned int num;
+	uint64_t start;
 
 	/* In lieu of pinning, we just check the sysc and will PF on the user addr
 	 * later (if the addr was unmapped).  Which is the plan for all UMEM. */
@@ -2659,15 +2930,23 @@ void run_local_syscall(struct syscall *sysc)
 	}
 	pcpui->cur_kthread->sysc = sysc;	/* let the core know which sysc it is */
 	systrace_start_trace(pcpui->cur_kthread, sysc);
+	tracepoint(syscall_enter, (uintptr_t)sysc, sysc->num, sysc->arg0,
+	           sysc->arg1);
 	alloc_sysc_str(pcpui->cur_kthread);
+	/* The user can change sysc->num while we run */
+	num = sysc->num;
+	start = read_tsc();
 	/* syscall() does not return for exec and yield, so put any cleanup in there
 	 * too. */
-	sysc->retval = syscall(pcpui->cur_proc, sysc->num, sysc->arg0, sysc->arg1,
+	sysc->retval = syscall(pcpui->cur_proc, num, sysc->arg0, sysc->arg1,
 	                       sysc->arg2, sysc->arg3, sysc->arg4, sysc->arg5);
+	lathist_record_sysc(num, start);
 	/* Need to re-load pcpui, in case we migrated */
 	pcpui = &per_cpu_info[core_id()];
 	free_sysc_str(pcpui->cur_kthread);
 	systrace_finish_trace(pcpui->cur_kthread, sysc->retval);
+	tracepoint(syscall_exit, (uintptr_t)sysc, sysc->num, sysc->retval,
+	           sysc->err);
 	/* Some 9ns paths set errstr, but not errno.  glibc will ignore errstr.
 	 * this is somewhat hacky, since errno might get set unnecessarily */
 	if ((current_errstr()[0] != 0) && (!sysc->err))
@@ -2676,6 +2955,61 @@ void run_local_syscall(struct syscall *sysc)
 	pcpui->cur_kthread->sysc = NULL;	/* No longer working on sysc */
 }
 
+/* Syscalls that change or depend on the calling user context can't be run
+ * from a queued KMSG; they'd return to the wrong place (or never return). */
+static bool syscall_is_queueable(unsigned int num)
+{
+	switch (num) {
+		case (SYS_fork):
+		case (SYS_exec):
+		case (SYS_yield):
+		case (SYS_change_vcore):
+		case (SYS_vc_entry):
+		case (SYS_pop_ctx):
+		case (SYS_change_to_m):
+		case (SYS_halt_core):
+		case (SYS_init_arsc):
+		case (SYS_sysring_setup):
+		case (SYS_sysring_enter):
+			return FALSE;
+		default:
+			return TRUE;
+	}
+}
+
+/* Routine KMSG handler for queue_syscall().  Each queued syscall runs in its
+ * own kthread, so if it blocks, the core moves on to the next KMSG. */
+static void __run_queued_syscall(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p = (struct proc*)a0;
+	struct syscall *sysc = (struct syscall*)a1;
+	uintptr_t old_proc;
+
+	old_proc = switch_to(p);
+	if (!is_user_rwaddr(sysc, sizeof(struct syscall))) {
+		printk("[kernel] bad user addr %p (+%p) in %s (user bug)\n", sysc,
+		       sizeof(struct syscall), __FUNCTION__);
+	} else if (!syscall_is_queueable(sysc->num)) {
+		sysc->err = EINVAL;
+		sysc->retval = -1;
+		finish_sysc(sysc, p);
+	} else if (!proc_is_dying(p)) {
+		run_local_syscall(sysc);
+	}
+	switch_back(p, old_proc);
+	proc_decref(p);
+}
+
+/* Runs sysc for p in the background on this core.  The caller must be in p's
+ * address space or have validated sysc.  Completion is signalled like any other
+ * async syscall. */
+void queue_syscall(struct proc *p, struct syscall *sysc)
+{
+	proc_incref(p, 1);
+	send_kernel_message(core_id(), __run_queued_syscall, (long)p, (long)sysc,
+	                    0, KMSG_ROUTINE);
+}
+
 /* A process can trap and call this function, which will set up the core to
  * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".  If there is
  * at least one, it will run it directly. */
@@ -2686,9 +3020,15 @@ void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 		printk("[kernel] No nr_sysc, probably a bug, user!\n");
 		return;
 	}
-	/* For all after the first call, send ourselves a KMSG (TODO). */
-	if (nr_syscs != 1)
-		warn("Only one supported (Debutante calls: %d)\n", nr_syscs);
+	if (!is_user_rwaddr(sysc, sizeof(struct syscall) * nr_syscs)) {
+		printk("[kernel] bad user addr %p (+%p) in %s (user bug)\n", sysc,
+		       sizeof(struct syscall) * nr_syscs, __FUNCTION__);
+		return;
+	}
+	/* For all after the first call, send ourselves a KMSG.  They'll run before
+	 * we return to userspace, or when the first one blocks. */
+	for (int i = 1; i < nr_syscs; i++)
+		queue_syscall(p, &sysc[i]);
 	/* Call the first one directly.  (we already checked to make sure there is
 	 * 1) */
 	run_local_syscall(sysc);
@@ -0,0 +1,382 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Syscall submission rings.  See ros/sysring.h for the interface.
+ *
+ * Each process gets at most one ring.  Consuming the ring just hands each
+ * struct syscall to queue_syscall(), which runs it in a routine KMSG on the
+ * consuming core.  That gives every syscall its own kthread, so a blocking
+ * syscall doesn't stall the rest of the batch, and completion goes through the
+ * usual finish_sysc() / ev_q path.
+ *
+ * SYSRING_SQPOLL rings are consumed by poller cores, taken from the idle pool at
+ * boot (CONFIG_SYSRING_POLLERS).  A poller is a routine KMSG that makes one pass
+ * over its rings and then resends itself, so the syscalls it queued get to run
+ * in between passes.  After SYSRING_POLL_IDLE_USEC without work, the poller
+ * sets SYSRING_NEED_WAKEUP in every ring and stops resending.  Userspace sees
+ * the flag and calls SYS_sysring_enter, which wakes the poller back up.
+ *
+ * The ring and the syscalls it points to are user memory, which can fault, so
+ * we never touch them with a spinlock held.  A ctx's qlock serializes consumers,
+ * and the poller only holds its spinlock long enough to see which rings it
+ * has.
+ *
+ * p->sysring holds a ref on its ctx, and so does a poller pass while it works
+ * on the ring.  exec gets rid of the ring, since it lives in the old image's
+ * memory: it marks the ctx dead under the qlock, so no one touches the ring
+ * after that, and drops p's ref.  p->sysring changes under the proc_lock. */
+
+#include <sysring.h>
+#include <syscall.h>
+#include <process.h>
+#include <schedule.h>
+#include <kmalloc.h>
+#include <smp.h>
+#include <trap.h>
+#include <time.h>
+#include <umem.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define SYSRING_POLL_IDLE_USEC	1000
+
+struct sysring_poller {
+	spinlock_t					lock;		/* protects rings */
+	struct sysring_ctx_tailq	rings;
+	int							coreid;
+	atomic_t					asleep;
+	uint64_t					last_work;	/* TSC, only touched by poller */
+};
+
+static struct sysring_poller *pollers;
+static int nr_pollers;
+static atomic_t next_poller;
+
+static void __sysring_poll(uint32_t srcid, long a0, long a1, long a2);
+
+static void sysring_ctx_release(struct kref *kref)
+{
+	struct sysring_ctx *ctx = container_of(kref, struct sysring_ctx, kref);
+
+	kfree(ctx);
+}
+
+/* Returns p's ctx with a ref, or 0 if it has none. */
+static struct sysring_ctx *sysring_get_ctx(struct proc *p)
+{
+	struct sysring_ctx *ctx;
+
+	spin_lock(&p->proc_lock);
+	ctx = p->sysring;
+	if (ctx)
+		kref_get(&ctx->kref, 1);
+	spin_unlock(&p->proc_lock);
+	return ctx;
+}
+
+/* Takes up to max (0 for all) entries off the ring and queues them.  Caller
+ * holds ctx->qlock and is in ctx->proc's address space.  Returns the number of
+ * syscalls queued. */
+static unsigned int __sysring_consume(struct sysring_ctx *ctx, unsigned int max)
+{
+	struct sysring *ring = ctx->ring;
+	struct syscall *sysc;
+	unsigned int tail, nr;
+
+	tail = ACCESS_ONCE(ring->sq_tail);
+	rmb();	/* read the sqes after reading the tail */
+	nr = tail - ctx->sq_head;
+	/* Garbage tail.  Take what a full ring would have, the user can sort it
+	 * out. */
+	if (nr > ctx->nr_entries)
+		nr = ctx->nr_entries;
+	if (max && (nr > max))
+		nr = max;
+	for (int i = 0; i < nr; i++) {
+		sysc = ring->sqes[(ctx->sq_head + i) & (ctx->nr_entries - 1)];
+		if (!is_user_rwaddr(sysc, sizeof(struct syscall))) {
+			printk("[kernel] bad sysring sqe %p from %d (user bug)\n", sysc,
+			       ctx->proc->pid);
+			continue;
+		}
+		/* The ring's ev_q is the default for syscalls that don't have one.
+		 * Same ordering as userspace: ev_q, then the flag. */
+		if (ctx->ev_q && !(atomic_read(&sysc->flags) & SC_UEVENT)) {
+			sysc->ev_q = ctx->ev_q;
+			wmb();
+			atomic_or(&sysc->flags, SC_UEVENT);
+		}
+		queue_syscall(ctx->proc, sysc);
+	}
+	ctx->sq_head += nr;
+	wmb();	/* the syscalls were read before we give back the slots */
+	ring->sq_head = ctx->sq_head;
+	return nr;
+}
+
+/* Makes one pass over the poller's rings.  If set_wakeup, we're about to sleep,
+ * and we tell userspace to wake us up.  o/w, we clear any stale wakeup flags.
+ * Returns the number of syscalls queued. */
+static unsigned int __poller_pass(struct sysring_poller *poller,
+                                  bool set_wakeup)
+{
+	struct sysring_ctx_tailq dead = TAILQ_HEAD_INITIALIZER(dead);
+	struct sysring_ctx_tailq work = TAILQ_HEAD_INITIALIZER(work);
+	struct sysring_ctx *ctx, *temp;
+	struct proc *p;
+	unsigned int nr = 0;
+	uintptr_t old_proc;
+
+	/* Each ring we work on gets its own ref, so that sysring_proc_destroy()
+	 * can take it off the list while we're using it. */
+	spin_lock(&poller->lock);
+	TAILQ_FOREACH_SAFE(ctx, &poller->rings, link, temp) {
+		if (proc_is_dying(ctx->proc)) {
+			TAILQ_REMOVE(&poller->rings, ctx, link);
+			ctx->poller = NULL;
+			kref_get(&ctx->kref, 1);
+			TAILQ_INSERT_TAIL(&dead, ctx, link);
+			continue;
+		}
+		proc_incref(ctx->proc, 1);
+		kref_get(&ctx->kref, 1);
+		TAILQ_INSERT_TAIL(&work, ctx, pass_link);
+	}
+	spin_unlock(&poller->lock);
+	TAILQ_FOREACH_SAFE(ctx, &work, pass_link, temp) {
+		p = ctx->proc;
+		old_proc = switch_to(p);
+		qlock(&ctx->qlock);
+		/* p exec'd since we grabbed it; the ring is gone */
+		if (!ctx->dead) {
+			if (set_wakeup) {
+				atomic_or(&ctx->ring->sr_flags, SYSRING_NEED_WAKEUP);
+				mb();	/* set the flag before checking the tail */
+			} else if (atomic_read(&ctx->ring->sr_flags) &
+			           SYSRING_NEED_WAKEUP) {
+				atomic_and(&ctx->ring->sr_flags, ~SYSRING_NEED_WAKEUP);
+			}
+			nr += __sysring_consume(ctx, 0);
+		}
+		qunlock(&ctx->qlock);
+		switch_back(p, old_proc);
+		kref_put(&ctx->kref);
+		proc_decref(p);
+	}
+	/* Dropping the poller's ref could free the proc (and ctx), which can't
+	 * happen while we hold a spinlock. */
+	TAILQ_FOREACH_SAFE(ctx, &dead, link, temp) {
+		p = ctx->proc;
+		proc_decref(p);
+		kref_put(&ctx->kref);
+	}
+	return nr;
+}
+
+static void sysring_poller_wake(struct sysring_poller *poller)
+{
+	if (atomic_cas(&poller->asleep, TRUE, FALSE))
+		send_kernel_message(poller->coreid, __sysring_poll, (long)poller, TRUE,
+		                    0, KMSG_ROUTINE);
+}
+
+/* Routine KMSG, a0 is the poller, a1 is TRUE if we were just woken up. */
+static void __sysring_poll(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct sysring_poller *poller = (struct sysring_poller*)a0;
+
+	if (a1)
+		poller->last_work = read_tsc();
+	if (__poller_pass(poller, FALSE)) {
+		poller->last_work = read_tsc();
+	} else if (read_tsc() - poller->last_work >
+	           usec2tsc(SYSRING_POLL_IDLE_USEC)) {
+		/* Once asleep is set, anyone who sees NEED_WAKEUP will send us a KMSG.
+		 * The final pass catches anything submitted before they saw it. */
+		atomic_set(&poller->asleep, TRUE);
+		if (!__poller_pass(poller, TRUE))
+			return;
+		/* Found work after all.  If someone already woke us, their KMSG will
+		 * run the next pass. */
+		if (!atomic_cas(&poller->asleep, TRUE, FALSE))
+			return;
+		poller->last_work = read_tsc();
+	}
+	send_kernel_message(core_id(), __sysring_poll, (long)poller, FALSE, 0,
+	                    KMSG_ROUTINE);
+}
+
+/* Grabs cores for the pollers.  Call after the ksched is set up. */
+void sysring_init(void)
+{
+	int coreid;
+
+	if (!CONFIG_SYSRING_POLLERS)
+		return;
+	pollers = kzmalloc(sizeof(struct sysring_poller) * CONFIG_SYSRING_POLLERS,
+	                   MEM_WAIT);
+	for (int i = 0; i < CONFIG_SYSRING_POLLERS; i++) {
+		coreid = get_any_idle_core();
+		if (coreid < 0) {
+			warn("Only got %d of %d sysring pollers", i,
+			     CONFIG_SYSRING_POLLERS);
+			break;
+		}
+		spinlock_init(&pollers[i].lock);
+		TAILQ_INIT(&pollers[i].rings);
+		pollers[i].coreid = coreid;
+		atomic_init(&pollers[i].asleep, TRUE);
+		nr_pollers++;
+		printk("Using core %d for a sysring poller\n", coreid);
+	}
+}
+
+/* Takes ctx off its poller's list, if it is on one, and drops the list's ref on
+ * the proc.  The caller holds a ref on the proc, so it isn't freed. */
+static void sysring_unlink(struct sysring_ctx *ctx)
+{
+	struct sysring_poller *poller;
+	bool on_list = FALSE;
+
+	/* A ring's poller only ever changes to NULL */
+	poller = ACCESS_ONCE(ctx->poller);
+	if (!poller)
+		return;
+	spin_lock(&poller->lock);
+	/* Lost the race with a pass that saw p dying */
+	if (ctx->poller) {
+		TAILQ_REMOVE(&poller->rings, ctx, link);
+		ctx->poller = NULL;
+		on_list = TRUE;
+	}
+	spin_unlock(&poller->lock);
+	if (on_list)
+		proc_decref(ctx->proc);
+}
+
+/* Called when p is destroyed.  A poller that has gone to sleep won't make
+ * another pass to notice that p is dying, so we take p's ring off its list and
+ * drop the list's ref here. */
+void sysring_proc_destroy(struct proc *p)
+{
+	struct sysring_ctx *ctx = sysring_get_ctx(p);
+
+	if (!ctx)
+		return;
+	sysring_unlink(ctx);
+	kref_put(&ctx->kref);
+}
+
+/* Called when p execs, before its old address space goes away.  The ring is in
+ * that address space, so we stop polling it, wait out anyone consuming it, and
+ * get rid of it.  p can set up a new ring in the new image. */
+void sysring_proc_exec(struct proc *p)
+{
+	struct sysring_ctx *ctx;
+
+	spin_lock(&p->proc_lock);
+	ctx = p->sysring;
+	p->sysring = NULL;
+	spin_unlock(&p->proc_lock);
+	if (!ctx)
+		return;
+	sysring_unlink(ctx);
+	qlock(&ctx->qlock);
+	ctx->dead = TRUE;
+	qunlock(&ctx->qlock);
+	kref_put(&ctx->kref);
+}
+
+/* Called when p is freed.  A polled ring holds a ref on p, so by now no poller
+ * can be looking at the ctx. */
+void sysring_proc_free(struct proc *p)
+{
+	if (!p->sysring)
+		return;
+	assert(!p->sysring->poller);
+	kref_put(&p->sysring->kref);
+	p->sysring = NULL;
+}
+
+int sys_sysring_setup(struct proc *p, struct sysring *ring, int flags)
+{
+	struct sysring_ctx *ctx;
+	struct sysring_poller *poller;
+	unsigned int nr_entries;
+
+	if (!is_user_rwaddr(ring, sizeof(struct sysring))) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	nr_entries = ring->nr_entries;
+	if (!IS_PWR2(nr_entries) || (nr_entries > SYSRING_MAX_ENTRIES)) {
+		set_error(EINVAL, "nr_entries %u must be a power of two <= %d",
+		          nr_entries, SYSRING_MAX_ENTRIES);
+		return -1;
+	}
+	if (!is_user_rwaddr(ring, sysring_size(nr_entries))) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	if ((flags & SYSRING_SQPOLL) && !nr_pollers) {
+		set_error(ENODEV, "No sysring pollers, see CONFIG_SYSRING_POLLERS");
+		return -1;
+	}
+	ctx = kzmalloc(sizeof(struct sysring_ctx), MEM_WAIT);
+	kref_init(&ctx->kref, sysring_ctx_release, 1);
+	qlock_init(&ctx->qlock);
+	ctx->proc = p;
+	ctx->ring = ring;
+	ctx->ev_q = ring->ev_q;
+	ctx->nr_entries = nr_entries;
+	ctx->sq_head = ring->sq_head;
+	ctx->flags = flags;
+	spin_lock(&p->proc_lock);
+	if (p->sysring) {
+		spin_unlock(&p->proc_lock);
+		kfree(ctx);
+		set_error(EBUSY, "Process already has a sysring");
+		return -1;
+	}
+	p->sysring = ctx;
+	spin_unlock(&p->proc_lock);
+	atomic_set(&ring->sr_flags, 0);
+	if (flags & SYSRING_SQPOLL) {
+		poller = &pollers[atomic_fetch_and_add(&next_poller, 1) % nr_pollers];
+		/* The poller's list holds a ref, dropped when it sees p dying */
+		proc_incref(p, 1);
+		spin_lock(&poller->lock);
+		ctx->poller = poller;
+		TAILQ_INSERT_TAIL(&poller->rings, ctx, link);
+		spin_unlock(&poller->lock);
+		sysring_poller_wake(poller);
+	}
+	return 0;
+}
+
+/* Submits up to to_submit (0 for all) syscalls from p's ring, returning how
+ * many were submitted.  For polled rings, this just wakes the poller if it is
+ * asleep. */
+int sys_sysring_enter(struct proc *p, unsigned int to_submit)
+{
+	struct sysring_ctx *ctx = sysring_get_ctx(p);
+	struct sysring_poller *poller;
+	unsigned int ret = 0;
+
+	if (!ctx) {
+		set_error(EINVAL, "Process has no sysring");
+		return -1;
+	}
+	poller = ACCESS_ONCE(ctx->poller);
+	if (poller) {
+		if (atomic_read(&ctx->ring->sr_flags) & SYSRING_NEED_WAKEUP)
+			sysring_poller_wake(poller);
+	} else {
+		qlock(&ctx->qlock);
+		if (!ctx->dead)
+			ret = __sysring_consume(ctx, to_submit);
+		qunlock(&ctx->qlock);
+	}
+	kref_put(&ctx->kref);
+	return ret;
+}
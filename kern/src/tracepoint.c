@@ -0,0 +1,174 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Static tracepoints.  See tracepoint.h for the overview. */
+
+#include <tracepoint.h>
+#include <trace.h>
+#include <arch/arch.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <process.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define TP_RING_SZ				(64 * 1024)	/* per core */
+
+#define __TP_DESC(_name, _kind, _fields)                                       \
+	[TP_##_name] = {.name = #_name, .kind = _kind, .fields = _fields},
+const struct tp_desc tp_descs[TP_NR_EVENTS] = {
+	TRACEPOINTS(__TP_DESC)
+};
+#undef __TP_DESC
+
+bool tp_enabled[TP_NR_EVENTS];
+
+static const char tp_kind_chars[] = {
+	[TP_INSTANT] = 'i',
+	[TP_BEGIN] = 'b',
+	[TP_END] = 'e',
+};
+
+/* Allocated the first time an event is enabled, and never freed */
+static struct trace_ring *tp_rings;
+static qlock_t tp_lock = QLOCK_INITIALIZER(tp_lock);
+
+void __tracepoint(int id, uint64_t *args)
+{
+	int8_t irq_state = 0;
+	struct tp_record *rec;
+	int coreid;
+
+	/* The only other writer to our ring is an IRQ on this core */
+	disable_irqsave(&irq_state);
+	coreid = core_id();
+	rec = get_trace_slot_overwrite_racy(&tp_rings[coreid]);
+	rec->tsc = read_tsc();
+	rec->id = id;
+	rec->coreid = coreid;
+	rec->pid = current ? current->pid : 0;
+	memcpy(rec->args, args, sizeof(rec->args));
+	enable_irqsave(&irq_state);
+}
+
+/* Returns the id of the event called name, or -1. */
+int tp_lookup(const char *name)
+{
+	for (int i = 0; i < TP_NR_EVENTS; i++) {
+		if (!strcmp(tp_descs[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+static void tp_alloc_rings(void)
+{
+	struct trace_ring *rings;
+
+	rings = kzmalloc(sizeof(struct trace_ring) * num_cores, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++)
+		trace_ring_init(&rings[i], kmalloc(TP_RING_SZ, MEM_WAIT), TP_RING_SZ,
+		                sizeof(struct tp_record));
+	wmb();	/* rings are ready before any tracepoint sees tp_enabled */
+	tp_rings = rings;
+}
+
+/* Turns event id on or off.  -1 means all of them. */
+void tp_set_enabled(int id, bool on)
+{
+	qlock(&tp_lock);
+	if (!tp_rings)
+		tp_alloc_rings();
+	for (int i = 0; i < TP_NR_EVENTS; i++) {
+		if ((id == -1) || (id == i))
+			tp_enabled[i] = on;
+	}
+	qunlock(&tp_lock);
+}
+
+/* Throws away everything in the rings.  Tracepoints that fire during the reset
+ * might leave partial records behind. */
+void tp_reset(void)
+{
+	qlock(&tp_lock);
+	if (tp_rings) {
+		for (int i = 0; i < num_cores; i++)
+			trace_ring_reset_and_clear(&tp_rings[i]);
+	}
+	qunlock(&tp_lock);
+}
+
+/* Returns a kmalloc'd string of the event descriptions, one per line, and its
+ * length in *len. */
+char *tp_describe(size_t *len)
+{
+	size_t bufsz = 0, off = 0;
+	char *buf;
+
+	for (int i = 0; i < TP_NR_EVENTS; i++)
+		bufsz += strlen(tp_descs[i].name) + strlen(tp_descs[i].fields) + 16;
+	buf = kmalloc(bufsz, MEM_WAIT);
+	for (int i = 0; i < TP_NR_EVENTS; i++)
+		off += snprintf(buf + off, bufsz - off, "%d %c %s %s\n", i,
+		                tp_kind_chars[tp_descs[i].kind], tp_descs[i].name,
+		                tp_descs[i].fields);
+	*len = off;
+	return buf;
+}
+
+/* Copies the used records out of tr.  Returns the number copied. */
+static size_t tp_copy_ring(struct trace_ring *tr, struct tp_record *to)
+{
+	unsigned long next = ACCESS_ONCE(tr->tr_next);
+	unsigned long start = next > tr->tr_max ? next - tr->tr_max : 0;
+	struct tp_record *rec;
+	size_t nr = 0;
+
+	for (unsigned long i = start; i < next; i++) {
+		rec = __get_tr_slot_overwrite(tr, i);
+		/* Cleared by a reset, or not written yet */
+		if (!rec->tsc)
+			continue;
+		to[nr++] = *rec;
+	}
+	return nr;
+}
+
+/* Returns a kmalloc'd copy of the trace, in the format in ros/tracepoint.h, and
+ * its length in *len.  Records written while we copy might be torn; disable
+ * the events first for a clean snapshot. */
+void *tp_snapshot(size_t *len)
+{
+	struct tp_stream_hdr *hdr;
+	struct tp_record *recs;
+	size_t desc_len, max_recs = 0, nr_recs = 0;
+	char *desc;
+	void *buf;
+
+	qlock(&tp_lock);
+	if (tp_rings) {
+		for (int i = 0; i < num_cores; i++)
+			max_recs += tp_rings[i].tr_max;
+	}
+	desc = tp_describe(&desc_len);
+	buf = kzmalloc(sizeof(struct tp_stream_hdr) + desc_len +
+	               max_recs * sizeof(struct tp_record), MEM_WAIT);
+	hdr = buf;
+	hdr->magic = TP_STREAM_MAGIC;
+	hdr->version = TP_STREAM_VERSION;
+	hdr->record_sz = sizeof(struct tp_record);
+	hdr->tsc_freq = __proc_global_info.tsc_freq;
+	hdr->nr_cores = num_cores;
+	hdr->desc_len = desc_len;
+	memcpy(buf + sizeof(struct tp_stream_hdr), desc, desc_len);
+	kfree(desc);
+	recs = buf + sizeof(struct tp_stream_hdr) + desc_len;
+	for (int i = 0; i < num_cores && tp_rings; i++)
+		nr_recs += tp_copy_ring(&tp_rings[i], recs + nr_recs);
+	qunlock(&tp_lock);
+	*len = sizeof(struct tp_stream_hdr) + desc_len +
+	       nr_recs * sizeof(struct tp_record);
+	return buf;
+}
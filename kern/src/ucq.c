@@ -126,6 +126,54 @@ error_addr:
 	return;
 }
 
+/* Sends nr msgs to the ucq, reserving runs of slots with a single CAS instead of
+ * a fetch_and_add per message.  A run stops at the end of the current page;
+ * whenever the page is full (or someone else is dealing with the overflow), we
+ * send one message through send_ucq_msg(), which handles getting the next page,
+ * and then go back to reserving runs.  Same rules as send_ucq_msg(). */
+void send_ucq_msgs(struct ucq *ucq, struct proc *p, struct event_msg *msgs,
+                   int nr)
+{
+	uintptr_t first_slot;
+	unsigned int run;
+	struct msg_container *first_msg;
+
+	assert(is_user_rwaddr(ucq, sizeof(struct ucq)));
+	if (!ucq->ucq_ready) {
+		if (__proc_is_mcp(p))
+			warn("proc %d is _M with an uninitialized ucq %p\n", p->pid, ucq);
+		return;
+	}
+	while (nr) {
+		if (ucq->prod_overflow)
+			goto one_msg;
+		first_slot = (uintptr_t)atomic_read(&ucq->prod_idx);
+		if (!slot_is_good(first_slot))
+			goto one_msg;
+		run = MIN(nr, NR_MSG_PER_PAGE - PGOFF(first_slot));
+		if (!atomic_cas(&ucq->prod_idx, first_slot, first_slot + run))
+			continue;
+		/* The run is contiguous on one page, so one check covers all of it */
+		first_msg = slot2msg(first_slot);
+		if (!is_user_rwaddr(first_msg, sizeof(struct msg_container) * run)) {
+			warn("Invalid user address, not sending %d messages", run);
+			return;
+		}
+		for (int i = 0; i < run; i++)
+			first_msg[i].ev_msg = msgs[i];
+		wmb();	/* all of the msgs are written before any are ready */
+		for (int i = 0; i < run; i++)
+			first_msg[i].ready = TRUE;
+		msgs += run;
+		nr -= run;
+		continue;
+one_msg:
+		send_ucq_msg(ucq, p, msgs);
+		msgs++;
+		nr--;
+	}
+}
+
 /* Debugging */
 #include <smp.h>
 #include <pmap.h>
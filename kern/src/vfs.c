@@ -29,6 +29,10 @@ struct kmem_cache *dentry_kcache; // not to be confused with the dcache
 struct kmem_cache *inode_kcache;
 struct kmem_cache *file_kcache;
 
+/* Held around changing a dentry's name and parent, so lockless path walks can
+ * tell they raced with a rename. */
+static seqlock_t rename_lock = {SPINLOCK_INITIALIZER, 0};
+
 /* Mounts fs from dev_name at mnt_pt in namespace ns.  There could be no mnt_pt,
  * such as with the root of (the default) namespace.  Not sure how it would work
  * with multiple namespaces on the same FS yet.  Note if you mount the same FS
@@ -491,6 +495,163 @@ next_loop:
 	return 0;
 }
 
+static struct dentry *__dcache_lookup(struct super_block *sb,
+                                      struct dentry *parent, struct qstr *name);
+
+/* Helpers for rcu_path_walk().  These are the RCU versions of climb_up(),
+ * follow_mount(), and do_lookup(): they don't touch krefs, and return 0 when the
+ * walk needs to fall back to link_path_walk(). */
+static struct dentry *rcu_climb_up(struct dentry *dentry)
+{
+	struct vfsmount *mnt;
+
+	if (!dentry->d_parent || (dentry->d_parent == dentry))
+		return dentry;
+	while ((mnt = dentry->d_sb->s_mount)->mnt_root == dentry) {
+		if (!mnt->mnt_parent)
+			return 0;
+		dentry = mnt->mnt_mountpoint;
+	}
+	return dentry->d_parent;
+}
+
+static struct dentry *rcu_follow_mount(struct dentry *dentry)
+{
+	struct vfsmount *mnt;
+
+	if (!dentry->d_mount_point)
+		return dentry;
+	mnt = ACCESS_ONCE(dentry->d_mounted_fs);
+	return mnt ? mnt->mnt_root : 0;
+}
+
+static struct dentry *rcu_lookup(struct dentry *parent, struct qstr *name)
+{
+	struct dentry *dentry;
+
+	name->hash = parent->d_op->d_hash(parent, name);
+	dentry = __dcache_lookup(parent->d_sb, parent, name);
+	if (!dentry || (dentry->d_flags & (DENTRY_NEGATIVE | DENTRY_DYING)))
+		return 0;
+	if (!dentry->d_inode)
+		return 0;
+	return dentry;
+}
+
+/* Lockless version of link_path_walk(), for the common case where every
+ * component is in the dcache and there are no symlinks to follow.  We walk the
+ * dcache as an RCU reader, taking no locks or krefs until we have the answer,
+ * and use rename_lock to catch renames that happened during the walk.
+ *
+ * Returns -EAGAIN if the caller needs to do a regular walk: a dcache miss, a
+ * symlink, an error, or a race.  In that case, nd and path are untouched. */
+static int rcu_path_walk(char *path, struct nameidata *nd)
+{
+	struct dentry *dentry = nd->dentry;
+	struct vfsmount *mnt;
+	struct qstr name;
+	char *link = path, *end, *next;
+	bool trailing_slash, dot, dotdot;
+	seq_ctr_t seq;
+
+	seq = read_seqbegin(&rename_lock);
+	if (seq_is_locked(seq))
+		return -EAGAIN;
+	rcu_read_lock();
+	while (*link == '/')
+		link++;
+	/* "/", let link_path_walk() sort out PARENT */
+	if (*link == '\0')
+		goto out_again;
+	while (1) {
+		for (end = link; *end && (*end != '/'); end++)
+			;
+		for (next = end; *next == '/'; next++)
+			;
+		trailing_slash = (*next == '\0') && (next != end);
+		name.name = link;
+		name.len = end - link;
+		dot = (name.len == 1) && (link[0] == '.');
+		dotdot = (name.len == 2) && (link[0] == '.') && (link[1] == '.');
+		if (*next == '\0')
+			break;
+		if (dot)
+			goto next_loop;
+		if (dotdot) {
+			dentry = rcu_climb_up(dentry);
+			if (!dentry)
+				goto out_again;
+			goto next_loop;
+		}
+		dentry = rcu_lookup(dentry, &name);
+		if (!dentry)
+			goto out_again;
+		/* Symlinks aren't directories either */
+		dentry = rcu_follow_mount(dentry);
+		if (!dentry || !S_ISDIR(dentry->d_inode->i_mode))
+			goto out_again;
+next_loop:
+		link = next;
+	}
+	/* dentry is the parent of the final component, link */
+	if (nd->flags & LOOKUP_PARENT) {
+		/* These need a null-terminated last name or special handling */
+		if (trailing_slash || dot || dotdot)
+			goto out_again;
+		/* Only need to look at the child if it might be a symlink */
+		if (nd->flags & LOOKUP_FOLLOW) {
+			struct dentry *child = rcu_lookup(dentry, &name);
+
+			if (!child || S_ISLNK(child->d_inode->i_mode))
+				goto out_again;
+		}
+	} else if (dot) {
+		/* stay put */
+	} else if (dotdot) {
+		dentry = rcu_climb_up(dentry);
+		if (!dentry)
+			goto out_again;
+	} else {
+		dentry = rcu_lookup(dentry, &name);
+		if (!dentry)
+			goto out_again;
+		if ((nd->flags & LOOKUP_FOLLOW) && S_ISLNK(dentry->d_inode->i_mode))
+			goto out_again;
+		dentry = rcu_follow_mount(dentry);
+		if (!dentry)
+			goto out_again;
+		if (((nd->flags & LOOKUP_DIRECTORY) || trailing_slash) &&
+		    !S_ISDIR(dentry->d_inode->i_mode))
+			goto out_again;
+	}
+	/* Unused dentries in the dcache have no krefs, but can be resurrected */
+	if (!kref_get_not_zero(&dentry->d_kref, 1)) {
+		dentry = dcache_get(dentry->d_sb, dentry);
+		if (!dentry)
+			goto out_again;
+	}
+	mnt = dentry->d_sb->s_mount;
+	kref_get(&mnt->mnt_kref, 1);
+	rcu_read_unlock();
+	if (read_seqretry(&rename_lock, seq)) {
+		kref_put(&dentry->d_kref);
+		kref_put(&mnt->mnt_kref);
+		return -EAGAIN;
+	}
+	kref_put(&nd->dentry->d_kref);
+	kref_put(&nd->mnt->mnt_kref);
+	nd->dentry = dentry;
+	nd->mnt = mnt;
+	if (trailing_slash)
+		nd->flags |= LOOKUP_DIRECTORY;
+	if (nd->flags & LOOKUP_PARENT)
+		stash_nd_name(nd, link);
+	return 0;
+out_again:
+	rcu_read_unlock();
+	return -EAGAIN;
+}
+
 /* Given path, return the inode for the final dentry.  The ND should be
  * initialized for the first call - specifically, we need the intent.
  * LOOKUP_PARENT and friends go in the flags var, which is not the intent.
@@ -528,7 +689,9 @@ int path_lookup(char *path, int flags, struct nameidata *nd)
 	kref_get(&nd->dentry->d_kref, 1);
 	nd->flags = flags;
 	nd->depth = 0;					/* used in symlink following */
-	retval =  link_path_walk(path, nd);
+	retval = rcu_path_walk(path, nd);
+	if (retval == -EAGAIN)
+		retval = link_path_walk(path, nd);
 	/* make sure our PARENT lookup worked */
 	if (!retval && (flags & LOOKUP_PARENT))
 		assert(nd->last.name);
@@ -566,24 +729,6 @@ out:
 
 /* Superblock functions */
 
-/* Dentry "hash" function for the hash table to use.  Since we already have the
- * hash in the qstr, we don't need to rehash.  Also, note we'll be using the
- * dentry in question as both the key and the value. */
-static size_t __dcache_hash(void *k)
-{
-	return (size_t)((struct dentry*)k)->d_name.hash;
-}
-
-/* Dentry cache hashtable equality function.  This means we need to pass in some
- * minimal dentry when doing a lookup. */
-static ssize_t __dcache_eq(void *k1, void *k2)
-{
-	if (((struct dentry*)k1)->d_parent != ((struct dentry*)k2)->d_parent)
-		return 0;
-	/* TODO: use the FS-specific string comparison */
-	return !strcmp(((struct dentry*)k1)->d_name.name,
-	               ((struct dentry*)k2)->d_name.name);
-}
 
 /* Helper to alloc and initialize a generic superblock.  This handles all the
  * VFS related things, like lists.  Each FS will need to handle its own things
@@ -599,7 +744,7 @@ struct super_block *get_sb(void)
 	TAILQ_INIT(&sb->s_io_wb);
 	TAILQ_INIT(&sb->s_lru_d);
 	TAILQ_INIT(&sb->s_files);
-	sb->s_dcache = create_hashtable(100, __dcache_hash, __dcache_eq);
+	sb->s_dcache = kzmalloc(sizeof(struct dentry*) * DCACHE_NR_BUCKETS, 0);
 	sb->s_icache = create_hashtable(100, __generic_hash, __generic_eq);
 	spinlock_init(&sb->s_lru_lock);
 	spinlock_init(&sb->s_dcache_lock);
@@ -774,8 +919,20 @@ void dentry_release(struct kref *kref)
  * Note that dentries pin and kref their inodes.  When all the dentries are
  * gone, we want the inode to be released via kref.  The inode has internal /
  * weak references to the dentry, which are not refcounted. */
+static void __dentry_free_rcu(struct rcu_head *head)
+{
+	__dentry_free(container_of(head, struct dentry, d_rcu));
+}
+
 void __dentry_free(struct dentry *dentry)
 {
+	/* Lockless path walkers could still be looking at a dentry that was in the
+	 * dcache, including its name, parent, and inode. */
+	if (dentry->d_flags & DENTRY_RCU) {
+		dentry->d_flags &= ~DENTRY_RCU;
+		call_rcu(&dentry->d_rcu, __dentry_free_rcu);
+		return;
+	}
 	if (dentry->d_inode)
 		printd("Freeing dentry %p: %s\n", dentry, dentry->d_name.name);
 	assert(dentry->d_op);	/* catch bugs.  a while back, some lacked d_op */
@@ -816,6 +973,73 @@ struct dentry *lookup_dentry(char *path, int flags)
 	return dentry;
 }
 
+/* The dcache is a hash table of dentries, keyed by parent and name.  Buckets
+ * are chained through d_hash_next.  Writers hold s_dcache_lock.  Readers either
+ * hold it too, or are RCU readers (see rcu_path_walk()).  A dentry that was in
+ * the dcache isn't freed until a grace period after it is removed, and a
+ * removed dentry keeps its d_hash_next, so RCU readers can keep walking a chain
+ * while it changes. */
+static struct dentry **dcache_bucket(struct super_block *sb,
+                                     struct dentry *parent, struct qstr *name)
+{
+	return &sb->s_dcache[(name->hash ^ ((uintptr_t)parent >> 4)) %
+	                     DCACHE_NR_BUCKETS];
+}
+
+static bool dcache_match(struct dentry *dentry, struct dentry *parent,
+                         struct qstr *name)
+{
+	/* TODO: use the FS-specific string comparison */
+	return (dentry->d_parent == parent) &&
+	       (dentry->d_name.hash == name->hash) &&
+	       (dentry->d_name.len == name->len) &&
+	       !strncmp(dentry->d_name.name, name->name, name->len);
+}
+
+/* Finds name in parent.  Caller holds the dcache lock or is an RCU reader. */
+static struct dentry *__dcache_lookup(struct super_block *sb,
+                                      struct dentry *parent, struct qstr *name)
+{
+	struct dentry *d_i;
+
+	for (d_i = rcu_dereference(*dcache_bucket(sb, parent, name));
+	     d_i;
+	     d_i = rcu_dereference(d_i->d_hash_next)) {
+		if (dcache_match(d_i, parent, name))
+			return d_i;
+	}
+	return 0;
+}
+
+/* Caller holds the dcache lock */
+static void __dcache_insert(struct super_block *sb, struct dentry *dentry)
+{
+	struct dentry **bucket = dcache_bucket(sb, dentry->d_parent,
+	                                       &dentry->d_name);
+
+	dentry->d_flags |= DENTRY_RCU;
+	dentry->d_hash_next = *bucket;
+	rcu_assign_pointer(*bucket, dentry);
+}
+
+/* Removes and returns the dentry with the same parent and name as key, or 0.
+ * Caller holds the dcache lock. */
+static struct dentry *__dcache_remove(struct super_block *sb,
+                                      struct dentry *key)
+{
+	struct dentry **pp = dcache_bucket(sb, key->d_parent, &key->d_name);
+	struct dentry *d_i;
+
+	for (d_i = *pp; d_i; pp = &d_i->d_hash_next, d_i = *pp) {
+		if (dcache_match(d_i, key->d_parent, &key->d_name)) {
+			/* d_i->d_hash_next stays put, for readers still on d_i */
+			rcu_assign_pointer(*pp, d_i->d_hash_next);
+			return d_i;
+		}
+	}
+	return 0;
+}
+
 /* Get a dentry from the dcache.  At a minimum, we need the name hash and parent
  * in what_i_want, though most uses will probably be from a get_dentry() call.
  * We pass in the SB in the off chance that we don't want to use a get'd dentry.
@@ -842,7 +1066,7 @@ struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
 	/* This lock protects the hash, as well as ensures the returned object
 	 * doesn't get deleted/freed out from under us */
 	spin_lock(&sb->s_dcache_lock);
-	found = hashtable_search(sb->s_dcache, what_i_want);
+	found = __dcache_lookup(sb, what_i_want->d_parent, &what_i_want->d_name);
 	if (found) {
 		if (found->d_flags & DENTRY_NEGATIVE) {
 			what_i_want->d_flags |= DENTRY_NEGATIVE;
@@ -871,9 +1095,8 @@ struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
 void dcache_put(struct super_block *sb, struct dentry *key_val)
 {
 	struct dentry *old;
-	int retval;
 	spin_lock(&sb->s_dcache_lock);
-	old = hashtable_remove(sb->s_dcache, key_val);
+	old = __dcache_remove(sb, key_val);
 	/* if it is old and non-negative, our caller lost a race with someone else
 	 * adding the dentry.  but since we yanked it out, like a bunch of idiots,
 	 * we still have to put it back.  should be fairly rare. */
@@ -889,9 +1112,7 @@ void dcache_put(struct super_block *sb, struct dentry *key_val)
 		assert(old != key_val); // checking TODO comment
 		__dentry_free(old);
 	}
-	/* this returns 0 on failure (TODO: Fix this ghetto shit) */
- 	retval = hashtable_insert(sb->s_dcache, key_val, key_val);
-	assert(retval);
+	__dcache_insert(sb, key_val);
 	spin_unlock(&sb->s_dcache_lock);
 }
 
@@ -904,7 +1125,7 @@ struct dentry *dcache_remove(struct super_block *sb, struct dentry *key)
 {
 	struct dentry *retval;
 	spin_lock(&sb->s_dcache_lock);
-	retval = hashtable_remove(sb->s_dcache, key);
+	retval = __dcache_remove(sb, key);
 	spin_unlock(&sb->s_dcache_lock);
 	return retval;
 }
@@ -927,7 +1148,7 @@ void dcache_prune(struct super_block *sb, bool negative_only)
 			if (negative_only && !(d_i->d_flags & DENTRY_NEGATIVE))
 				continue;
 			/* another place where we'd be better off with tools, not sol'ns */
-			hashtable_remove(sb->s_dcache, d_i);
+			__dcache_remove(sb, d_i);
 			TAILQ_REMOVE(&sb->s_lru_d, d_i, d_lru);
 			TAILQ_INSERT_HEAD(&victims, d_i, d_lru);
 		}
@@ -1113,6 +1334,10 @@ void inode_release(struct kref *kref)
 	struct inode *inode = container_of(kref, struct inode, i_kref);
 	TAILQ_REMOVE(&inode->i_sb->s_inodes, inode, i_sb_list);
 	icache_remove(inode->i_sb, inode->i_ino);
+	/* Writes back and frees the page cache, before the inode goes to disk.
+	 * Only the inode's own PM: a bdev's inode maps the bdev's b_pm, which
+	 * outlives the inode. */
+	pm_destroy(&inode->i_pm);
 	/* Might need to write back or delete the file/inode */
 	if (inode->i_nlink) {
 		if (inode->i_state & I_STATE_DIRTY)
@@ -1129,8 +1354,6 @@ void inode_release(struct kref *kref)
 	/* Either way, we dealloc the in-memory version */
 	inode->i_sb->s_op->dealloc_inode(inode);	/* FS-specific clean-up */
 	kref_put(&inode->i_sb->s_kref);
-	/* TODO: clean this up */
-	assert(inode->i_mapping == &inode->i_pm);
 	kmem_cache_free(inode_kcache, inode);
 }
 
@@ -1244,6 +1467,9 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
 	first_idx = orig_off >> PGSHIFT;
 	last_idx = (orig_off + count) >> PGSHIFT;
 	buf_end = buf + count;
+	pm_ra_update(file->f_mapping, &file->f_ra, first_idx,
+	             last_idx - first_idx + 1,
+	             nr_pages(file->f_dentry->d_inode->i_size));
 	/* For each file page, make sure it's in the page cache, then copy it out.
 	 * TODO: will probably need to consider concurrently truncated files here.*/
 	for (int i = first_idx; i <= last_idx; i++) {
@@ -1268,6 +1494,53 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
 	return count;
 }
 
+/* Reads up to count bytes of the file at offset into a new block, straight
+ * from the page cache, for in-kernel readers like sendfile().  Returns the
+ * amount read, with the block in *bpp, 0 at EOF, or -1 on error. */
+ssize_t generic_file_bread(struct file *file, struct block **bpp, size_t count,
+                           off64_t offset)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	struct block *bp;
+	struct page *page;
+	off64_t page_off;
+	unsigned long first_idx, last_idx;
+	size_t copy_amt;
+	int error;
+
+	if (!(file->f_flags & O_READ)) {
+		set_errno(EBADF);
+		return -1;
+	}
+	if (!count || (offset >= inode->i_size))
+		return 0;
+	count = MIN(count, inode->i_size - offset);
+	page_off = offset & (PGSIZE - 1);
+	first_idx = offset >> PGSHIFT;
+	last_idx = (offset + count - 1) >> PGSHIFT;
+	pm_ra_update(file->f_mapping, &file->f_ra, first_idx,
+	             last_idx - first_idx + 1, nr_pages(inode->i_size));
+	bp = block_alloc(count, MEM_WAIT);
+	for (unsigned long i = first_idx; i <= last_idx; i++) {
+		error = pm_load_page(file->f_mapping, i, &page);
+		if (error) {
+			/* Hand back what we got; the next call will fail */
+			if (BLEN(bp))
+				break;
+			freeb(bp);
+			set_errno(-error);
+			return -1;
+		}
+		copy_amt = MIN(PGSIZE - page_off, count - BLEN(bp));
+		memcpy(bp->wp, page2kva(page) + page_off, copy_amt);
+		bp->wp += copy_amt;
+		page_off = 0;
+		pm_put_page(page);
+	}
+	*bpp = bp;
+	return BLEN(bp);
+}
+
 /* Write count bytes from buf to the file, starting at *offset, which is
  * increased accordingly, returning the number of bytes transfered.  Most
  * filesystems will use this function for their f_op->write.  Note, this uses
@@ -1334,6 +1607,96 @@ ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
 	return count;
 }
 
+/* Vectored generic_file_read(), through the file's read op.  Stops at the first
+ * short read, like a read() of the whole thing would.  The iov_bases are user
+ * addresses, the vector itself is in the kernel. */
+ssize_t generic_file_readv(struct file *file, const struct iovec *vector,
+                           unsigned long count, off64_t *offset)
+{
+	ssize_t ret, sofar = 0;
+
+	for (unsigned long i = 0; i < count; i++) {
+		if (!vector[i].iov_len)
+			continue;
+		ret = file->f_op->read(file, vector[i].iov_base, vector[i].iov_len,
+		                       offset);
+		if (ret < 0)
+			return sofar ? sofar : ret;
+		sofar += ret;
+		if (ret < vector[i].iov_len)
+			break;
+	}
+	return sofar;
+}
+
+/* Vectored generic_file_write(), through the file's write op. */
+ssize_t generic_file_writev(struct file *file, const struct iovec *vector,
+                            unsigned long count, off64_t *offset)
+{
+	ssize_t ret, sofar = 0;
+
+	for (unsigned long i = 0; i < count; i++) {
+		if (!vector[i].iov_len)
+			continue;
+		ret = file->f_op->write(file, vector[i].iov_base, vector[i].iov_len,
+		                        offset);
+		if (ret < 0)
+			return sofar ? sofar : ret;
+		sofar += ret;
+		if (ret < vector[i].iov_len)
+			break;
+	}
+	return sofar;
+}
+
+#define FILE_WILLNEED_MAX		1024	/* pages per POSIX_FADV_WILLNEED */
+
+/* posix_fadvise() for VFS files.  len == 0 means to the end of the file.  The
+ * access pattern hints set the file's readahead mode, WILLNEED starts
+ * readahead for the range, and DONTNEED drops the range from the page cache,
+ * writing back dirty pages first. */
+int file_advise(struct file *file, off64_t offset, off64_t len, int advice)
+{
+	struct page_map *pm = file->f_mapping;
+	size_t size = file->f_dentry->d_inode->i_size;
+	unsigned long first_idx, end_idx;
+	off64_t end;
+
+	if ((offset < 0) || (len < 0)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	switch (advice) {
+	case POSIX_FADV_NORMAL:
+	case POSIX_FADV_RANDOM:
+	case POSIX_FADV_SEQUENTIAL:
+		memset(&file->f_ra, 0, sizeof(struct pm_ra));
+		file->f_ra.ra_mode = advice == POSIX_FADV_RANDOM ? PM_RA_RANDOM :
+		                     advice == POSIX_FADV_SEQUENTIAL ? PM_RA_SEQUENTIAL :
+		                     PM_RA_NORMAL;
+		return 0;
+	case POSIX_FADV_WILLNEED:
+	case POSIX_FADV_DONTNEED:
+		break;
+	case POSIX_FADV_NOREUSE:
+		return 0;
+	default:
+		set_errno(EINVAL);
+		return -1;
+	}
+	if (!pm || (offset >= size))
+		return 0;
+	end = (!len || (len > size - offset)) ? size : offset + len;
+	first_idx = offset >> PGSHIFT;
+	end_idx = nr_pages(end);
+	if (advice == POSIX_FADV_WILLNEED)
+		pm_readahead(pm, first_idx, MIN(end_idx - first_idx,
+		                                FILE_WILLNEED_MAX));
+	else
+		pm_remove_contig(pm, first_idx, end_idx - first_idx);
+	return 0;
+}
+
 /* Directories usually use this for their read method, which is the way glibc
  * currently expects us to do a readdir (short of doing linux's getdents).  Will
  * probably need work, based on whatever real programs want. */
@@ -2171,6 +2534,7 @@ int do_rename(char *old_path, char *new_path)
 	 * particularly cumbersome since there are two levels here: the FS has its
 	 * info about where things are, and the VFS has its dentry tree.  and it's
 	 * all racy (TODO). */
+	write_seqlock(&rename_lock);
 	dentry_set_name(old_d, new_d->d_name.name);
 	old_d->d_parent = new_d->d_parent;
 	if (S_ISDIR(old_d->d_inode->i_mode)) {
@@ -2184,6 +2548,7 @@ int do_rename(char *old_path, char *new_path)
 	 * old_d or negative versions of new_d sitting around.  dcache_put should
 	 * replace a potentially negative dentry for new_d (now called old_d) */
 	dcache_put(old_dir_d->d_sb, old_d);
+	write_sequnlock(&rename_lock);
 
 	/* TODO could have a helper for this, but it's going away soon */
 	now = nsec2timespec(epoch_nsec());
@@ -2289,6 +2654,7 @@ struct file *dentry_open(struct dentry *dentry, int flags)
 	spinlock_init(&file->f_ep_lock);
 	file->f_privdata = 0;						/* prob overriden by the fs */
 	file->f_mapping = inode->i_mapping;
+	memset(&file->f_ra, 0, sizeof(struct pm_ra));
 	file->f_op->open(inode, file);
 	return file;
 error_access:
@@ -2490,8 +2856,7 @@ bool close_fd(struct fd_table *fdt, int fd)
 		kref_put(&file->f_kref);
 	else
 		cclose(chan);
-	if (tap)
-		kref_put(&tap->kref);
+	put_fd_taps(tap);
 	return ret;
 }
 
@@ -2642,8 +3007,7 @@ void close_fdt(struct fd_table *fdt, bool cloexec)
 			kref_put(&to_close[i].fd_file->f_kref);
 		else
 			cclose(to_close[i].fd_chan);
-		if (to_close[i].fd_tap)
-			kref_put(&to_close[i].fd_tap->kref);
+		put_fd_taps(to_close[i].fd_tap);
 	}
 	kfree(to_close);
 }
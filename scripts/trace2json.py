@@ -0,0 +1,134 @@
+#!/usr/bin/env python
+#
+# Copyright (c) 2016 Google Inc
+# See LICENSE for details.
+#
+# Converts a tracepoint stream (read from #trace/data) into the Chrome trace
+# event JSON format, which chrome://tracing and ui.perfetto.dev can load.
+#
+# Usage: trace2json.py trace.bin > trace.json
+#
+# Each core is a thread, and each process is a process; pid 0 is the kernel.
+# Begin / end events (syscalls, page faults, IRQs) become complete ("X") events
+# on the core they began on.  A begin without its end (the ring wrapped, or it
+# hadn't finished) becomes an instant.  See kern/include/ros/tracepoint.h for
+# the stream format.
+
+import json
+import struct
+import sys
+
+TP_STREAM_MAGIC = 0x5452414b
+TP_STREAM_VERSION = 1
+TP_NR_ARGS = 4
+
+HDR_FMT = '<IHHQII'
+REC_FMT = '<QHHI%dQ' % TP_NR_ARGS
+
+
+class Event(object):
+    def __init__(self, line):
+        fields = line.split()
+        self.id = int(fields[0])
+        self.kind = fields[1]
+        self.name = fields[2]
+        self.fields = fields[3:]
+        # syscall_enter and syscall_exit are both "syscall"
+        self.base = self.name
+        for suffix in ('_enter', '_exit'):
+            if self.name.endswith(suffix):
+                self.base = self.name[:-len(suffix)]
+
+
+def parse(data):
+    hdr_sz = struct.calcsize(HDR_FMT)
+    magic, version, record_sz, tsc_freq, nr_cores, desc_len = \
+        struct.unpack_from(HDR_FMT, data, 0)
+    if magic != TP_STREAM_MAGIC:
+        sys.exit('Not a tracepoint stream (magic %x)' % magic)
+    if version != TP_STREAM_VERSION:
+        sys.exit('Unknown tracepoint stream version %d' % version)
+    if record_sz != struct.calcsize(REC_FMT):
+        sys.exit('Unexpected record size %d' % record_sz)
+    desc = data[hdr_sz:hdr_sz + desc_len].decode('ascii')
+    events = {}
+    for line in desc.splitlines():
+        if line.strip():
+            ev = Event(line)
+            events[ev.id] = ev
+    records = []
+    for off in range(hdr_sz + desc_len, len(data) - record_sz + 1, record_sz):
+        rec = struct.unpack_from(REC_FMT, data, off)
+        records.append({'tsc': rec[0], 'id': rec[1], 'core': rec[2],
+                        'pid': rec[3], 'args': rec[4:]})
+    records.sort(key=lambda r: r['tsc'])
+    return tsc_freq, nr_cores, events, records
+
+
+def to_us(tsc, base, tsc_freq):
+    return (tsc - base) * 1000000.0 / tsc_freq
+
+
+def named_args(ev, rec):
+    return dict((name, rec['args'][i]) for i, name in enumerate(ev.fields))
+
+
+def convert(tsc_freq, nr_cores, events, records):
+    out = []
+    base = records[0]['tsc'] if records else 0
+    pids = set()
+    # (base name, pid, args[0]) -> stack of begin records
+    open_begins = {}
+
+    def instant(ev, rec):
+        out.append({'name': ev.name, 'ph': 'i', 's': 't',
+                    'ts': to_us(rec['tsc'], base, tsc_freq),
+                    'pid': rec['pid'], 'tid': rec['core'],
+                    'args': named_args(ev, rec)})
+
+    for rec in records:
+        ev = events.get(rec['id'])
+        if not ev:
+            continue
+        pids.add(rec['pid'])
+        key = (ev.base, rec['pid'], rec['args'][0])
+        if ev.kind == 'b':
+            open_begins.setdefault(key, []).append(rec)
+        elif ev.kind == 'e' and open_begins.get(key):
+            begin = open_begins[key].pop()
+            begin_ev = events[begin['id']]
+            args = named_args(begin_ev, begin)
+            args.update(dict(('exit_' + k, v) for k, v in
+                             named_args(ev, rec).items()))
+            if begin['core'] != rec['core']:
+                args['exit_core'] = rec['core']
+            out.append({'name': ev.base, 'ph': 'X',
+                        'ts': to_us(begin['tsc'], base, tsc_freq),
+                        'dur': to_us(rec['tsc'], begin['tsc'], tsc_freq),
+                        'pid': begin['pid'], 'tid': begin['core'],
+                        'args': args})
+        else:
+            instant(ev, rec)
+    for stack in open_begins.values():
+        for rec in stack:
+            instant(events[rec['id']], rec)
+    for pid in pids:
+        out.append({'name': 'process_name', 'ph': 'M', 'pid': pid,
+                    'args': {'name': 'kernel' if pid == 0 else 'pid %d' % pid}})
+        for core in range(nr_cores):
+            out.append({'name': 'thread_name', 'ph': 'M', 'pid': pid,
+                        'tid': core, 'args': {'name': 'core %d' % core}})
+    return {'traceEvents': out, 'displayTimeUnit': 'ns'}
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit('Usage: %s trace.bin > trace.json' % sys.argv[0])
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    json.dump(convert(*parse(data)), sys.stdout)
+    sys.stdout.write('\n')
+
+
+if __name__ == '__main__':
+    main()
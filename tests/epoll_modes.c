@@ -0,0 +1,168 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Epoll modes test: level-triggered, EPOLLONESHOT, the same FD in two sets,
+ * nested sets, and growing a set past its initial size.  Uses eventfds, which
+ * support level-triggered taps. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <parlib/parlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+#define NR_RESULTS 16
+
+static int nr_ready(int epfd)
+{
+	struct epoll_event results[NR_RESULTS];
+
+	return epoll_wait(epfd, results, NR_RESULTS, 0);
+}
+
+static void add_fd(int epfd, int fd, uint32_t events)
+{
+	struct epoll_event ep_ev;
+
+	ep_ev.events = events;
+	ep_ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ep_ev))
+		handle_error("epoll_ctl_add");
+}
+
+static void test_level_triggered(void)
+{
+	int epfd = epoll_create(1);
+	int efd = eventfd(1, EFD_NONBLOCK);
+	eventfd_t val;
+
+	add_fd(epfd, efd, EPOLLIN);
+	/* Stays ready until we read it */
+	assert(nr_ready(epfd) == 1);
+	assert(nr_ready(epfd) == 1);
+	if (eventfd_read(efd, &val))
+		handle_error("eventfd_read");
+	assert(nr_ready(epfd) == 0);
+	close(efd);
+	close(epfd);
+}
+
+static void test_edge_triggered(void)
+{
+	int epfd = epoll_create(1);
+	int efd = eventfd(1, EFD_NONBLOCK);
+
+	add_fd(epfd, efd, EPOLLIN | EPOLLET);
+	/* Ready on add, then nothing until it changes */
+	assert(nr_ready(epfd) == 1);
+	assert(nr_ready(epfd) == 0);
+	eventfd_write(efd, 1);
+	assert(nr_ready(epfd) == 1);
+	close(efd);
+	close(epfd);
+}
+
+static void test_oneshot(void)
+{
+	int epfd = epoll_create(1);
+	int efd = eventfd(1, EFD_NONBLOCK);
+	struct epoll_event ep_ev;
+
+	add_fd(epfd, efd, EPOLLIN | EPOLLONESHOT);
+	assert(nr_ready(epfd) == 1);
+	eventfd_write(efd, 1);
+	assert(nr_ready(epfd) == 0);
+	/* MOD rearms, and it's still readable */
+	ep_ev.events = EPOLLIN | EPOLLONESHOT;
+	ep_ev.data.fd = efd;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, efd, &ep_ev))
+		handle_error("epoll_ctl_mod");
+	assert(nr_ready(epfd) == 1);
+	close(efd);
+	close(epfd);
+}
+
+static void test_multi_set(void)
+{
+	int epfd1 = epoll_create(1);
+	int epfd2 = epoll_create(1);
+	int efd = eventfd(0, EFD_NONBLOCK);
+
+	add_fd(epfd1, efd, EPOLLIN | EPOLLET);
+	add_fd(epfd2, efd, EPOLLIN | EPOLLET);
+	eventfd_write(efd, 1);
+	assert(nr_ready(epfd1) == 1);
+	assert(nr_ready(epfd2) == 1);
+	/* Removing it from one set leaves the other alone */
+	if (epoll_ctl(epfd1, EPOLL_CTL_DEL, efd, 0))
+		handle_error("epoll_ctl_del");
+	eventfd_write(efd, 1);
+	assert(nr_ready(epfd1) == 0);
+	assert(nr_ready(epfd2) == 1);
+	close(efd);
+	close(epfd1);
+	close(epfd2);
+}
+
+static void test_nested(void)
+{
+	int outer = epoll_create(1);
+	int inner = epoll_create(1);
+	int efd = eventfd(0, EFD_NONBLOCK);
+	struct epoll_event results[NR_RESULTS];
+
+	add_fd(inner, efd, EPOLLIN | EPOLLET);
+	add_fd(outer, inner, EPOLLIN);
+	assert(nr_ready(outer) == 0);
+	eventfd_write(efd, 1);
+	/* Outer sees inner, and blocks until it does */
+	if (epoll_wait(outer, results, NR_RESULTS, 1000) != 1)
+		handle_error("nested epoll_wait");
+	assert(results[0].data.fd == inner);
+	assert(nr_ready(inner) == 1);
+	assert(nr_ready(outer) == 0);
+	/* No loops */
+	assert(epoll_ctl(inner, EPOLL_CTL_ADD, outer, &results[0]) == -1);
+	close(efd);
+	close(inner);
+	close(outer);
+}
+
+static void test_grow(void)
+{
+	#define NR_GROW_FDS 300
+	int epfd = epoll_create(1);
+	int efds[NR_GROW_FDS];
+
+	for (int i = 0; i < NR_GROW_FDS; i++) {
+		efds[i] = eventfd(1, EFD_NONBLOCK);
+		if (efds[i] < 0)
+			handle_error("eventfd");
+		add_fd(epfd, efds[i], EPOLLIN | EPOLLET);
+	}
+	for (int nr = 0; nr < NR_GROW_FDS; ) {
+		int ret = nr_ready(epfd);
+
+		assert(ret > 0);
+		nr += ret;
+	}
+	for (int i = 0; i < NR_GROW_FDS; i++)
+		close(efds[i]);
+	close(epfd);
+}
+
+int main(int argc, char **argv)
+{
+	test_level_triggered();
+	test_edge_triggered();
+	test_oneshot();
+	test_multi_set();
+	test_nested();
+	test_grow();
+	printf("Passed\n");
+	return 0;
+}
@@ -0,0 +1,135 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Microbenchmark for draining event mailboxes: mbox_batch [NR_MSGS] [LOOPS]
+ *
+ * Fills a UCQ with syscall completions and a CEQ with eventfd taps, then times
+ * draining them one message at a time (get_ucq_msg(), get_ceq_msg()) against
+ * the batch calls (get_ucq_msgs(), get_ceq_msgs()).  No INDIRs or IPIs, so we
+ * are the only consumer. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <parlib/parlib.h>
+#include <parlib/event.h>
+#include <parlib/ucq.h>
+#include <parlib/ceq.h>
+#include <parlib/timing.h>
+
+#define BATCH_SZ 64
+
+static struct event_msg msgs[BATCH_SZ];
+
+static void fill_ucq(struct event_queue *evq, struct syscall *syscs, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		syscall_async_evq(&syscs[i], evq, SYS_null);
+}
+
+static uint64_t drain_ucq(struct ucq *ucq, int nr, bool batch)
+{
+	uint64_t start = read_tsc();
+	int got = 0, ret;
+
+	while (got < nr) {
+		if (batch) {
+			ret = get_ucq_msgs(ucq, msgs, BATCH_SZ);
+		} else {
+			ret = get_ucq_msg(ucq, &msgs[0]) ? 1 : 0;
+		}
+		assert(ret);
+		got += ret;
+	}
+	return read_tsc() - start;
+}
+
+static void fill_ceq(int *efds, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		eventfd_write(efds[i], 1);
+}
+
+static uint64_t drain_ceq(struct ceq *ceq, int nr, bool batch)
+{
+	uint64_t start = read_tsc();
+	int got = 0, ret;
+
+	while (got < nr) {
+		if (batch) {
+			ret = get_ceq_msgs(ceq, msgs, BATCH_SZ);
+		} else {
+			ret = get_ceq_msg(ceq, &msgs[0]) ? 1 : 0;
+		}
+		assert(ret);
+		got += ret;
+	}
+	return read_tsc() - start;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_msgs = 1000, loops = 10;
+	struct event_queue *ucq_evq, *ceq_evq;
+	struct ceq *ceq;
+	struct syscall *syscs;
+	struct fd_tap_req tap_req = {0};
+	int *efds;
+	uint64_t ucq_single = 0, ucq_batch = 0, ceq_single = 0, ceq_batch = 0;
+
+	if (argc > 1)
+		nr_msgs = atoi(argv[1]);
+	if (argc > 2)
+		loops = atoi(argv[2]);
+
+	ucq_evq = get_eventq(EV_MBOX_UCQ);
+	ucq_evq->ev_flags = 0;
+	syscs = malloc(sizeof(struct syscall) * nr_msgs);
+
+	ceq_evq = get_eventq_raw();
+	ceq_evq->ev_mbox->type = EV_MBOX_CEQ;
+	ceq = &ceq_evq->ev_mbox->ceq;
+	ceq_init(ceq, CEQ_OR, nr_msgs, ROUNDUPPWR2(nr_msgs));
+	ceq_evq->ev_flags = 0;
+	efds = malloc(sizeof(int) * nr_msgs);
+	for (int i = 0; i < nr_msgs; i++) {
+		efds[i] = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+		if (efds[i] < 0) {
+			perror("eventfd");
+			exit(-1);
+		}
+		tap_req.fd = efds[i];
+		tap_req.cmd = FDTAP_CMD_ADD;
+		tap_req.filter = FDTAP_FILT_READABLE;
+		tap_req.ev_q = ceq_evq;
+		tap_req.ev_id = i;
+		if (sys_tap_fds(&tap_req, 1) != 1) {
+			perror("tap");
+			exit(-1);
+		}
+	}
+
+	for (int i = 0; i < loops; i++) {
+		fill_ucq(ucq_evq, syscs, nr_msgs);
+		ucq_single += drain_ucq(&ucq_evq->ev_mbox->ucq, nr_msgs, FALSE);
+		fill_ucq(ucq_evq, syscs, nr_msgs);
+		ucq_batch += drain_ucq(&ucq_evq->ev_mbox->ucq, nr_msgs, TRUE);
+		fill_ceq(efds, nr_msgs);
+		ceq_single += drain_ceq(ceq, nr_msgs, FALSE);
+		fill_ceq(efds, nr_msgs);
+		ceq_batch += drain_ceq(ceq, nr_msgs, TRUE);
+	}
+	printf("%d msgs x %d loops, nsec per msg:\n", nr_msgs, loops);
+	printf("\tUCQ single: %llu, batch: %llu\n",
+	       tsc2nsec(ucq_single) / (nr_msgs * loops),
+	       tsc2nsec(ucq_batch) / (nr_msgs * loops));
+	printf("\tCEQ single: %llu, batch: %llu\n",
+	       tsc2nsec(ceq_single) / (nr_msgs * loops),
+	       tsc2nsec(ceq_batch) / (nr_msgs * loops));
+	for (int i = 0; i < nr_msgs; i++)
+		close(efds[i]);
+	free(efds);
+	free(syscs);
+	return 0;
+}
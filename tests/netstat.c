@@ -17,6 +17,7 @@
 #include <signal.h>
 #include <iplib/iplib.h>
 #include <dirent.h>
+#include <ros/conv_info.h>
 
 enum {
 	maxproto = 20,
@@ -24,16 +25,18 @@ enum {
 void pip(char *, struct dirent *);
 void nstat(char *, void (*)(char *, struct dirent *));
 void pipifc(void);
+void pinfo(char *, char *);
 
 FILE *out;
 char *netroot;
 char *proto[maxproto];
 int nproto;
 int notrans;
+int showinfo;
 
 void usage(char *argv0)
 {
-	fprintf(stderr, "usage: %s [-in] [-p proto] [network-dir]\n", argv0);
+	fprintf(stderr, "usage: %s [-int] [-p proto] [network-dir]\n", argv0);
 	fprintf(stderr, "usage");
 	exit(1);
 }
@@ -55,6 +58,9 @@ void main(int argc, char *argv[])
 			case 'n':
 				notrans = 1;
 				break;
+			case 't':
+				showinfo = 1;
+				break;
 			case 'p':
 				if (nproto >= maxproto){
 					fprintf(stderr, "too many protos");
@@ -213,15 +219,45 @@ void pip(char *net, struct dirent *db)
 
 	if (notrans) {
 		fprintf(out, "%-10s %s\n", getport(net, p), buf);
+		pinfo(net, db->d_name);
 		return;
 	}
 	dname = NULL;	//csgetvalue(netroot, "ip", buf, "dom", nil);
 	if (dname == NULL) {
 		fprintf(out, "%-10s %s\n", getport(net, p), buf);
+		pinfo(net, db->d_name);
 		return;
 	}
 	fprintf(out, "%-10s %s\n", getport(net, p), dname);
 	free(dname);
+	pinfo(net, db->d_name);
+}
+
+/* With -t, prints the queue and TCP numbers from the conversation's info. */
+void pinfo(char *net, char *conv)
+{
+	struct conv_info info;
+	char buf[128];
+	int n, fd;
+
+	if (!showinfo)
+		return;
+	snprintf(buf, sizeof buf, "%s/%s/%s/info", netroot, net, conv);
+	fd = open(buf, O_RDONLY);
+	if (fd < 0)
+		return;
+	n = read(fd, &info, sizeof(info));
+	close(fd);
+	if (n < sizeof(info) || info.version != CONV_INFO_VERSION)
+		return;
+	fprintf(out, "\trq %u/%u wq %u/%u", info.rq_len,
+	        info.rq_len + info.rq_window, info.wq_len,
+	        info.wq_len + info.wq_window);
+	if (!strcmp(net, "tcp"))
+		fprintf(out, " srtt %uus rttvar %uus rto %ums cwnd %u inflight %u"
+		        " retrans %u", info.srtt_us, info.rttvar_us, info.rto_ms,
+		        info.cwnd, info.bytes_in_flight, info.retransmits);
+	fprintf(out, "\n");
 }
 
 void pipifc(void)
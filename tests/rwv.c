@@ -0,0 +1,114 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Vectored I/O test: rwv [FILE]
+ *
+ * writev/readv across a pipe, which takes the write as one block, and
+ * pwritev/preadv on FILE (default /tmp/rwv_test). */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <parlib/parlib.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+static char hdr[] = "header:";
+static char body[] = "the body of the message";
+static char tail[] = ":tail";
+
+static void fill_iov(struct iovec *iov)
+{
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = strlen(hdr);
+	iov[1].iov_base = body;
+	iov[1].iov_len = strlen(body);
+	/* Empty iovecs are allowed */
+	iov[2].iov_base = NULL;
+	iov[2].iov_len = 0;
+	iov[3].iov_base = tail;
+	iov[3].iov_len = strlen(tail);
+}
+
+static size_t total_len(void)
+{
+	return strlen(hdr) + strlen(body) + strlen(tail);
+}
+
+static void check_split(char *a, size_t a_len, char *b, size_t b_len)
+{
+	char expect[128];
+
+	snprintf(expect, sizeof(expect), "%s%s%s", hdr, body, tail);
+	assert(a_len + b_len == strlen(expect));
+	assert(!memcmp(a, expect, a_len));
+	assert(!memcmp(b, expect + a_len, b_len));
+}
+
+static void test_pipe(void)
+{
+	int pipefd[2];
+	struct iovec iov[4];
+	char a[10], b[100];
+	ssize_t ret;
+
+	if (pipe(pipefd))
+		handle_error("pipe");
+	fill_iov(iov);
+	ret = writev(pipefd[1], iov, 4);
+	if (ret != total_len())
+		handle_error("writev");
+	/* Read it back split at a different spot than it was written */
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+	ret = readv(pipefd[0], iov, 2);
+	if (ret != total_len())
+		handle_error("readv");
+	check_split(a, sizeof(a), b, ret - sizeof(a));
+	close(pipefd[0]);
+	close(pipefd[1]);
+}
+
+static void test_file(char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	struct iovec iov[4];
+	char a[5], b[100];
+	ssize_t ret;
+
+	if (fd < 0)
+		handle_error("open");
+	fill_iov(iov);
+	ret = pwritev(fd, iov, 4, 100);
+	if (ret != total_len())
+		handle_error("pwritev");
+	/* pwritev didn't move the offset */
+	assert(lseek(fd, 0, SEEK_CUR) == 0);
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+	/* Short read, we asked for more than the file has */
+	ret = preadv(fd, iov, 2, 100);
+	if (ret != total_len())
+		handle_error("preadv");
+	check_split(a, sizeof(a), b, ret - sizeof(a));
+	/* Bad iovcnt */
+	assert(readv(fd, iov, -1) == -1);
+	close(fd);
+	unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+	test_pipe();
+	test_file(argc > 1 ? argv[1] : "/tmp/rwv_test");
+	printf("Passed\n");
+	return 0;
+}
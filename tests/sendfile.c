@@ -0,0 +1,91 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * sendfile test: sendfile [FILE]
+ *
+ * Sends FILE (default /tmp/sendfile_test) into a pipe, with and without an
+ * offset, and pipe to pipe. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <parlib/parlib.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+static char msg[] = "sendfile moves this without a trip through userspace";
+
+static void check_pipe(int fd, char *expect, size_t len)
+{
+	char buf[128];
+
+	assert(len < sizeof(buf));
+	if (read(fd, buf, sizeof(buf)) != len)
+		handle_error("read");
+	assert(!memcmp(buf, expect, len));
+}
+
+static void test_file(char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	int pipefd[2];
+	off_t off = 9;
+	ssize_t ret;
+
+	if (fd < 0)
+		handle_error("open");
+	if (write(fd, msg, strlen(msg)) != strlen(msg))
+		handle_error("write");
+	if (pipe(pipefd))
+		handle_error("pipe");
+	/* With an offset: the file position stays at the end */
+	ret = sendfile(pipefd[1], fd, &off, 5);
+	if (ret != 5)
+		handle_error("sendfile off");
+	assert(off == 14);
+	check_pipe(pipefd[0], msg + 9, 5);
+	assert(lseek(fd, 0, SEEK_CUR) == strlen(msg));
+	/* From the file position, asking for more than there is */
+	lseek(fd, 0, SEEK_SET);
+	ret = sendfile(pipefd[1], fd, NULL, 4096);
+	if (ret != strlen(msg))
+		handle_error("sendfile");
+	check_pipe(pipefd[0], msg, strlen(msg));
+	assert(lseek(fd, 0, SEEK_CUR) == strlen(msg));
+	/* At EOF */
+	assert(sendfile(pipefd[1], fd, NULL, 4096) == 0);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(fd);
+	unlink(path);
+}
+
+static void test_pipe(void)
+{
+	int a[2], b[2];
+
+	if (pipe(a) || pipe(b))
+		handle_error("pipe");
+	if (write(a[1], msg, strlen(msg)) != strlen(msg))
+		handle_error("write");
+	/* Pipe reads are short: we get what was there without blocking */
+	if (sendfile(b[1], a[0], NULL, 4096) != strlen(msg))
+		handle_error("sendfile pipe");
+	check_pipe(b[0], msg, strlen(msg));
+	close(a[0]);
+	close(a[1]);
+	close(b[0]);
+	close(b[1]);
+}
+
+int main(int argc, char **argv)
+{
+	test_file(argc > 1 ? argv[1] : "/tmp/sendfile_test");
+	test_pipe();
+	printf("Passed\n");
+	return 0;
+}
@@ -1,9 +1,13 @@
 /* Copyright (c) 2016 Google Inc., All Rights Reserved.
  * Ron Minnich <rminnich@google.com>
- * See LICENSE for details. */
+ * See LICENSE for details.
+ *
+ * The kernel gives us binary systrace_records (ros/systrace.h); we decode them
+ * into text here, off the traced process's cores. */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <parlib/parlib.h>
 #include <unistd.h>
 #include <signal.h>
@@ -18,29 +22,145 @@
 #include <benchutil/alarm.h>
 #include <ndblib/ndb.h>
 #include <fcntl.h>
+#include <ros/systrace.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 
+static const char *sysc_names[] = SYSTRACE_SYSC_NAMES;
+
 void usage(void)
 {
-	fprintf(stderr, "usage: strace command [args...]\n");
+	fprintf(stderr,
+	        "usage: strace [-e SYSC,...] [-p PID,...] command [args...]\n"
+	        "\t-e: only trace these syscalls (names or numbers)\n"
+	        "\t-p: only trace these pids (command and its children)\n");
 	exit(1);
 }
 
+static const char *sysc_name(uint64_t num)
+{
+	if (num >= COUNT_OF(sysc_names) || !sysc_names[num])
+		return "unknown";
+	return sysc_names[num];
+}
+
+/* Returns the number of the syscall called name (or numbered name), or -1. */
+static int sysc_num(const char *name)
+{
+	if (isdigit(name[0]))
+		return atoi(name);
+	for (int i = 0; i < COUNT_OF(sysc_names); i++) {
+		if (sysc_names[i] && !strcmp(sysc_names[i], name))
+			return i;
+	}
+	return -1;
+}
+
+/* Turns a list like "read,write" into a ctl message like "stracesysc 100 101".
+ * Returns 0 on success. */
+static int build_sysc_filter(char *list, char *msg, size_t msg_sz)
+{
+	char *tok, *save;
+	size_t len;
+	int num;
+
+	len = snprintf(msg, msg_sz, "stracesysc");
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		num = sysc_num(tok);
+		if (num < 0) {
+			fprintf(stderr, "Unknown syscall %s\n", tok);
+			return -1;
+		}
+		len += snprintf(msg + len, msg_sz - len, " %d", num);
+	}
+	return 0;
+}
+
+static int write_ctl(int fd, char *msg)
+{
+	if (write(fd, msg, strlen(msg)) < strlen(msg)) {
+		fprintf(stderr, "write to ctl %s %d: %r\n", msg, fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void print_data(FILE *f, struct systrace_record *t)
+{
+	fputc('\'', f);
+	for (int i = 0; i < t->datalen; i++) {
+		if (isprint(t->data[i]))
+			fputc(t->data[i], f);
+		else
+			fprintf(f, "\\%03o", t->data[i]);
+	}
+	fputc('\'', f);
+}
+
+/* Same format the kernel's loud systrace prints */
+static void print_record(FILE *f, struct systrace_record *t)
+{
+	uint64_t start = tsc2nsec(t->start_timestamp);
+	uint64_t end = t->end_timestamp ? tsc2nsec(t->end_timestamp) : 0;
+
+	if (t->type == SYSTR_MARKER) {
+		fprintf(f, "M [%7d.%09d] proc: %d core: %d data: ",
+		        (int)(start / 1000000000), (int)(start % 1000000000), t->pid,
+		        t->coreid);
+		print_data(f, t);
+		fputc('\n', f);
+		return;
+	}
+	fprintf(f, "%c [%7d.%09d]-[%7d.%09d] Syscall %3d (%12s):(0x%llx, 0x%llx, "
+	        "0x%llx, 0x%llx, 0x%llx, 0x%llx) ret: ",
+	        t->type == SYSTR_ENTRY ? 'E' : 'X',
+	        (int)(start / 1000000000), (int)(start % 1000000000),
+	        (int)(end / 1000000000), (int)(end % 1000000000),
+	        (int)t->syscallno, sysc_name(t->syscallno), t->arg0, t->arg1,
+	        t->arg2, t->arg3, t->arg4, t->arg5);
+	if (t->type == SYSTR_ENTRY)
+		fprintf(f, "---");
+	else
+		fprintf(f, "0x%llx", t->retval);
+	fprintf(f, " proc: %d core: %d vcore: %d data: ", t->pid, t->coreid,
+	        t->vcoreid);
+	print_data(f, t);
+	fputc('\n', f);
+}
+
 void main(int argc, char **argv, char **envp)
 {
 	int fd;
 	int pid;
 	int amt;
+	int opt;
+	char *sysc_list = NULL;
+	char *pid_list = NULL;
 	static char p[2 * MAX_PATH_LEN];
-	static char buf[16384];
+	static struct systrace_record traces[64];
 	struct syscall sysc;
 
-	if (argc < 2)
+	/* + stops at the first non-option, which is the command */
+	while ((opt = getopt(argc, argv, "+e:p:")) != -1) {
+		switch (opt) {
+		case 'e':
+			sysc_list = optarg;
+			break;
+		case 'p':
+			pid_list = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
 		usage();
 
-	pid = create_child_with_stdfds(argv[1], argc - 1, argv + 1, envp);
+	pid = create_child_with_stdfds(argv[0], argc, argv, envp);
 	if (pid < 0) {
 		perror("proc_create");
 		exit(-1);
@@ -57,10 +177,20 @@ void main(int argc, char **argv, char **envp)
 		exit(1);
 	}
 
-	snprintf(p, sizeof(p), "straceall");
-	if (write(fd, p, strlen(p)) < strlen(p)) {
-		fprintf(stderr, "write to ctl %s %d: %r\n", p, fd);
+	if (write_ctl(fd, "straceall"))
 		exit(1);
+	if (sysc_list) {
+		if (build_sysc_filter(sysc_list, p, sizeof(p)) || write_ctl(fd, p))
+			exit(1);
+	}
+	if (pid_list) {
+		snprintf(p, sizeof(p), "stracepid %s", pid_list);
+		for (char *c = p; *c; c++) {
+			if (*c == ',')
+				*c = ' ';
+		}
+		if (write_ctl(fd, p))
+			exit(1);
 	}
 	close(fd);
 
@@ -75,11 +205,9 @@ void main(int argc, char **argv, char **envp)
 	 * great that the process doesn't immediately start when you make it? */
 	sys_proc_run(pid);
 
-	while ((amt = read(fd, buf, sizeof(buf))) > 0) {
-		if (write(fileno(stderr), buf, amt) < amt) {
-			fprintf(stderr, "Write to stdout: %r\n");
-			exit(1);
-		}
+	while ((amt = read(fd, traces, sizeof(traces))) > 0) {
+		for (int i = 0; i < amt / sizeof(struct systrace_record); i++)
+			print_record(stderr, &traces[i]);
 	}
 	fprintf(stderr, "strace of PID %d: %r\n", pid);
 }
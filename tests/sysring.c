@@ -0,0 +1,72 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Basic test for syscall rings: sysring [-p] [NR_SYSCS]
+ *
+ * Writes NR_SYSCS small buffers to /dev/null through a syscall ring, one trap
+ * per batch (or no traps with -p, which needs CONFIG_SYSRING_POLLERS), and
+ * spins on SC_DONE for all of them. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <parlib/parlib.h>
+#include <parlib/sysring.h>
+#include <parlib/timing.h>
+
+#define BATCH_SZ 64
+
+int main(int argc, char **argv)
+{
+	struct sysring *ring;
+	struct syscall *syscs;
+	int flags = 0, nr_syscs = 4096, fd, submitted = 0;
+	uint64_t start;
+	char buf[16] = "hello, sysring\n";
+
+	if ((argc > 1) && !strcmp(argv[1], "-p")) {
+		flags |= SYSRING_SQPOLL;
+		argc--;
+		argv++;
+	}
+	if (argc > 1)
+		nr_syscs = atoi(argv[1]);
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		perror("open /dev/null");
+		exit(-1);
+	}
+	ring = sysring_create(BATCH_SZ, 0, flags);
+	if (!ring) {
+		perror("sysring_create");
+		exit(-1);
+	}
+	syscs = calloc(nr_syscs, sizeof(struct syscall));
+	start = read_tsc();
+	while (submitted < nr_syscs) {
+		while ((submitted < nr_syscs) &&
+		       sysring_submit(ring, &syscs[submitted], SYS_write, fd, buf,
+		                      sizeof(buf)))
+			submitted++;
+		if (sysring_flush(ring) < 0) {
+			perror("sysring_flush");
+			exit(-1);
+		}
+		cpu_relax();
+	}
+	for (int i = 0; i < nr_syscs; i++) {
+		while (!(atomic_read(&syscs[i].flags) & SC_DONE))
+			cpu_relax();
+		if (syscs[i].retval != sizeof(buf)) {
+			printf("Syscall %d failed: ret %ld, err %d\n", i,
+			       syscs[i].retval, syscs[i].err);
+			exit(-1);
+		}
+	}
+	printf("%d writes in %llu usec\n", nr_syscs, tsc2usec(read_tsc() - start));
+	free(syscs);
+	close(fd);
+	return 0;
+}
@@ -1,4 +1,4 @@
-/* Advise system about intentions for a memory region.  Stub version.
+/* Advise system about intentions for a memory region.
    Copyright (C) 1994-2014 Free Software Foundation, Inc.
    This file is part of the GNU C Library.
 
@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <ros/syscall.h>
 
 /* Advise the system about particular usage patterns the program follows
    for the region starting at ADDR and extending LEN bytes.  */
@@ -26,8 +27,7 @@
 int
 __madvise (void *addr, size_t len, int advice)
 {
-  // simply ignore any advice we're given
-  return 0;
+  return ros_syscall(SYS_madvise, addr, len, advice, 0, 0, 0);
 }
 libc_hidden_def (__madvise)
 weak_alias (__madvise, madvise)
@@ -0,0 +1,29 @@
+/* Write data from multiple buffers at an offset.
+   Copyright (C) 1991-2014 Free Software Foundation, Inc.
+   This file is part of the GNU C Library.
+
+   The GNU C Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The GNU C Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the GNU C Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include <sys/uio.h>
+#include <ros/syscall.h>
+
+/* Write data at OFFSET in FD, from the buffers described by VECTOR, which
+   is a vector of COUNT 'struct iovec's.  The file position is not
+   changed.  */
+ssize_t
+pwritev (int fd, const struct iovec *vector, int count, off_t offset)
+{
+  return ros_syscall(SYS_pwritev, fd, vector, count, offset, 0, 0);
+}
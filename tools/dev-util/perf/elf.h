@@ -1,8 +1,31 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define BUILD_ID_SIZE   20
 
+struct elf_func_sym {
+	uint64_t addr;
+	uint64_t size;
+	char *name;
+};
+
+/* A PT_LOAD segment, for turning file offsets into symbol addresses */
+struct elf_load_seg {
+	uint64_t offset;
+	uint64_t vaddr;
+	uint64_t filesz;
+};
+
+struct elf_func_syms {
+	struct elf_func_sym *syms;		/* sorted by addr */
+	size_t nr_syms;
+	struct elf_load_seg *segs;
+	size_t nr_segs;
+};
+
 int filename__read_build_id(const char *filename, void *bf, size_t size);
+int filename__read_func_syms(const char *filename, struct elf_func_syms *fs);
+void elf_func_syms__free(struct elf_func_syms *fs);
 void symbol__elf_init(void);
@@ -17,12 +17,14 @@
 #include <errno.h>
 #include <argp.h>
 #include <time.h>
+#include <signal.h>
 #include <parlib/parlib.h>
 #include <parlib/timing.h>
 #include "xlib.h"
 #include "akaros.h"
 #include "perfconv.h"
 #include "perf_core.h"
+#include "perf_top.h"
 
 /* Helpers */
 static void run_process_and_wait(int argc, char *argv[],
@@ -49,8 +51,14 @@ struct perf_opts {
 	bool						verbose;
 	bool						sampling;
 	bool						stat_bignum;
+	pid_t						stat_pid;
 	bool						record_quiet;
+	bool						record_offcpu;
 	unsigned long				record_period;
+	unsigned int				top_delay;
+	int							top_entries;
+	int							top_iterations;
+	const char					*top_vmlinux;
 };
 static struct perf_opts opts;
 
@@ -65,6 +73,7 @@ static int perf_help(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_list(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_record(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[]);
+static int perf_top(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_pmu_caps(struct perf_cmd *cmd, int argc, char *argv[]);
 
 static struct perf_cmd perf_cmds[] = {
@@ -88,6 +97,11 @@ static struct perf_cmd perf_cmds[] = {
 	  .opts = 0,
 	  .func = perf_stat,
 	},
+	{ .name = "top",
+	  .desc = "Live view of the functions with the most samples",
+	  .opts = 0,
+	  .func = perf_top,
+	},
 	{ .name = "pmu_caps",
 	  .desc = "Shows PMU capabilities",
 	  .opts = "",
@@ -251,7 +265,10 @@ static void submit_events(struct perf_opts *opts)
 		sel = perf_parse_event(tok);
 		PMEV_SET_INTEN(sel->ev.event, opts->sampling);
 		sel->ev.trigger_count = opts->record_period;
-		perf_context_event_submit(pctx, &opts->cores, sel);
+		if (opts->stat_pid)
+			perf_context_proc_event_submit(pctx, opts->stat_pid, sel);
+		else
+			perf_context_event_submit(pctx, &opts->cores, sel);
 	}
 	free(dup_evts);
 }
@@ -264,6 +281,7 @@ static struct argp_option record_opts[] = {
 	{"freq", 'F', "FREQUENCY", 0, "Sampling frequency (assumes cycles)"},
 	{"call-graph", 'g', 0, 0, "Backtrace recording (always on!)"},
 	{"quiet", 'q', 0, 0, "No printing to stdio"},
+	{"off-cpu", 'O', 0, 0, "Also record where threads block, and for how long"},
 	{ 0 }
 };
 
@@ -304,6 +322,9 @@ static error_t parse_record_opt(int key, char *arg, struct argp_state *state)
 	case 'q':
 		p_opts->record_quiet = TRUE;
 		break;
+	case 'O':
+		p_opts->record_offcpu = TRUE;
+		break;
 	case ARGP_KEY_END:
 		if (!p_opts->events)
 			p_opts->events = "cycles";
@@ -329,9 +350,13 @@ static int perf_record(struct perf_cmd *cmd, int argc, char *argv[])
 	/* Once a perf event is submitted, it'll start counting and firing the IRQ.
 	 * However, we can control whether or not the samples are collected. */
 	submit_events(&opts);
+	if (opts.record_offcpu)
+		perf_start_offcpu(pctx, perf_offcpu_eventsel());
 	perf_start_sampling(pctx);
 	run_process_and_wait(opts.cmd_argc, opts.cmd_argv, &opts.cores);
 	perf_stop_sampling(pctx);
+	if (opts.record_offcpu)
+		perf_stop_offcpu(pctx);
 	if (opts.verbose)
 		perf_context_show_events(pctx, stdout);
 	/* The events are still counting and firing IRQs.  Let's be nice and turn
@@ -349,6 +374,8 @@ static int perf_record(struct perf_cmd *cmd, int argc, char *argv[])
 static struct argp_option stat_opts[] = {
 	{"big-num", 'B', 0, 0, "Formatting option"},
 	{"output", 'o', "FILE", 0, "Print output to file (default stdout)"},
+	{"pid", 'p', "PID", 0,
+	 "Count only PID, on whichever cores it runs, while COMMAND runs"},
 	{ 0 }
 };
 
@@ -363,6 +390,11 @@ static error_t parse_stat_opt(int key, char *arg, struct argp_state *state)
 	case 'o':
 		p_opts->outfile = xfopen(arg, "w");
 		break;
+	case 'p':
+		p_opts->stat_pid = atoi(arg);
+		if (p_opts->stat_pid <= 0)
+			argp_error(state, "Bad PID %s", arg);
+		break;
 	case ARGP_KEY_END:
 		if (!p_opts->events)
 			p_opts->events = "cache-misses,cache-references,"
@@ -516,9 +548,15 @@ static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[])
 	subtract_timespecs(&diff, &end, &start);
 	stat_vals = collect_stats(pctx, &diff);
 	perf_stop_events(pctx);
-	cmd_string = cmd_as_str(opts.cmd_argc, opts.cmd_argv);
-	fprintf(out, "\nPerformance counter stats for '%s':\n\n", cmd_string);
-	free(cmd_string);
+	if (opts.stat_pid) {
+		fprintf(out, "\nPerformance counter stats for process id '%d':\n\n",
+		        opts.stat_pid);
+	} else {
+		cmd_string = cmd_as_str(opts.cmd_argc, opts.cmd_argv);
+		fprintf(out, "\nPerformance counter stats for '%s':\n\n",
+		        cmd_string);
+		free(cmd_string);
+	}
 	for (int i = 0; i < pctx->event_count; i++)
 		stat_print_val(out, &stat_vals[i], stat_vals, pctx->event_count + 1);
 	fprintf(out, "\n%8llu.%09llu seconds time elapsed\n\n", diff.tv_sec,
@@ -528,6 +566,116 @@ static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[])
 	return 0;
 }
 
+/**************************** perf top  ************************/
+
+static struct argp_option top_opts[] = {
+	{"event", 'e', "EVENT", 0, "Event string, e.g. cycles:u:k"},
+	{"cores", 'C', "CORE_LIST", 0, "Only sample these cores, e.g. 0.2.4:8-19"},
+	{"cpu", 'C', 0, OPTION_ALIAS},
+	{"count", 'c', "PERIOD", 0, "Sampling period"},
+	{"freq", 'F', "FREQUENCY", 0, "Sampling frequency (assumes cycles)"},
+	{"delay", 'd', "SECS", 0, "Seconds between refreshes (default 1)"},
+	{"entries", 'n', "N", 0, "Number of functions to show (default 20)"},
+	{"iterations", 'i', "N", 0, "Exit after N refreshes (default: until ^C)"},
+	{"vmlinux", 'k', "FILE", 0, "Kernel ELF, for kernel symbols"},
+	{ 0 }
+};
+
+static error_t parse_top_opt(int key, char *arg, struct argp_state *state)
+{
+	struct perf_opts *p_opts = state->input;
+
+	switch (key) {
+	case 'e':
+		p_opts->events = arg;
+		break;
+	case 'C':
+		ros_parse_cores(arg, &p_opts->cores);
+		p_opts->got_cores = TRUE;
+		break;
+	case 'c':
+		if (p_opts->record_period)
+			argp_error(state, "Period set.  Only use at most one of -c -F");
+		p_opts->record_period = atol(arg);
+		break;
+	case 'F':
+		if (p_opts->record_period)
+			argp_error(state, "Period set.  Only use at most one of -c -F");
+		p_opts->record_period = freq_to_period(atol(arg));
+		break;
+	case 'd':
+		p_opts->top_delay = atoi(arg);
+		if (!p_opts->top_delay)
+			argp_error(state, "Bad delay %s", arg);
+		break;
+	case 'n':
+		p_opts->top_entries = atoi(arg);
+		break;
+	case 'i':
+		p_opts->top_iterations = atoi(arg);
+		break;
+	case 'k':
+		p_opts->top_vmlinux = arg;
+		break;
+	case ARGP_KEY_ARG:
+		argp_usage(state);
+		break;
+	case ARGP_KEY_END:
+		if (!p_opts->events)
+			p_opts->events = "cycles";
+		if (!p_opts->got_cores)
+			ros_get_all_cores_set(&p_opts->cores);
+		if (!p_opts->record_period)
+			p_opts->record_period = freq_to_period(1000);
+		if (!p_opts->top_delay)
+			p_opts->top_delay = 1;
+		if (!p_opts->top_entries)
+			p_opts->top_entries = 20;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static volatile bool top_stop;
+
+static void top_sigint(int sig)
+{
+	top_stop = TRUE;
+}
+
+static int perf_top(struct perf_cmd *cmd, int argc, char *argv[])
+{
+	struct argp argp_top = {top_opts, parse_top_opt, 0, cmd->desc};
+	struct perf_top *top;
+	int kpdata_fd;
+
+	argv[0] = "perf top";
+	argp_parse(&argp_top, argc, argv, 0, 0, &opts);
+	opts.sampling = TRUE;
+
+	top = perf_top_create(&opts.cores, opts.top_vmlinux);
+	submit_events(&opts);
+	/* Opens kpctl, which sets up kpdata and fills it with the current mmaps */
+	perf_start_sampling(pctx);
+	kpdata_fd = xopen(perf_cfg.kpdata_file, O_RDONLY, 0);
+	signal(SIGINT, top_sigint);
+	for (int i = 0; !opts.top_iterations || i < opts.top_iterations; i++) {
+		sleep(opts.top_delay);
+		if (top_stop)
+			break;
+		perf_flush_sampling(pctx);
+		perf_top_read(top, kpdata_fd);
+		perf_top_show(top, stdout, opts.top_entries);
+	}
+	perf_stop_sampling(pctx);
+	perf_stop_events(pctx);
+	close(kpdata_fd);
+	perf_top_free(top);
+	return 0;
+}
+
 static void run_process_and_wait(int argc, char *argv[],
 								 const struct core_set *cores)
 {
@@ -461,6 +461,29 @@ static int perf_open_event(int perf_fd, const struct core_set *cores,
 	return (int) ped;
 }
 
+static int perf_open_proc_event(int perf_fd, pid_t pid,
+                                const struct perf_eventsel *sel)
+{
+	uint8_t cmdbuf[1 + 4 * sizeof(uint64_t) + sizeof(uint32_t)];
+	uint8_t *wptr = cmdbuf;
+	const uint8_t *rptr = cmdbuf;
+	uint32_t ped;
+
+	*wptr++ = PERFMON_CMD_PROC_COUNTER_OPEN;
+	wptr = put_le_u64(wptr, sel->ev.event);
+	wptr = put_le_u64(wptr, sel->ev.flags);
+	wptr = put_le_u64(wptr, sel->ev.trigger_count);
+	wptr = put_le_u64(wptr, sel->ev.user_data);
+	wptr = put_le_u32(wptr, pid);
+
+	xpwrite(perf_fd, cmdbuf, wptr - cmdbuf, 0);
+	xpread(perf_fd, cmdbuf, sizeof(uint32_t), 0);
+
+	rptr = get_le_u32(rptr, &ped);
+
+	return (int) ped;
+}
+
 static uint64_t *perf_get_event_values(int perf_fd, int ped, size_t *pnvalues)
 {
 	ssize_t rsize;
@@ -499,7 +522,8 @@ static uint64_t *perf_get_event_values(int perf_fd, int ped, size_t *pnvalues)
 	return values;
 }
 
-/* Helper, returns the total count (across all cores) of the event @idx */
+/* Helper, returns the total count (across all cores, or all vcores for
+ * per-process events) of the event @idx */
 uint64_t perf_get_event_count(struct perf_context *pctx, unsigned int idx)
 {
 	uint64_t total = 0;
@@ -569,6 +593,28 @@ void perf_context_event_submit(struct perf_context *pctx,
 	}
 }
 
+/* Submits an event that only counts while process @pid runs, wherever it runs.
+ * These events can't sample. */
+void perf_context_proc_event_submit(struct perf_context *pctx, pid_t pid,
+                                    const struct perf_eventsel *sel)
+{
+	struct perf_event *pevt = pctx->events + pctx->event_count;
+
+	if (pctx->event_count >= COUNT_OF(pctx->events)) {
+		fprintf(stderr, "Too many open events: %d\n", pctx->event_count);
+		exit(1);
+	}
+	pctx->event_count++;
+	memset(&pevt->cores, 0, sizeof(pevt->cores));
+	pevt->sel = *sel;
+	pevt->ped = perf_open_proc_event(pctx->perf_fd, pid, sel);
+	if (pevt->ped < 0) {
+		fprintf(stderr, "Unable to submit event \"%s\" for PID %d: %s\n",
+		        sel->fq_str, pid, errstr());
+		exit(1);
+	}
+}
+
 void perf_stop_events(struct perf_context *pctx)
 {
 	for (int i = 0; i < pctx->event_count; i++)
@@ -597,6 +643,50 @@ void perf_stop_sampling(struct perf_context *pctx)
 	xwrite(pctx->kpctl_fd, disable_str, strlen(disable_str));
 }
 
+/* Pushes the samples buffered on each core out to kpdata, without stopping. */
+void perf_flush_sampling(struct perf_context *pctx)
+{
+	static const char * const flush_str = "flush";
+
+	ensure_kpctl_is_open(pctx);
+	xwrite(pctx->kpctl_fd, flush_str, strlen(flush_str));
+}
+
+/* Off-CPU samples aren't from a PMU event.  The kernel tags them with our
+ * user_data, like any other sample, and we report them as a software event
+ * whose period is the time spent blocked, in nsec. */
+struct perf_eventsel *perf_offcpu_eventsel(void)
+{
+	struct perf_eventsel *sel = xzmalloc(sizeof(struct perf_eventsel));
+
+	sel->ev.user_data = (uint64_t)sel;
+	sel->ev.trigger_count = 1;
+	PMEV_SET_OS(sel->ev.event, 1);
+	PMEV_SET_USR(sel->ev.event, 1);
+	sel->type = PERF_TYPE_SOFTWARE;
+	sel->config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+	strlcpy(sel->fq_str, "offcpu", MAX_FQSTR_SZ);
+	return sel;
+}
+
+void perf_start_offcpu(struct perf_context *pctx,
+                       const struct perf_eventsel *sel)
+{
+	char cmd[64];
+
+	ensure_kpctl_is_open(pctx);
+	snprintf(cmd, sizeof(cmd), "prof_offcpu %llu", sel->ev.user_data);
+	xwrite(pctx->kpctl_fd, cmd, strlen(cmd));
+}
+
+void perf_stop_offcpu(struct perf_context *pctx)
+{
+	static const char * const disable_str = "prof_offcpu off";
+
+	ensure_kpctl_is_open(pctx);
+	xwrite(pctx->kpctl_fd, disable_str, strlen(disable_str));
+}
+
 void perf_context_show_events(struct perf_context *pctx, FILE *file)
 {
 	struct perf_eventsel *sel;
@@ -64,9 +64,16 @@ void perf_free_context(struct perf_context *pctx);
 void perf_context_event_submit(struct perf_context *pctx,
 							   const struct core_set *cores,
 							   const struct perf_eventsel *sel);
+void perf_context_proc_event_submit(struct perf_context *pctx, pid_t pid,
+                                    const struct perf_eventsel *sel);
 void perf_stop_events(struct perf_context *pctx);
 void perf_start_sampling(struct perf_context *pctx);
 void perf_stop_sampling(struct perf_context *pctx);
+void perf_flush_sampling(struct perf_context *pctx);
+struct perf_eventsel *perf_offcpu_eventsel(void);
+void perf_start_offcpu(struct perf_context *pctx,
+                       const struct perf_eventsel *sel);
+void perf_stop_offcpu(struct perf_context *pctx);
 uint64_t perf_get_event_count(struct perf_context *pctx, unsigned int idx);
 void perf_context_show_events(struct perf_context *pctx, FILE *file);
 void perf_show_events(const char *rx, FILE *file);
@@ -312,6 +312,27 @@ enum perf_hw_id {
 	PERF_COUNT_HW_MAX,						/* non-ABI */
 };
 
+/*
+ * Special "software" events provided by the kernel, even if the hardware
+ * does not support performance events. These events measure various
+ * physical and sw events of the kernel (and allow the profiling of them as
+ * well):
+ */
+enum perf_sw_ids {
+	PERF_COUNT_SW_CPU_CLOCK					= 0,
+	PERF_COUNT_SW_TASK_CLOCK				= 1,
+	PERF_COUNT_SW_PAGE_FAULTS				= 2,
+	PERF_COUNT_SW_CONTEXT_SWITCHES			= 3,
+	PERF_COUNT_SW_CPU_MIGRATIONS			= 4,
+	PERF_COUNT_SW_PAGE_FAULTS_MIN			= 5,
+	PERF_COUNT_SW_PAGE_FAULTS_MAJ			= 6,
+	PERF_COUNT_SW_ALIGNMENT_FAULTS			= 7,
+	PERF_COUNT_SW_EMULATION_FAULTS			= 8,
+	PERF_COUNT_SW_DUMMY						= 9,
+
+	PERF_COUNT_SW_MAX,						/* non-ABI */
+};
+
 /* We can output a bunch of different versions of perf_event_attr.  The oldest
  * Linux perf I've run across expects version 3 and can't handle anything
  * larger.  Since we're not using anything from versions 1 or higher, we can sit
@@ -573,6 +594,7 @@ struct perf_record_sample {
 	uint64_t time;
 	uint64_t addr;
 	uint32_t cpu, res;
+	uint64_t period;
 	uint64_t nr;
 	uint64_t ips[0];
 } __attribute__((packed));
@@ -0,0 +1,409 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Live "perf top".
+ *
+ * Samples are read from kpdata as they come in, instead of all at once after
+ * the profiler stops.  kpdata is a queue, and a read of more than what's in it
+ * blocks, so we only read what stat says is there (after a kpctl flush).  Those
+ * bytes can end in the middle of a record, so we keep the leftovers around for
+ * the next read.
+ *
+ * The kernel tells us about every executable mmap (profiler_notify_mmap()),
+ * including the ones that existed when we opened kpctl.  We keep those per
+ * process, and resolve a user PC by finding its mmap, turning it into an offset
+ * in the file, and then into an address in the ELF's symbol table.  Each file's
+ * symbols are loaded once, the first time it is mmapped.  Kernel PCs are looked
+ * up directly in the kernel ELF, if we were given one.
+ *
+ * We only look at the PC of each sample, not the rest of the backtrace. */
+
+#include <ros/common.h>
+#include <ros/profiler_records.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "xlib.h"
+#include "elf.h"
+#include "perf_top.h"
+
+#define TOP_NR_MAP_BUCKETS		256
+#define TOP_NR_ENTRY_BUCKETS	4096
+
+/* An ELF file that some process mmapped, or the kernel */
+struct top_dso {
+	struct top_dso *next;
+	char *path;
+	const char *name;
+	bool is_kernel;
+	struct elf_func_syms fs;
+};
+
+struct top_map {
+	struct top_map *next;
+	uint32_t pid;
+	uint64_t addr;
+	uint64_t size;
+	uint64_t offset;
+	struct top_dso *dso;
+};
+
+/* Samples in one function.  Without a symbol, it's samples at addr. */
+struct top_entry {
+	struct top_entry *next;
+	struct top_dso *dso;
+	const struct elf_func_sym *sym;
+	uint64_t addr;
+	uint64_t count;
+};
+
+struct perf_top {
+	struct core_set cores;
+	struct top_dso *dsos;
+	struct top_dso *kernel;
+	struct top_map *maps[TOP_NR_MAP_BUCKETS];
+	struct top_entry *entries[TOP_NR_ENTRY_BUCKETS];
+	size_t nr_entries;
+	uint64_t nr_samples;
+	char *buf;
+	size_t buf_len;
+	size_t buf_sz;
+};
+
+static struct top_dso *top_new_dso(const char *path, const char *name)
+{
+	struct top_dso *dso = xzmalloc(sizeof(struct top_dso));
+
+	dso->path = xstrdup(path);
+	dso->name = name;
+	if (!dso->name) {
+		dso->name = strrchr(dso->path, '/');
+		dso->name = dso->name ? dso->name + 1 : dso->path;
+	}
+	/* If it fails, we just won't have symbols for it */
+	filename__read_func_syms(path, &dso->fs);
+	return dso;
+}
+
+static struct top_dso *top_get_dso(struct perf_top *top, const char *path)
+{
+	struct top_dso *dso;
+
+	for (dso = top->dsos; dso; dso = dso->next) {
+		if (!strcmp(dso->path, path))
+			return dso;
+	}
+	dso = top_new_dso(path, NULL);
+	dso->next = top->dsos;
+	top->dsos = dso;
+	return dso;
+}
+
+struct perf_top *perf_top_create(const struct core_set *cores,
+                                 const char *vmlinux)
+{
+	struct perf_top *top = xzmalloc(sizeof(struct perf_top));
+
+	top->cores = *cores;
+	top->kernel = top_new_dso(vmlinux ? vmlinux : "", "[kernel]");
+	top->kernel->is_kernel = TRUE;
+	return top;
+}
+
+static void top_clear_entries(struct perf_top *top)
+{
+	struct top_entry *e, *next;
+
+	for (int i = 0; i < TOP_NR_ENTRY_BUCKETS; i++) {
+		for (e = top->entries[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+		top->entries[i] = NULL;
+	}
+	top->nr_entries = 0;
+	top->nr_samples = 0;
+}
+
+static void top_drop_maps(struct perf_top *top, uint32_t pid)
+{
+	struct top_map **pm = &top->maps[pid % TOP_NR_MAP_BUCKETS];
+	struct top_map *m;
+
+	while ((m = *pm)) {
+		if (m->pid == pid) {
+			*pm = m->next;
+			free(m);
+		} else {
+			pm = &m->next;
+		}
+	}
+}
+
+void perf_top_free(struct perf_top *top)
+{
+	struct top_dso *dso, *next;
+
+	top_clear_entries(top);
+	for (int i = 0; i < TOP_NR_MAP_BUCKETS; i++) {
+		while (top->maps[i])
+			top_drop_maps(top, top->maps[i]->pid);
+	}
+	for (dso = top->dsos; dso; dso = next) {
+		next = dso->next;
+		elf_func_syms__free(&dso->fs);
+		free(dso->path);
+		free(dso);
+	}
+	elf_func_syms__free(&top->kernel->fs);
+	free(top->kernel->path);
+	free(top->kernel);
+	free(top->buf);
+	free(top);
+}
+
+static void top_add_map(struct perf_top *top,
+                        const struct proftype_pid_mmap64 *rec)
+{
+	struct top_map *m = xzmalloc(sizeof(struct top_map));
+
+	m->pid = rec->pid;
+	m->addr = rec->addr;
+	m->size = rec->size;
+	m->offset = rec->offset;
+	m->dso = top_get_dso(top, (const char *) rec->path);
+	m->next = top->maps[m->pid % TOP_NR_MAP_BUCKETS];
+	top->maps[m->pid % TOP_NR_MAP_BUCKETS] = m;
+}
+
+static struct top_map *top_find_map(struct perf_top *top, uint32_t pid,
+                                    uint64_t pc)
+{
+	struct top_map *m;
+
+	for (m = top->maps[pid % TOP_NR_MAP_BUCKETS]; m; m = m->next) {
+		if (m->pid == pid && pc >= m->addr && pc < m->addr + m->size)
+			return m;
+	}
+	return NULL;
+}
+
+/* Turns an offset into the file into the address the symbol table uses. */
+static uint64_t top_offset_to_vaddr(const struct elf_func_syms *fs,
+                                    uint64_t off)
+{
+	const struct elf_load_seg *seg;
+
+	for (size_t i = 0; i < fs->nr_segs; i++) {
+		seg = &fs->segs[i];
+		if (off >= seg->offset && off < seg->offset + seg->filesz)
+			return off - seg->offset + seg->vaddr;
+	}
+	return off;
+}
+
+static const struct elf_func_sym *top_find_sym(const struct elf_func_syms *fs,
+                                               uint64_t addr)
+{
+	const struct elf_func_sym *sym;
+	size_t lo = 0, hi = fs->nr_syms, mid;
+
+	/* Find the last symbol at or below addr */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (fs->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+	sym = &fs->syms[lo - 1];
+	if (sym->size && addr >= sym->addr + sym->size)
+		return NULL;
+	return sym;
+}
+
+static void top_account(struct perf_top *top, struct top_dso *dso,
+                        uint64_t addr)
+{
+	const struct elf_func_sym *sym = dso ? top_find_sym(&dso->fs, addr) : NULL;
+	uint64_t key = sym ? (uintptr_t) sym : addr;
+	size_t idx = (((uintptr_t) dso ^ key) * 0x9e37fffffffc0001ULL >> 32) %
+	             TOP_NR_ENTRY_BUCKETS;
+	struct top_entry *e;
+
+	top->nr_samples++;
+	for (e = top->entries[idx]; e; e = e->next) {
+		if (e->dso == dso && e->sym == sym && (sym || e->addr == addr)) {
+			e->count++;
+			return;
+		}
+	}
+	e = xzmalloc(sizeof(struct top_entry));
+	e->dso = dso;
+	e->sym = sym;
+	e->addr = addr;
+	e->count = 1;
+	e->next = top->entries[idx];
+	top->entries[idx] = e;
+	top->nr_entries++;
+}
+
+static void top_account_user(struct perf_top *top, uint32_t pid, uint64_t pc)
+{
+	struct top_map *m = top_find_map(top, pid, pc);
+
+	if (!m) {
+		top_account(top, NULL, pc);
+		return;
+	}
+	top_account(top, m->dso, top_offset_to_vaddr(&m->dso->fs,
+	                                             pc - m->addr + m->offset));
+}
+
+static void top_handle_record(struct perf_top *top, uint64_t type,
+                              const char *data, uint64_t size)
+{
+	const struct proftype_kern_trace64 *krec;
+	const struct proftype_user_trace64 *urec;
+
+	switch (type) {
+	case PROFTYPE_KERN_TRACE64:
+		krec = (const struct proftype_kern_trace64 *) data;
+		if (size < sizeof(*krec) || !krec->num_traces ||
+		    !ros_get_bit(&top->cores, krec->cpu))
+			break;
+		top_account(top, top->kernel, krec->trace[0]);
+		break;
+	case PROFTYPE_USER_TRACE64:
+		urec = (const struct proftype_user_trace64 *) data;
+		if (size < sizeof(*urec) || !urec->num_traces ||
+		    !ros_get_bit(&top->cores, urec->cpu))
+			break;
+		top_account_user(top, urec->pid, urec->trace[0]);
+		break;
+	case PROFTYPE_PID_MMAP64:
+		if (size > sizeof(struct proftype_pid_mmap64))
+			top_add_map(top, (const struct proftype_pid_mmap64 *) data);
+		break;
+	case PROFTYPE_NEW_PROCESS:
+		/* Its mmaps come after this */
+		if (size >= sizeof(struct proftype_new_process))
+			top_drop_maps(top, ((const struct proftype_new_process *)
+			                    data)->pid);
+		break;
+	default:
+		/* Off-CPU samples and anything newer */
+		break;
+	}
+}
+
+/* Like vb_decode_uint64(), but returns NULL if the number runs past end. */
+static const char *top_decode_uint64(const char *data, const char *end,
+                                     uint64_t *pval)
+{
+	unsigned int i = 0;
+	uint64_t val = 0;
+
+	for (; data < end; data++, i += 7) {
+		val |= (((uint64_t) *data) & 0x7f) << i;
+		if (!(*data & 0x80)) {
+			*pval = val;
+			return data + 1;
+		}
+	}
+	return NULL;
+}
+
+static void top_process(struct perf_top *top)
+{
+	const char *ptr = top->buf, *end = top->buf + top->buf_len, *data;
+	uint64_t type, size;
+
+	for (;;) {
+		data = top_decode_uint64(ptr, end, &type);
+		if (data)
+			data = top_decode_uint64(data, end, &size);
+		if (!data || end - data < size)
+			break;
+		top_handle_record(top, type, data, size);
+		ptr = data + size;
+	}
+	/* Keep the partial record for next time */
+	top->buf_len = end - ptr;
+	memmove(top->buf, ptr, top->buf_len);
+}
+
+/* Reads whatever is in kpdata right now.  Flush the profiler first. */
+void perf_top_read(struct perf_top *top, int kpdata_fd)
+{
+	struct stat st;
+	size_t len;
+	ssize_t ret;
+
+	if (fstat(kpdata_fd, &st) || st.st_size <= 0)
+		return;
+	len = st.st_size;
+	if (top->buf_len + len > top->buf_sz) {
+		top->buf_sz = top->buf_len + len;
+		top->buf = realloc(top->buf, top->buf_sz);
+		if (!top->buf) {
+			fprintf(stderr, "Out of memory reading %lu bytes\n", len);
+			exit(1);
+		}
+	}
+	while (len) {
+		ret = read(kpdata_fd, top->buf + top->buf_len, len);
+		if (ret <= 0)
+			break;
+		top->buf_len += ret;
+		len -= ret;
+	}
+	top_process(top);
+}
+
+static int top_entry_cmp(const void *a, const void *b)
+{
+	const struct top_entry *ea = *(const struct top_entry **) a;
+	const struct top_entry *eb = *(const struct top_entry **) b;
+
+	if (ea->count == eb->count)
+		return 0;
+	return ea->count > eb->count ? -1 : 1;
+}
+
+/* Clears the screen and prints the nr_entries functions with the most samples
+ * since the last time, then starts counting over. */
+void perf_top_show(struct perf_top *top, FILE *out, int nr_entries)
+{
+	struct top_entry **sorted, *e;
+	size_t n = 0;
+
+	sorted = xmalloc(sizeof(struct top_entry *) * (top->nr_entries + 1));
+	for (int i = 0; i < TOP_NR_ENTRY_BUCKETS; i++) {
+		for (e = top->entries[i]; e; e = e->next)
+			sorted[n++] = e;
+	}
+	qsort(sorted, n, sizeof(struct top_entry *), top_entry_cmp);
+
+	fprintf(out, "\033[H\033[2J");
+	fprintf(out, "Samples: %lu\n\n", top->nr_samples);
+	fprintf(out, "%8s  %-20s %s\n", "Overhead", "Shared Object", "Symbol");
+	for (size_t i = 0; i < MIN(n, nr_entries); i++) {
+		e = sorted[i];
+		fprintf(out, "%7.2f%%  %-20.20s ", e->count * 100.0 / top->nr_samples,
+		        e->dso ? e->dso->name : "[unknown]");
+		if (e->sym)
+			fprintf(out, "%s\n", e->sym->name);
+		else
+			fprintf(out, "0x%016lx\n", e->addr);
+	}
+	fflush(out);
+	free(sorted);
+	top_clear_entries(top);
+}
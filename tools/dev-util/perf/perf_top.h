@@ -0,0 +1,20 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Live "perf top": reads samples from kpdata while the profiler runs, and keeps
+ * per-function sample counts.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "akaros.h"
+
+struct perf_top;
+
+struct perf_top *perf_top_create(const struct core_set *cores,
+                                 const char *vmlinux);
+void perf_top_free(struct perf_top *top);
+void perf_top_read(struct perf_top *top, int kpdata_fd);
+void perf_top_show(struct perf_top *top, FILE *out, int nr_entries);
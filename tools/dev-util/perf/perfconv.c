@@ -573,7 +573,8 @@ static uint64_t perfconv_get_event_id(struct perfconv_context *cctx,
 	/* Closely coupled with struct perf_record_sample */
 	attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
 	                   PERF_SAMPLE_ADDR | PERF_SAMPLE_IDENTIFIER |
-	                   PERF_SAMPLE_CPU | PERF_SAMPLE_CALLCHAIN;
+	                   PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD |
+	                   PERF_SAMPLE_CALLCHAIN;
 	attr.exclude_guest = 1;	/* we can't trace VMs yet */
 	attr.exclude_hv = 1;	/* we aren't tracing our hypervisor, AFAIK */
 	attr.exclude_user = !PMEV_GET_USR(raw_event);
@@ -585,6 +586,14 @@ static uint64_t perfconv_get_event_id(struct perfconv_context *cctx,
 	return raw_info;
 }
 
+/* PMU samples happen once per sample_period events */
+static uint64_t perfconv_get_event_period(uint64_t raw_info)
+{
+	struct perf_eventsel *sel = (struct perf_eventsel*)raw_info;
+
+	return sel->ev.trigger_count;
+}
+
 static void emit_static_mmaps(struct perfconv_context *cctx)
 {
 	struct static_mmap64 *mm;
@@ -677,6 +686,7 @@ static void emit_kernel_trace64(struct perf_record *pr,
 	xrec->addr = rec->trace[0];
 	xrec->identifier = perfconv_get_event_id(cctx, rec->info);
 	xrec->cpu = rec->cpu;
+	xrec->period = perfconv_get_event_period(rec->info);
 	xrec->nr = rec->num_traces - 1;
 	memcpy(xrec->ips, rec->trace + 1, (rec->num_traces - 1) * sizeof(uint64_t));
 
@@ -703,6 +713,7 @@ static void emit_user_trace64(struct perf_record *pr,
 	xrec->addr = rec->trace[0];
 	xrec->identifier = perfconv_get_event_id(cctx, rec->info);
 	xrec->cpu = rec->cpu;
+	xrec->period = perfconv_get_event_period(rec->info);
 	xrec->nr = rec->num_traces - 1;
 	memcpy(xrec->ips, rec->trace + 1, (rec->num_traces - 1) * sizeof(uint64_t));
 
@@ -711,6 +722,58 @@ static void emit_user_trace64(struct perf_record *pr,
 	free(xrec);
 }
 
+/* Off-CPU samples are weighted by how long they were blocked, in nsec.  The
+ * callchain has both the kernel and user PCs, marked with PERF_CONTEXT_*, the
+ * way Linux does it when a sample has both. */
+static void emit_offcpu_trace64(struct perf_record *pr,
+								struct perfconv_context *cctx)
+{
+	struct proftype_offcpu_trace64 *rec = (struct proftype_offcpu_trace64 *)
+		pr->data;
+	size_t nr_kpcs = rec->num_kern_traces;
+	size_t nr_upcs = rec->num_user_traces;
+	size_t nr = (nr_kpcs ? nr_kpcs + 1 : 0) + (nr_upcs ? nr_upcs + 1 : 0);
+	size_t size = sizeof(struct perf_record_sample) + nr * sizeof(uint64_t);
+	struct perf_record_sample *xrec = xzmalloc(size);
+	uint64_t *ips = xrec->ips;
+
+	if (!nr_kpcs && !nr_upcs) {
+		free(xrec);
+		return;
+	}
+	xrec->header.type = PERF_RECORD_SAMPLE;
+	xrec->header.misc = nr_kpcs ? PERF_RECORD_MISC_KERNEL :
+	                    PERF_RECORD_MISC_USER;
+	xrec->header.size = size;
+	xrec->ip = rec->trace[0];
+	if (rec->pid == -1) {
+		xrec->pid = -1;
+		xrec->tid = 0;
+	} else {
+		xrec->pid = rec->pid;
+		xrec->tid = rec->pid;
+	}
+	xrec->time = rec->tstamp;
+	xrec->addr = xrec->ip;
+	xrec->identifier = perfconv_get_event_id(cctx, rec->info);
+	xrec->cpu = rec->cpu;
+	xrec->period = rec->duration;
+	xrec->nr = nr;
+	if (nr_kpcs) {
+		*ips++ = PERF_CONTEXT_KERNEL;
+		memcpy(ips, rec->trace, nr_kpcs * sizeof(uint64_t));
+		ips += nr_kpcs;
+	}
+	if (nr_upcs) {
+		*ips++ = PERF_CONTEXT_USER;
+		memcpy(ips, rec->trace + nr_kpcs, nr_upcs * sizeof(uint64_t));
+	}
+
+	mem_file_write(&cctx->data, xrec, size, 0);
+
+	free(xrec);
+}
+
 static void emit_new_process(struct perf_record *pr,
 							 struct perfconv_context *cctx)
 {
@@ -779,6 +842,9 @@ void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 		case PROFTYPE_NEW_PROCESS:
 			emit_new_process(&pr, cctx);
 			break;
+		case PROFTYPE_OFFCPU_TRACE64:
+			emit_offcpu_trace64(&pr, cctx);
+			break;
 		default:
 			fprintf(stderr, "Unknown record: type=%lu size=%lu\n", pr.type,
 					pr.size);
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
 #include <gelf.h>
 #include <libelf.h>
@@ -295,6 +296,113 @@ out:
 	return err;
 }
 
+static int elf_func_sym__cmp(const void *a, const void *b)
+{
+	const struct elf_func_sym *sa = a, *sb = b;
+
+	if (sa->addr == sb->addr)
+		return 0;
+	return sa->addr < sb->addr ? -1 : 1;
+}
+
+static void elf_read_load_segs(Elf *elf, struct elf_func_syms *fs)
+{
+	GElf_Phdr phdr;
+	size_t nr_phdrs;
+
+	if (elf_getphdrnum(elf, &nr_phdrs))
+		return;
+	fs->segs = xzmalloc(sizeof(struct elf_load_seg) * (nr_phdrs + 1));
+	for (size_t i = 0; i < nr_phdrs; i++) {
+		if (!gelf_getphdr(elf, i, &phdr) || phdr.p_type != PT_LOAD)
+			continue;
+		fs->segs[fs->nr_segs].offset = phdr.p_offset;
+		fs->segs[fs->nr_segs].vaddr = phdr.p_vaddr;
+		fs->segs[fs->nr_segs].filesz = phdr.p_filesz;
+		fs->nr_segs++;
+	}
+}
+
+/* Reads the function symbols from .symtab, or .dynsym if the file is
+ * stripped. */
+static int elf_read_func_syms(Elf *elf, struct elf_func_syms *fs)
+{
+	Elf_Scn *sec = NULL, *symsec = NULL;
+	GElf_Shdr shdr, symshdr = { 0 };
+	Elf_Data *data;
+	GElf_Sym sym;
+	uint32_t idx;
+	size_t nr_syms;
+	const char *name;
+
+	while ((sec = elf_nextscn(elf, sec)) != NULL) {
+		gelf_getshdr(sec, &shdr);
+		if (shdr.sh_type == SHT_SYMTAB ||
+		    (shdr.sh_type == SHT_DYNSYM && !symsec)) {
+			symsec = sec;
+			symshdr = shdr;
+		}
+	}
+	if (!symsec || !symshdr.sh_entsize)
+		return -1;
+	data = elf_getdata(symsec, NULL);
+	if (data == NULL)
+		return -1;
+	nr_syms = symshdr.sh_size / symshdr.sh_entsize;
+	fs->syms = xzmalloc(sizeof(struct elf_func_sym) * (nr_syms + 1));
+	elf_symtab__for_each_symbol(data, nr_syms, idx, sym) {
+		if (!elf_sym__is_function(&sym))
+			continue;
+		name = elf_strptr(elf, symshdr.sh_link, sym.st_name);
+		if (!name)
+			continue;
+		fs->syms[fs->nr_syms].addr = sym.st_value;
+		fs->syms[fs->nr_syms].size = sym.st_size;
+		fs->syms[fs->nr_syms].name = xstrdup(name);
+		fs->nr_syms++;
+	}
+	qsort(fs->syms, fs->nr_syms, sizeof(struct elf_func_sym),
+	      elf_func_sym__cmp);
+	return 0;
+}
+
+int filename__read_func_syms(const char *filename, struct elf_func_syms *fs)
+{
+	int fd, err = -1;
+	Elf *elf;
+
+	memset(fs, 0, sizeof(*fs));
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		goto out;
+
+	elf = elf_begin(fd, PERF_ELF_C_READ_MMAP, NULL);
+	if (elf == NULL) {
+		pr_debug2("%s: cannot read %s ELF file.\n", __func__, filename);
+		goto out_close;
+	}
+
+	if (elf_kind(elf) == ELF_K_ELF) {
+		elf_read_load_segs(elf, fs);
+		err = elf_read_func_syms(elf, fs);
+	}
+
+	elf_end(elf);
+out_close:
+	close(fd);
+out:
+	return err;
+}
+
+void elf_func_syms__free(struct elf_func_syms *fs)
+{
+	for (size_t i = 0; i < fs->nr_syms; i++)
+		free(fs->syms[i].name);
+	free(fs->syms);
+	free(fs->segs);
+	memset(fs, 0, sizeof(*fs));
+}
+
 void symbol__elf_init(void)
 {
 	elf_version(EV_CURRENT);
@@ -4,31 +4,41 @@
  *
  * Epoll, built on FD taps, CEQs, and blocking uthreads on event queues.
  *
+ * Level-triggered FDs are rechecked when they are reported: at the start of the
+ * next epoll_wait(), we ask the kernel to POLL their taps, which fires the tap
+ * again if the FD is still ready.  EPOLLONESHOT FDs are disarmed in userspace
+ * after they are reported, until EPOLL_CTL_MOD.  Every epoll set has its own
+ * taps (one per {CEQ, FD}), so an FD can be in several sets.
+ *
+ * You can epoll on an epoll FD.  The inner set gets an eventfd, which we tap
+ * like any other FD, and the inner set's CEQ handler writes to the eventfd when
+ * the inner set has activity.  We only allow one level of nesting, which keeps
+ * us from making loops.
+ *
  * TODO: There are a few incompatibilities with Linux's epoll, some of which are
  * artifacts of the implementation, and other issues:
- * 	- you can't epoll on an epoll fd (or any user fd).  you can only epoll on a
- * 	kernel FD that accepts your FD taps.
- * 	- there's no EPOLLONESHOT or level-triggered support.
- * 	- you can only tap one FD at a time, so you can't add the same FD to
- * 	multiple epoll sets.
- * 	- there is no support for growing the epoll set.
+ * 	- you can't epoll on user fds other than epoll fds.  you can only epoll on
+ * 	a kernel FD that accepts your FD taps.
+ * 	- level-triggered requires the device to support FDTAP_CMD_POLL (#ip,
+ * 	#pipe, and #eventfd do).
+ * 	- the CEQ's events array grows, but its ring does not.  a small ring with
+ * 	a large set will overflow more often, which costs a scan of the array.
  * 	- closing the epoll is a little dangerous, if there are outstanding INDIR
  * 	events.  this will only pop up if you're yielding cores, maybe getting
  * 	preempted, and are unlucky.
  * 	- epoll_create1 does not support CLOEXEC.  That'd need some work in glibc's
  * 	exec and flags in struct user_fd.
- * 	- EPOLL_CTL_MOD is just a DEL then an ADD.  There might be races associated
- * 	with that.
+ * 	- EPOLL_CTL_MOD is just a DEL then an ADD.  The ADD polls the FD, so events
+ * 	that happened in between are not lost, though they could be reported
+ * 	twice.
  * 	- epoll_pwait is probably racy.
  * 	- You can't dup an epoll fd (same as other user FDs).
  * 	- If you add a BSD socket FD to an epoll set, you'll get taps on both the
  * 	data FD and the listen FD.
- * 	- If you add the same BSD socket listener to multiple epoll sets, you will
- * 	likely fail.  This is in addition to being able to tap only one FD at a
- * 	time.
  * */
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <parlib/parlib.h>
 #include <parlib/event.h>
 #include <parlib/ceq.h>
@@ -46,6 +56,14 @@
 /* Sanity check, so we can ID our own FDs */
 #define EPOLL_UFD_MAGIC 		0xe9011
 
+/* Max LT FDs we recheck per sys_tap_fds() */
+#define EP_LT_BATCH				32
+/* Max CEQ messages we extract at a time in epoll_wait() */
+#define EP_POLL_BATCH			64
+
+struct ep_fd_data;
+TAILQ_HEAD(ep_fd_tailq, ep_fd_data);
+
 struct epoll_ctlr {
 	TAILQ_ENTRY(epoll_ctlr)		link;
 	struct event_queue			*ceq_evq;
@@ -54,24 +72,46 @@ struct epoll_ctlr {
 	unsigned int				size;
 	uth_mutex_t					mtx;
 	struct user_fd				ufd;
+	/* LT FDs we reported, to recheck on the next wait.  Protected by mtx. */
+	struct ep_fd_tailq			lt_recheck;
+	/* For when we are in other epoll sets.  nest_efd is created once, under
+	 * nest_mtx.  The counts only go up under nest_mtx. */
+	int							nest_efd;
+	atomic_t					nest_signaled;
+	atomic_t					nr_parents;
+	atomic_t					nr_nested;
 };
 
 TAILQ_HEAD(epoll_ctlrs, epoll_ctlr);
 static struct epoll_ctlrs all_ctlrs = TAILQ_HEAD_INITIALIZER(all_ctlrs);
 static uth_mutex_t ctlrs_mtx;
+/* Serializes adding epoll sets to other sets.  Lock ordering: ctlrs_mtx ->
+ * nest_mtx -> ep->mtx. */
+static uth_mutex_t nest_mtx;
+
+/* The CEQ's event queue, with a way back to its ctlr for our handler. */
+struct ep_ceq_evq {
+	struct event_queue_big		big_q;		/* must be first */
+	struct epoll_ctlr			*ep;
+};
 
-/* There's some bookkeeping we need to maintain on every FD.  Right now, the FD
- * is the index into the CEQ event array, so we can just hook this into the user
+/* There's some bookkeeping we need to maintain on every FD.  The tapped FD is
+ * the index into the CEQ event array, so we can just hook this into the user
  * data blob in the ceq_event.
  *
- * If we ever do not maintain a 1:1 mapping from FDs to CEQ IDs, we can use this
- * to track the CEQ ID and FD. */
+ * For nested epoll sets, the tapped FD is the inner set's eventfd, not the FD
+ * the user gave us.  ep_event.data is what the user wants back either way. */
 struct ep_fd_data {
 	struct epoll_event			ep_event;
 	int							fd;
-	int							filter;
+	bool						disarmed;		/* EPOLLONESHOT fired */
+	bool						lt_queued;		/* on lt_recheck */
+	TAILQ_ENTRY(ep_fd_data)		lt_link;
+	struct epoll_ctlr			*nested;		/* fd is nested's eventfd */
 };
 
+static void ep_nest_signal(struct epoll_ctlr *ep);
+
 /* Converts epoll events to FD taps. */
 static int ep_events_to_taps(uint32_t ep_ev)
 {
@@ -113,9 +153,9 @@ static uint32_t taps_to_ep_events(int taps)
 
 static struct ceq_event *ep_get_ceq_ev(struct epoll_ctlr *ep, size_t idx)
 {
-	if (ep->ceq_evq->ev_mbox->ceq.nr_events <= idx)
+	if (ep->ceq->nr_events <= idx)
 		return 0;
-	return &ep->ceq_evq->ev_mbox->ceq.events[idx];
+	return &ep->ceq->events[idx];
 }
 
 static struct epoll_ctlr *fd_to_cltr(int fd)
@@ -130,14 +170,33 @@ static struct epoll_ctlr *fd_to_cltr(int fd)
 	return container_of(ufd, struct epoll_ctlr, ufd);
 }
 
+/* Runs in vcore context when the kernel posts to our CEQ.  On top of waking
+ * our own waiters, we tell any epoll sets we're in that we have activity. */
+static void ep_ceq_evq_handler(struct event_queue *ceq_evq)
+{
+	struct epoll_ctlr *ep = ACCESS_ONCE(((struct ep_ceq_evq*)ceq_evq)->ep);
+
+	evq_wakeup_handler(ceq_evq);
+	if (ep)
+		ep_nest_signal(ep);
+}
+
 /* Event queue helpers: */
-static struct event_queue *ep_get_ceq_evq(unsigned int ceq_size)
+static struct event_queue *ep_get_ceq_evq(struct epoll_ctlr *ep,
+                                          unsigned int ceq_size)
 {
-	struct event_queue *ceq_evq = get_eventq_raw();
+	struct ep_ceq_evq *ep_evq = malloc(sizeof(struct ep_ceq_evq));
+	struct event_queue *ceq_evq = (struct event_queue*)&ep_evq->big_q;
+
+	/* Same as get_eventq_raw(), plus our ep */
+	memset(ep_evq, 0, sizeof(struct ep_ceq_evq));
+	ep_evq->big_q.ev_mbox = &ep_evq->big_q.ev_imbox;
+	ep_evq->ep = ep;
 	ceq_evq->ev_mbox->type = EV_MBOX_CEQ;
 	ceq_init(&ceq_evq->ev_mbox->ceq, CEQ_OR, ceq_size, ceq_size);
 	ceq_evq->ev_flags = EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP;
 	evq_attach_wakeup_ctlr(ceq_evq);
+	ceq_evq->ev_handler = ep_ceq_evq_handler;
 	return ceq_evq;
 }
 
@@ -171,6 +230,19 @@ static void ep_put_alarm_evq(struct event_queue *alarm_evq)
 #endif
 }
 
+/* Sends tap requests to the kernel.  Requests could fail if the tapped files
+ * are already closed.  We need to skip the failed one (the +1) and send the
+ * rest. */
+static void ep_send_tap_reqs(struct fd_tap_req *tap_reqs, int nr_tap_req)
+{
+	int nr_done = 0;
+
+	while (nr_done < nr_tap_req) {
+		nr_done += sys_tap_fds(tap_reqs + nr_done, nr_tap_req - nr_done);
+		nr_done += 1;	/* nr_done could be more than nr_tap_req now */
+	}
+}
+
 static void epoll_close(struct user_fd *ufd)
 {
 	struct epoll_ctlr *ep = container_of(ufd, struct epoll_ctlr, ufd);
@@ -178,7 +250,6 @@ static void epoll_close(struct user_fd *ufd)
 	struct ceq_event *ceq_ev_i;
 	struct ep_fd_data *ep_fd_i;
 	int nr_tap_req = 0;
-	int nr_done = 0;
 
 	tap_reqs = malloc(sizeof(struct fd_tap_req) * ep->size);
 	memset(tap_reqs, 0, sizeof(struct fd_tap_req) * ep->size);
@@ -190,23 +261,30 @@ static void epoll_close(struct user_fd *ufd)
 		ep_fd_i = (struct ep_fd_data*)ceq_ev_i->user_data;
 		if (!ep_fd_i)
 			continue;
+		/* Only our tap; the FD could be in other sets */
 		tap_req_i = &tap_reqs[nr_tap_req++];
 		tap_req_i->fd = i;
 		tap_req_i->cmd = FDTAP_CMD_REM;
+		tap_req_i->ev_q = ep->ceq_evq;
+		tap_req_i->ev_id = i;
+		if (ep_fd_i->nested)
+			atomic_dec(&ep_fd_i->nested->nr_parents);
 		free(ep_fd_i);
 	}
-	/* Requests could fail if the tapped files are already closed.  We need to
-	 * skip the failed one (the +1) and untap the rest. */
-	do {
-		nr_done += sys_tap_fds(tap_reqs + nr_done, nr_tap_req - nr_done);
-		nr_done += 1;	/* nr_done could be more than nr_tap_req now */
-	} while (nr_done < nr_tap_req);
+	ep_send_tap_reqs(tap_reqs, nr_tap_req);
 	free(tap_reqs);
+	/* The handler could still be running for us.  Same problem as the INDIRs
+	 * below. */
+	((struct ep_ceq_evq*)ep->ceq_evq)->ep = 0;
 	ep_put_ceq_evq(ep->ceq_evq);
 	ep_put_alarm_evq(ep->alarm_evq);
 	uth_mutex_lock(ctlrs_mtx);
 	TAILQ_REMOVE(&all_ctlrs, ep, link);
 	uth_mutex_unlock(ctlrs_mtx);
+	/* Our parents already dropped their taps on the eventfd when our epoll FD
+	 * was closed (epoll_fd_closed()). */
+	if (ep->nest_efd >= 0)
+		close(ep->nest_efd);
 	uth_mutex_free(ep->mtx);
 	free(ep);
 }
@@ -215,7 +293,7 @@ static int init_ep_ctlr(struct epoll_ctlr *ep, int size)
 {
 	unsigned int ceq_size;
 
-	/* TODO: we don't grow yet.  Until then, we help out a little. */
+	/* We'll grow as needed, but we can help out a little. */
 	if (size == 1)
 		size = 128;
 	ceq_size = ROUNDUPPWR2(size);
@@ -223,8 +301,11 @@ static int init_ep_ctlr(struct epoll_ctlr *ep, int size)
 	ep->mtx = uth_mutex_alloc();
 	ep->ufd.magic = EPOLL_UFD_MAGIC;
 	ep->ufd.close = epoll_close;
-	ep->ceq_evq = ep_get_ceq_evq(ceq_size);
+	ep->ceq_evq = ep_get_ceq_evq(ep, ceq_size);
+	ep->ceq = &ep->ceq_evq->ev_mbox->ceq;
 	ep->alarm_evq = ep_get_alarm_evq();
+	TAILQ_INIT(&ep->lt_recheck);
+	ep->nest_efd = -1;
 	return 0;
 }
 
@@ -247,6 +328,7 @@ static void epoll_init(void)
 
 	register_close_cb(&epoll_close_cb);
 	ctlrs_mtx = uth_mutex_alloc();
+	nest_mtx = uth_mutex_alloc();
 }
 
 int epoll_create(int size)
@@ -282,22 +364,151 @@ int epoll_create1(int flags)
 	return epoll_create(1);
 }
 
-static int __epoll_ctl_add(struct epoll_ctlr *ep, int fd,
-                           struct epoll_event *event)
+/* Tells the sets we are in that we have activity, if we haven't already.  Can
+ * be called from vcore context. */
+static void ep_nest_signal(struct epoll_ctlr *ep)
+{
+	int efd = ACCESS_ONCE(ep->nest_efd);
+
+	if (efd < 0)
+		return;
+	if (atomic_swap(&ep->nest_signaled, TRUE))
+		return;
+	eventfd_write(efd, 1);
+}
+
+/* Clears our nest signal once we have nothing left to report.  Caller holds
+ * ep->mtx. */
+static void ep_nest_settle(struct epoll_ctlr *ep)
+{
+	eventfd_t dummy;
+
+	if (ep->nest_efd < 0)
+		return;
+	if (!ceq_is_empty(ep->ceq) || !TAILQ_EMPTY(&ep->lt_recheck))
+		return;
+	if (!atomic_swap(&ep->nest_signaled, FALSE))
+		return;
+	eventfd_read(ep->nest_efd, &dummy);
+	/* The handler could have run after our check and seen the old signal. */
+	if (!ceq_is_empty(ep->ceq))
+		ep_nest_signal(ep);
+}
+
+/* Grows the set so that fd fits. */
+static void ep_grow(struct epoll_ctlr *ep, int fd)
+{
+	unsigned int new_size = MAX(ROUNDUPPWR2(fd + 1), ep->size * 2);
+
+	ceq_grow(ep->ceq, new_size);
+	ep->size = new_size;
+}
+
+/* Adds a tap for a kernel FD.  nested is the inner epoll set, if fd is its
+ * eventfd. */
+static int __epoll_ctl_add_fd(struct epoll_ctlr *ep, int fd,
+                              struct epoll_event *event,
+                              struct epoll_ctlr *nested)
 {
 	struct ceq_event *ceq_ev;
 	struct ep_fd_data *ep_fd;
 	struct fd_tap_req tap_req = {0};
-	int ret, filter, sock_listen_fd;
-	struct epoll_event listen_event;
+	int ret, filter;
+
+	if (fd >= ep->size)
+		ep_grow(ep, fd);
+	ceq_ev = ep_get_ceq_ev(ep, fd);
+	assert(ceq_ev);
+	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
+	if (ep_fd) {
+		errno = EEXIST;
+		return -1;
+	}
+	tap_req.fd = fd;
+	tap_req.cmd = FDTAP_CMD_ADD;
+	/* EPOLLHUP is implicitly set for all epolls. */
+	filter = ep_events_to_taps(event->events | EPOLLHUP);
+	tap_req.filter = filter;
+	tap_req.ev_q = ep->ceq_evq;
+	tap_req.ev_id = fd;	/* using FD as the CEQ ID */
+	ret = sys_tap_fds(&tap_req, 1);
+	if (ret != 1)
+		return -1;
+	ep_fd = malloc(sizeof(struct ep_fd_data));
+	memset(ep_fd, 0, sizeof(struct ep_fd_data));
+	ep_fd->fd = fd;
+	ep_fd->ep_event = *event;
+	ep_fd->ep_event.events |= EPOLLHUP;
+	ep_fd->nested = nested;
+	ceq_ev->user_data = (uint64_t)ep_fd;
+	/* Like Linux, we report FDs that are already ready when they are added.
+	 * This also tells us whether the device can do level-triggered. */
+	tap_req.cmd = FDTAP_CMD_POLL;
+	if ((sys_tap_fds(&tap_req, 1) != 1) && !(event->events & EPOLLET)) {
+		tap_req.cmd = FDTAP_CMD_REM;
+		sys_tap_fds(&tap_req, 1);
+		ceq_ev->user_data = 0;
+		free(ep_fd);
+		errno = EPERM;
+		werrstr("Epoll level-triggered not supported for FD %d", fd);
+		return -1;
+	}
+	return 0;
+}
 
-	/* Only support ET.  Also, we just ignore EPOLLONESHOT.  That might work,
-	 * logically, just with spurious events firing. */
-	if (!(event->events & EPOLLET)) {
+/* Adds the epoll set at fd (a user FD) to ep.  Caller holds nest_mtx. */
+static int __epoll_ctl_add_nested(struct epoll_ctlr *ep, int fd,
+                                  struct epoll_event *event)
+{
+	struct epoll_ctlr *inner = fd_to_cltr(fd);
+	struct epoll_event nest_event;
+	int ret;
+
+	if (!inner) {
 		errno = EPERM;
-		werrstr("Epoll level-triggered not supported");
+		werrstr("Epoll can't track User FD %d", fd);
+		return -1;
+	}
+	if (inner == ep) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* One level of nesting: no set can be both a parent and a child. */
+	if (atomic_read(&inner->nr_nested) || atomic_read(&ep->nr_parents)) {
+		errno = ELOOP;
+		werrstr("Epoll sets can only be nested one level deep");
 		return -1;
 	}
+	if (inner->nest_efd < 0) {
+		ret = eventfd(0, EFD_NONBLOCK);
+		if (ret < 0)
+			return -1;
+		inner->nest_efd = ret;
+		/* It could have had activity before it had an eventfd */
+		if (!ceq_is_empty(inner->ceq))
+			ep_nest_signal(inner);
+	}
+	nest_event.events = event->events & (EPOLLIN | EPOLLET | EPOLLONESHOT);
+	nest_event.data = event->data;
+	ret = __epoll_ctl_add_fd(ep, inner->nest_efd, &nest_event, inner);
+	if (ret)
+		return ret;
+	atomic_inc(&inner->nr_parents);
+	atomic_inc(&ep->nr_nested);
+	return 0;
+}
+
+static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
+                           struct epoll_event *event);
+
+static int __epoll_ctl_add(struct epoll_ctlr *ep, int fd,
+                           struct epoll_event *event)
+{
+	int ret, sock_listen_fd;
+	struct epoll_event listen_event;
+
+	if (fd >= USER_FD_BASE)
+		return __epoll_ctl_add_nested(ep, fd, event);
 	/* The sockets-to-plan9 networking shims are a bit inconvenient.  The user
 	 * asked us to epoll on an FD, but that FD is actually a Qdata FD.  We might
 	 * need to actually epoll on the listen_fd.  Further, we don't know yet
@@ -314,40 +525,17 @@ static int __epoll_ctl_add(struct epoll_ctlr *ep, int fd,
 	 * that in event->data. */
 	sock_listen_fd = _sock_lookup_listen_fd(fd);
 	if (sock_listen_fd >= 0) {
-		listen_event.events = EPOLLET | EPOLLIN | EPOLLHUP;
+		listen_event.events = (event->events & (EPOLLET | EPOLLONESHOT)) |
+		                      EPOLLIN | EPOLLHUP;
 		listen_event.data = event->data;
-		ret = __epoll_ctl_add(ep, sock_listen_fd, &listen_event);
+		ret = __epoll_ctl_add_fd(ep, sock_listen_fd, &listen_event, 0);
 		if (ret < 0)
 			return ret;
 	}
-	ceq_ev = ep_get_ceq_ev(ep, fd);
-	if (!ceq_ev) {
-		errno = ENOMEM;
-		werrstr("Epoll set cannot grow yet!");
-		return -1;
-	}
-	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
-	if (ep_fd) {
-		errno = EEXIST;
-		return -1;
-	}
-	tap_req.fd = fd;
-	tap_req.cmd = FDTAP_CMD_ADD;
-	/* EPOLLHUP is implicitly set for all epolls. */
-	filter = ep_events_to_taps(event->events | EPOLLHUP);
-	tap_req.filter = filter;
-	tap_req.ev_q = ep->ceq_evq;
-	tap_req.ev_id = fd;	/* using FD as the CEQ ID */
-	ret = sys_tap_fds(&tap_req, 1);
-	if (ret != 1)
-		return -1;
-	ep_fd = malloc(sizeof(struct ep_fd_data));
-	ep_fd->fd = fd;
-	ep_fd->filter = filter;
-	ep_fd->ep_event = *event;
-	ep_fd->ep_event.events |= EPOLLHUP;
-	ceq_ev->user_data = (uint64_t)ep_fd;
-	return 0;
+	ret = __epoll_ctl_add_fd(ep, fd, event, 0);
+	if (ret && (sock_listen_fd >= 0))
+		__epoll_ctl_del(ep, sock_listen_fd, 0);
+	return ret;
 }
 
 static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
@@ -355,9 +543,18 @@ static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
 {
 	struct ceq_event *ceq_ev;
 	struct ep_fd_data *ep_fd;
+	struct epoll_ctlr *inner;
 	struct fd_tap_req tap_req = {0};
-	int ret, sock_listen_fd;
+	int sock_listen_fd;
 
+	if (fd >= USER_FD_BASE) {
+		inner = fd_to_cltr(fd);
+		if (!inner || (inner->nest_efd < 0)) {
+			errno = ENOENT;
+			return -1;
+		}
+		fd = inner->nest_efd;
+	}
 	/* If we were dealing with a socket shim FD, we tapped both the listen and
 	 * the data file and need to untap both of them. */
 	sock_listen_fd = _sock_lookup_listen_fd(fd);
@@ -382,10 +579,18 @@ static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
 	assert(ep_fd->fd == fd);
 	tap_req.fd = fd;
 	tap_req.cmd = FDTAP_CMD_REM;
+	tap_req.ev_q = ep->ceq_evq;
+	tap_req.ev_id = fd;
 	/* ignoring the return value; we could have failed to remove it if the FD
 	 * has already closed and the kernel removed the tap. */
 	sys_tap_fds(&tap_req, 1);
 	ceq_ev->user_data = 0;
+	if (ep_fd->lt_queued)
+		TAILQ_REMOVE(&ep->lt_recheck, ep_fd, lt_link);
+	if (ep_fd->nested) {
+		atomic_dec(&ep_fd->nested->nr_parents);
+		atomic_dec(&ep->nr_nested);
+	}
 	free(ep_fd);
 	return 0;
 }
@@ -394,22 +599,20 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
 	int ret;
 	struct epoll_ctlr *ep = fd_to_cltr(epfd);
+	bool nesting = (fd >= USER_FD_BASE) && (op != EPOLL_CTL_DEL);
+
 	if (!ep) {
 		errno = EBADF;/* or EINVAL */
 		return -1;
 	}
-	if (fd >= USER_FD_BASE) {
-		errno = EINVAL;
-		werrstr("Epoll can't track User FDs");
-		return -1;
-	}
+	if (nesting)
+		uth_mutex_lock(nest_mtx);
 	uth_mutex_lock(ep->mtx);
 	switch (op) {
 		case (EPOLL_CTL_MOD):
-			/* In lieu of a proper MOD, just remove and readd.  The errors might
-			 * not work out well, and there could be a missed event in the
-			 * middle.  Not sure what the guarantees are, but we can fake a
-			 * poke. (TODO). */
+			/* In lieu of a proper MOD, just remove and readd.  The ADD polls
+			 * the FD, so we won't miss anything that happened in between, and
+			 * it rearms EPOLLONESHOT. */
 			ret = __epoll_ctl_del(ep, fd, 0);
 			if (ret)
 				break;
@@ -426,9 +629,12 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 			ret = -1;
 	}
 	uth_mutex_unlock(ep->mtx);
+	if (nesting)
+		uth_mutex_unlock(nest_mtx);
 	return ret;
 }
 
+/* Caller holds ep->mtx. */
 static bool get_ep_event_from_msg(struct epoll_ctlr *ep, struct event_msg *msg,
                                   struct epoll_event *ep_ev)
 {
@@ -444,18 +650,51 @@ static bool get_ep_event_from_msg(struct epoll_ctlr *ep, struct event_msg *msg,
 		 * event sent to this epoll set. */
 		return FALSE;
 	}
+	if (ep_fd->disarmed)
+		return FALSE;
 	ep_ev->data = ep_fd->ep_event.data;
 	/* The events field was initialized to 0 in epoll_wait() */
 	ep_ev->events |= taps_to_ep_events(msg->ev_arg2);
+	if (ep_fd->ep_event.events & EPOLLONESHOT) {
+		ep_fd->disarmed = TRUE;
+	} else if (!(ep_fd->ep_event.events & EPOLLET) && !ep_fd->lt_queued) {
+		ep_fd->lt_queued = TRUE;
+		TAILQ_INSERT_TAIL(&ep->lt_recheck, ep_fd, lt_link);
+	}
 	return TRUE;
 }
 
+/* Level-triggered FDs we reported need to be reported again if they are still
+ * ready.  We ask the kernel to poll their taps, which fires them into our CEQ
+ * if so.  Caller holds ep->mtx. */
+static void __ep_lt_recheck(struct epoll_ctlr *ep)
+{
+	struct fd_tap_req tap_reqs[EP_LT_BATCH];
+	struct ep_fd_data *ep_fd;
+	int nr_tap_req = 0;
+
+	memset(tap_reqs, 0, sizeof(tap_reqs));
+	while ((ep_fd = TAILQ_FIRST(&ep->lt_recheck))) {
+		TAILQ_REMOVE(&ep->lt_recheck, ep_fd, lt_link);
+		ep_fd->lt_queued = FALSE;
+		tap_reqs[nr_tap_req].fd = ep_fd->fd;
+		tap_reqs[nr_tap_req].cmd = FDTAP_CMD_POLL;
+		tap_reqs[nr_tap_req].ev_q = ep->ceq_evq;
+		tap_reqs[nr_tap_req].ev_id = ep_fd->fd;
+		if (++nr_tap_req == EP_LT_BATCH) {
+			ep_send_tap_reqs(tap_reqs, nr_tap_req);
+			nr_tap_req = 0;
+		}
+	}
+	ep_send_tap_reqs(tap_reqs, nr_tap_req);
+}
+
 /* Helper: extracts as many epoll_events as possible from the ep. */
 static int __epoll_wait_poll(struct epoll_ctlr *ep, struct epoll_event *events,
                              int maxevents)
 {
-	struct event_msg msg = {0};
-	int nr_ret = 0;
+	struct event_msg msgs[EP_POLL_BATCH];
+	int nr_msgs, nr_ret = 0;
 
 	if (maxevents <= 0)
 		return 0;
@@ -463,14 +702,21 @@ static int __epoll_wait_poll(struct epoll_ctlr *ep, struct epoll_event *events,
 	 * stored at ceq_ev->user_data does not get concurrently removed and
 	 * freed. */
 	uth_mutex_lock(ep->mtx);
-	for (int i = 0; i < maxevents; i++) {
-retry:
-		if (!uth_check_evqs(&msg, NULL, 1, ep->ceq_evq))
+	while (nr_ret < maxevents) {
+		/* Same as uth_check_evqs(), but in bulk.  Some messages might be
+		 * stale, so we could get fewer events than messages. */
+		uth_disable_notifs();
+		nr_msgs = extract_mbox_msgs(ep->ceq_evq->ev_mbox, msgs,
+		                            MIN(maxevents - nr_ret, EP_POLL_BATCH));
+		uth_enable_notifs();
+		if (!nr_msgs)
 			break;
-		if (!get_ep_event_from_msg(ep, &msg, &events[i]))
-			goto retry;
-		nr_ret++;
+		for (int i = 0; i < nr_msgs; i++) {
+			if (get_ep_event_from_msg(ep, &msgs[i], &events[nr_ret]))
+				nr_ret++;
+		}
 	}
+	ep_nest_settle(ep);
 	uth_mutex_unlock(ep->mtx);
 	return nr_ret;
 }
@@ -487,6 +733,12 @@ static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
 	int nr_ret;
 	struct syscall sysc;
 
+	/* Lockless peek, most sets have no LT FDs to recheck */
+	if (!TAILQ_EMPTY(&ep->lt_recheck)) {
+		uth_mutex_lock(ep->mtx);
+		__ep_lt_recheck(ep);
+		uth_mutex_unlock(ep->mtx);
+	}
 	nr_ret = __epoll_wait_poll(ep, events, maxevents);
 	if (nr_ret)
 		return nr_ret;
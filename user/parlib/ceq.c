@@ -26,6 +26,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+/* Events arrays replaced by ceq_grow().  The kernel could still be posting to
+ * them, so we keep them until ceq_cleanup() and check them when extracting. */
+struct ceq_retired {
+	struct ceq_retired			*next;
+	struct ceq_event			*events;
+	unsigned int				nr_events;
+};
+
 void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
               size_t ring_sz)
 {
@@ -49,30 +57,45 @@ void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
 	spin_pdr_init((struct spin_pdr_lock*)&ceq->u_lock);
 }
 
-/* Helper, returns an index into the events array from the ceq ring.  -1 if the
- * ring was empty when we looked (could be filled right after we looked).  This
- * is the same algorithm used with BCQs, but with a magic value (-1) instead of
- * a bool to track whether or not the slot is ready for consumption. */
-static int32_t get_ring_idx(struct ceq *ceq)
+/* Max ring slots we claim at once in get_ceq_msgs() */
+#define CEQ_BATCH_SZ			64
+
+/* Helper, claims up to max indices from the ceq ring with one CAS and copies
+ * them into idxs.  Returns the number claimed, 0 if the ring was empty when we
+ * looked (could be filled right after we looked).  This is the same algorithm
+ * used with BCQs, but with a magic value (-1) instead of a bool to track
+ * whether or not the slot is ready for consumption. */
+static int get_ring_idxs(struct ceq *ceq, int32_t *idxs, int max)
 {
 	long pvt_idx, prod_idx;
-	int32_t ret;
+	int32_t *slot;
+	struct ceq_event *events;
+	int nr;
+
 	do {
 		prod_idx = atomic_read(&ceq->prod_idx);
 		pvt_idx = atomic_read(&ceq->cons_pvt_idx);
 		if (__ring_empty(prod_idx, pvt_idx))
-			return -1;
-	} while (!atomic_cas(&ceq->cons_pvt_idx, pvt_idx, pvt_idx + 1));
-	/* We claimed our slot, which is pvt_idx.  The new cons_pvt_idx is advanced
-	 * by 1 for the next consumer.  Now we need to wait on the kernel to fill
-	 * the value: */
-	while ((ret = ceq->ring[pvt_idx & (ceq->ring_sz - 1)]) == -1)
-		cpu_relax();
-	/* Set the value back to -1 for the next time the slot is used */
-	ceq->ring[pvt_idx & (ceq->ring_sz - 1)] = -1;
-	/* We now have our entry.  We need to make sure the pub_idx is updated.  All
-	 * consumers are doing this.  We can just wait on all of them to update the
-	 * cons_pub to our location, then we update it to the next.
+			return 0;
+		nr = MIN(max, prod_idx - pvt_idx);
+	} while (!atomic_cas(&ceq->cons_pvt_idx, pvt_idx, pvt_idx + nr));
+	/* We claimed our slots, starting at pvt_idx.  The new cons_pvt_idx is
+	 * advanced by nr for the next consumer.  Now we need to wait on the kernel
+	 * to fill the values: */
+	events = ACCESS_ONCE(ceq->events);
+	for (int i = 0; i < nr; i++) {
+		slot = &ceq->ring[(pvt_idx + i) & (ceq->ring_sz - 1)];
+		while ((idxs[i] = ACCESS_ONCE(*slot)) == -1)
+			cpu_relax();
+		/* Set the value back to -1 for the next time the slot is used */
+		*slot = -1;
+		/* Start pulling in the event while we work on the rest of the ring.
+		 * It's just a hint, even if the array was grown under us. */
+		__builtin_prefetch(&events[idxs[i]], 1);
+	}
+	/* We now have our entries.  We need to make sure the pub_idx is updated.
+	 * All consumers are doing this.  We can just wait on all of them to update
+	 * the cons_pub to our location, then we update it to the next.
 	 *
 	 * We're waiting on other vcores, but we don't know which one(s). */
 	while (atomic_read(&ceq->cons_pub_idx) != pvt_idx)
@@ -82,22 +105,36 @@ static int32_t get_ring_idx(struct ceq *ceq)
 	 * no one gets to this point until pub == their pvt_idx, all of which are
 	 * unique. */
 	/* No rwmb needed, it's the same variable (con_pub) */
-	atomic_set(&ceq->cons_pub_idx, pvt_idx + 1);
-	return ret;
+	atomic_set(&ceq->cons_pub_idx, pvt_idx + nr);
+	return nr;
 }
 
-/* Helper, extracts a message from a ceq[idx], returning TRUE if there was a
- * message.  Note that there might have been nothing in the message (coal == 0).
- * still, that counts; it's more about idx_posted.  A concurrent reader could
- * have swapped out the coal contents (imagine two consumers, each gets past the
- * idx_posted check).  If having an "empty" coal is a problem, then higher level
- * software can ask for another event.
+/* Helper, returns an index into the events array from the ceq ring.  -1 if the
+ * ring was empty when we looked. */
+static int32_t get_ring_idx(struct ceq *ceq)
+{
+	int32_t idx;
+
+	if (!get_ring_idxs(ceq, &idx, 1))
+		return -1;
+	return idx;
+}
+
+/* Helper, extracts the contents of ceq_ev into msg, merging with whatever is
+ * already in msg.  Returns TRUE if ceq_ev was posted.  Note that there might
+ * have been nothing in the message (coal == 0).  still, that counts; it's more
+ * about idx_posted.  A concurrent reader could have swapped out the coal
+ * contents (imagine two consumers, each gets past the idx_posted check).  If
+ * having an "empty" coal is a problem, then higher level software can ask for
+ * another event.
  *
  * Implied in all of that is that idx_posted is also racy.  The consumer blindly
  * sets it to false.  So long as it extracts coal after doing so, we're fine. */
-static bool extract_ceq_msg(struct ceq *ceq, int32_t idx, struct event_msg *msg)
+static bool __extract_ceq_ev(struct ceq *ceq, struct ceq_event *ceq_ev,
+                             struct event_msg *msg)
 {
-	struct ceq_event *ceq_ev = &ceq->events[idx];
+	long coal;
+
 	if (!ceq_ev->idx_posted)
 		return FALSE;
 	/* Once we clear this flag, any new coalesces will trigger another ring
@@ -108,12 +145,37 @@ static bool extract_ceq_msg(struct ceq *ceq, int32_t idx, struct event_msg *msg)
 	cmb();	/* order the read after the flag write.  swap provides cpu_mb */
 	/* We extract the existing coals and reset the collection to 0; now the
 	 * collected events are in our msg. */
-	msg->ev_arg2 = atomic_swap(&ceq_ev->coalesce, 0);
+	coal = atomic_swap(&ceq_ev->coalesce, 0);
+	if (ceq->operation == CEQ_ADD)
+		msg->ev_arg2 += coal;
+	else
+		msg->ev_arg2 |= coal;
+	msg->ev_arg3 = (void*)ceq_ev->blob_data;
+	ceq_ev->blob_data = 0;	/* racy, but there are no blob guarantees */
+	return TRUE;
+}
+
+/* Helper, extracts a message from a ceq[idx], returning TRUE if there was a
+ * message.  If the CEQ was grown, the kernel might have posted idx in an old
+ * events array, so we check those too. */
+static bool extract_ceq_msg(struct ceq *ceq, int32_t idx, struct event_msg *msg)
+{
+	struct ceq_retired *old;
+	bool ret;
+
+	msg->ev_arg2 = 0;
+	msg->ev_arg3 = 0;
+	rmb();	/* ceq_grow() publishes events before the idx can be used */
+	ret = __extract_ceq_ev(ceq, &(ACCESS_ONCE(ceq->events))[idx], msg);
+	for (old = ACCESS_ONCE(ceq->u_retired); old; old = old->next) {
+		if (idx < old->nr_events)
+			ret |= __extract_ceq_ev(ceq, &old->events[idx], msg);
+	}
+	if (!ret)
+		return FALSE;
 	/* if the user wants access to user_data, they can peak in the event array
 	 * via ceq->events[msg->ev_type].user_data. */
 	msg->ev_type = idx;
-	msg->ev_arg3 = (void*)ceq_ev->blob_data;
-	ceq_ev->blob_data = 0;	/* racy, but there are no blob guarantees */
 	return TRUE;
 }
 
@@ -174,6 +236,32 @@ bool get_ceq_msg(struct ceq *ceq, struct event_msg *msg)
 	return TRUE;
 }
 
+/* Batch version of get_ceq_msg(): extracts up to max messages into msgs,
+ * returning how many we got.  We claim a run of ring slots with one CAS and
+ * pull in their events before we extract them.  Overflow recovery is rare, and
+ * we leave that to get_ceq_msg(). */
+int get_ceq_msgs(struct ceq *ceq, struct event_msg *msgs, int max)
+{
+	int32_t idxs[CEQ_BATCH_SZ];
+	int nr_idxs, nr_ret = 0;
+
+	while (nr_ret < max) {
+		nr_idxs = get_ring_idxs(ceq, idxs, MIN(max - nr_ret, CEQ_BATCH_SZ));
+		if (!nr_idxs)
+			break;
+		for (int i = 0; i < nr_idxs; i++) {
+			if (extract_ceq_msg(ceq, idxs[i], &msgs[nr_ret]))
+				nr_ret++;
+		}
+	}
+	while ((nr_ret < max) && (ceq->ring_overflowed || ceq->overflow_recovery)) {
+		if (!get_ceq_msg(ceq, &msgs[nr_ret]))
+			break;
+		nr_ret++;
+	}
+	return nr_ret;
+}
+
 /* pvt_idx is the next slot that a new consumer will try to consume.  when
  * pvt_idx != pub_idx, pub_idx is lagging, and it represents consumptions in
  * progress. */
@@ -193,8 +281,54 @@ bool ceq_is_empty(struct ceq *ceq)
 	return TRUE;
 }
 
+/* Grows the events array to nr_events, which can't be smaller than it was.
+ * The ring stays the same size.  user_data is carried over.  Callers must not
+ * grow the same CEQ concurrently, and they must not be touching user_data in
+ * the old array (it's a copy now).
+ *
+ * The new array is published before the new nr_events, so the kernel will not
+ * use an index beyond the old array's bounds with the old array.  The kernel
+ * can keep posting to the old array for a while, so we keep it around and
+ * extract_ceq_msg() checks it too. */
+void ceq_grow(struct ceq *ceq, unsigned int nr_events)
+{
+	struct ceq_event *new_events;
+	struct ceq_retired *old;
+	unsigned int old_nr = ceq->nr_events;
+
+	assert(nr_events >= old_nr);
+	if (nr_events == old_nr)
+		return;
+	new_events = malloc(sizeof(struct ceq_event) * nr_events);
+	memset(new_events, 0, sizeof(struct ceq_event) * nr_events);
+	for (int i = 0; i < old_nr; i++)
+		new_events[i].user_data = ceq->events[i].user_data;
+	old = malloc(sizeof(struct ceq_retired));
+	old->events = ceq->events;
+	old->nr_events = old_nr;
+	/* The overflow recovery scan uses nr_events and events; keep it from
+	 * running while we swap them.  Extractors can see the retired list as
+	 * soon as the new events is visible. */
+	spin_pdr_lock((struct spin_pdr_lock*)&ceq->u_lock);
+	old->next = ceq->u_retired;
+	ceq->u_retired = old;
+	wmb();	/* retired list, then new events, then new nr_events */
+	ceq->events = new_events;
+	wmb();
+	ceq->nr_events = nr_events;
+	spin_pdr_unlock((struct spin_pdr_lock*)&ceq->u_lock);
+}
+
 void ceq_cleanup(struct ceq *ceq)
 {
+	struct ceq_retired *old, *next;
+
+	for (old = ceq->u_retired; old; old = next) {
+		next = old->next;
+		free(old->events);
+		free(old);
+	}
+	ceq->u_retired = 0;
 	free(ceq->events);
 	free(ceq->ring);
 }
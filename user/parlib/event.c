@@ -319,6 +319,25 @@ bool extract_one_mbox_msg(struct event_mbox *ev_mbox, struct event_msg *ev_msg)
 	}
 }
 
+/* Attempts to extract up to max messages from an mbox, copying them into msgs.
+ * Returns the number extracted.  UCQs and CEQs do this in bulk. */
+int extract_mbox_msgs(struct event_mbox *ev_mbox, struct event_msg *msgs,
+                      int max)
+{
+	int nr = 0;
+
+	switch (ev_mbox->type) {
+		case (EV_MBOX_UCQ):
+			return get_ucq_msgs(&ev_mbox->ucq, msgs, max);
+		case (EV_MBOX_CEQ):
+			return get_ceq_msgs(&ev_mbox->ceq, msgs, max);
+		default:
+			while ((nr < max) && extract_one_mbox_msg(ev_mbox, &msgs[nr]))
+				nr++;
+			return nr;
+	}
+}
+
 /* Attempts to handle a message.  Returns 1 if we dequeued a msg, 0 o/w. */
 int handle_one_mbox_msg(struct event_mbox *ev_mbox)
 {
@@ -26,15 +26,16 @@ __BEGIN_DECLS
 
 /* If you get a non-raw event queue (with mbox, initialized by event code), then
  * you'll get a CEQ with 128 events and 128 ring slots with the OR operation.
- * It's actually doable to have the user grow the CEQ, but we don't have support
- * for that yet, so just pick a size in advance.  If you're using a CEQ, you'll
- * probably want to do it yourself. */
+ * You can grow the events array later with ceq_grow(), but not the ring.  If
+ * you're using a CEQ, you'll probably want to do it yourself. */
 #define CEQ_DEFAULT_SZ 128
 
 void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
               size_t ring_sz);
 bool get_ceq_msg(struct ceq *ceq, struct event_msg *msg);
+int get_ceq_msgs(struct ceq *ceq, struct event_msg *msgs, int max);
 bool ceq_is_empty(struct ceq *ceq);
+void ceq_grow(struct ceq *ceq, unsigned int nr_events);
 void ceq_cleanup(struct ceq *ceq);
 
 __END_DECLS
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <parlib/ros_debug.h>
 #include <ros/fdtap.h>
+#include <ros/sysring.h>
 
 __BEGIN_DECLS
 
@@ -52,6 +53,8 @@ int         sys_poke_ksched(int pid, unsigned int res_type);
 int         sys_abort_sysc(struct syscall *sysc);
 int         sys_abort_sysc_fd(int fd);
 int         sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs);
+int         sys_sysring_setup(struct sysring *ring, int flags);
+int         sys_sysring_enter(unsigned int to_submit);
 
 void		syscall_async(struct syscall *sysc, unsigned long num, ...);
 void        syscall_async_evq(struct syscall *sysc, struct event_queue *evq,
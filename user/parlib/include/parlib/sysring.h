@@ -0,0 +1,29 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Syscall submission rings, user side.  See ros/sysring.h.
+ *
+ * sysring_submit() only writes to shared memory.  sysring_flush() traps into
+ * the kernel if the kernel needs to be told about the new entries: always for
+ * normal rings, and only when the poller went to sleep for SYSRING_SQPOLL
+ * rings.  Submitters must be serialized by the caller. */
+
+#pragma once
+
+#include <ros/sysring.h>
+#include <ros/syscall.h>
+
+__BEGIN_DECLS
+
+struct sysring *sysring_create(unsigned int nr_entries,
+                               struct event_queue *ev_q, int flags);
+bool sysring_submit(struct sysring *ring, struct syscall *sysc,
+                    unsigned long num, ...);
+int sysring_flush(struct sysring *ring);
+
+static inline unsigned int sysring_nr_pending(struct sysring *ring)
+{
+	return ring->sq_tail - ACCESS_ONCE(ring->sq_head);
+}
+
+__END_DECLS
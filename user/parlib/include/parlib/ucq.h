@@ -15,6 +15,7 @@ void ucq_init_raw(struct ucq *ucq, uintptr_t pg1, uintptr_t pg2);
 void ucq_init(struct ucq *ucq);
 void ucq_free_pgs(struct ucq *ucq);
 bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg);
+int get_ucq_msgs(struct ucq *ucq, struct event_msg *msgs, int max);
 bool ucq_is_empty(struct ucq *ucq);
 
 __END_DECLS
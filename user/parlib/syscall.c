@@ -167,6 +167,16 @@ int sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs)
 	return ros_syscall(SYS_tap_fds, tap_reqs, nr_reqs, 0, 0, 0, 0);
 }
 
+int sys_sysring_setup(struct sysring *ring, int flags)
+{
+	return ros_syscall(SYS_sysring_setup, ring, flags, 0, 0, 0, 0);
+}
+
+int sys_sysring_enter(unsigned int to_submit)
+{
+	return ros_syscall(SYS_sysring_enter, to_submit, 0, 0, 0, 0, 0);
+}
+
 void syscall_async(struct syscall *sysc, unsigned long num, ...)
 {
 	va_list args;
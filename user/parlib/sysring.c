@@ -0,0 +1,86 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Syscall submission rings, user side.  See ros/sysring.h. */
+
+#include <ros/arch/membar.h>
+#include <parlib/arch/atomic.h>
+#include <parlib/parlib.h>
+#include <parlib/sysring.h>
+#include <parlib/assert.h>
+#include <sys/mman.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+/* Creates and registers the process's syscall ring.  Completions go to ev_q
+ * for any syscall that doesn't have its own (ev_q can be 0).  Returns 0 and
+ * sets errno on failure. */
+struct sysring *sysring_create(unsigned int nr_entries,
+                               struct event_queue *ev_q, int flags)
+{
+	struct sysring *ring;
+	size_t sz = ROUNDUP(sysring_size(nr_entries), PGSIZE);
+
+	if (!IS_PWR2(nr_entries) || (nr_entries > SYSRING_MAX_ENTRIES)) {
+		errno = EINVAL;
+		return 0;
+	}
+	/* The kernel (and maybe a poller core) reads this outside of our syscalls,
+	 * so it needs to be there already. */
+	ring = mmap(0, sz, PROT_WRITE | PROT_READ, MAP_POPULATE | MAP_ANONYMOUS,
+	            -1, 0);
+	if (ring == MAP_FAILED)
+		return 0;
+	ring->nr_entries = nr_entries;
+	ring->ev_q = ev_q;
+	ring->u_flags = flags;
+	if (sys_sysring_setup(ring, flags)) {
+		munmap(ring, sz);
+		return 0;
+	}
+	return ring;
+}
+
+/* Fills in sysc and puts it on the ring.  Returns FALSE if the ring is full.
+ * The kernel doesn't see it until the next sysring_flush() (or the poller's next
+ * pass, for SYSRING_SQPOLL rings).  Like syscall_async(), this pulls all six
+ * args off the stack. */
+bool sysring_submit(struct sysring *ring, struct syscall *sysc,
+                    unsigned long num, ...)
+{
+	va_list args;
+
+	if (sysring_nr_pending(ring) == ring->nr_entries)
+		return FALSE;
+	sysc->num = num;
+	atomic_set(&sysc->flags, 0);
+	sysc->ev_q = 0;
+	va_start(args, num);
+	sysc->arg0 = va_arg(args, long);
+	sysc->arg1 = va_arg(args, long);
+	sysc->arg2 = va_arg(args, long);
+	sysc->arg3 = va_arg(args, long);
+	sysc->arg4 = va_arg(args, long);
+	sysc->arg5 = va_arg(args, long);
+	va_end(args);
+	ring->sqes[ring->sq_tail & (ring->nr_entries - 1)] = sysc;
+	wmb();	/* write the sysc and sqe before the kernel can see the tail */
+	ring->sq_tail++;
+	return TRUE;
+}
+
+/* Tells the kernel about submitted syscalls, if it needs to be told.  Returns
+ * the number of syscalls the kernel took off the ring (0 for polled rings), or
+ * -1 on error. */
+int sysring_flush(struct sysring *ring)
+{
+	if (ring->u_flags & SYSRING_SQPOLL) {
+		mb();	/* publish the tail before checking if the poller is asleep */
+		if (!(atomic_read(&ring->sr_flags) & SYSRING_NEED_WAKEUP))
+			return 0;
+		return sys_sysring_enter(0);
+	}
+	if (!sysring_nr_pending(ring))
+		return 0;
+	return sys_sysring_enter(0);
+}
@@ -60,14 +60,42 @@ void ucq_free_pgs(struct ucq *ucq)
 	munmap((void*)pg2, PGSIZE);
 }
 
-/* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
- * the ucq appears empty, it will return FALSE.  Messages may have arrived after
- * we started getting that we do not receive. */
-bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
+/* Max pages a batch consumer unmaps at once */
+#define UCQ_FREE_BATCH			8
+
+/* Pages that consumers are done with, to munmap outside the lock. */
+struct ucq_free_pgs {
+	uintptr_t					pgs[UCQ_FREE_BATCH];
+	int							nr;
+};
+
+/* munmaps the pages, merging contiguous ones into one call. */
+static void ucq_flush_free_pgs(struct ucq_free_pgs *fp)
 {
-	uintptr_t my_idx;
+	uintptr_t start;
+	size_t len;
+
+	for (int i = 0; i < fp->nr; i++) {
+		start = fp->pgs[i];
+		len = PGSIZE;
+		while ((i + 1 < fp->nr) && (fp->pgs[i + 1] == start + len)) {
+			len += PGSIZE;
+			i++;
+		}
+		munmap((void*)start, len);
+	}
+	fp->nr = 0;
+}
+
+/* Helper: claims up to max slots on the consumer's current page with one CAS.
+ * Returns the number of slots claimed, 0 if the ucq appears empty, with the
+ * first slot in *first.  Pages we retire get added to fp. */
+static unsigned int ucq_claim_slots(struct ucq *ucq, unsigned int max,
+                                    uintptr_t *first, struct ucq_free_pgs *fp)
+{
+	uintptr_t my_idx, prod_idx;
+	unsigned int nr;
 	struct ucq_page *old_page, *other_page;
-	struct msg_container *my_msg;
 	struct spin_pdr_lock *ucq_lock = (struct spin_pdr_lock*)(&ucq->u_lock);
 
 	do {
@@ -77,7 +105,7 @@ loop_top:
 		/* The ucq is empty if the consumer and producer are on the same 'next'
 		 * slot. */
 		if (my_idx == atomic_read(&ucq->prod_idx))
-			return FALSE;
+			return 0;
 		/* Is the slot we want good?  If not, we're going to need to try and
 		 * move on to the next page.  If it is, we bypass all of this and try to
 		 * CAS on us getting my_idx. */
@@ -93,7 +121,7 @@ loop_top:
 			spin_pdr_unlock(ucq_lock);
 			/* Make sure this new slot has a producer (ucq isn't empty) */
 			if (my_idx == atomic_read(&ucq->prod_idx))
-				return FALSE;
+				return 0;
 			goto claim_slot;
 		}
 		/* At this point, the slot is bad, and all other possible consumers are
@@ -122,13 +150,17 @@ loop_top:
 		old_page->header.cons_next_pg = 0;
 		atomic_set(&old_page->header.nr_cons, 0);
 		/* We want to "free" the page.  We'll try and set it as the spare.  If
-		 * there is already a spare, we'll free that one. */
+		 * there is already a spare, we'll free that one, once we're out of the
+		 * lock. */
 		other_page = (struct ucq_page*)atomic_swap(&ucq->spare_pg,
 		                                           (long)old_page);
 		assert(!PGOFF(other_page));
 		if (other_page) {
-			munmap(other_page, PGSIZE);
 			atomic_dec(&ucq->nr_extra_pgs);
+			if (fp->nr == UCQ_FREE_BATCH)
+				munmap(other_page, PGSIZE);
+			else
+				fp->pgs[fp->nr++] = (uintptr_t)other_page;
 		}
 		/* All fixed up, unlock.  Other consumers may lock and check to make
 		 * sure things are done. */
@@ -137,27 +169,83 @@ loop_top:
 		goto loop_top;
 claim_slot:
 		cmb();	/* so we can goto claim_slot */
-		/* If we're still here, my_idx is good, and we'll try to claim it.  If
-		 * we fail, we need to repeat the whole process. */
-	} while (!atomic_cas(&ucq->cons_idx, my_idx, my_idx + 1));
+		/* If we're still here, my_idx is good, and we'll try to claim it and
+		 * as many after it as we can, up to the end of the page or the
+		 * producer.  If we fail, we need to repeat the whole process. */
+		prod_idx = atomic_read(&ucq->prod_idx);
+		/* prod_idx can be on another page, or on this page's address again
+		 * after it was recycled, so never go past the end of the page. */
+		nr = MIN(prod_idx - my_idx, NR_MSG_PER_PAGE - PGOFF(my_idx));
+		nr = MIN(nr, max);
+	} while (!atomic_cas(&ucq->cons_idx, my_idx, my_idx + nr));
 	assert(slot_is_good(my_idx));
-	/* Now we have a good slot that we can consume */
-	my_msg = slot2msg(my_idx);
-	/* linux would put an rmb_depends() here */
-	/* Wait til the msg is ready (kernel sets this flag) */
-	while (!my_msg->ready)
-		cpu_relax();
-	rmb();	/* order the ready read before the contents */
-	/* Copy out */
-	*msg = my_msg->ev_msg;
-	/* Unset this for the next usage of the container */
-	my_msg->ready = FALSE;
-	wmb();	/* post the ready write before incrementing */
-	/* Increment nr_cons, showing we're done */
-	atomic_inc(&((struct ucq_page*)PTE_ADDR(my_idx))->header.nr_cons);
+	*first = my_idx;
+	return nr;
+}
+
+/* Helper: copies out nr claimed messages, starting at slot first. */
+static void ucq_consume_slots(uintptr_t first, unsigned int nr,
+                              struct event_msg *msgs)
+{
+	struct msg_container *my_msg;
+
+	for (int i = 0; i < nr; i++) {
+		my_msg = slot2msg(first + i);
+		/* linux would put an rmb_depends() here */
+		/* Wait til the msg is ready (kernel sets this flag) */
+		while (!my_msg->ready)
+			cpu_relax();
+		rmb();	/* order the ready read before the contents */
+		/* Copy out */
+		msgs[i] = my_msg->ev_msg;
+		/* Unset this for the next usage of the container */
+		my_msg->ready = FALSE;
+	}
+	wmb();	/* post the ready writes before incrementing */
+	/* Increment nr_cons, showing we're done with all of them */
+	atomic_fetch_and_add(&((struct ucq_page*)PTE_ADDR(first))->header.nr_cons,
+	                     nr);
+}
+
+/* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
+ * the ucq appears empty, it will return FALSE.  Messages may have arrived after
+ * we started getting that we do not receive. */
+bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
+{
+	struct ucq_free_pgs fp = {.nr = 0};
+	uintptr_t slot;
+
+	if (!ucq_claim_slots(ucq, 1, &slot, &fp)) {
+		ucq_flush_free_pgs(&fp);
+		return FALSE;
+	}
+	ucq_consume_slots(slot, 1, msg);
+	ucq_flush_free_pgs(&fp);
 	return TRUE;
 }
 
+/* Batch version of get_ucq_msg(): extracts up to max messages into msgs,
+ * returning how many we got.  We claim a run of slots with one CAS, up to the
+ * end of a page, and finish them with one atomic.  Retired pages are unmapped
+ * at the end. */
+int get_ucq_msgs(struct ucq *ucq, struct event_msg *msgs, int max)
+{
+	struct ucq_free_pgs fp = {.nr = 0};
+	uintptr_t slot;
+	unsigned int nr;
+	int nr_ret = 0;
+
+	while (nr_ret < max) {
+		nr = ucq_claim_slots(ucq, max - nr_ret, &slot, &fp);
+		if (!nr)
+			break;
+		ucq_consume_slots(slot, nr, &msgs[nr_ret]);
+		nr_ret += nr;
+	}
+	ucq_flush_free_pgs(&fp);
+	return nr_ret;
+}
+
 bool ucq_is_empty(struct ucq *ucq)
 {
 	/* The ucq is empty if the consumer and producer are on the same 'next'